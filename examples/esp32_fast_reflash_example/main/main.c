@@ -14,6 +14,7 @@
 
 #include <sys/param.h>
 #include <string.h>
+#include <inttypes.h>
 #include "esp_err.h"
 #include "esp_log.h"
 #include "driver/uart.h"
@@ -96,8 +97,19 @@ void app_main(void)
         }
 
         if (esp_loader_flash_verify_known_md5(&loader, app_addr, app_bin_size, app_bin_md5) != ESP_LOADER_SUCCESS) {
-            ESP_LOGI(TAG, "Application MD5 mismatch, flashing...");
-            flash_binary(&loader, app_bin, app_bin_size, app_addr);
+            ESP_LOGI(TAG, "Application MD5 mismatch, flashing the changed sectors...");
+            esp_loader_flash_diff_cfg_t diff_cfg = {
+                .offset = app_addr,
+                .image = app_bin,
+                .image_size = app_bin_size,
+                .block_size = 1024,
+            };
+            if (esp_loader_flash_diff_write(&loader, &diff_cfg) == ESP_LOADER_SUCCESS) {
+                ESP_LOGI(TAG, "%" PRIu32 " bytes written in %" PRIu32 " runs", diff_cfg.bytes_written, diff_cfg.runs);
+            } else {
+                ESP_LOGW(TAG, "Differential write failed, flashing the whole application...");
+                flash_binary(&loader, app_bin, app_bin_size, app_addr);
+            }
         } else {
             ESP_LOGI(TAG, "Application MD5 match, skipping...");
         }
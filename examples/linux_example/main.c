@@ -19,13 +19,19 @@
 #include <stdlib.h>
 #include <string.h>
 #include <getopt.h>
+#include <unistd.h>
 #include "linux_port.h"
+#include "linux_deflate.h"
 #include "esp_loader.h"
 #include "example_common.h"
 
 #define DEFAULT_SERIAL_DEVICE  "/dev/ttyUSB0"
 #define DEFAULT_BAUD_RATE      115200
 #define HIGHER_BAUD_RATE       460800
+#define PLAN_BLOCK_SIZE        1024
+#define PLAN_MAX_GAP           (16 * 1024)
+#define COMPRESS_BLOCK_SIZE    (16 * 1024)
+#define ROM_BLOCK_SIZE         1024
 
 static void print_usage(const char *prog)
 {
@@ -37,6 +43,11 @@ static void print_usage(const char *prog)
             "  -b, --baud <rate>     Baud rate     (default: %d)\n"
             "  -m, --mode <mode>     GPIO mode: dtr-rts | gpio | none (default: dtr-rts)\n"
             "  -n, --no-stub         Use ROM bootloader instead of stub (stub is default)\n"
+            "  -P, --profile-dir <dir>  Cache target profiles in <dir>, keyed by USB serial number\n"
+            "  -g, --plan            Flash all images as one plan, merging nearby images\n"
+            "  -d, --dry-run         Report what the plan would send without flashing (implies --plan)\n"
+            "  -j, --threads <n>     Compress images on n threads while flashing, 0 for one per CPU\n"
+            "  -r, --resume          Journal progress in <file>.journal and resume interrupted writes\n"
             "  -h, --help\n"
             "\n"
             "Note: USB JTAG Serial devices (ESP32-C3/S3/C6/H2/P4 native USB,\n"
@@ -50,6 +61,100 @@ static void print_usage(const char *prog)
             prog, DEFAULT_SERIAL_DEVICE, DEFAULT_BAUD_RATE, prog, prog, prog, prog);
 }
 
+/* Profiles are keyed by the USB serial number, or by the device name when there is none */
+static void profile_path(const linux_port_t *port, const char *dir, char *path, size_t size)
+{
+    char key[128];
+    if (!linux_port_get_usb_serial(port, key, sizeof(key))) {
+        const char *name = strrchr(port->device, '/');
+        snprintf(key, sizeof(key), "%s", name ? name + 1 : port->device);
+    }
+    snprintf(path, size, "%s/%s.profile", dir, key);
+}
+
+static bool load_profile(const char *path, esp_loader_profile_t *profile)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        return false;
+    }
+    bool ok = fread(profile, sizeof(*profile), 1, f) == 1;
+    fclose(f);
+    return ok;
+}
+
+static void save_profile(const char *path, const esp_loader_profile_t *profile)
+{
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        fprintf(stderr, "Warning: cannot write profile '%s'\n", path);
+        return;
+    }
+    fwrite(profile, sizeof(*profile), 1, f);
+    fclose(f);
+}
+
+static bool load_journal(const char *path, esp_loader_flash_journal_t *journal)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        return false;
+    }
+    bool ok = fread(journal, sizeof(*journal), 1, f) == 1;
+    fclose(f);
+    return ok;
+}
+
+/* Synced to disk, so the journal never claims more than the target has acknowledged */
+static esp_loader_error_t save_journal(void *ctx, const esp_loader_flash_journal_t *journal)
+{
+    const char *path = ctx;
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        fprintf(stderr, "Error: cannot write journal '%s'\n", path);
+        return ESP_LOADER_ERROR_FAIL;
+    }
+    bool ok = fwrite(journal, sizeof(*journal), 1, f) == 1 && fflush(f) == 0 && fsync(fileno(f)) == 0;
+    fclose(f);
+    return ok ? ESP_LOADER_SUCCESS : ESP_LOADER_ERROR_FAIL;
+}
+
+static esp_loader_error_t flash_resumable(esp_loader_t *loader, const uint8_t *buf, size_t size,
+        uint32_t addr, const char *file_path, bool use_stub)
+{
+    static uint8_t block_buffer[COMPRESS_BLOCK_SIZE];
+    char journal_file[512];
+    esp_loader_flash_journal_t journal;
+
+    snprintf(journal_file, sizeof(journal_file), "%s.journal", file_path);
+    if (!load_journal(journal_file, &journal)) {
+        memset(&journal, 0, sizeof(journal));
+    }
+
+    esp_loader_flash_resumable_cfg_t cfg = {
+        .offset         = addr,
+        .image          = buf,
+        .image_size     = (uint32_t)size,
+        .block_size     = use_stub ? COMPRESS_BLOCK_SIZE : ROM_BLOCK_SIZE,
+        .compress       = use_stub,
+        .block_buffer   = block_buffer,
+        .journal        = &journal,
+        .journal_update = save_journal,
+        .journal_ctx    = journal_file,
+    };
+    esp_loader_error_t err = esp_loader_flash_write_resumable(loader, &cfg);
+    if (err != ESP_LOADER_SUCCESS) {
+        fprintf(stderr, "Progress kept in '%s', run again to resume\n", journal_file);
+        return err;
+    }
+
+    if (cfg.resumed_from > 0) {
+        printf("Resumed at 0x%" PRIx32 "\n", addr + cfg.resumed_from);
+    }
+    remove(journal_file);
+    return ESP_LOADER_SUCCESS;
+}
+
 static uint8_t *read_file(const char *path, size_t *out_size)
 {
     FILE *f = fopen(path, "rb");
@@ -58,6 +163,7 @@ static uint8_t *read_file(const char *path, size_t *out_size)
         return NULL;
     }
 
+    /* Padded with 0xFF to the 4-byte alignment flash writes need */
     fseek(f, 0, SEEK_END);
     long len = ftell(f);
     fseek(f, 0, SEEK_SET);
@@ -68,7 +174,8 @@ static uint8_t *read_file(const char *path, size_t *out_size)
         return NULL;
     }
 
-    uint8_t *buf = malloc((size_t)len);
+    const size_t padded_len = ((size_t)len + 3) & ~(size_t)3;
+    uint8_t *buf = malloc(padded_len);
     if (!buf) {
         fprintf(stderr, "Error: out of memory\n");
         fclose(f);
@@ -83,28 +190,102 @@ static uint8_t *read_file(const char *path, size_t *out_size)
     }
 
     fclose(f);
-    *out_size = (size_t)len;
+    memset(buf + len, 0xFF, padded_len - (size_t)len);
+    *out_size = padded_len;
     return buf;
 }
 
+static bool parse_address(const char *str, uint32_t *addr)
+{
+    char *endptr;
+    *addr = (uint32_t)strtoul(str, &endptr, 0);
+    if (*endptr != '\0') {
+        fprintf(stderr, "Error: invalid address '%s'\n", str);
+        return false;
+    }
+    return true;
+}
+
+/* Flashes all <addr> <file> pairs with a single esp_loader_flash_plan() call */
+static int flash_plan(esp_loader_t *loader, char **pair_args, int num_pairs, bool dry_run)
+{
+    static uint8_t block_buffer[PLAN_BLOCK_SIZE];
+    esp_loader_flash_region_t *regions = calloc((size_t)num_pairs, sizeof(*regions));
+    int ret = 1;
+
+    if (!regions) {
+        fprintf(stderr, "Error: out of memory\n");
+        return 1;
+    }
+
+    for (int i = 0; i < num_pairs; i++) {
+        size_t size = 0;
+        if (!parse_address(pair_args[i * 2], &regions[i].offset)) {
+            goto cleanup;
+        }
+        uint8_t *buf = read_file(pair_args[i * 2 + 1], &size);
+        if (!buf) {
+            goto cleanup;
+        }
+        regions[i].data = buf;
+        regions[i].size = (uint32_t)size;
+    }
+
+    esp_loader_flash_plan_cfg_t cfg = {
+        .block_size   = PLAN_BLOCK_SIZE,
+        .max_gap      = PLAN_MAX_GAP,
+        .block_buffer = block_buffer,
+        .dry_run      = dry_run,
+    };
+
+    printf("\n%s %d images as one plan...\n", dry_run ? "Planning" : "Flashing", num_pairs);
+    esp_loader_error_t err = esp_loader_flash_plan(loader, regions, (uint32_t)num_pairs, &cfg);
+    if (err != ESP_LOADER_SUCCESS) {
+        fprintf(stderr, "Error: flash plan failed (error %d)\n", (int)err);
+        goto cleanup;
+    }
+
+    printf("%" PRIu32 " passes, %" PRIu32 " bytes %s, %" PRIu32 " bytes erased\n",
+           cfg.passes, cfg.wire_bytes, dry_run ? "to send" : "sent", cfg.erase_bytes);
+    ret = 0;
+
+cleanup:
+    for (int i = 0; i < num_pairs; i++) {
+        free((void *)regions[i].data);
+    }
+    free(regions);
+    return ret;
+}
+
 int main(int argc, char *argv[])
 {
     const char       *device    = DEFAULT_SERIAL_DEVICE;
     uint32_t          baud_rate = DEFAULT_BAUD_RATE;
     linux_gpio_mode_t gpio_mode = LINUX_GPIO_DTR_RTS;
     bool              use_stub  = true;
+    const char       *profile_dir = NULL;
+    bool              use_plan  = false;
+    bool              dry_run   = false;
+    bool              compress  = false;
+    uint32_t          threads   = 0;
+    bool              resume    = false;
 
     static const struct option long_opts[] = {
         { "port",     required_argument, NULL, 'p' },
         { "baud",     required_argument, NULL, 'b' },
         { "mode",     required_argument, NULL, 'm' },
         { "no-stub",  no_argument,       NULL, 'n' },
+        { "profile-dir", required_argument, NULL, 'P' },
+        { "plan",     no_argument,       NULL, 'g' },
+        { "dry-run",  no_argument,       NULL, 'd' },
+        { "threads",  required_argument, NULL, 'j' },
+        { "resume",   no_argument,       NULL, 'r' },
         { "help",     no_argument,       NULL, 'h' },
         { NULL, 0, NULL, 0 }
     };
 
     int opt;
-    while ((opt = getopt_long(argc, argv, "p:b:m:nh", long_opts, NULL)) != -1) {
+    while ((opt = getopt_long(argc, argv, "p:b:m:nP:gdj:rh", long_opts, NULL)) != -1) {
         switch (opt) {
         case 'p':
             device = optarg;
@@ -131,6 +312,23 @@ int main(int argc, char *argv[])
         case 'n':
             use_stub = false;
             break;
+        case 'P':
+            profile_dir = optarg;
+            break;
+        case 'd':
+            dry_run = true;
+            use_plan = true;
+            break;
+        case 'g':
+            use_plan = true;
+            break;
+        case 'j':
+            compress = true;
+            threads = (uint32_t)strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            resume = true;
+            break;
         case 'h':
             print_usage(argv[0]);
             return 0;
@@ -182,6 +380,16 @@ int main(int argc, char *argv[])
         return 1;
     }
 
+    char profile_file[512];
+    esp_loader_profile_t profile;
+    if (profile_dir) {
+        profile_path(&port, profile_dir, profile_file, sizeof(profile_file));
+        if (load_profile(profile_file, &profile) &&
+                esp_loader_profile_apply(&loader, &profile) == ESP_LOADER_SUCCESS) {
+            printf("Using cached profile '%s'\n", profile_file);
+        }
+    }
+
     esp_loader_error_t conn_err;
     if (use_stub) {
         conn_err = connect_to_target_with_stub(&loader, HIGHER_BAUD_RATE);
@@ -192,14 +400,23 @@ int main(int argc, char *argv[])
         return 1;
     }
 
-    for (int i = 0; i < num_pairs; i++) {
+    if (profile_dir && esp_loader_profile_capture(&loader, &profile) == ESP_LOADER_SUCCESS) {
+        save_profile(profile_file, &profile);
+    }
+
+    if (use_plan) {
+        int ret = flash_plan(&loader, pair_args, num_pairs, dry_run);
+        if (ret != 0 || dry_run) {
+            return ret;
+        }
+    }
+
+    for (int i = 0; i < num_pairs && !use_plan; i++) {
         const char *addr_str = pair_args[i * 2];
         const char *file_path = pair_args[i * 2 + 1];
 
-        char *endptr;
-        uint32_t addr = (uint32_t)strtoul(addr_str, &endptr, 0);
-        if (*endptr != '\0') {
-            fprintf(stderr, "Error: invalid address '%s'\n", addr_str);
+        uint32_t addr;
+        if (!parse_address(addr_str, &addr)) {
             return 1;
         }
 
@@ -210,7 +427,25 @@ int main(int argc, char *argv[])
         }
 
         printf("\nFlashing '%s' at 0x%" PRIx32 " (%zu bytes)...\n", file_path, addr, size);
-        esp_loader_error_t err = flash_binary(&loader, buf, (uint32_t)size, addr);
+        esp_loader_error_t err;
+        if (resume) {
+            err = flash_resumable(&loader, buf, size, addr, file_path, use_stub);
+        } else if (compress) {
+            static uint8_t block_buffer[COMPRESS_BLOCK_SIZE];
+            esp_loader_flash_compress_cfg_t cfg = {
+                .offset       = addr,
+                .image        = buf,
+                .image_size   = (uint32_t)size,
+                .block_size   = COMPRESS_BLOCK_SIZE,
+                .block_buffer = block_buffer,
+            };
+            err = linux_flash_write_compressed(&loader, &cfg, threads);
+            if (err == ESP_LOADER_SUCCESS) {
+                printf("%" PRIu32 " bytes sent compressed\n", cfg.compressed_size);
+            }
+        } else {
+            err = flash_binary(&loader, buf, (uint32_t)size, addr);
+        }
         free(buf);
 
         if (err != ESP_LOADER_SUCCESS) {
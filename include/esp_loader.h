@@ -8,6 +8,7 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include "esp_loader_error.h"
 #include "esp_loader_io.h"
 #include "md5_ctx.h"
@@ -102,6 +103,103 @@ typedef struct {
   .trials = 10, \
 }
 
+/**
+ * @brief Magic value marking a valid esp_loader_profile_t record.
+ */
+#define ESP_LOADER_PROFILE_MAGIC 0x45535050
+
+/**
+ * @brief Size of a raw MD5 digest, as returned by esp_loader_flash_fingerprint().
+ */
+#define ESP_LOADER_MD5_DIGEST_SIZE 16
+
+/**
+ * @brief Region size esp_loader_flash_fingerprint() uses when none is given.
+ */
+#define ESP_LOADER_FINGERPRINT_DEFAULT_GRANULARITY (64 * 1024)
+
+/**
+ * @brief Magic value marking a valid esp_loader_flash_journal_t record.
+ */
+#define ESP_LOADER_JOURNAL_MAGIC 0x45534A4E
+
+/**
+ * @brief Cached facts about a particular target device.
+ *
+ * Every connect normally re-derives the chip type, the SPI flash pin
+ * configuration, the flash size and (on ESP32-C2) the crystal frequency.
+ * Capture them once with esp_loader_profile_capture(), keep the record in RAM
+ * or on disk keyed by MAC or USB serial number, and hand it back with
+ * esp_loader_profile_apply() in later sessions to skip those probes.
+ *
+ * The record is plain data and may be stored as-is. On connect the MAC
+ * address is read back and compared against @c mac; on mismatch the profile
+ * is discarded and the usual detection runs.
+ */
+typedef struct {
+    uint32_t      magic;             /*!< ESP_LOADER_PROFILE_MAGIC for a valid record */
+    target_chip_t target_chip;       /*!< Chip the profile was captured from */
+    uint8_t       mac[6];            /*!< Factory MAC address, used to validate the profile */
+    uint8_t       crystal_freq_mhz;  /*!< ESP32-C2 crystal frequency in MHz, 0 if unknown or not applicable */
+    uint8_t       reserved;          /*!< Reserved, set to 0 */
+    uint32_t      spi_config;        /*!< SPI flash pin configuration passed to SPI_ATTACH */
+    uint32_t      flash_size;        /*!< Flash size in bytes, 0 if unknown */
+    uint32_t      transmission_rate; /*!< Last transmission rate accepted by the target, 0 if never changed */
+} esp_loader_profile_t;
+
+/**
+ * @brief Transport statistics, see esp_loader_get_stats().
+ */
+typedef struct {
+    uint32_t commands;              /*!< Commands sent to the target */
+    uint32_t status_polls;          /*!< Status register reads made while waiting on the target */
+    uint32_t max_polls_per_command; /*!< Most status polls spent on a single command */
+    uint32_t interrupt_waits;       /*!< Times the host blocked on a target interrupt instead of polling */
+} esp_loader_stats_t;
+
+/**
+ * @brief Register program operation type.
+ */
+typedef enum {
+    ESP_LOADER_REG_WRITE, /*!< Write value to address, only the bits set in mask are modified */
+    ESP_LOADER_REG_READ,  /*!< Read address into *result */
+    ESP_LOADER_REG_POLL,  /*!< Read address until (reg & mask) == value */
+} esp_loader_reg_op_type_t;
+
+/**
+ * @brief Single operation of a register program run by esp_loader_run_reg_program().
+ *
+ * Use the ESP_LOADER_REG_OP_* initializers below rather than filling the fields by hand.
+ */
+typedef struct {
+    esp_loader_reg_op_type_t type;
+    uint32_t  address;  /*!< Register address */
+    uint32_t  value;    /*!< Value to write (WRITE) or expected masked value (POLL) */
+    uint32_t  mask;     /*!< Bits to modify (WRITE) or compare (POLL) */
+    uint32_t  delay_us; /*!< Delay after the write, applied by the target (WRITE only) */
+    uint32_t *result;   /*!< Optional destination of the value read (READ, POLL) */
+} esp_loader_reg_op_t;
+
+#define ESP_LOADER_REG_OP_WRITE(addr, val) { \
+  .type = ESP_LOADER_REG_WRITE, \
+  .address = (addr), \
+  .value = (val), \
+  .mask = 0xFFFFFFFF, \
+}
+
+#define ESP_LOADER_REG_OP_READ(addr, res) { \
+  .type = ESP_LOADER_REG_READ, \
+  .address = (addr), \
+  .result = (res), \
+}
+
+#define ESP_LOADER_REG_OP_POLL(addr, msk, val) { \
+  .type = ESP_LOADER_REG_POLL, \
+  .address = (addr), \
+  .value = (val), \
+  .mask = (msk), \
+}
+
 /**
  * @brief Flash operation context.
  *
@@ -121,6 +219,81 @@ typedef struct {
     } _state;
 } esp_loader_flash_cfg_t;
 
+/**
+ * @brief Differential flash write context, see esp_loader_flash_diff_write().
+ *
+ * Fill the input fields; the result fields are set by the library.
+ */
+typedef struct {
+    uint32_t       offset;        /*!< Flash address of the image. Must be 4 KB aligned. */
+    const uint8_t *image;         /*!< The complete new image. */
+    uint32_t       image_size;    /*!< Size of the image. Must be 4-byte aligned. */
+    uint32_t       granularity;   /*!< Bytes compared per MD5, a multiple of 4 KB. 0 selects 4 KB. */
+    uint32_t       block_size;    /*!< Size of the data blocks written for changed regions. */
+    uint32_t       units_changed; /*!< Result: granules whose content differed */
+    uint32_t       runs;          /*!< Result: contiguous changed regions erased and written */
+    uint32_t       bytes_written; /*!< Result: bytes erased and written */
+} esp_loader_flash_diff_cfg_t;
+
+/**
+ * @brief Flash repair context, see esp_loader_flash_repair().
+ *
+ * Fill the input fields; the result fields are set by the library.
+ */
+typedef struct {
+    uint32_t       offset;            /*!< Flash address of the image. Must be 4 KB aligned. */
+    const uint8_t *image;             /*!< The image that should be in flash. */
+    uint32_t       image_size;        /*!< Size of the image. Must be 4-byte aligned. */
+    uint32_t       block_size;        /*!< Size of the data blocks written for damaged sectors. */
+    uint32_t       max_rounds;        /*!< Rounds of locating and rewriting damaged sectors, 0 selects 3. */
+    uint32_t       sectors_rewritten; /*!< Result: 4 KB sectors erased and written, over all rounds */
+    uint32_t       runs;              /*!< Result: contiguous damaged regions erased and written */
+    uint32_t       md5_queries;       /*!< Result: ranges hashed on the target, one round trip each */
+    uint32_t       rounds;            /*!< Result: rounds that had to rewrite sectors */
+} esp_loader_flash_repair_cfg_t;
+
+/**
+ * @brief Sparse flash write context, see esp_loader_flash_write_sparse().
+ */
+typedef struct {
+    uint32_t       offset;        /*!< Flash address of the image. Must be 4 KB aligned. */
+    const uint8_t *image;         /*!< The complete image. */
+    uint32_t       image_size;    /*!< Size of the image. Must be 4-byte aligned. */
+    uint32_t       block_size;    /*!< Size of the data blocks written. */
+    bool           skip_verify;   /*!< When true, the final MD5 verification is skipped. */
+    bool           skip_blank_erase; /*!< When true, blank blocks of the image that are blank in flash
+                                      *   already are not erased either. */
+    uint32_t       runs;          /*!< Result: contiguous regions with data written */
+    uint32_t       bytes_skipped; /*!< Result: blank (0xFF) bytes not sent */
+    uint32_t       bytes_erase_skipped; /*!< Result: blank bytes not erased, as the flash was blank already */
+} esp_loader_flash_sparse_cfg_t;
+
+/**
+ * @brief One image of a multi-image flash plan, see esp_loader_flash_plan().
+ */
+typedef struct {
+    uint32_t       offset;        /*!< Flash address of the image. Must be 4-byte aligned. */
+    const uint8_t *data;          /*!< Image contents. */
+    uint32_t       size;          /*!< Size of the image. Must be 4-byte aligned. */
+    const uint8_t *deflated;      /*!< Optional zlib stream of the image, NULL if there is none. */
+    uint32_t       deflated_size; /*!< Size of the zlib stream. */
+} esp_loader_flash_region_t;
+
+/**
+ * @brief Multi-image flash plan parameters and results, see esp_loader_flash_plan().
+ */
+typedef struct {
+    uint32_t block_size;   /*!< Size of the data blocks written. */
+    uint32_t max_gap;      /*!< Images at most this many bytes apart are written in one pass,
+                            *   the gap filled with 0xFF. Images sharing a sector always are. */
+    uint8_t *block_buffer; /*!< block_size bytes for blocks that span several images. Unused in a dry run. */
+    bool     dry_run;      /*!< When true, only the results are computed and nothing is sent. */
+    bool     skip_verify;  /*!< When true, the MD5 verification of each pass is skipped. */
+    uint32_t passes;       /*!< Result: FLASH_BEGIN passes */
+    uint32_t wire_bytes;   /*!< Result: command and data bytes sent, without transport framing */
+    uint32_t erase_bytes;  /*!< Result: bytes erased */
+} esp_loader_flash_plan_cfg_t;
+
 /**
  * @brief Compressed flash operation context (DEFLATE/zlib stream).
  *
@@ -138,6 +311,63 @@ typedef struct {
     } _state;
 } esp_loader_flash_deflate_cfg_t;
 
+/**
+ * @brief On-the-fly compressed flash write context, see esp_loader_flash_write_compressed().
+ */
+typedef struct {
+    uint32_t       offset;          /*!< Flash address of the image. Must be 4-byte aligned. */
+    const uint8_t *image;           /*!< The uncompressed image. */
+    uint32_t       image_size;      /*!< Size of the image. Must be 4-byte aligned. */
+    uint32_t       block_size;      /*!< Size of the compressed data blocks sent. */
+    uint8_t       *block_buffer;    /*!< block_size bytes for the compressed output. */
+    bool           skip_verify;     /*!< When true, the final MD5 verification is skipped. */
+    bool           adaptive;        /*!< When true, each 64 KB region is sent compressed only where that is
+                                     *   expected to be faster. The offset must be 4 KB aligned. */
+    uint32_t       compressed_size; /*!< Result: size of the data sent, compressed or not */
+    uint32_t       regions_compressed; /*!< Result, adaptive mode: regions sent compressed */
+    uint32_t       regions_raw;     /*!< Result, adaptive mode: regions sent uncompressed */
+    uint32_t       elapsed_ms;      /*!< Result, adaptive mode: time the data blocks took */
+} esp_loader_flash_compress_cfg_t;
+
+/**
+ * @brief Progress of a resumable flash write, see esp_loader_flash_write_resumable().
+ *
+ * The record is plain data and may be stored as-is, in RAM or on disk, so that a
+ * write cut short by a disconnect or a reset of either side continues where it
+ * stopped. A zeroed record, or one written for another image, starts from the beginning.
+ */
+typedef struct {
+    uint32_t magic;       /*!< ESP_LOADER_JOURNAL_MAGIC for a valid record */
+    uint32_t offset;      /*!< Flash address of the image */
+    uint32_t image_size;  /*!< Size of the image */
+    uint32_t confirmed;   /*!< Bytes from the start of the image acknowledged by the target */
+    uint8_t  image_md5[ESP_LOADER_MD5_DIGEST_SIZE]; /*!< Identifies the image the record belongs to */
+} esp_loader_flash_journal_t;
+
+/**
+ * @brief Called after each change of the journal, e.g. to save it. An error stops the write.
+ */
+typedef esp_loader_error_t (*esp_loader_journal_cb_t)(void *ctx, const esp_loader_flash_journal_t *journal);
+
+/**
+ * @brief Resumable flash write parameters and results, see esp_loader_flash_write_resumable().
+ */
+typedef struct {
+    uint32_t       offset;        /*!< Flash address of the image. Must be 4 KB aligned. */
+    const uint8_t *image;         /*!< The complete image. */
+    uint32_t       image_size;    /*!< Size of the image. Must be 4-byte aligned. */
+    uint32_t       block_size;    /*!< Size of the data blocks sent. */
+    bool           compress;      /*!< When true, the image is sent compressed, in 64 KB segments. */
+    uint8_t       *block_buffer;  /*!< block_size bytes, needed when compressing. */
+    bool           skip_verify;   /*!< When true, the final MD5 verification is skipped. */
+    uint32_t       check_sectors; /*!< Sectors before the journal's resume point whose MD5 is
+                                   *   checked before continuing, 0 selects 4, at most 16. */
+    esp_loader_flash_journal_t *journal;    /*!< Progress record, updated as the write goes. */
+    esp_loader_journal_cb_t     journal_update; /*!< Optional, called after each journal change. */
+    void          *journal_ctx;   /*!< Passed to journal_update. */
+    uint32_t       resumed_from;  /*!< Result: position in the image the write started from */
+} esp_loader_flash_resumable_cfg_t;
+
 /**
  * @brief RAM load operation context.
  *
@@ -151,6 +381,7 @@ typedef struct {
     uint32_t block_size;  /*!< Size of each block passed to esp_loader_mem_write(). */
     struct {
         uint32_t _sequence_number;
+        bool     _through_stub;
     } _state;
 } esp_loader_mem_cfg_t;
 
@@ -158,7 +389,7 @@ typedef struct {
  * @brief Protocol type stored in the loader context.
  *
  * Used internally to gate protocol-specific behaviour (e.g. baud-rate changes
- * are not available on SDIO; SPI does not support flash operations).
+ * are not available on SDIO; SPI has no stub and its block size is bounded).
  */
 typedef enum {
     ESP_LOADER_PROTOCOL_SERIAL, /*!< SLIP over a byte stream (UART, USB CDC-ACM, …) */
@@ -182,14 +413,43 @@ typedef struct esp_loader {
     uint32_t  _target_flash_size;
     bool      _stub_running;
     bool      _spi_attached;
+    bool      _spi_config_valid;
+    uint8_t   _crystal_freq_mhz;
+    uint32_t  _spi_config;
+    uint32_t  _transmission_rate;
+    const esp_loader_bin_segment_t *_stub_segments;
+    uint32_t  _stub_segment_count;
+    esp_loader_stats_t _stats;
+    struct {
+        bool          pending;
+        target_chip_t target;
+        uint8_t       mac[6];
+        uint32_t      transmission_rate;
+    } _profile;
     union {
         struct {
             uint32_t sip_seq_tx;
             uint32_t mem_offset;
+            uint32_t cmd_polls;
+            bool     int_enabled;
+            /* Commands written but not yet answered, oldest at inflight_head */
+            struct {
+                uint32_t sequence_number;
+                uint8_t  command;
+                bool     internal;
+            } inflight[8];
+            uint8_t  inflight_head;
+            uint8_t  inflight_count;
+            uint32_t next_data_sequence; /* Sequence number the next data response answers */
+            esp_loader_error_t deferred_err;
         } sdio;
         struct {
             uint8_t slave_seq_tx;
             uint8_t slave_seq_rx;
+            uint32_t slave_buf_size;  /* Receive buffer size last reported by the slave, 0 until known */
+            bool     qpi;             /* Link switched to QPI by esp_loader_spi_set_mode() */
+            bool     ready_wait;      /* Block on spi_wait_ready instead of polling */
+            uint32_t cmd_polls;
         } spi;
     } _proto_ctx;
 } esp_loader_t;
@@ -332,6 +592,8 @@ esp_loader_error_t esp_loader_connect_secure_download_mode(esp_loader_t *loader,
   *        calls, even when @p cfg->skip_verify is @c true. Skipping esp_loader_flash_finish()
   *        causes the flash-end command to never be sent and, when @p cfg->skip_verify is @c false,
   *        silently skips MD5 verification.
+  * @note  Over SPI, a data block and its command header must fit the receive buffer
+  *        the slave reports, typically a few kilobytes.
   *
   * @param loader[in]  Pointer to initialized loader context.
   * @param cfg[in,out] Flash operation context. Caller fills offset, image_size and block_size
@@ -341,6 +603,7 @@ esp_loader_error_t esp_loader_connect_secure_download_mode(esp_loader_t *loader,
   * @return
   *     - ESP_LOADER_SUCCESS Success
   *     - ESP_LOADER_ERROR_TIMEOUT Timeout
+  *     - ESP_LOADER_ERROR_INVALID_PARAM Unaligned offset or size, or block_size too large for the SPI slave
   *     - ESP_LOADER_ERROR_INVALID_RESPONSE Internal error
   */
 esp_loader_error_t esp_loader_flash_start(esp_loader_t *loader, esp_loader_flash_cfg_t *cfg);
@@ -348,6 +611,12 @@ esp_loader_error_t esp_loader_flash_start(esp_loader_t *loader, esp_loader_flash
 /**
   * @brief Writes supplied data to target's flash memory.
   *
+  * Over SDIO, blocks are queued on the target while it has free receive
+  * buffers, and the function returns before the block is acknowledged.
+  * The payload buffer may still be reused right away. A block rejected by
+  * the target is reported by the next esp_loader_flash_write() or by
+  * esp_loader_flash_finish().
+  *
   * @param loader[in,out]  Pointer to initialized loader context.
   * @param cfg[in,out]     Flash operation context initialized by esp_loader_flash_start().
   * @param payload[in]     Data to be flashed into target's memory.
@@ -505,6 +774,10 @@ esp_loader_error_t esp_loader_get_security_info(esp_loader_t *loader,
 /**
   * @brief Initiates RAM load operation.
   *
+  * If the flasher stub is running, the image is loaded through the stub at the
+  * current transmission rate. Only when the image overlaps the memory occupied
+  * by the stub is the target reset into the ROM loader first.
+  *
   * @param loader[in]  Pointer to initialized loader context.
   * @param cfg[in,out] RAM load context. Caller fills offset, size and block_size before
   *                    calling. The _state sub-struct is initialized by this function and
@@ -587,6 +860,53 @@ esp_loader_error_t esp_loader_write_register(esp_loader_t *loader, uint32_t addr
   */
 esp_loader_error_t esp_loader_read_register(esp_loader_t *loader, uint32_t address, uint32_t *reg_value);
 
+/**
+  * @brief Runs a sequence of register reads, writes and polls.
+  *
+  * Over UART and SDIO the commands are pipelined: up to a few commands are
+  * sent before their responses are collected, so a program costs roughly one
+  * round trip per POLL operation instead of one per operation. Operations
+  * following a POLL are only sent once the poll condition has been met. Over
+  * SPI the operations are executed one by one.
+  *
+  * A POLL is retried up to 10 times before ESP_LOADER_ERROR_TIMEOUT is returned.
+  * When an operation is rejected by the target, no further operations are sent.
+  *
+  * @param loader[in]       Pointer to initialized loader context.
+  * @param ops[in]          Operations to run, in order.
+  * @param count[in]        Number of operations.
+  * @param failed_op[out]   Index of the operation that failed, may be NULL.
+  *                         Left untouched on success.
+  *
+  * @return
+  *     - ESP_LOADER_SUCCESS Success
+  *     - ESP_LOADER_ERROR_TIMEOUT Timeout, or a POLL condition was never met
+  *     - ESP_LOADER_ERROR_INVALID_RESPONSE Internal error
+  */
+esp_loader_error_t esp_loader_run_reg_program(esp_loader_t *loader, const esp_loader_reg_op_t *ops,
+        size_t count, size_t *failed_op);
+
+/**
+  * @brief Reads a block of consecutive 32-bit words from target memory.
+  *
+  * Intended for efuse blocks, ROM tables and RAM regions. On serial
+  * connections several READ_REG commands are kept in flight at once, so the
+  * cost is close to one round trip per eight words instead of one per word.
+  * Works both with the ROM loader and the flasher stub.
+  *
+  * @param loader[in]       Pointer to initialized loader context.
+  * @param address[in]      Address of the first word. Must be 4-byte aligned.
+  * @param words[in]        Number of words to read.
+  * @param out[out]         Destination for the words read, in address order.
+  *
+  * @return
+  *     - ESP_LOADER_SUCCESS Success
+  *     - ESP_LOADER_ERROR_INVALID_PARAM Unaligned address or NULL output buffer
+  *     - ESP_LOADER_ERROR_TIMEOUT Timeout
+  *     - ESP_LOADER_ERROR_INVALID_RESPONSE Internal error
+  */
+esp_loader_error_t esp_loader_read_memory(esp_loader_t *loader, uint32_t address, size_t words, uint32_t *out);
+
 /**
   * @brief Change host and target transmission rate.
   *
@@ -606,6 +926,31 @@ esp_loader_error_t esp_loader_read_register(esp_loader_t *loader, uint32_t addre
   */
 esp_loader_error_t esp_loader_change_transmission_rate(esp_loader_t *loader, uint32_t transmission_rate);
 
+/**
+  * @brief Switch the SPI link between single-line SPI and QPI.
+  *
+  * In QPI mode the command, address and data of every slave transaction use four
+  * lines, quadrupling the bandwidth at the same clock. Call after @c esp_loader_connect();
+  * a later connect returns to single-line SPI. The port must provide @c spi_set_mode
+  * and have the WP and HD lines wired to the target.
+  *
+  * When the slave does not answer in QPI, the link falls back to single-line SPI and
+  * stays usable.
+  *
+  * @note  Only supported on the SPI interface.
+  *
+  * @param loader[in]  Pointer to initialized loader context.
+  * @param mode[in]    Requested line mode.
+  *
+  * @return
+  *     - ESP_LOADER_SUCCESS Success
+  *     - ESP_LOADER_ERROR_FAIL The slave did not switch, the link is back on single-line SPI
+  *     - ESP_LOADER_ERROR_UNSUPPORTED_FUNC Not supported by the protocol or the port
+  *     - ESP_LOADER_ERROR_TIMEOUT Timeout
+  *     - ESP_LOADER_ERROR_INVALID_RESPONSE The slave answers in neither mode
+  */
+esp_loader_error_t esp_loader_spi_set_mode(esp_loader_t *loader, esp_loader_spi_mode_t mode);
+
 /**
   * @brief Verify target's flash integrity by checking with a known MD5 checksum
   * for a specified offset and length.
@@ -625,6 +970,284 @@ esp_loader_error_t esp_loader_flash_verify_known_md5(esp_loader_t *loader,
         uint32_t size,
         const uint8_t *expected_md5);
 
+/**
+  * @brief Write an image to flash without sending the 64 KB blocks that are all 0xFF.
+  *
+  * Aligned 64 KB blocks whose image content is entirely 0xFF only need erasing, so they
+  * are erased but their data is not transferred. The rest of the image is written in runs,
+  * each with its own FLASH_BEGIN. Blocks rather than sectors are skipped so that the flash
+  * is still erased a block at a time, which is several times faster than by sector.
+  * Unless @p cfg->skip_verify is set, the whole range is verified with a single MD5 check.
+  *
+  * With @p cfg->skip_blank_erase set, the flash fingerprint of the blank blocks is compared
+  * against the MD5 of erased flash first, and the blocks that are blank already are not erased.
+  * This saves most of the erase time when programming factory-fresh parts or after a chip
+  * erase. The blocks holding data are always erased, as FLASH_BEGIN erases what it writes.
+  *
+  * @note  Padded application partitions and filesystem images often contain long runs
+  *        of 0xFF. Use the compressed write instead where the stub is available; it already
+  *        sends such runs in a few bytes.
+  *
+  * @param loader[in]  Pointer to initialized loader context.
+  * @param cfg[in,out] Image and write parameters, results on return.
+  *
+  * @return
+  *     - ESP_LOADER_SUCCESS Success
+  *     - ESP_LOADER_ERROR_INVALID_PARAM Unaligned offset or size
+  *     - ESP_LOADER_ERROR_IMAGE_SIZE Image does not fit the flash
+  *     - ESP_LOADER_ERROR_INVALID_MD5 Final verification failed
+  *     - ESP_LOADER_ERROR_UNSUPPORTED_FUNC Unsupported on the target
+  *     - ESP_LOADER_ERROR_TIMEOUT Timeout
+  *     - ESP_LOADER_ERROR_INVALID_RESPONSE Internal error
+  */
+esp_loader_error_t esp_loader_flash_write_sparse(esp_loader_t *loader, esp_loader_flash_sparse_cfg_t *cfg);
+
+/**
+  * @brief Compress an image on the host while writing it to flash.
+  *
+  * Unlike esp_loader_flash_deflate_start(), which needs a zlib stream prepared in advance,
+  * this takes the uncompressed image and compresses it with a small built-in encoder.
+  * The encoder uses a 2 KB hash table on the stack and @p cfg->block_buffer, whatever the
+  * image size. The image is compressed twice, first to learn the number of blocks
+  * FLASH_DEFL_BEGIN announces. Unless @p cfg->skip_verify is set, the flash is verified
+  * against the MD5 of the uncompressed image.
+  *
+  * @note  The encoder favours small memory over ratio. It does well on padding and other
+  *        repetitive data, and slightly enlarges data that does not compress.
+  *
+  * In adaptive mode the image is written in 64 KB regions, each in its own session. The
+  * compression ratio of every region is computed up front, and the time the data blocks
+  * of each region take is measured with the port timer. From these the loader estimates
+  * the link time per byte and the fixed target cost of programming and inflating, and
+  * sends a region compressed only when that is predicted to be faster than sending it raw.
+  * Encrypted images and other incompressible data thus go out raw, padding compressed.
+  * The decisions and the effective throughput are logged and returned in @p cfg.
+  *
+  * @param loader[in]  Pointer to initialized loader context.
+  * @param cfg[in,out] Image and write parameters, compressed size on return.
+  *
+  * @return
+  *     - ESP_LOADER_SUCCESS Success
+  *     - ESP_LOADER_ERROR_INVALID_PARAM Unaligned size or no block buffer
+  *     - ESP_LOADER_ERROR_IMAGE_SIZE Image does not fit the flash
+  *     - ESP_LOADER_ERROR_INVALID_MD5 Verification failed
+  *     - ESP_LOADER_ERROR_UNSUPPORTED_FUNC Unsupported on the target
+  *     - ESP_LOADER_ERROR_TIMEOUT Timeout
+  *     - ESP_LOADER_ERROR_INVALID_RESPONSE Internal error
+  */
+esp_loader_error_t esp_loader_flash_write_compressed(esp_loader_t *loader, esp_loader_flash_compress_cfg_t *cfg);
+
+/**
+  * @brief Write several images to flash as one plan.
+  *
+  * The images are sorted by address and checked for overlaps. Images at most
+  * @p cfg->max_gap bytes apart, and images sharing a flash sector, are merged into one pass
+  * with a single FLASH_BEGIN, erase and MD5 check, the gaps between them filled with 0xFF.
+  * An image written on its own is sent compressed when it has a zlib stream, the stub is
+  * running and the stream is smaller than the image. Otherwise the pass is sent raw.
+  *
+  * Writing the images one at a time instead erases a shared sector twice, and the second
+  * erase destroys the end of the image written before it.
+  *
+  * @note  With @p cfg->dry_run set, nothing is sent to the target and the results report
+  *        what the plan would send and erase.
+  *
+  * @param loader[in]      Pointer to initialized loader context.
+  * @param regions[in,out] Images to write, sorted by address on return.
+  * @param count[in]       Number of images.
+  * @param cfg[in,out]     Plan parameters, results on return.
+  *
+  * @return
+  *     - ESP_LOADER_SUCCESS Success
+  *     - ESP_LOADER_ERROR_INVALID_PARAM Overlapping or unaligned images, or no block buffer
+  *     - ESP_LOADER_ERROR_IMAGE_SIZE An image does not fit the flash
+  *     - ESP_LOADER_ERROR_INVALID_MD5 Verification of a pass failed
+  *     - ESP_LOADER_ERROR_TIMEOUT Timeout
+  *     - ESP_LOADER_ERROR_INVALID_RESPONSE Internal error
+  */
+esp_loader_error_t esp_loader_flash_plan(esp_loader_t *loader, esp_loader_flash_region_t *regions, uint32_t count,
+        esp_loader_flash_plan_cfg_t *cfg);
+
+/**
+  * @brief Computes the MD5 of each region of a flash range on the target.
+  *
+  * The range is split into regions of @p granularity bytes, the last one possibly shorter,
+  * and the raw digest of region i is stored at @p out_hashes + i * ESP_LOADER_MD5_DIGEST_SIZE.
+  * Over UART and SDIO the requests are pipelined, so the target hashes the next region
+  * while the previous digest is transferred. Over SPI they are sent one at a time.
+  *
+  * @note  Not supported by the ESP8266 ROM loader, which has no MD5 command.
+  *
+  * @param loader[in]       Pointer to initialized loader context.
+  * @param address[in]      Start of the flash range.
+  * @param size[in]         Size of the flash range.
+  * @param granularity[in]  Region size, 0 selects ESP_LOADER_FINGERPRINT_DEFAULT_GRANULARITY.
+  * @param out_hashes[out]  Buffer for ceil(size / granularity) * ESP_LOADER_MD5_DIGEST_SIZE bytes.
+  *
+  * @return
+  *     - ESP_LOADER_SUCCESS Success
+  *     - ESP_LOADER_ERROR_INVALID_PARAM Empty range or no output buffer
+  *     - ESP_LOADER_ERROR_IMAGE_SIZE Range does not fit the flash
+  *     - ESP_LOADER_ERROR_UNSUPPORTED_FUNC Unsupported on the target
+  *     - ESP_LOADER_ERROR_TIMEOUT Timeout
+  *     - ESP_LOADER_ERROR_INVALID_RESPONSE Internal error
+  */
+esp_loader_error_t esp_loader_flash_fingerprint(esp_loader_t *loader, uint32_t address, uint32_t size,
+        uint32_t granularity, uint8_t *out_hashes);
+
+/**
+  * @brief Write an image to flash, sending only the parts that differ from the flash contents.
+  *
+  * The image is split into granules of @p cfg->granularity bytes. The MD5 of every granule
+  * is computed on the host and compared against the flash fingerprint of the same range,
+  * see esp_loader_flash_fingerprint(). Adjacent changed
+  * granules are merged into runs, and only those runs are erased and written. The whole
+  * image is then verified with a single MD5 check, unless nothing had to be written.
+  *
+  * @note  A one-byte change costs one granule plus the MD5 queries, instead of the whole
+  *        image. Not supported by the ESP8266 ROM loader, which has no MD5 command.
+  *
+  * @param loader[in]  Pointer to initialized loader context.
+  * @param cfg[in,out] Image and write parameters, results on return.
+  *
+  * @return
+  *     - ESP_LOADER_SUCCESS Success
+  *     - ESP_LOADER_ERROR_INVALID_PARAM Unaligned offset, size or granularity
+  *     - ESP_LOADER_ERROR_IMAGE_SIZE Image does not fit the flash
+  *     - ESP_LOADER_ERROR_INVALID_MD5 Final verification failed
+  *     - ESP_LOADER_ERROR_UNSUPPORTED_FUNC Unsupported on the target
+  *     - ESP_LOADER_ERROR_TIMEOUT Timeout
+  *     - ESP_LOADER_ERROR_INVALID_RESPONSE Internal error
+  */
+esp_loader_error_t esp_loader_flash_diff_write(esp_loader_t *loader, esp_loader_flash_diff_cfg_t *cfg);
+
+/**
+  * @brief Repair an image in flash by rewriting only the sectors that differ from it.
+  *
+  * Meant for when esp_loader_flash_finish() reports ESP_LOADER_ERROR_INVALID_MD5, e.g. after
+  * a marginal link or a few weak flash sectors. The range found to differ is split in halves,
+  * and the MD5 of both is compared against the image, until the damaged 4 KB sectors are
+  * found. Only those are erased and written, adjacent ones together. The image is then
+  * verified again, and the search repeated for up to @p cfg->max_rounds rounds.
+  *
+  * @note  Locating one damaged sector in an image of n sectors takes about 2 * log2(n) MD5
+  *        queries, against n for esp_loader_flash_diff_write(). With many damaged sectors,
+  *        the latter is cheaper. Not supported by the ESP8266 ROM loader, which has no MD5 command.
+  *
+  * @param loader[in]  Pointer to initialized loader context.
+  * @param cfg[in,out] Image and write parameters, repair statistics on return.
+  *
+  * @return
+  *     - ESP_LOADER_SUCCESS The flash matches the image
+  *     - ESP_LOADER_ERROR_INVALID_PARAM Unaligned offset or size, or empty image
+  *     - ESP_LOADER_ERROR_IMAGE_SIZE Image does not fit the flash
+  *     - ESP_LOADER_ERROR_INVALID_MD5 The flash still differs after the last round
+  *     - ESP_LOADER_ERROR_UNSUPPORTED_FUNC Unsupported on the target
+  *     - ESP_LOADER_ERROR_TIMEOUT Timeout
+  *     - ESP_LOADER_ERROR_INVALID_RESPONSE Internal error
+  */
+esp_loader_error_t esp_loader_flash_repair(esp_loader_t *loader, esp_loader_flash_repair_cfg_t *cfg);
+
+/**
+  * @brief Write an image to flash so that an interrupted write can be continued.
+  *
+  * Progress is kept in @p cfg->journal. Uncompressed, the journal advances to the last
+  * complete sector acknowledged after each data block. Over links that queue data blocks,
+  * such as SDIO with the stub, only blocks whose response has arrived count. Compressed, the image is sent in
+  * 64 KB segments, each a zlib stream of its own, and the journal advances per segment.
+  * A stream cannot be entered midway, so this is what lets a compressed write resume.
+  *
+  * Called again with the journal of an interrupted write of the same image, after
+  * reconnecting, it first checks the MD5 of the last @p cfg->check_sectors sectors
+  * before the recorded point. The stub acknowledges data before it is written, so these
+  * may not hold what was acknowledged. The write continues from the first sector that
+  * differs, or from the recorded point if none does. Compressed, it continues from the
+  * segment holding that point. The whole image is verified at the end, so damage
+  * further back is still reported, see esp_loader_flash_repair() to fix it.
+  *
+  * @note  Not supported by the ESP8266 ROM loader, which has no MD5 command.
+  *
+  * @param loader[in]  Pointer to initialized loader context.
+  * @param cfg[in,out] Image, write parameters and journal, results on return.
+  *
+  * @return
+  *     - ESP_LOADER_SUCCESS Success
+  *     - ESP_LOADER_ERROR_INVALID_PARAM Unaligned offset or size, missing journal or block buffer
+  *     - ESP_LOADER_ERROR_IMAGE_SIZE Image does not fit the flash
+  *     - ESP_LOADER_ERROR_INVALID_MD5 Final verification failed
+  *     - ESP_LOADER_ERROR_UNSUPPORTED_FUNC Unsupported on the target
+  *     - ESP_LOADER_ERROR_TIMEOUT Timeout
+  *     - ESP_LOADER_ERROR_INVALID_RESPONSE Internal error
+  *     - Any error returned by @p cfg->journal_update
+  */
+esp_loader_error_t esp_loader_flash_write_resumable(esp_loader_t *loader, esp_loader_flash_resumable_cfg_t *cfg);
+
+/**
+  * @brief Captures the connection profile of the connected target.
+  *
+  * Reads the MAC address and fills in everything the loader has learned about
+  * the target so far. Facts not yet known (SPI configuration, flash size,
+  * ESP32-C2 crystal frequency) are probed once and cached in the loader.
+  *
+  * @note  The ESP32-C2 crystal frequency can only be measured before the
+  *        transmission rate is changed, so capture the profile right after
+  *        connecting if it is needed.
+  *
+  * @param loader[in]   Pointer to a connected loader context.
+  * @param profile[out] Profile record to fill.
+  *
+  * @return
+  *     - ESP_LOADER_SUCCESS Success
+  *     - ESP_LOADER_ERROR_INVALID_TARGET Not connected to a target
+  *     - ESP_LOADER_ERROR_UNSUPPORTED_CHIP Target MAC cannot be read (ESP8266)
+  *     - ESP_LOADER_ERROR_TIMEOUT Timeout
+  *     - ESP_LOADER_ERROR_INVALID_RESPONSE Internal error
+  */
+esp_loader_error_t esp_loader_profile_capture(esp_loader_t *loader, esp_loader_profile_t *profile);
+
+/**
+  * @brief Seeds the loader context with a previously captured profile.
+  *
+  * Must be called after esp_loader_init_*() and before esp_loader_connect() or
+  * esp_loader_connect_with_stub(). The connect call then skips chip detection,
+  * and later operations skip the SPI configuration, flash size and crystal
+  * frequency probes. The connect call validates the profile by reading the MAC
+  * address once; if it differs (board swapped), the profile is dropped and the
+  * regular probes are used instead.
+  *
+  * @note  On serial links, a stored transmission rate is applied once the
+  *        profile has been validated, at the end of the connect call. A failure
+  *        to change it is returned by the connect call.
+  *
+  * @param loader[in]  Pointer to initialized loader context.
+  * @param profile[in] Profile captured by esp_loader_profile_capture().
+  *
+  * @return
+  *     - ESP_LOADER_SUCCESS Success
+  *     - ESP_LOADER_ERROR_INVALID_PARAM Profile record is not valid
+  */
+esp_loader_error_t esp_loader_profile_apply(esp_loader_t *loader, const esp_loader_profile_t *profile);
+
+/**
+  * @brief Returns transport statistics collected since initialization or the last
+  *        esp_loader_reset_stats() call.
+  *
+  * Status polls are counted on transports that have to poll the target for
+  * responses or buffer space (SDIO and SPI). Useful to measure the effect of
+  * interrupt-driven notification or a handshake line on a given host.
+  *
+  * @param loader[in]   Pointer to initialized loader context.
+  * @param stats[out]   Statistics.
+  */
+void esp_loader_get_stats(const esp_loader_t *loader, esp_loader_stats_t *stats);
+
+/**
+  * @brief Clears the transport statistics.
+  *
+  * @param loader[in]   Pointer to initialized loader context.
+  */
+void esp_loader_reset_stats(esp_loader_t *loader);
+
 /**
   * @brief Toggles reset pin.
   *
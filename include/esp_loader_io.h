@@ -71,6 +71,22 @@ extern "C" {
  */
 typedef struct esp_loader_port_s esp_loader_port_t;
 
+/**
+ * @brief One buffer of a gathered write, see @c sdio_writev and @c spi_transfer.
+ */
+typedef struct {
+    const void *data;   /*!< Start of the buffer */
+    uint32_t size;      /*!< Number of bytes, may be 0 */
+} esp_loader_iovec_t;
+
+/**
+ * @brief Line mode of SPI transfers, see @c spi_set_mode.
+ */
+typedef enum {
+    ESP_LOADER_SPI_MODE_SINGLE,  /*!< Standard SPI, one data line per direction */
+    ESP_LOADER_SPI_MODE_QPI,     /*!< Command, address and data all on four lines */
+} esp_loader_spi_mode_t;
+
 /**
  * @brief Unified port operations vtable.
  *
@@ -83,7 +99,9 @@ typedef struct esp_loader_port_s esp_loader_port_t;
  *  - @c change_transmission_rate — NULL for SDIO (host driver manages speed)
  *  - @c write / @c read          — NULL for SDIO ports
  *  - @c spi_set_cs               — NULL for non-SPI ports
+ *  - @c spi_transfer / @c spi_set_mode / @c spi_wait_ready — optional for SPI ports, NULL otherwise
  *  - @c sdio_write / @c sdio_read / @c sdio_card_init — NULL for non-SDIO ports
+ *  - @c sdio_write_blocks / @c sdio_read_blocks / @c sdio_wait_interrupt / @c sdio_writev — optional for SDIO ports, NULL otherwise
  */
 typedef struct {
     /**
@@ -165,6 +183,52 @@ typedef struct {
 
     /** Initializes the SDIO card. NULL for non-SDIO ports. */
     esp_loader_error_t (*sdio_card_init)(esp_loader_port_t *port);
+
+    /** Writes whole 512-byte blocks over SDIO in a single block-mode (multi-block CMD53) transfer.
+     *  size is a non-zero multiple of 512 and at most 511 blocks. Optional; when NULL the
+     *  library issues one sdio_write per 512 bytes instead. */
+    esp_loader_error_t (*sdio_write_blocks)(esp_loader_port_t *port, uint32_t function, uint32_t addr,
+                                            const uint8_t *data, uint32_t size, uint32_t timeout);
+
+    /** Reads whole 512-byte blocks over SDIO in a single block-mode (multi-block CMD53) transfer.
+     *  Same constraints as sdio_write_blocks. Optional. */
+    esp_loader_error_t (*sdio_read_blocks)(esp_loader_port_t *port, uint32_t function, uint32_t addr,
+                                           uint8_t *data, uint32_t size, uint32_t timeout);
+
+    /** Blocks until the SDIO card signals an interrupt (DAT1) or timeout milliseconds pass.
+     *  Returns ESP_LOADER_ERROR_TIMEOUT when no interrupt arrived and
+     *  ESP_LOADER_ERROR_UNSUPPORTED_FUNC when the host cannot deliver interrupts.
+     *  Optional; when NULL the library polls the target's interrupt status register. */
+    esp_loader_error_t (*sdio_wait_interrupt)(esp_loader_port_t *port, uint32_t timeout);
+
+    /** Writes the concatenation of iovcnt buffers over SDIO to consecutive addresses starting at addr,
+     *  as one packet: the port splits it into as few CMD53 transfers as its controller allows, such
+     *  as whole blocks plus a byte-mode tail, regardless of where the buffers start and end.
+     *  Block-mode transfers may only be used when sdio_write_blocks is provided as well.
+     *  Optional; when NULL the library copies packets of up to one SIP packet into a single
+     *  sdio_write/sdio_write_blocks call and writes larger ones a buffer at a time. */
+    esp_loader_error_t (*sdio_writev)(esp_loader_port_t *port, uint32_t function, uint32_t addr,
+                                      const esp_loader_iovec_t *iov, uint32_t iovcnt, uint32_t timeout);
+
+    /** Performs one complete SPI transaction: asserts chip select, writes the concatenation of the
+     *  txcnt buffers, then reads rx_size bytes into rx and releases chip select. rx_size may be 0.
+     *  The first buffer always holds the 3-byte slave transaction preamble (command, address, dummy).
+     *  Optional; when NULL the library drives spi_set_cs and calls write and read once per buffer. */
+    esp_loader_error_t (*spi_transfer)(esp_loader_port_t *port, const esp_loader_iovec_t *tx, uint32_t txcnt,
+                                       uint8_t *rx, uint32_t rx_size, uint32_t timeout);
+
+    /** Sets the line mode of all following SPI transfers, including the preamble.
+     *  Returns ESP_LOADER_ERROR_UNSUPPORTED_FUNC, without changing the mode, when the bus cannot
+     *  use it, e.g. because the WP and HD lines are not wired. ESP_LOADER_SPI_MODE_SINGLE must
+     *  always succeed. Optional; when NULL the library only uses single-line transfers. */
+    esp_loader_error_t (*spi_set_mode)(esp_loader_port_t *port, esp_loader_spi_mode_t mode);
+
+    /** Blocks until the SPI slave's handshake line signals a new buffer in its status registers
+     *  or timeout milliseconds pass. Returns at once while the line is still asserted.
+     *  Returns ESP_LOADER_ERROR_TIMEOUT when the line stayed idle and
+     *  ESP_LOADER_ERROR_UNSUPPORTED_FUNC when no handshake line is wired.
+     *  Optional; when NULL the library polls the status registers. */
+    esp_loader_error_t (*spi_wait_ready)(esp_loader_port_t *port, uint32_t timeout);
 } esp_loader_port_ops_t;
 
 /**
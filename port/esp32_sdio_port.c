@@ -8,9 +8,16 @@
 #include "loader_port_stdio_log.h"
 #include "driver/gpio.h"
 #include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include "freertos/FreeRTOS.h"
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
+/* Function 1 block size set up by the library, and the most blocks one CMD53 can move */
+#define SDIO_BLOCK_SIZE 512
+#define SDIO_MAX_BLOCKS_PER_TRANSFER 511
+
 LOADER_PORT_STDIO_LOG_CALLBACK(esp32_sdio_log, "esf-sdio");
 
 static esp_loader_error_t esp32_sdio_port_init(esp_loader_port_t *port)
@@ -65,6 +72,10 @@ static void esp32_sdio_port_deinit(esp_loader_port_t *port)
     free(p->_card.host.dma_aligned_buffer);
     p->_card.host.dma_aligned_buffer = NULL;
 
+    heap_caps_free(p->_tx_frame);
+    p->_tx_frame = NULL;
+    p->_tx_frame_size = 0;
+
     if (p->_host_driver_needs_deinit) {
         sdmmc_host_deinit();
         p->_host_driver_needs_deinit = false;
@@ -115,9 +126,109 @@ static esp_loader_error_t esp32_sdio_read(esp_loader_port_t *port, uint32_t func
     }
 }
 
+static esp_loader_error_t esp32_sdio_write_blocks(esp_loader_port_t *port, uint32_t function, uint32_t addr,
+        const uint8_t *data, uint32_t size, uint32_t timeout)
+{
+    esp32_sdio_port_t *p = container_of(port, esp32_sdio_port_t, port);
+    (void)timeout;
+
+    if (data == NULL) {
+        return ESP_LOADER_ERROR_INVALID_PARAM;
+    }
+
+    esp_err_t err = sdmmc_io_write_blocks(&p->_card, function, addr, data, (size_t)size);
+
+    if (err == ESP_OK) {
+        return ESP_LOADER_SUCCESS;
+    } else if (err == ESP_ERR_TIMEOUT) {
+        return ESP_LOADER_ERROR_TIMEOUT;
+    } else {
+        return ESP_LOADER_ERROR_FAIL;
+    }
+}
+
+static esp_loader_error_t esp32_sdio_read_blocks(esp_loader_port_t *port, uint32_t function, uint32_t addr,
+        uint8_t *data, uint32_t size, uint32_t timeout)
+{
+    esp32_sdio_port_t *p = container_of(port, esp32_sdio_port_t, port);
+    (void)timeout;
+
+    if (data == NULL) {
+        return ESP_LOADER_ERROR_INVALID_PARAM;
+    }
+
+    esp_err_t err = sdmmc_io_read_blocks(&p->_card, function, addr, data, (size_t)size);
+
+    if (err == ESP_OK) {
+        return ESP_LOADER_SUCCESS;
+    } else if (err == ESP_ERR_TIMEOUT) {
+        return ESP_LOADER_ERROR_TIMEOUT;
+    } else {
+        return ESP_LOADER_ERROR_FAIL;
+    }
+}
+
+/*
+ * The buffers are gathered into a DMA-capable frame, so a packet costs one
+ * block-mode transfer for its whole blocks and one byte-mode transfer for the
+ * tail, instead of up to three transfers per buffer.
+ */
+static esp_loader_error_t esp32_sdio_writev(esp_loader_port_t *port, uint32_t function, uint32_t addr,
+        const esp_loader_iovec_t *iov, uint32_t iovcnt, uint32_t timeout)
+{
+    esp32_sdio_port_t *p = container_of(port, esp32_sdio_port_t, port);
+
+    uint32_t size = 0;
+    for (uint32_t i = 0; i < iovcnt; i++) {
+        if (iov[i].data == NULL && iov[i].size != 0) {
+            return ESP_LOADER_ERROR_INVALID_PARAM;
+        }
+        size += iov[i].size;
+    }
+
+    if (p->_tx_frame_size < size) {
+        uint8_t *frame = heap_caps_realloc(p->_tx_frame, size, MALLOC_CAP_DMA);
+        if (frame == NULL) {
+            return ESP_LOADER_ERROR_FAIL;
+        }
+        p->_tx_frame = frame;
+        p->_tx_frame_size = size;
+    }
+
+    uint32_t offset = 0;
+    for (uint32_t i = 0; i < iovcnt; i++) {
+        if (iov[i].size != 0) {
+            memcpy(&p->_tx_frame[offset], iov[i].data, iov[i].size);
+            offset += iov[i].size;
+        }
+    }
+
+    offset = 0;
+    while (offset < size) {
+        const uint32_t remaining = size - offset;
+        esp_loader_error_t err;
+        uint32_t chunk_size;
+        if (remaining >= SDIO_BLOCK_SIZE) {
+            const uint32_t blocks = remaining / SDIO_BLOCK_SIZE;
+            chunk_size = (blocks < SDIO_MAX_BLOCKS_PER_TRANSFER ? blocks : SDIO_MAX_BLOCKS_PER_TRANSFER) * SDIO_BLOCK_SIZE;
+            err = esp32_sdio_write_blocks(port, function, addr + offset, &p->_tx_frame[offset], chunk_size, timeout);
+        } else {
+            chunk_size = remaining;
+            err = esp32_sdio_write(port, function, addr + offset, &p->_tx_frame[offset], (uint16_t)chunk_size, timeout);
+        }
+        if (err != ESP_LOADER_SUCCESS) {
+            return err;
+        }
+        offset += chunk_size;
+    }
+
+    return ESP_LOADER_SUCCESS;
+}
+
 static esp_loader_error_t esp32_sdio_card_init(esp_loader_port_t *port)
 {
     esp32_sdio_port_t *p = container_of(port, esp32_sdio_port_t, port);
+    p->_int_enabled = false;
     esp_err_t err = sdmmc_card_init(&p->_card_config, &p->_card);
 
     if (err == ESP_OK) {
@@ -167,15 +278,36 @@ static void esp32_sdio_enter_bootloader(esp_loader_port_t *port)
     gpio_set_level(p->boot_pin, 1);
 }
 
-esp_loader_error_t loader_port_wait_int(esp32_sdio_port_t *port, uint32_t timeout)
+static esp_loader_error_t esp32_sdio_wait_interrupt(esp_loader_port_t *port, uint32_t timeout)
 {
-    if (sdmmc_io_wait_int(&port->_card, timeout) == ESP_OK) {
+    esp32_sdio_port_t *p = container_of(port, esp32_sdio_port_t, port);
+
+    // The host side of the card interrupt is armed on first use, after the card is initialized
+    if (!p->_int_enabled) {
+        if (sdmmc_io_enable_int(&p->_card) != ESP_OK) {
+            return ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
+        }
+        p->_int_enabled = true;
+    }
+
+    esp_err_t err = sdmmc_io_wait_int(&p->_card, pdMS_TO_TICKS(timeout));
+
+    if (err == ESP_OK) {
         return ESP_LOADER_SUCCESS;
-    } else {
+    } else if (err == ESP_ERR_TIMEOUT) {
         return ESP_LOADER_ERROR_TIMEOUT;
+    } else if (err == ESP_ERR_NOT_SUPPORTED) {
+        return ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
+    } else {
+        return ESP_LOADER_ERROR_FAIL;
     }
 }
 
+esp_loader_error_t loader_port_wait_int(esp32_sdio_port_t *port, uint32_t timeout)
+{
+    return esp32_sdio_wait_interrupt(&port->port, timeout);
+}
+
 const esp_loader_port_ops_t esp32_sdio_ops = {
     .init                     = esp32_sdio_port_init,
     .deinit                   = esp32_sdio_port_deinit,
@@ -190,4 +322,8 @@ const esp_loader_port_ops_t esp32_sdio_ops = {
     .sdio_write               = esp32_sdio_write,
     .sdio_read                = esp32_sdio_read,
     .sdio_card_init           = esp32_sdio_card_init,
+    .sdio_write_blocks        = esp32_sdio_write_blocks,
+    .sdio_read_blocks         = esp32_sdio_read_blocks,
+    .sdio_wait_interrupt      = esp32_sdio_wait_interrupt,
+    .sdio_writev              = esp32_sdio_writev,
 };
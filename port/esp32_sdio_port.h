@@ -62,6 +62,9 @@ typedef struct {
     sdmmc_host_t  _card_config;
     int64_t       _time_end;
     bool          _host_driver_needs_deinit;
+    bool          _int_enabled;
+    uint8_t      *_tx_frame;      /*!< DMA-capable buffer gathering sdio_writev packets */
+    uint32_t      _tx_frame_size;
 } esp32_sdio_port_t;
 
 /** Port operations vtable for the ESP32 SDIO port. */
@@ -8,8 +8,11 @@
 #include "loader_port_stdio_log.h"
 #include "driver/gpio.h"
 #include "esp_timer.h"
+#include "esp_attr.h"
+#include "esp_heap_caps.h"
 #include "esp_idf_version.h"
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 
 #if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(4, 3, 0)
@@ -19,9 +22,47 @@
 #endif
 
 #define WORD_ALIGNED(ptr) ((size_t)ptr % sizeof(size_t) == 0)
+#define SPI_PREAMBLE_SIZE 3
+/* Dummy clocks of the slave HD protocol, the same 8 bit dummy byte is 4 clocks in QIO */
+#define SPI_DUMMY_CLOCKS 8
+#define SPI_QIO_DUMMY_CLOCKS 4
 
 LOADER_PORT_STDIO_LOG_CALLBACK(esp32_spi_log, "esf-spi");
 
+static void IRAM_ATTR esp32_spi_handshake_isr(void *arg)
+{
+    esp32_spi_port_t *p = arg;
+    BaseType_t task_woken = pdFALSE;
+    xSemaphoreGiveFromISR(p->_handshake_sem, &task_woken);
+    if (task_woken) {
+        portYIELD_FROM_ISR();
+    }
+}
+
+static esp_loader_error_t esp32_spi_handshake_init(esp32_spi_port_t *p)
+{
+    p->_handshake_sem = xSemaphoreCreateBinary();
+    if (p->_handshake_sem == NULL) {
+        return ESP_LOADER_ERROR_FAIL;
+    }
+
+    gpio_reset_pin(p->handshake_pin);
+    gpio_set_direction(p->handshake_pin, GPIO_MODE_INPUT);
+    gpio_set_pull_mode(p->handshake_pin, GPIO_PULLDOWN_ONLY);
+    gpio_set_intr_type(p->handshake_pin, GPIO_INTR_POSEDGE);
+
+    // The ISR service may already be installed by the application
+    esp_err_t err = gpio_install_isr_service(0);
+    if (err != ESP_OK && err != ESP_ERR_INVALID_STATE) {
+        return ESP_LOADER_ERROR_FAIL;
+    }
+    if (gpio_isr_handler_add(p->handshake_pin, esp32_spi_handshake_isr, p) != ESP_OK) {
+        return ESP_LOADER_ERROR_FAIL;
+    }
+
+    return ESP_LOADER_SUCCESS;
+}
+
 static esp_loader_error_t esp32_spi_port_init(esp_loader_port_t *port)
 {
     esp32_spi_port_t *p = container_of(port, esp32_spi_port_t, port);
@@ -60,6 +101,10 @@ static esp_loader_error_t esp32_spi_port_init(esp_loader_port_t *port)
     gpio_set_direction(p->spi_cs_pin, GPIO_MODE_OUTPUT);
     gpio_set_level(p->spi_cs_pin, 1);
 
+    if (p->use_handshake) {
+        return esp32_spi_handshake_init(p);
+    }
+
     return ESP_LOADER_SUCCESS;
 }
 
@@ -73,65 +118,191 @@ static void esp32_spi_port_deinit(esp_loader_port_t *port)
         spi_bus_free(p->spi_bus);
         p->_bus_needs_deinit = false;
     }
+    if (p->_handshake_sem != NULL) {
+        gpio_isr_handler_remove(p->handshake_pin);
+        gpio_reset_pin(p->handshake_pin);
+        vSemaphoreDelete(p->_handshake_sem);
+        p->_handshake_sem = NULL;
+    }
+    heap_caps_free(p->_tx_frame);
+    p->_tx_frame = NULL;
+    p->_tx_frame_size = 0;
 }
 
 static void esp32_spi_set_cs(esp_loader_port_t *port, uint32_t level)
 {
     esp32_spi_port_t *p = container_of(port, esp32_spi_port_t, port);
     gpio_set_level(p->spi_cs_pin, level);
+    p->_preamble_pending = level == 0;
 }
 
+/*
+ * Sends the preamble's command and address bytes in their own phases, followed
+ * by the dummy clocks. In QPI the command and address go over four lines too,
+ * and the dummy phase shrinks to the 4 clocks the slave waits for.
+ */
+static void esp32_spi_preamble_phases(const esp32_spi_port_t *p, const uint8_t *preamble,
+                                      spi_transaction_ext_t *transaction)
+{
+    transaction->base.flags |= SPI_TRANS_VARIABLE_CMD | SPI_TRANS_VARIABLE_ADDR | SPI_TRANS_VARIABLE_DUMMY;
+    if (p->_qpi) {
+        transaction->base.flags |= SPI_TRANS_MULTILINE_CMD | SPI_TRANS_MULTILINE_ADDR;
+    }
+    transaction->base.cmd = preamble[0];
+    transaction->base.addr = preamble[1];
+    transaction->command_bits = 8;
+    transaction->address_bits = 8;
+    transaction->dummy_bits = p->_qpi ? SPI_QIO_DUMMY_CLOCKS : SPI_DUMMY_CLOCKS;
+}
+
+static esp_loader_error_t esp32_spi_result(esp_err_t err)
+{
+    if (err == ESP_OK) {
+        return ESP_LOADER_SUCCESS;
+    } else if (err == ESP_ERR_TIMEOUT) {
+        return ESP_LOADER_ERROR_TIMEOUT;
+    } else {
+        return ESP_LOADER_ERROR_FAIL;
+    }
+}
+
+/* The first write after chip select falls starts with the preamble */
 static esp_loader_error_t esp32_spi_write(esp_loader_port_t *port, const uint8_t *data, const uint16_t size, const uint32_t timeout)
 {
     esp32_spi_port_t *p = container_of(port, esp32_spi_port_t, port);
     (void)timeout;
 
-    if (data == NULL) {
+    if (data == NULL || (p->_preamble_pending && size < SPI_PREAMBLE_SIZE)) {
         return ESP_LOADER_ERROR_INVALID_PARAM;
     }
 
-    spi_transaction_t transaction = {
-        .tx_buffer = data,
-        .rx_buffer = NULL,
-        .length    = size * 8U,
-        .rxlength  = 0,
+    spi_transaction_ext_t transaction = {
+        .base = {
+            .flags     = p->_qpi ? SPI_TRANS_MODE_QIO : 0,
+            .tx_buffer = data,
+            .length    = size * 8U,
+        },
     };
 
-    esp_err_t err = spi_device_transmit(p->_device_h, &transaction);
-
-    if (err == ESP_OK) {
-        return ESP_LOADER_SUCCESS;
-    } else if (err == ESP_ERR_TIMEOUT) {
-        return ESP_LOADER_ERROR_TIMEOUT;
-    } else {
-        return ESP_LOADER_ERROR_FAIL;
+    if (p->_preamble_pending) {
+        esp32_spi_preamble_phases(p, data, &transaction);
+        transaction.base.tx_buffer = size > SPI_PREAMBLE_SIZE ? &data[SPI_PREAMBLE_SIZE] : NULL;
+        transaction.base.length = (size - SPI_PREAMBLE_SIZE) * 8U;
+        p->_preamble_pending = false;
     }
+
+    return esp32_spi_result(spi_device_transmit(p->_device_h, &transaction.base));
 }
 
+/* Reads always follow the write of their preamble, so they only carry the data phase */
 static esp_loader_error_t esp32_spi_read(esp_loader_port_t *port, uint8_t *data, const uint16_t size, const uint32_t timeout)
 {
     esp32_spi_port_t *p = container_of(port, esp32_spi_port_t, port);
     (void)timeout;
 
-    if (data == NULL || !WORD_ALIGNED(data)) {
+    if (data == NULL || !WORD_ALIGNED(data) || p->_preamble_pending) {
         return ESP_LOADER_ERROR_INVALID_PARAM;
     }
 
     spi_transaction_t transaction = {
+        .flags     = p->_qpi ? SPI_TRANS_MODE_QIO : 0,
         .tx_buffer = NULL,
         .rx_buffer = data,
         .rxlength  = size * 8,
     };
 
-    esp_err_t err = spi_device_transmit(p->_device_h, &transaction);
+    return esp32_spi_result(spi_device_transmit(p->_device_h, &transaction));
+}
 
-    if (err == ESP_OK) {
+/*
+ * The preamble is sent in the command, address and dummy phases, so a whole slave
+ * transaction costs a single spi_device_transmit(). Payload buffers are
+ * gathered into a DMA-capable frame unless there is only one of them. The
+ * library never combines a payload with a read, which the half-duplex DMA of
+ * the original ESP32 could not do in one transaction.
+ */
+static esp_loader_error_t esp32_spi_transfer(esp_loader_port_t *port, const esp_loader_iovec_t *tx, uint32_t txcnt,
+        uint8_t *rx, uint32_t rx_size, uint32_t timeout)
+{
+    esp32_spi_port_t *p = container_of(port, esp32_spi_port_t, port);
+    (void)timeout;
+
+    if (txcnt == 0 || tx[0].size != SPI_PREAMBLE_SIZE || (rx_size != 0 && (rx == NULL || !WORD_ALIGNED(rx)))) {
+        return ESP_LOADER_ERROR_INVALID_PARAM;
+    }
+
+    const uint8_t *preamble = tx[0].data;
+    const void *payload = NULL;
+    uint32_t payload_size = 0;
+    uint32_t payload_buffers = 0;
+    for (uint32_t i = 1; i < txcnt; i++) {
+        if (tx[i].size != 0) {
+            payload = tx[i].data;
+            payload_size += tx[i].size;
+            payload_buffers++;
+        }
+    }
+
+    if (payload_buffers > 1) {
+        if (p->_tx_frame_size < payload_size) {
+            uint8_t *frame = heap_caps_realloc(p->_tx_frame, payload_size, MALLOC_CAP_DMA);
+            if (frame == NULL) {
+                return ESP_LOADER_ERROR_FAIL;
+            }
+            p->_tx_frame = frame;
+            p->_tx_frame_size = payload_size;
+        }
+
+        uint32_t offset = 0;
+        for (uint32_t i = 1; i < txcnt; i++) {
+            memcpy(&p->_tx_frame[offset], tx[i].data, tx[i].size);
+            offset += tx[i].size;
+        }
+        payload = p->_tx_frame;
+    }
+
+    spi_transaction_ext_t transaction = {
+        .base = {
+            .flags     = p->_qpi ? SPI_TRANS_MODE_QIO : 0,
+            .length    = payload_size * 8U,
+            .tx_buffer = payload,
+            .rxlength  = rx_size * 8U,
+            .rx_buffer = rx_size != 0 ? rx : NULL,
+        },
+    };
+    esp32_spi_preamble_phases(p, preamble, &transaction);
+
+    return esp32_spi_result(spi_device_transmit(p->_device_h, &transaction.base));
+}
+
+static esp_loader_error_t esp32_spi_set_mode(esp_loader_port_t *port, esp_loader_spi_mode_t mode)
+{
+    esp32_spi_port_t *p = container_of(port, esp32_spi_port_t, port);
+
+    if (mode == ESP_LOADER_SPI_MODE_QPI && (p->spi_quadwp_pin < 0 || p->spi_quadhd_pin < 0)) {
+        return ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
+    }
+
+    p->_qpi = mode == ESP_LOADER_SPI_MODE_QPI;
+    return ESP_LOADER_SUCCESS;
+}
+
+static esp_loader_error_t esp32_spi_wait_ready(esp_loader_port_t *port, uint32_t timeout)
+{
+    esp32_spi_port_t *p = container_of(port, esp32_spi_port_t, port);
+
+    if (p->_handshake_sem == NULL) {
+        return ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
+    }
+
+    // Drop edges seen before this wait; the level tells whether the slave is ready now
+    xSemaphoreTake(p->_handshake_sem, 0);
+    if (gpio_get_level(p->handshake_pin) == 1) {
         return ESP_LOADER_SUCCESS;
-    } else if (err == ESP_ERR_TIMEOUT) {
-        return ESP_LOADER_ERROR_TIMEOUT;
-    } else {
-        return ESP_LOADER_ERROR_FAIL;
     }
+
+    return xSemaphoreTake(p->_handshake_sem, pdMS_TO_TICKS(timeout)) == pdTRUE ?
+           ESP_LOADER_SUCCESS : ESP_LOADER_ERROR_TIMEOUT;
 }
 
 static void esp32_spi_delay_ms(esp_loader_port_t *port, uint32_t ms)
@@ -240,4 +411,7 @@ const esp_loader_port_ops_t esp32_spi_ops = {
     .write                    = esp32_spi_write,
     .read                     = esp32_spi_read,
     .spi_set_cs               = esp32_spi_set_cs,
+    .spi_transfer             = esp32_spi_transfer,
+    .spi_set_mode             = esp32_spi_set_mode,
+    .spi_wait_ready           = esp32_spi_wait_ready,
 };
@@ -9,6 +9,8 @@
 #include "esp_loader_io.h"
 #include "driver/gpio.h"
 #include "driver/spi_master.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -53,6 +55,8 @@ typedef struct {
     gpio_num_t        strap_bit2_pin;
     gpio_num_t        strap_bit3_pin;
     bool              dont_initialize_bus;  /*!< Set if bus already initialised externally */
+    bool              use_handshake;        /*!< Set if the slave's ready line is wired to handshake_pin */
+    gpio_num_t        handshake_pin;
 
     /* Private runtime state — do not access directly */
     spi_bus_config_t              _spi_config;
@@ -60,6 +64,11 @@ typedef struct {
     spi_device_interface_config_t _device_config;
     int64_t                       _time_end;
     bool                          _bus_needs_deinit;
+    bool                          _qpi;             /*!< Transfers use four lines, see spi_set_mode */
+    bool                          _preamble_pending; /*!< Chip select is low and the preamble not sent yet */
+    SemaphoreHandle_t             _handshake_sem;   /*!< Given on each rising edge of handshake_pin */
+    uint8_t                      *_tx_frame;        /*!< DMA-capable buffer gathering spi_transfer payloads */
+    uint32_t                      _tx_frame_size;
 } esp32_spi_port_t;
 
 /** Port operations vtable for the ESP32 SPI port. */
@@ -0,0 +1,256 @@
+/*
+ * SPDX-FileCopyrightText: 2026 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "linux_deflate.h"
+#include "deflate.h"
+#include "esp_loader_internal.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CHUNK_SIZE (128 * 1024)
+#define CHUNKS_AHEAD_PER_THREAD 2
+#define MAX_THREADS 64
+#define ADLER_SIZE 4
+
+static const uint8_t ZLIB_HEADER[] = DEFLATE_ZLIB_HEADER;
+
+typedef struct {
+    uint8_t *data;
+    uint32_t size;
+    bool done;
+    esp_loader_error_t error;
+} chunk_t;
+
+typedef struct {
+    const uint8_t *image;
+    uint32_t image_size;
+    chunk_t *chunks;
+    uint32_t chunk_count;
+    uint32_t next;      /* Next chunk to compress */
+    uint32_t sent;      /* Chunks handed to the link */
+    uint32_t ahead;     /* Most chunks compressed but not sent */
+    bool abort;
+    pthread_mutex_t lock;
+    pthread_cond_t compressed;
+    pthread_cond_t released;
+} pipeline_t;
+
+typedef struct {
+    esp_loader_t *loader;
+    esp_loader_flash_deflate_cfg_t deflate_cfg;
+    uint8_t *block;
+    uint32_t fill;
+    uint32_t total;
+} transmitter_t;
+
+/* Chunks are compressed into a buffer one byte over their bound, so the sink is
+   only called once at the end, with the buffer itself. A full buffer means the
+   bound was exceeded and the start of the chunk is about to be overwritten. */
+static esp_loader_error_t chunk_sink(void *ctx, const uint8_t *data, uint32_t size)
+{
+    const uint32_t *buffer_size = ctx;
+    (void)data;
+    return size < *buffer_size ? ESP_LOADER_SUCCESS : ESP_LOADER_ERROR_FAIL;
+}
+
+static void *compress_worker(void *arg)
+{
+    pipeline_t *pipeline = arg;
+
+    pthread_mutex_lock(&pipeline->lock);
+    for (;;) {
+        while (!pipeline->abort && pipeline->next < pipeline->chunk_count &&
+                pipeline->next >= pipeline->sent + pipeline->ahead) {
+            pthread_cond_wait(&pipeline->released, &pipeline->lock);
+        }
+        if (pipeline->abort || pipeline->next == pipeline->chunk_count) {
+            break;
+        }
+        const uint32_t index = pipeline->next++;
+        pthread_mutex_unlock(&pipeline->lock);
+
+        const uint32_t start = index * CHUNK_SIZE;
+        const uint32_t end = pipeline->image_size - start > CHUNK_SIZE ? start + CHUNK_SIZE : pipeline->image_size;
+        uint32_t buffer_size = DEFLATE_CHUNK_BOUND(end - start) + 1;
+        chunk_t *chunk = &pipeline->chunks[index];
+        uint8_t *data = malloc(buffer_size);
+        uint32_t size = 0;
+        esp_loader_error_t error = ESP_LOADER_ERROR_FAIL;
+
+        if (data != NULL) {
+            error = deflate_compress_chunk(pipeline->image, start, end, index == pipeline->chunk_count - 1,
+                                           data, buffer_size, chunk_sink, &buffer_size, &size);
+        }
+
+        pthread_mutex_lock(&pipeline->lock);
+        chunk->data = data;
+        chunk->size = size;
+        chunk->error = error;
+        chunk->done = true;
+        pthread_cond_broadcast(&pipeline->compressed);
+    }
+    pthread_mutex_unlock(&pipeline->lock);
+
+    return NULL;
+}
+
+static esp_loader_error_t transmit(transmitter_t *tx, const uint8_t *data, uint32_t size)
+{
+    const uint32_t block_size = tx->deflate_cfg.block_size;
+
+    tx->total += size;
+    while (size > 0) {
+        const uint32_t count = size < block_size - tx->fill ? size : block_size - tx->fill;
+        memcpy(&tx->block[tx->fill], data, count);
+        tx->fill += count;
+        data += count;
+        size -= count;
+
+        if (tx->fill == block_size) {
+            RETURN_ON_ERROR(esp_loader_flash_deflate_write(tx->loader, &tx->deflate_cfg, tx->block, tx->fill));
+            tx->fill = 0;
+        }
+    }
+
+    return ESP_LOADER_SUCCESS;
+}
+
+/* Sends the chunks in order as the workers finish them */
+static esp_loader_error_t transmit_chunks(pipeline_t *pipeline, transmitter_t *tx)
+{
+    for (uint32_t index = 0; index < pipeline->chunk_count; index++) {
+        chunk_t *chunk = &pipeline->chunks[index];
+
+        pthread_mutex_lock(&pipeline->lock);
+        while (!chunk->done) {
+            pthread_cond_wait(&pipeline->compressed, &pipeline->lock);
+        }
+        pthread_mutex_unlock(&pipeline->lock);
+
+        RETURN_ON_ERROR(chunk->error);
+        RETURN_ON_ERROR(transmit(tx, chunk->data, chunk->size));
+
+        pthread_mutex_lock(&pipeline->lock);
+        free(chunk->data);
+        chunk->data = NULL;
+        pipeline->sent++;
+        pthread_cond_broadcast(&pipeline->released);
+        pthread_mutex_unlock(&pipeline->lock);
+    }
+
+    return ESP_LOADER_SUCCESS;
+}
+
+static esp_loader_error_t write_stream(pipeline_t *pipeline, transmitter_t *tx)
+{
+    const uint32_t adler = deflate_adler32(pipeline->image, pipeline->image_size);
+    const uint8_t trailer[ADLER_SIZE] = {
+        (uint8_t)(adler >> 24), (uint8_t)(adler >> 16), (uint8_t)(adler >> 8), (uint8_t)adler
+    };
+
+    RETURN_ON_ERROR(transmit(tx, ZLIB_HEADER, sizeof(ZLIB_HEADER)));
+    RETURN_ON_ERROR(transmit_chunks(pipeline, tx));
+    RETURN_ON_ERROR(transmit(tx, trailer, sizeof(trailer)));
+
+    if (tx->fill > 0) {
+        RETURN_ON_ERROR(esp_loader_flash_deflate_write(tx->loader, &tx->deflate_cfg, tx->block, tx->fill));
+    }
+    return esp_loader_flash_deflate_finish(tx->loader, &tx->deflate_cfg);
+}
+
+esp_loader_error_t linux_flash_write_compressed(esp_loader_t *loader, esp_loader_flash_compress_cfg_t *cfg,
+        uint32_t threads)
+{
+    if (cfg->image_size % 4 != 0 || cfg->block_size == 0 || cfg->block_buffer == NULL || cfg->adaptive) {
+        return ESP_LOADER_ERROR_INVALID_PARAM;
+    }
+
+    // The block count announced up front is only a bound, which the ROM loader would take literally
+    if (!loader->_stub_running) {
+        return ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
+    }
+
+    if (threads == 0) {
+        const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (uint32_t)cpus : 1;
+    }
+    threads = threads < MAX_THREADS ? threads : MAX_THREADS;
+
+    // An empty image still needs its final block
+    const uint32_t chunk_count = cfg->image_size == 0 ? 1 : (cfg->image_size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    const uint64_t bound = sizeof(ZLIB_HEADER) + (uint64_t)cfg->image_size + cfg->image_size / 8 +
+                           (uint64_t)DEFLATE_CHUNK_BOUND(0) * chunk_count + ADLER_SIZE;
+    if (bound > UINT32_MAX) {
+        return ESP_LOADER_ERROR_INVALID_PARAM;
+    }
+
+    pipeline_t pipeline = {
+        .image = cfg->image,
+        .image_size = cfg->image_size,
+        .chunks = calloc(chunk_count, sizeof(chunk_t)),
+        .chunk_count = chunk_count,
+        .ahead = threads * CHUNKS_AHEAD_PER_THREAD,
+    };
+    pthread_t workers[MAX_THREADS];
+    uint32_t started = 0;
+
+    if (pipeline.chunks == NULL) {
+        return ESP_LOADER_ERROR_FAIL;
+    }
+    pthread_mutex_init(&pipeline.lock, NULL);
+    pthread_cond_init(&pipeline.compressed, NULL);
+    pthread_cond_init(&pipeline.released, NULL);
+
+    while (started < threads && pthread_create(&workers[started], NULL, compress_worker, &pipeline) == 0) {
+        started++;
+    }
+
+    // The session only opens once the pipeline runs, so a local failure leaves none behind on the target
+    transmitter_t tx = {
+        .loader = loader,
+        .deflate_cfg = {
+            .offset = cfg->offset,
+            .image_size = cfg->image_size,
+            .compressed_size = (uint32_t)bound,
+            .block_size = cfg->block_size,
+        },
+        .block = cfg->block_buffer,
+    };
+    esp_loader_error_t result = ESP_LOADER_ERROR_FAIL;
+    if (started > 0) {
+        result = esp_loader_flash_deflate_start(loader, &tx.deflate_cfg);
+    }
+    if (result == ESP_LOADER_SUCCESS) {
+        result = write_stream(&pipeline, &tx);
+    }
+
+    pthread_mutex_lock(&pipeline.lock);
+    pipeline.abort = true;
+    pthread_cond_broadcast(&pipeline.released);
+    pthread_mutex_unlock(&pipeline.lock);
+    for (uint32_t i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    for (uint32_t i = 0; i < chunk_count; i++) {
+        free(pipeline.chunks[i].data);
+    }
+    free(pipeline.chunks);
+    pthread_cond_destroy(&pipeline.released);
+    pthread_cond_destroy(&pipeline.compressed);
+    pthread_mutex_destroy(&pipeline.lock);
+
+    cfg->compressed_size = tx.total;
+    RETURN_ON_ERROR(result);
+
+    if (cfg->skip_verify) {
+        return ESP_LOADER_SUCCESS;
+    }
+    return loader_flash_verify_image(loader, cfg->offset, cfg->image, cfg->image_size);
+}
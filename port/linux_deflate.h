@@ -0,0 +1,50 @@
+/*
+ * SPDX-FileCopyrightText: 2026 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include "esp_loader.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Compress an image on worker threads while writing it to flash.
+ *
+ * The multi-threaded counterpart of esp_loader_flash_write_compressed() for Linux
+ * hosts. The image is split into 128 KB chunks compressed in parallel, each able
+ * to match into the 32 KB before it, and joined into one zlib stream. Blocks are
+ * sent as soon as the chunks they come from are ready, so compression overlaps
+ * the link. Workers stay at most two chunks per thread ahead of the link, which
+ * bounds the memory held by compressed chunks.
+ *
+ * The compressed size is not known when FLASH_DEFL_BEGIN is sent, so the number
+ * of blocks it announces is the encoder's upper bound rather than the exact count.
+ * The stub only uses it to tell whether more input is coming. The ROM loader
+ * expects exactly that many blocks, so the stub has to be running.
+ *
+ * @param loader[in]  Pointer to initialized loader context.
+ * @param cfg[inout]  As for esp_loader_flash_write_compressed(); adaptive mode is not
+ *                    supported. compressed_size is set to the size of the stream sent.
+ * @param threads[in] Worker threads, 0 for one per online CPU.
+ *
+ * @return
+ *     - ESP_LOADER_SUCCESS Success
+ *     - ESP_LOADER_ERROR_INVALID_PARAM Invalid parameter
+ *     - ESP_LOADER_ERROR_FAIL Out of memory or threads
+ *     - ESP_LOADER_ERROR_INVALID_MD5 Final verification failed
+ *     - ESP_LOADER_ERROR_UNSUPPORTED_FUNC The flasher stub is not running, or unsupported on the target
+ *     - ESP_LOADER_ERROR_TIMEOUT Timeout
+ *     - ESP_LOADER_ERROR_INVALID_RESPONSE Internal error
+ */
+esp_loader_error_t linux_flash_write_compressed(esp_loader_t *loader, esp_loader_flash_compress_cfg_t *cfg,
+        uint32_t threads);
+
+#ifdef __cplusplus
+}
+#endif
@@ -193,6 +193,32 @@ static bool is_usb_jtag_serial(const char *device)
     return (vid == ESPRESSIF_USB_JTAG_VID && pid == ESPRESSIF_USB_JTAG_PID);
 }
 
+bool linux_port_get_usb_serial(const linux_port_t *port, char *serial, size_t size)
+{
+    const char *name = strrchr(port->device, '/');
+    name = name ? name + 1 : port->device;
+
+    /* USB CDC-ACM and most USB-to-UART bridges expose the serial one level above the interface */
+    char path[256];
+    snprintf(path, sizeof(path), "/sys/class/tty/%s/device/../serial", name);
+
+    if (size == 0) {
+        return false;
+    }
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return false;
+    }
+    bool ok = fgets(serial, (int)size, f) != NULL;
+    fclose(f);
+    if (!ok) {
+        return false;
+    }
+
+    serial[strcspn(serial, "\r\n")] = '\0';
+    return serial[0] != '\0';
+}
+
 /*
  * After a USB JTAG Serial device re-enumerates, the port disappears briefly.
  * Close the current fd and poll serial_open() for up to `timeout_ms`.
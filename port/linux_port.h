@@ -8,6 +8,7 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include "esp_loader_io.h"
 
 #ifdef __cplusplus
@@ -89,6 +90,20 @@ typedef struct {
 /** Port operations vtable for the Linux UART port. */
 extern const esp_loader_port_ops_t linux_uart_ops;
 
+/**
+ * @brief Reads the USB serial number of the adapter behind @c port->device.
+ *
+ * Resolved through sysfs, so it also works before the port is opened. Useful
+ * as a stable key for storing an esp_loader_profile_t per attached board.
+ *
+ * @param port[in]    Port instance with @c device filled in.
+ * @param serial[out] Buffer receiving the NUL-terminated serial number.
+ * @param size[in]    Size of @p serial in bytes.
+ *
+ * @return true on success, false if the device has no USB serial number.
+ */
+bool linux_port_get_usb_serial(const linux_port_t *port, char *serial, size_t size);
+
 #ifdef __cplusplus
 }
 #endif
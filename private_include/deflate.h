@@ -0,0 +1,84 @@
+/*
+ * SPDX-FileCopyrightText: 2026 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#pragma once
+
+#include "esp_loader.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* zlib stream header: deflate with a 32 KB window, no dictionary */
+#define DEFLATE_ZLIB_HEADER { 0x78, 0x01 }
+
+/* Most bytes deflate_compress_chunk() produces for size bytes of input, 9 bits per byte plus block framing */
+#define DEFLATE_CHUNK_BOUND(size) ((size) + (size) / 8 + 16)
+
+/* Receives the compressed stream in chunks of the output buffer size, the last one shorter */
+typedef esp_loader_error_t (*deflate_sink_t)(void *ctx, const uint8_t *data, uint32_t size);
+
+/**
+ * @brief Compresses data into a zlib stream, as accepted by FLASH_DEFL_DATA.
+ *
+ * The encoder is LZ77 with a single hash candidate per position and the fixed
+ * Huffman codes of deflate, so it needs no memory beyond a 2 KB hash table on
+ * the stack and the output buffer. The window is the input itself. Its output
+ * depends only on the input, so a first call without output buffer and sink
+ * gives the size a second call will produce.
+ *
+ * @param data[in]          Data to compress.
+ * @param size[in]          Size of the data.
+ * @param out_buf[in]       Output buffer, or NULL to only compute the size.
+ * @param out_buf_size[in]  Size of the output buffer, the chunk size passed to sink.
+ * @param sink[in]          Called with each chunk, NULL when only computing the size.
+ * @param ctx[in]           Passed to sink.
+ * @param compressed_size[out] Size of the zlib stream.
+ *
+ * @return The first error returned by sink, ESP_LOADER_SUCCESS otherwise.
+ */
+esp_loader_error_t deflate_compress(const uint8_t *data, uint32_t size,
+                                    uint8_t *out_buf, uint32_t out_buf_size,
+                                    deflate_sink_t sink, void *ctx,
+                                    uint32_t *compressed_size);
+
+/**
+ * @brief Compresses one chunk of a larger input into raw deflate blocks.
+ *
+ * Matches may reach up to 32 KB back before @p start, so chunks compressed
+ * independently, e.g. on separate threads, still find the matches spanning their
+ * boundaries. Every chunk but the final one ends on a byte boundary with an empty
+ * stored block, so the chunks concatenate into one deflate stream. Wrapping it as
+ * a zlib stream takes DEFLATE_ZLIB_HEADER in front and the deflate_adler32() of
+ * the whole input behind, most significant byte first.
+ *
+ * @param data[in]          The whole input.
+ * @param start[in]         Offset of the chunk in @p data.
+ * @param end[in]           Offset one past the chunk.
+ * @param final[in]         True for the last chunk of the stream.
+ * @param out_buf[in]       Output buffer, or NULL to only compute the size.
+ * @param out_buf_size[in]  Size of the output buffer, the chunk size passed to sink.
+ * @param sink[in]          Called with each chunk of output, NULL when only computing the size.
+ * @param ctx[in]           Passed to sink.
+ * @param compressed_size[out] Size of the compressed chunk, at most DEFLATE_CHUNK_BOUND(end - start).
+ *
+ * @return The first error returned by sink, ESP_LOADER_SUCCESS otherwise.
+ */
+esp_loader_error_t deflate_compress_chunk(const uint8_t *data, uint32_t start, uint32_t end, bool final,
+        uint8_t *out_buf, uint32_t out_buf_size,
+        deflate_sink_t sink, void *ctx,
+        uint32_t *compressed_size);
+
+/**
+ * @brief Computes the Adler-32 checksum ending a zlib stream.
+ */
+uint32_t deflate_adler32(const uint8_t *data, uint32_t size);
+
+#ifdef __cplusplus
+}
+#endif
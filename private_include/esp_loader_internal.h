@@ -0,0 +1,28 @@
+/*
+ * SPDX-FileCopyrightText: 2026 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#pragma once
+
+#include "esp_loader.h"
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Checks a flash range against the MD5 of the image written there.
+ *
+ * Shared by the write paths of the library and the host ports built on them.
+ *
+ * @return As esp_loader_flash_verify_known_md5().
+ */
+esp_loader_error_t loader_flash_verify_image(esp_loader_t *loader, uint32_t offset, const uint8_t *image,
+        uint32_t size);
+
+#ifdef __cplusplus
+}
+#endif
@@ -33,6 +33,9 @@ typedef struct esp_loader_protocol_ops_s {
 
     esp_loader_error_t (*spi_attach)(esp_loader_t *loader, uint32_t config);
 
+    /* Switches the SPI slave link between single-line and QPI (NULL = single-line only) */
+    esp_loader_error_t (*set_line_mode)(esp_loader_t *loader, esp_loader_spi_mode_t mode);
+
     /* Raw stub packet transport used by shared flash-read stub logic. */
     esp_loader_error_t (*recv_stub_packet)(esp_loader_t *loader, uint8_t *dest,
                                            size_t max_size, size_t *recv_size);
@@ -45,6 +48,18 @@ typedef struct esp_loader_protocol_ops_s {
     esp_loader_error_t (*mem_data_cmd)(esp_loader_t *loader,
                                        const uint8_t *data, uint32_t size);
     esp_loader_error_t (*mem_end_cmd)(esp_loader_t *loader, uint32_t entrypoint);
+
+    /* Split-phase command transport used for pipelining (NULL = lockstep only).
+     * write_cmd sends a command without waiting for its response; read_response
+     * collects the oldest outstanding response. Responses arrive in issue order. */
+    esp_loader_error_t (*write_cmd)(esp_loader_t *loader,
+                                    const struct send_cmd_config *config);
+    esp_loader_error_t (*read_response)(esp_loader_t *loader,
+                                        const struct send_cmd_config *config);
+
+    /* Flash data packets sent but not yet answered (NULL = send_cmd always waits
+     * for the response, so there are none) */
+    uint32_t (*data_in_flight)(const esp_loader_t *loader);
 } esp_loader_protocol_ops_t;
 
 /**
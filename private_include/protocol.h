@@ -306,6 +306,19 @@ esp_loader_error_t loader_write_reg_cmd(esp_loader_t *loader, uint32_t address,
 
 esp_loader_error_t loader_read_reg_cmd(esp_loader_t *loader, uint32_t address, uint32_t *reg);
 
+/* Split-phase register commands, only valid when the protocol provides write_cmd/read_response.
+   Responses must be collected with loader_reg_cmd_recv() in the order the commands were sent. */
+esp_loader_error_t loader_write_reg_cmd_send(esp_loader_t *loader, uint32_t address, uint32_t value, uint32_t mask, uint32_t delay_us);
+
+esp_loader_error_t loader_read_reg_cmd_send(esp_loader_t *loader, uint32_t address);
+
+esp_loader_error_t loader_reg_cmd_recv(esp_loader_t *loader, command_t command, uint32_t *reg);
+
+/* Split-phase SPI_FLASH_MD5, with the same constraints as the register commands above */
+esp_loader_error_t loader_md5_cmd_send(esp_loader_t *loader, uint32_t address, uint32_t size);
+
+esp_loader_error_t loader_md5_cmd_recv(esp_loader_t *loader, uint8_t *md5_out);
+
 esp_loader_error_t loader_change_baudrate_cmd(esp_loader_t *loader, uint32_t new_baudrate, uint32_t old_baudrate);
 
 #ifdef __cplusplus
@@ -4,13 +4,25 @@
  * SPDX-License-Identifier: Apache-2.0
  */
 
+#include <assert.h>
+
 #define SIP_HDR_F_SYNC 0x4
 #define SIP_IFIDX_MASK 0xf0
 #define SIP_IFIDX_S 4
 #define SIP_TYPE_MASK 0x0f
 #define SIP_TYPE_S 0
 
-#define SIP_PACKET_SIZE 256
+/* Size of the SIP packets used to upload RAM segments in SDIO download mode.
+   256 bytes is always accepted by the ROM loader; larger packets cut the
+   per-packet overhead on targets whose ROM receive buffers allow it. */
+#ifndef SERIAL_FLASHER_SDIO_SIP_PACKET_SIZE
+#define SERIAL_FLASHER_SDIO_SIP_PACKET_SIZE 256
+#endif
+
+#define SIP_PACKET_SIZE SERIAL_FLASHER_SDIO_SIP_PACKET_SIZE
+
+static_assert(SIP_PACKET_SIZE % 4 == 0 && SIP_PACKET_SIZE >= 64 && SIP_PACKET_SIZE <= 0xFFFC,
+              "SIP packet size must be a multiple of 4 between 64 and 65532 bytes");
 
 typedef enum {
     SIP_PACKET_TYPE_CTRL = 0,
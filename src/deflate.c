@@ -0,0 +1,271 @@
+/*
+ * SPDX-FileCopyrightText: 2026 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "deflate.h"
+#include <string.h>
+
+#define HASH_BITS 10
+#define HASH_SIZE (1U << HASH_BITS)
+#define MIN_MATCH 3
+#define MAX_MATCH 258
+#define MAX_DISTANCE 32768
+#define ADLER_MOD 65521
+#define ADLER_NMAX 5552    // Most bytes summed before the sums can overflow
+
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+
+static const uint16_t LENGTH_BASE[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+
+static const uint8_t LENGTH_EXTRA[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+
+static const uint16_t DIST_BASE[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+
+static const uint8_t DIST_EXTRA[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+typedef struct {
+    uint8_t *out;
+    uint32_t out_size;
+    uint32_t out_len;
+    deflate_sink_t sink;
+    void *ctx;
+    uint32_t bits;
+    uint32_t bit_count;
+    uint32_t total;
+    esp_loader_error_t error;
+} bit_writer_t;
+
+static void put_byte(bit_writer_t *w, uint8_t byte)
+{
+    w->total++;
+    if (w->out == NULL || w->error != ESP_LOADER_SUCCESS) {
+        return;
+    }
+
+    w->out[w->out_len++] = byte;
+    if (w->out_len == w->out_size) {
+        w->error = w->sink(w->ctx, w->out, w->out_len);
+        w->out_len = 0;
+    }
+}
+
+/* Deflate packs bits starting from the least significant one */
+static void put_bits(bit_writer_t *w, uint32_t value, uint32_t count)
+{
+    w->bits |= value << w->bit_count;
+    w->bit_count += count;
+    while (w->bit_count >= 8) {
+        put_byte(w, (uint8_t)w->bits);
+        w->bits >>= 8;
+        w->bit_count -= 8;
+    }
+}
+
+/* Huffman codes are the exception, they start from the most significant bit */
+static void put_code(bit_writer_t *w, uint32_t code, uint32_t length)
+{
+    uint32_t reversed = 0;
+    for (uint32_t i = 0; i < length; i++) {
+        reversed = (reversed << 1) | (code & 1);
+        code >>= 1;
+    }
+    put_bits(w, reversed, length);
+}
+
+/* Fixed literal/length code of RFC 1951, section 3.2.6 */
+static void put_symbol(bit_writer_t *w, uint32_t symbol)
+{
+    if (symbol < 144) {
+        put_code(w, 0x30 + symbol, 8);
+    } else if (symbol < 256) {
+        put_code(w, 0x190 + symbol - 144, 9);
+    } else if (symbol < 280) {
+        put_code(w, symbol - 256, 7);
+    } else {
+        put_code(w, 0xC0 + symbol - 280, 8);
+    }
+}
+
+static void put_match(bit_writer_t *w, uint32_t length, uint32_t distance)
+{
+    uint32_t code = 28;
+    while (LENGTH_BASE[code] > length) {
+        code--;
+    }
+    put_symbol(w, 257 + code);
+    put_bits(w, length - LENGTH_BASE[code], LENGTH_EXTRA[code]);
+
+    code = 29;
+    while (DIST_BASE[code] > distance) {
+        code--;
+    }
+    put_code(w, code, 5);
+    put_bits(w, distance - DIST_BASE[code], DIST_EXTRA[code]);
+}
+
+static uint32_t hash3(const uint8_t *p)
+{
+    const uint32_t value = (uint32_t)p[0] << 16 | (uint32_t)p[1] << 8 | p[2];
+    return (value * 2654435761U) >> (32 - HASH_BITS);
+}
+
+uint32_t deflate_adler32(const uint8_t *data, uint32_t size)
+{
+    uint32_t a = 1;
+    uint32_t b = 0;
+
+    while (size > 0) {
+        uint32_t n = MIN(size, ADLER_NMAX);
+        size -= n;
+        while (n--) {
+            a += *data++;
+            b += a;
+        }
+        a %= ADLER_MOD;
+        b %= ADLER_MOD;
+    }
+
+    return b << 16 | a;
+}
+
+/* Encodes data[start, end) as one fixed Huffman block, matching back into the
+   window before start. A final block is padded to a byte boundary, any other
+   one is followed by an empty stored block, which does the same. */
+static void compress_block(bit_writer_t *w, const uint8_t *data, uint32_t start, uint32_t end, bool final)
+{
+    /* Low 16 bits of the last position each hash was seen at. Positions
+       the table got wrong only cost a comparison that fails. */
+    uint16_t head[HASH_SIZE];
+    memset(head, 0, sizeof(head));
+
+    for (uint32_t pos = start > MAX_DISTANCE ? start - MAX_DISTANCE : 0; pos < start && pos + MIN_MATCH <= end; pos++) {
+        head[hash3(&data[pos])] = (uint16_t)pos;
+    }
+
+    put_bits(w, final ? 1 : 0, 1);
+    put_bits(w, 1, 2);
+
+    uint32_t pos = start;
+    while (pos < end) {
+        uint32_t match_len = 0;
+        uint32_t match_dist = 0;
+
+        if (pos + MIN_MATCH <= end) {
+            const uint32_t h = hash3(&data[pos]);
+            uint32_t candidate = (pos & ~0xFFFFU) | head[h];
+            head[h] = (uint16_t)pos;
+
+            if (candidate >= pos && pos >= 0x10000) {
+                candidate -= 0x10000;
+            }
+
+            if (candidate < pos && pos - candidate <= MAX_DISTANCE) {
+                const uint32_t max_len = MIN(MAX_MATCH, end - pos);
+                uint32_t len = 0;
+                while (len < max_len && data[candidate + len] == data[pos + len]) {
+                    len++;
+                }
+                if (len >= MIN_MATCH) {
+                    match_len = len;
+                    match_dist = pos - candidate;
+                }
+            }
+        }
+
+        if (match_len == 0) {
+            put_symbol(w, data[pos]);
+            pos++;
+            continue;
+        }
+
+        put_match(w, match_len, match_dist);
+        for (uint32_t i = 1; i < match_len && pos + i + MIN_MATCH <= end; i++) {
+            head[hash3(&data[pos + i])] = (uint16_t)(pos + i);
+        }
+        pos += match_len;
+    }
+
+    put_symbol(w, 256);
+
+    if (!final) {
+        put_bits(w, 0, 3);
+    }
+    if (w->bit_count > 0) {
+        put_bits(w, 0, 8 - w->bit_count);
+    }
+    if (!final) {
+        put_bits(w, 0x0000, 16);
+        put_bits(w, 0xFFFF, 16);
+    }
+}
+
+static esp_loader_error_t flush_output(bit_writer_t *w, uint32_t *compressed_size)
+{
+    if (w->out != NULL && w->out_len > 0 && w->error == ESP_LOADER_SUCCESS) {
+        w->error = w->sink(w->ctx, w->out, w->out_len);
+    }
+
+    *compressed_size = w->total;
+    return w->error;
+}
+
+esp_loader_error_t deflate_compress(const uint8_t *data, uint32_t size,
+                                    uint8_t *out_buf, uint32_t out_buf_size,
+                                    deflate_sink_t sink, void *ctx,
+                                    uint32_t *compressed_size)
+{
+    bit_writer_t w = {
+        .out = out_buf,
+        .out_size = out_buf_size,
+        .sink = sink,
+        .ctx = ctx,
+        .error = ESP_LOADER_SUCCESS,
+    };
+
+    static const uint8_t header[] = DEFLATE_ZLIB_HEADER;
+    for (uint32_t i = 0; i < sizeof(header); i++) {
+        put_byte(&w, header[i]);
+    }
+    compress_block(&w, data, 0, size, true);
+
+    const uint32_t adler = deflate_adler32(data, size);
+    put_byte(&w, (uint8_t)(adler >> 24));
+    put_byte(&w, (uint8_t)(adler >> 16));
+    put_byte(&w, (uint8_t)(adler >> 8));
+    put_byte(&w, (uint8_t)adler);
+
+    return flush_output(&w, compressed_size);
+}
+
+esp_loader_error_t deflate_compress_chunk(const uint8_t *data, uint32_t start, uint32_t end, bool final,
+        uint8_t *out_buf, uint32_t out_buf_size,
+        deflate_sink_t sink, void *ctx,
+        uint32_t *compressed_size)
+{
+    bit_writer_t w = {
+        .out = out_buf,
+        .out_size = out_buf_size,
+        .sink = sink,
+        .ctx = ctx,
+        .error = ESP_LOADER_SUCCESS,
+    };
+
+    compress_block(&w, data, start, end, final);
+    return flush_output(&w, compressed_size);
+}
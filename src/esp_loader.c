@@ -7,9 +7,11 @@
 #include "protocol.h"
 #include "esp_loader.h"
 #include "esp_loader_protocol.h"
+#include "esp_loader_internal.h"
 #include "esp_stubs.h"
 #include "esp_targets.h"
 #include "md5_hash.h"
+#include "deflate.h"
 #include "slip.h"
 #include "loader_log.h"
 #include <string.h>
@@ -53,12 +55,46 @@ static const char *target_chip_name(target_chip_t chip)
 #define INITIAL_UART_BAUDRATE 115200
 
 #define FLASH_SECTOR_SIZE 4096
+#define FLASH_BLOCK_ERASE_SIZE (64 * 1024)
 #define ROM_FLASH_BLOCK_SIZE 1024
 
 #define DEFAULT_FLASH_SIZE (2 * 1024 * 1024)
 #define MAX_ROM_FLASH_SIZE (16 * 1024 * 1024)
 #define FLASH_READ_STUB_PACKET_SIZE 4096U
 
+#define REG_PIPELINE_DEPTH 8
+#define REG_POLL_TRIALS 10
+
+/* Largest transmit buffer of spi_flash_command() */
+#define SPI_FLASH_CMD_MAX_TX 64
+/* Register program of spi_flash_command(): save two registers, set up to two
+   data lengths, set up the user registers, load the data registers, start, poll */
+#define SPI_FLASH_CMD_MAX_OPS (2 + 2 + 2 + (SPI_FLASH_CMD_MAX_TX + 31) / (8 * 4) + 2)
+
+/* MD5 queries kept in flight by esp_loader_flash_fingerprint() */
+#define MD5_PIPELINE_DEPTH 8
+
+/* Granules compared by esp_loader_flash_diff_write() before the changed runs
+   among them are written, bounded by the bits of the change mask */
+#define DIFF_WINDOW_UNITS 32
+
+/* Erase blocks checked per fingerprint by esp_loader_flash_write_sparse() */
+#define SPARSE_BLANK_CHECK_BLOCKS 16
+
+#define REPAIR_DEFAULT_ROUNDS 3
+
+/* Compressed resumable writes restart their zlib stream at segment boundaries */
+#define RESUME_SEGMENT_SIZE (64 * 1024)
+#define RESUME_DEFAULT_CHECK_SECTORS 4
+#define RESUME_MAX_CHECK_SECTORS 16
+
+/* Size of the regions esp_loader_flash_write_compressed() decides on in adaptive mode */
+#define ADAPTIVE_REGION_SIZE (64 * 1024)
+/* Ratios are kept in 1/1024ths. Until both modes have been timed, regions
+   that compress below the prior ratio are sent compressed. */
+#define ADAPTIVE_RATIO_ONE 1024
+#define ADAPTIVE_PRIOR_RATIO (ADAPTIVE_RATIO_ONE * 7 / 8)
+
 typedef enum {
     SPI_FLASH_READ_ID = 0x9F
 } spi_flash_cmd_t;
@@ -143,15 +179,65 @@ static esp_loader_error_t loader_ensure_spi_attached(esp_loader_t *loader)
         uint32_t sequence_number = 0;
         RETURN_ON_ERROR(loader_flash_begin_cmd(loader, &sequence_number, 0, 0, 0, 0, false));
     } else {
-        uint32_t spi_config;
-        RETURN_ON_ERROR(loader_read_spi_config(loader, loader->_target, &spi_config));
-        RETURN_ON_ERROR(loader->_protocol->spi_attach(loader, spi_config));
+        if (!loader->_spi_config_valid) {
+            RETURN_ON_ERROR(loader_read_spi_config(loader, loader->_target, &loader->_spi_config));
+            loader->_spi_config_valid = true;
+        }
+        RETURN_ON_ERROR(loader->_protocol->spi_attach(loader, loader->_spi_config));
     }
 
     loader->_spi_attached = true;
     return ESP_LOADER_SUCCESS;
 }
 
+/*
+ * Validates a profile seeded by esp_loader_profile_apply() once the link is up.
+ * A single MAC read is enough to tell whether the same board is still attached;
+ * on mismatch all seeded facts are dropped and the regular detection runs.
+ */
+static esp_loader_error_t loader_check_profile(esp_loader_t *loader)
+{
+    if (!loader->_profile.pending) {
+        // A rate left over from a connect that failed after its profile matched
+        loader->_profile.transmission_rate = 0;
+        return ESP_LOADER_SUCCESS;
+    }
+    loader->_profile.pending = false;
+
+    uint8_t mac[6];
+    if (loader->_target == loader->_profile.target &&
+            loader_read_mac(loader, loader->_target, mac) == ESP_LOADER_SUCCESS &&
+            memcmp(mac, loader->_profile.mac, sizeof(mac)) == 0) {
+        LOADER_LOGI(loader, "Target profile matched, skipping probes");
+        return ESP_LOADER_SUCCESS;
+    }
+
+    LOADER_LOGW(loader, "Target profile does not match the connected device, probing");
+    loader->_profile.transmission_rate = 0;
+    loader->_spi_config_valid = false;
+    loader->_spi_config = 0;
+    loader->_crystal_freq_mhz = 0;
+    loader->_target_flash_size = 0;
+    if (loader->_protocol_type != ESP_LOADER_PROTOCOL_SDIO) {
+        loader->_target = ESP_UNKNOWN_CHIP;
+    }
+    return loader_detect_chip(loader);
+}
+
+/* Switches to the transmission rate of a matched profile, once connected.
+   Only serial links change their rate. */
+static esp_loader_error_t loader_apply_profile_rate(esp_loader_t *loader)
+{
+    const uint32_t transmission_rate = loader->_profile.transmission_rate;
+    loader->_profile.transmission_rate = 0;
+
+    if (transmission_rate == 0 || loader->_protocol_type != ESP_LOADER_PROTOCOL_SERIAL) {
+        return ESP_LOADER_SUCCESS;
+    }
+
+    return esp_loader_change_transmission_rate(loader, transmission_rate);
+}
+
 esp_loader_error_t esp_loader_connect(esp_loader_t *loader, esp_loader_connect_args_t *connect_args)
 {
     loader->_port->ops->enter_bootloader(loader->_port);
@@ -159,10 +245,11 @@ esp_loader_error_t esp_loader_connect(esp_loader_t *loader, esp_loader_connect_a
     RETURN_ON_ERROR(loader->_protocol->initialize_conn(loader, connect_args));
 
     RETURN_ON_ERROR(loader_detect_chip(loader));
+    RETURN_ON_ERROR(loader_check_profile(loader));
 
     LOADER_LOGI(loader, "Connected - target: %s", target_chip_name(loader->_target));
 
-    return ESP_LOADER_SUCCESS;
+    return loader_apply_profile_rate(loader);
 }
 
 target_chip_t esp_loader_get_target(esp_loader_t *loader)
@@ -176,13 +263,16 @@ esp_loader_error_t esp_loader_connect_with_stub(esp_loader_t *loader, esp_loader
         return ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
     }
 
-    loader->_target_flash_size = 0;
+    if (!loader->_profile.pending) {
+        loader->_target_flash_size = 0;
+    }
 
     loader->_port->ops->enter_bootloader(loader->_port);
 
     RETURN_ON_ERROR(loader->_protocol->initialize_conn(loader, connect_args));
 
     RETURN_ON_ERROR(loader_detect_chip(loader));
+    RETURN_ON_ERROR(loader_check_profile(loader));
 
     const esp_stub_t *stub;
     if (loader->_target == ESP32P4_CHIP) {
@@ -238,8 +328,10 @@ esp_loader_error_t esp_loader_connect_with_stub(esp_loader_t *loader, esp_loader
     }
 
     loader->_stub_running = true;
+    loader->_stub_segments = stub->segments;
+    loader->_stub_segment_count = sizeof(stub->segments) / sizeof(stub->segments[0]);
 
-    return ESP_LOADER_SUCCESS;
+    return loader_apply_profile_rate(loader);
 }
 
 esp_loader_error_t esp_loader_connect_secure_download_mode(esp_loader_t *loader,
@@ -250,6 +342,12 @@ esp_loader_error_t esp_loader_connect_secure_download_mode(esp_loader_t *loader,
         return ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
     }
 
+    /* Efuses are not readable in secure download mode, so a profile cannot be validated */
+    if (loader->_profile.pending) {
+        loader->_profile.pending = false;
+        loader->_profile.transmission_rate = 0;
+        loader->_target = ESP_UNKNOWN_CHIP;
+    }
     loader->_target_flash_size = flash_size;
 
     loader->_port->ops->enter_bootloader(loader->_port);
@@ -274,36 +372,10 @@ esp_loader_error_t esp_loader_connect_secure_download_mode(esp_loader_t *loader,
     return ESP_LOADER_SUCCESS;
 }
 
-static esp_loader_error_t spi_set_data_lengths(esp_loader_t *loader, size_t mosi_bits, size_t miso_bits)
-{
-
-    if (mosi_bits > 0) {
-        RETURN_ON_ERROR(esp_loader_write_register(loader, loader->_reg->mosi_dlen, mosi_bits - 1));
-    }
-    if (miso_bits > 0) {
-        RETURN_ON_ERROR(esp_loader_write_register(loader, loader->_reg->miso_dlen, miso_bits - 1));
-    }
-
-    return ESP_LOADER_SUCCESS;
-}
-
-static esp_loader_error_t spi_set_data_lengths_8266(esp_loader_t *loader, size_t mosi_bits, size_t miso_bits)
-{
-
-    uint32_t mosi_mask = (mosi_bits == 0) ? 0 : mosi_bits - 1;
-    uint32_t miso_mask = (miso_bits == 0) ? 0 : miso_bits - 1;
-    return esp_loader_write_register(loader, loader->_reg->usr1, (miso_mask << 8) | (mosi_mask << 17));
-}
-
 static esp_loader_error_t spi_flash_command(esp_loader_t *loader, spi_flash_cmd_t cmd, void *data_tx, size_t tx_size, void *data_rx, size_t rx_size)
 {
-
-    if (loader->_protocol_type == ESP_LOADER_PROTOCOL_SPI) {
-        return ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
-    }
-
     assert(rx_size <= 32);
-    assert(tx_size <= 64);
+    assert(tx_size <= SPI_FLASH_CMD_MAX_TX);
 
     uint32_t SPI_USR_CMD  = (1 << 31);
     uint32_t SPI_USR_MISO = (1 << 28);
@@ -311,17 +383,6 @@ static esp_loader_error_t spi_flash_command(esp_loader_t *loader, spi_flash_cmd_
     uint32_t SPI_CMD_USR  = (1 << 18);
     uint32_t CMD_LEN_SHIFT = 28;
 
-    uint32_t old_spi_usr;
-    uint32_t old_spi_usr2;
-    RETURN_ON_ERROR(esp_loader_read_register(loader, loader->_reg->usr, &old_spi_usr));
-    RETURN_ON_ERROR(esp_loader_read_register(loader, loader->_reg->usr2, &old_spi_usr2));
-
-    if (loader->_target == ESP8266_CHIP) {
-        RETURN_ON_ERROR(spi_set_data_lengths_8266(loader, tx_size, rx_size));
-    } else {
-        RETURN_ON_ERROR(spi_set_data_lengths(loader, tx_size, rx_size));
-    }
-
     uint32_t usr_reg_2 = (7 << CMD_LEN_SHIFT) | cmd;
     uint32_t usr_reg = SPI_USR_CMD;
     if (rx_size > 0) {
@@ -331,44 +392,60 @@ static esp_loader_error_t spi_flash_command(esp_loader_t *loader, spi_flash_cmd_
         usr_reg |= SPI_USR_MOSI;
     }
 
-    RETURN_ON_ERROR(esp_loader_write_register(loader, loader->_reg->usr, usr_reg));
-    RETURN_ON_ERROR(esp_loader_write_register(loader, loader->_reg->usr2, usr_reg_2));
+    uint32_t old_spi_usr;
+    uint32_t old_spi_usr2;
+
+    /* Save the user registers, set up and start the transaction, then wait for it to finish */
+    esp_loader_reg_op_t ops[SPI_FLASH_CMD_MAX_OPS] = {
+        ESP_LOADER_REG_OP_READ(loader->_reg->usr, &old_spi_usr),
+        ESP_LOADER_REG_OP_READ(loader->_reg->usr2, &old_spi_usr2),
+    };
+    size_t count = 2;
+
+    if (loader->_target == ESP8266_CHIP) {
+        uint32_t mosi_mask = (tx_size == 0) ? 0 : tx_size - 1;
+        uint32_t miso_mask = (rx_size == 0) ? 0 : rx_size - 1;
+        ops[count++] = (esp_loader_reg_op_t)ESP_LOADER_REG_OP_WRITE(loader->_reg->usr1,
+                       (miso_mask << 8) | (mosi_mask << 17));
+    } else {
+        if (tx_size > 0) {
+            ops[count++] = (esp_loader_reg_op_t)ESP_LOADER_REG_OP_WRITE(loader->_reg->mosi_dlen, tx_size - 1);
+        }
+        if (rx_size > 0) {
+            ops[count++] = (esp_loader_reg_op_t)ESP_LOADER_REG_OP_WRITE(loader->_reg->miso_dlen, rx_size - 1);
+        }
+    }
+
+    ops[count++] = (esp_loader_reg_op_t)ESP_LOADER_REG_OP_WRITE(loader->_reg->usr, usr_reg);
+    ops[count++] = (esp_loader_reg_op_t)ESP_LOADER_REG_OP_WRITE(loader->_reg->usr2, usr_reg_2);
 
     if (tx_size == 0) {
-        RETURN_ON_ERROR(esp_loader_write_register(loader, loader->_reg->w0, 0));
+        ops[count++] = (esp_loader_reg_op_t)ESP_LOADER_REG_OP_WRITE(loader->_reg->w0, 0);
     } else {
         uint32_t *data = (uint32_t *)data_tx;
         uint32_t words_to_write = (tx_size + 31) / (8 * 4);
         uint32_t data_reg_addr = loader->_reg->w0;
 
         while (words_to_write--) {
-            uint32_t word = *data++;
-            RETURN_ON_ERROR(esp_loader_write_register(loader, data_reg_addr, word));
+            ops[count++] = (esp_loader_reg_op_t)ESP_LOADER_REG_OP_WRITE(data_reg_addr, *data++);
             data_reg_addr += 4;
         }
     }
 
-    RETURN_ON_ERROR(esp_loader_write_register(loader, loader->_reg->cmd, SPI_CMD_USR));
-
-    uint32_t trials = 10;
-    while (trials--) {
-        uint32_t cmd_reg;
-        RETURN_ON_ERROR(esp_loader_read_register(loader, loader->_reg->cmd, &cmd_reg));
-        if ((cmd_reg & SPI_CMD_USR) == 0) {
-            break;
-        }
-    }
-
-    if (trials == 0) {
-        return ESP_LOADER_ERROR_TIMEOUT;
-    }
+    ops[count++] = (esp_loader_reg_op_t)ESP_LOADER_REG_OP_WRITE(loader->_reg->cmd, SPI_CMD_USR);
+    ops[count++] = (esp_loader_reg_op_t)ESP_LOADER_REG_OP_POLL(loader->_reg->cmd, SPI_CMD_USR, 0);
+    assert(count <= sizeof(ops) / sizeof(ops[0]));
 
-    RETURN_ON_ERROR(esp_loader_read_register(loader, loader->_reg->w0, data_rx));
+    RETURN_ON_ERROR(esp_loader_run_reg_program(loader, ops, count, NULL));
 
-    RETURN_ON_ERROR(esp_loader_write_register(loader, loader->_reg->usr, old_spi_usr));
-    RETURN_ON_ERROR(esp_loader_write_register(loader, loader->_reg->usr2, old_spi_usr2));
+    /* Collect the result and restore the user registers */
+    const esp_loader_reg_op_t finish_ops[] = {
+        ESP_LOADER_REG_OP_READ(loader->_reg->w0, (uint32_t *)data_rx),
+        ESP_LOADER_REG_OP_WRITE(loader->_reg->usr, old_spi_usr),
+        ESP_LOADER_REG_OP_WRITE(loader->_reg->usr2, old_spi_usr2),
+    };
 
-    return ESP_LOADER_SUCCESS;
+    return esp_loader_run_reg_program(loader, finish_ops, sizeof(finish_ops) / sizeof(finish_ops[0]), NULL);
 }
 
 static uint32_t calc_erase_size(const target_chip_t target, bool stub_running,
@@ -471,17 +548,30 @@ static esp_loader_error_t init_flash_params(esp_loader_t *loader)
     return ESP_LOADER_SUCCESS;
 }
 
-esp_loader_error_t esp_loader_flash_start(esp_loader_t *loader, esp_loader_flash_cfg_t *cfg)
+/* Over SPI each data command has to fit the receive buffer of the slave, so a
+   block size that cannot work is rejected before the target starts erasing */
+static esp_loader_error_t check_block_size(esp_loader_t *loader, uint32_t block_size)
 {
+    const uint32_t buf_size = loader->_protocol_type == ESP_LOADER_PROTOCOL_SPI ?
+                              loader->_proto_ctx.spi.slave_buf_size : 0;
 
-    if (loader->_protocol_type == ESP_LOADER_PROTOCOL_SPI) {
-        return ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
+    if (buf_size != 0 && sizeof(data_command_t) + block_size > buf_size) {
+        LOADER_LOGE(loader, "Block size %" PRIu32 " exceeds the %u bytes the SPI slave buffer can take",
+                    block_size, (unsigned)(buf_size - sizeof(data_command_t)));
+        return ESP_LOADER_ERROR_INVALID_PARAM;
     }
 
+    return ESP_LOADER_SUCCESS;
+}
+
+esp_loader_error_t esp_loader_flash_start(esp_loader_t *loader, esp_loader_flash_cfg_t *cfg)
+{
     if (cfg->offset % 4 != 0 || cfg->image_size % 4 != 0) {
         return ESP_LOADER_ERROR_INVALID_PARAM;
     }
 
+    RETURN_ON_ERROR(check_block_size(loader, cfg->block_size));
+
     /* ROM bootloader uses 24-bit SPI addressing — addresses >= 16 MB silently
      * wrap around to 0. Reject such writes early to prevent silent corruption. */
     if (!loader->_stub_running && cfg->offset >= MAX_ROM_FLASH_SIZE) {
@@ -511,13 +601,16 @@ esp_loader_error_t esp_loader_flash_start(esp_loader_t *loader, esp_loader_flash
 }
 
 
-esp_loader_error_t esp_loader_flash_write(esp_loader_t *loader, esp_loader_flash_cfg_t *cfg, const void *payload, uint32_t size)
+/* Sending a block again only helps when the failure was its own. Protocols that
+   queue data blocks, such as SDIO with the stub, may report an earlier block's
+   failure instead, which no retry of the current one can fix. */
+static bool flash_block_retryable(const esp_loader_t *loader)
 {
+    return loader->_protocol->data_in_flight == NULL || !loader->_stub_running;
+}
 
-    if (loader->_protocol_type == ESP_LOADER_PROTOCOL_SPI) {
-        return ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
-    }
-
+esp_loader_error_t esp_loader_flash_write(esp_loader_t *loader, esp_loader_flash_cfg_t *cfg, const void *payload, uint32_t size)
+{
     if (size > cfg->block_size) {
         return ESP_LOADER_ERROR_INVALID_PARAM;
     }
@@ -526,6 +619,7 @@ esp_loader_error_t esp_loader_flash_write(esp_loader_t *loader, esp_loader_flash
         md5_update(cfg, payload, size);
     }
 
+    const unsigned int attempts = flash_block_retryable(loader) ? SERIAL_FLASHER_WRITE_BLOCK_RETRIES : 1;
     unsigned int attempt = 0;
     esp_loader_error_t result = ESP_LOADER_ERROR_FAIL;
     uint32_t saved_seq = cfg->_state._sequence_number;
@@ -534,11 +628,11 @@ esp_loader_error_t esp_loader_flash_write(esp_loader_t *loader, esp_loader_flash
         loader->_port->ops->start_timer(loader->_port, DEFAULT_TIMEOUT);
         result = loader_flash_data_cmd(loader, &cfg->_state._sequence_number, payload, size);
         attempt++;
-        if (result != ESP_LOADER_SUCCESS && attempt < SERIAL_FLASHER_WRITE_BLOCK_RETRIES) {
+        if (result != ESP_LOADER_SUCCESS && attempt < attempts) {
             LOADER_LOGW(loader, "Flash write failed (attempt %u/%u), retrying",
                         attempt, (unsigned)SERIAL_FLASHER_WRITE_BLOCK_RETRIES);
         }
-    } while (result != ESP_LOADER_SUCCESS && attempt < SERIAL_FLASHER_WRITE_BLOCK_RETRIES);
+    } while (result != ESP_LOADER_SUCCESS && attempt < attempts);
 
     return result;
 }
@@ -557,10 +651,6 @@ static void hexify(const uint8_t raw_md5[16], uint8_t hex_md5_out[32])
 
 esp_loader_error_t esp_loader_flash_finish(esp_loader_t *loader, esp_loader_flash_cfg_t *cfg)
 {
-    if (loader->_protocol_type == ESP_LOADER_PROTOCOL_SPI) {
-        return ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
-    }
-
     if (!cfg->skip_verify) {
         uint8_t raw_md5[16] = {0};
         uint8_t hex_md5[MAX(MD5_SIZE_ROM, MD5_SIZE_STUB) + 1] = {0};
@@ -582,15 +672,12 @@ esp_loader_error_t esp_loader_flash_finish(esp_loader_t *loader, esp_loader_flas
 
 esp_loader_error_t esp_loader_flash_deflate_start(esp_loader_t *loader, esp_loader_flash_deflate_cfg_t *cfg)
 {
-
-    if (loader->_protocol_type == ESP_LOADER_PROTOCOL_SPI) {
-        return ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
-    }
-
     if (cfg->offset % 4 != 0) {
         return ESP_LOADER_ERROR_INVALID_PARAM;
     }
 
+    RETURN_ON_ERROR(check_block_size(loader, cfg->block_size));
+
     if (loader->_target == ESP8266_CHIP && !loader->_stub_running) {
         return ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
     }
@@ -615,15 +702,11 @@ esp_loader_error_t esp_loader_flash_deflate_start(esp_loader_t *loader, esp_load
 
 esp_loader_error_t esp_loader_flash_deflate_write(esp_loader_t *loader, esp_loader_flash_deflate_cfg_t *cfg, void *payload, uint32_t size)
 {
-
-    if (loader->_protocol_type == ESP_LOADER_PROTOCOL_SPI) {
-        return ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
-    }
-
     if (size > cfg->block_size) {
         return ESP_LOADER_ERROR_INVALID_PARAM;
     }
 
+    const unsigned int attempts = flash_block_retryable(loader) ? SERIAL_FLASHER_WRITE_BLOCK_RETRIES : 1;
     unsigned int attempt = 0;
     esp_loader_error_t result = ESP_LOADER_ERROR_FAIL;
     uint32_t saved_seq = cfg->_state._sequence_number;
@@ -632,11 +715,11 @@ esp_loader_error_t esp_loader_flash_deflate_write(esp_loader_t *loader, esp_load
         loader->_port->ops->start_timer(loader->_port, DEFAULT_TIMEOUT);
         result = loader_flash_deflate_data_cmd(loader, &cfg->_state._sequence_number, payload, size);
         attempt++;
-        if (result != ESP_LOADER_SUCCESS && attempt < SERIAL_FLASHER_WRITE_BLOCK_RETRIES) {
+        if (result != ESP_LOADER_SUCCESS && attempt < attempts) {
             LOADER_LOGW(loader, "Compressed flash write failed (attempt %u/%u), retrying",
                         attempt, (unsigned)SERIAL_FLASHER_WRITE_BLOCK_RETRIES);
         }
-    } while (result != ESP_LOADER_SUCCESS && attempt < SERIAL_FLASHER_WRITE_BLOCK_RETRIES);
+    } while (result != ESP_LOADER_SUCCESS && attempt < attempts);
 
     return result;
 }
@@ -646,10 +729,6 @@ esp_loader_error_t esp_loader_flash_deflate_finish(esp_loader_t *loader, esp_loa
 {
     (void)cfg;
 
-    if (loader->_protocol_type == ESP_LOADER_PROTOCOL_SPI) {
-        return ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
-    }
-
     if (!loader->_stub_running) {
         return ESP_LOADER_SUCCESS;
     }
@@ -660,11 +739,6 @@ esp_loader_error_t esp_loader_flash_deflate_finish(esp_loader_t *loader, esp_loa
 
 esp_loader_error_t esp_loader_flash_erase(esp_loader_t *loader)
 {
-
-    if (loader->_protocol_type == ESP_LOADER_PROTOCOL_SPI) {
-        return ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
-    }
-
     LOADER_LOGI(loader, "Flash erase start");
 
     if (loader->_stub_running) {
@@ -688,11 +762,6 @@ esp_loader_error_t esp_loader_flash_erase(esp_loader_t *loader)
 
 esp_loader_error_t esp_loader_flash_erase_region(esp_loader_t *loader, uint32_t offset, uint32_t size)
 {
-
-    if (loader->_protocol_type == ESP_LOADER_PROTOCOL_SPI) {
-        return ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
-    }
-
     if (offset % FLASH_SECTOR_SIZE != 0 || size % FLASH_SECTOR_SIZE != 0) {
         return ESP_LOADER_ERROR_INVALID_PARAM;
     }
@@ -736,11 +805,6 @@ static uint32_t byte_popcnt(uint8_t byte)
 esp_loader_error_t esp_loader_get_security_info(esp_loader_t *loader,
         esp_loader_target_security_info_t *security_info)
 {
-
-    if (loader->_protocol_type == ESP_LOADER_PROTOCOL_SPI) {
-        return ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
-    }
-
     loader->_port->ops->start_timer(loader->_port, SHORT_TIMEOUT);
 
     get_security_info_response_data_t resp;
@@ -841,11 +905,6 @@ static esp_loader_error_t loader_flash_read_stub(esp_loader_t *loader, uint8_t *
 
 esp_loader_error_t esp_loader_flash_read(esp_loader_t *loader, uint8_t *dest, uint32_t address, uint32_t length)
 {
-
-    if (loader->_protocol_type == ESP_LOADER_PROTOCOL_SPI) {
-        return ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
-    }
-
     RETURN_ON_ERROR(init_flash_params(loader));
     if (address + length > loader->_target_flash_size) {
         return ESP_LOADER_ERROR_IMAGE_SIZE;
@@ -883,14 +942,39 @@ esp_loader_error_t esp_loader_flash_read(esp_loader_t *loader, uint8_t *dest, ui
     return ESP_LOADER_SUCCESS;
 }
 
+static bool stub_region_overlaps(const esp_loader_t *loader, uint32_t offset, uint32_t size)
+{
+    // Without a record of where the stub lives, assume the worst
+    if (loader->_stub_segments == NULL) {
+        return true;
+    }
+
+    for (uint32_t i = 0; i < loader->_stub_segment_count; i++) {
+        const esp_loader_bin_segment_t *seg = &loader->_stub_segments[i];
+        if (seg->size != 0 && offset < seg->addr + seg->size && seg->addr < offset + size) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
 esp_loader_error_t esp_loader_mem_start(esp_loader_t *loader, esp_loader_mem_cfg_t *cfg)
 {
+    RETURN_ON_ERROR(check_block_size(loader, cfg->block_size));
 
     uint32_t blocks_to_write = ROUNDUP(cfg->size, cfg->block_size);
 
     loader->_port->ops->start_timer(loader->_port, timeout_per_mb(cfg->size, LOAD_RAM_TIMEOUT_PER_MB));
 
-    if (loader->_protocol->mem_begin_cmd) {
+    /* The stub handles MEM_* itself, so keep using it (and the negotiated
+       transmission rate) unless the image would overwrite the stub. */
+    cfg->_state._through_stub = loader->_stub_running && !stub_region_overlaps(loader, cfg->offset, cfg->size);
+    if (loader->_stub_running && !cfg->_state._through_stub) {
+        LOADER_LOGI(loader, "RAM image overlaps the stub, reloading through the ROM loader");
+    }
+
+    if (loader->_protocol->mem_begin_cmd && !cfg->_state._through_stub) {
         cfg->_state._sequence_number = 0;
         return loader->_protocol->mem_begin_cmd(loader, cfg->offset, cfg->size, blocks_to_write, cfg->block_size);
     }
@@ -907,7 +991,7 @@ esp_loader_error_t esp_loader_mem_write(esp_loader_t *loader, esp_loader_mem_cfg
     esp_loader_error_t result = ESP_LOADER_ERROR_FAIL;
     do {
         loader->_port->ops->start_timer(loader->_port, timeout_per_mb(size, LOAD_RAM_TIMEOUT_PER_MB));
-        if (loader->_protocol->mem_data_cmd) {
+        if (loader->_protocol->mem_data_cmd && !cfg->_state._through_stub) {
             result = loader->_protocol->mem_data_cmd(loader, data, size);
         } else {
             result = loader_mem_data_cmd(loader, &cfg->_state._sequence_number, data, size);
@@ -925,15 +1009,21 @@ esp_loader_error_t esp_loader_mem_write(esp_loader_t *loader, esp_loader_mem_cfg
 
 esp_loader_error_t esp_loader_mem_finish(esp_loader_t *loader, esp_loader_mem_cfg_t *cfg, uint32_t entrypoint)
 {
-    (void)cfg;
-
     loader->_port->ops->start_timer(loader->_port, DEFAULT_TIMEOUT);
 
-    if (loader->_protocol->mem_end_cmd) {
+    if (loader->_protocol->mem_end_cmd && !cfg->_state._through_stub) {
         return loader->_protocol->mem_end_cmd(loader, entrypoint);
     }
 
-    return loader_mem_end_cmd(loader, entrypoint);
+    RETURN_ON_ERROR(loader_mem_end_cmd(loader, entrypoint));
+
+    // The stub jumps to the loaded application unless told to stay
+    if (cfg->_state._through_stub && entrypoint != 0) {
+        loader->_stub_running = false;
+        loader->_spi_attached = false;
+    }
+
+    return ESP_LOADER_SUCCESS;
 }
 
 esp_loader_error_t esp_loader_read_mac(esp_loader_t *loader, uint8_t *mac)
@@ -960,6 +1050,218 @@ esp_loader_error_t esp_loader_write_register(esp_loader_t *loader, uint32_t addr
     return loader_write_reg_cmd(loader, address, reg_value, 0xFFFFFFFF, 0);
 }
 
+static bool cmd_pipelined(const esp_loader_t *loader)
+{
+    return loader->_protocol->write_cmd != NULL && loader->_protocol->read_response != NULL;
+}
+
+/* Sends the command of a register operation. Does nothing in lockstep mode,
+   where reg_op_complete() executes the whole command. */
+static esp_loader_error_t reg_op_issue(esp_loader_t *loader, const esp_loader_reg_op_t *op)
+{
+    if (!cmd_pipelined(loader)) {
+        return ESP_LOADER_SUCCESS;
+    }
+
+    loader->_port->ops->start_timer(loader->_port, DEFAULT_TIMEOUT);
+
+    if (op->type == ESP_LOADER_REG_WRITE) {
+        return loader_write_reg_cmd_send(loader, op->address, op->value, op->mask, op->delay_us);
+    }
+
+    return loader_read_reg_cmd_send(loader, op->address);
+}
+
+static esp_loader_error_t reg_op_complete(esp_loader_t *loader, const esp_loader_reg_op_t *op, uint32_t *value)
+{
+    loader->_port->ops->start_timer(loader->_port, DEFAULT_TIMEOUT + op->delay_us / 1000);
+
+    if (op->type == ESP_LOADER_REG_WRITE) {
+        return cmd_pipelined(loader)
+               ? loader_reg_cmd_recv(loader, WRITE_REG, NULL)
+               : loader_write_reg_cmd(loader, op->address, op->value, op->mask, op->delay_us);
+    }
+
+    return cmd_pipelined(loader)
+           ? loader_reg_cmd_recv(loader, READ_REG, value)
+           : loader_read_reg_cmd(loader, op->address, value);
+}
+
+/* Collects and drops a response still in flight after a failure, so that
+   a later command does not take it for its own. The wait is short, as the
+   failure may have been the loss of this very response. */
+static void reg_response_drop(esp_loader_t *loader, command_t command)
+{
+    uint32_t value;
+    loader->_port->ops->start_timer(loader->_port, SHORT_TIMEOUT);
+    (void)loader_reg_cmd_recv(loader, command, &value);
+}
+
+static void reg_ops_drain(esp_loader_t *loader, const esp_loader_reg_op_t *ops, size_t from, size_t to)
+{
+    for (size_t i = from; i < to && cmd_pipelined(loader); i++) {
+        reg_response_drop(loader, ops[i].type == ESP_LOADER_REG_WRITE ? WRITE_REG : READ_REG);
+    }
+}
+
+/* Re-reads a polled register until the condition is met. Nothing else is in
+   flight at this point, as a POLL always closes its pipeline window. */
+static esp_loader_error_t reg_op_poll(esp_loader_t *loader, const esp_loader_reg_op_t *op, uint32_t value)
+{
+    for (uint32_t trials = 1; (value & op->mask) != op->value; trials++) {
+        if (trials == REG_POLL_TRIALS) {
+            return ESP_LOADER_ERROR_TIMEOUT;
+        }
+        RETURN_ON_ERROR(reg_op_issue(loader, op));
+        esp_loader_error_t err = reg_op_complete(loader, op, &value);
+        if (err != ESP_LOADER_SUCCESS) {
+            if (err != ESP_LOADER_ERROR_INVALID_RESPONSE) {
+                reg_ops_drain(loader, op, 0, 1);
+            }
+            return err;
+        }
+    }
+
+    if (op->result != NULL) {
+        *op->result = value;
+    }
+
+    return ESP_LOADER_SUCCESS;
+}
+
+esp_loader_error_t esp_loader_run_reg_program(esp_loader_t *loader, const esp_loader_reg_op_t *ops,
+        size_t count, size_t *failed_op)
+{
+    const size_t depth = cmd_pipelined(loader) ? REG_PIPELINE_DEPTH : 1;
+    size_t window_start = 0;
+
+    while (window_start < count) {
+        /* A window ends with a POLL, whose outcome gates everything after it */
+        size_t window_end = window_start + 1;
+        while (window_end < count && ops[window_end - 1].type != ESP_LOADER_REG_POLL) {
+            window_end++;
+        }
+
+        esp_loader_error_t result = ESP_LOADER_SUCCESS;
+        size_t result_op = window_start;
+        size_t sent = window_start;
+        size_t received = window_start;
+
+        while (received < window_end) {
+            while (result == ESP_LOADER_SUCCESS && sent < window_end && sent - received < depth) {
+                esp_loader_error_t err = reg_op_issue(loader, &ops[sent]);
+                if (err != ESP_LOADER_SUCCESS) {
+                    result = err;
+                    result_op = sent;
+                    reg_ops_drain(loader, ops, received, sent);
+                    goto done;
+                }
+                sent++;
+            }
+
+            if (received == sent) {
+                break;
+            }
+
+            const esp_loader_reg_op_t *op = &ops[received];
+            uint32_t value = 0;
+            esp_loader_error_t err = reg_op_complete(loader, op, &value);
+            // First op whose response is still to be read
+            const size_t in_flight = err == ESP_LOADER_SUCCESS || err == ESP_LOADER_ERROR_INVALID_RESPONSE
+                               ? received + 1 : received;
+
+            if (err == ESP_LOADER_SUCCESS && result == ESP_LOADER_SUCCESS) {
+                if (op->type == ESP_LOADER_REG_POLL) {
+                    err = reg_op_poll(loader, op, value);
+                } else if (op->type == ESP_LOADER_REG_READ && op->result != NULL) {
+                    *op->result = value;
+                }
+            }
+
+            if (err != ESP_LOADER_SUCCESS) {
+                if (result == ESP_LOADER_SUCCESS) {
+                    result = err;
+                    result_op = received;
+                }
+                /* A rejected command leaves the stream in sync, so collect the
+                   responses still in flight. Anything else is fatal. */
+                if (err != ESP_LOADER_ERROR_INVALID_RESPONSE) {
+                    reg_ops_drain(loader, ops, in_flight, sent);
+                    goto done;
+                }
+            }
+            received++;
+        }
+
+done:
+        if (result != ESP_LOADER_SUCCESS) {
+            if (failed_op != NULL) {
+                *failed_op = result_op;
+            }
+            return result;
+        }
+
+        window_start = window_end;
+    }
+
+    return ESP_LOADER_SUCCESS;
+}
+
+esp_loader_error_t esp_loader_read_memory(esp_loader_t *loader, uint32_t address, size_t words, uint32_t *out)
+{
+    if (address % 4 != 0 || (words != 0 && out == NULL)) {
+        return ESP_LOADER_ERROR_INVALID_PARAM;
+    }
+
+    if (!cmd_pipelined(loader)) {
+        for (size_t i = 0; i < words; i++) {
+            RETURN_ON_ERROR(esp_loader_read_register(loader, address + i * 4, &out[i]));
+        }
+        return ESP_LOADER_SUCCESS;
+    }
+
+    esp_loader_error_t result = ESP_LOADER_SUCCESS;
+    size_t sent = 0;
+    size_t received = 0;
+
+    while (received < words) {
+        while (result == ESP_LOADER_SUCCESS && sent < words && sent - received < REG_PIPELINE_DEPTH) {
+            loader->_port->ops->start_timer(loader->_port, DEFAULT_TIMEOUT);
+            esp_loader_error_t err = loader_read_reg_cmd_send(loader, address + sent * 4);
+            if (err != ESP_LOADER_SUCCESS) {
+                for (; received < sent; received++) {
+                    reg_response_drop(loader, READ_REG);
+                }
+                return err;
+            }
+            sent++;
+        }
+
+        if (received == sent) {
+            break;
+        }
+
+        loader->_port->ops->start_timer(loader->_port, DEFAULT_TIMEOUT);
+        esp_loader_error_t err = loader_reg_cmd_recv(loader, READ_REG, &out[received]);
+        if (err != ESP_LOADER_SUCCESS) {
+            /* Keep collecting the replies in flight after a rejected read so
+               they are not mistaken for responses to later commands */
+            if (err != ESP_LOADER_ERROR_INVALID_RESPONSE) {
+                for (; received < sent; received++) {
+                    reg_response_drop(loader, READ_REG);
+                }
+                return err;
+            }
+            if (result == ESP_LOADER_SUCCESS) {
+                result = err;
+            }
+        }
+        received++;
+    }
+
+    return result;
+}
+
 static esp_loader_error_t get_crystal_frequency_esp32c2(esp_loader_t *loader, uint32_t *frequency)
 {
     /*
@@ -1004,6 +1306,7 @@ static esp_loader_error_t get_crystal_frequency_esp32c2(esp_loader_t *loader, ui
 
 esp_loader_error_t esp_loader_change_transmission_rate(esp_loader_t *loader, uint32_t transmission_rate)
 {
+    const uint32_t requested_rate = transmission_rate;
 
     if (loader->_target == ESP8266_CHIP || loader->_protocol_type == ESP_LOADER_PROTOCOL_SDIO) {
         return ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
@@ -1012,11 +1315,15 @@ esp_loader_error_t esp_loader_change_transmission_rate(esp_loader_t *loader, uin
         const uint32_t ESP32C2_CRYSTAL_26MHZ = 26;
         const uint32_t ESP32C2_CRYSTAL_40MHZ = 40;
 
-        uint32_t frequency;
         // The ESP32-C2 still thinks it has 40 MHz crystal, even though it might be 26 MHz.
-        // So we need to adjust the transmission rate accordingly.
-        RETURN_ON_ERROR(get_crystal_frequency_esp32c2(loader, &frequency));
-        if (frequency == ESP32C2_CRYSTAL_26MHZ) {
+        // So we need to adjust the transmission rate accordingly. The measurement relies on
+        // the initial baud rate, so it is taken once and cached.
+        if (loader->_crystal_freq_mhz == 0) {
+            uint32_t frequency;
+            RETURN_ON_ERROR(get_crystal_frequency_esp32c2(loader, &frequency));
+            loader->_crystal_freq_mhz = (uint8_t)frequency;
+        }
+        if (loader->_crystal_freq_mhz == ESP32C2_CRYSTAL_26MHZ) {
             transmission_rate = transmission_rate * ESP32C2_CRYSTAL_40MHZ / ESP32C2_CRYSTAL_26MHZ;
         }
     }
@@ -1032,33 +1339,155 @@ esp_loader_error_t esp_loader_change_transmission_rate(esp_loader_t *loader, uin
             err = loader->_port->ops->change_transmission_rate(loader->_port, transmission_rate);
         }
     }
+    if (err == ESP_LOADER_SUCCESS) {
+        loader->_transmission_rate = requested_rate;
+    }
     return err;
 }
 
-esp_loader_error_t esp_loader_flash_verify_known_md5(esp_loader_t *loader,
-        uint32_t address,
-        uint32_t size,
-        const uint8_t *expected_md5)
+esp_loader_error_t esp_loader_spi_set_mode(esp_loader_t *loader, esp_loader_spi_mode_t mode)
 {
-
-    if ((loader->_target == ESP8266_CHIP && !loader->_stub_running) || loader->_protocol_type == ESP_LOADER_PROTOCOL_SPI) {
+    if (loader->_protocol->set_line_mode == NULL) {
         return ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
     }
 
-    RETURN_ON_ERROR(init_flash_params(loader));
-
-    if (address + size > loader->_target_flash_size) {
-        return ESP_LOADER_ERROR_IMAGE_SIZE;
-    }
+    loader->_port->ops->start_timer(loader->_port, DEFAULT_TIMEOUT);
 
-    uint8_t received_md5[MAX(MD5_SIZE_ROM, MD5_SIZE_STUB) + 1] = {0};
+    return loader->_protocol->set_line_mode(loader, mode);
+}
 
-    loader->_port->ops->start_timer(loader->_port, timeout_per_mb(size, MD5_TIMEOUT_PER_MB));
+static esp_loader_error_t unhexify(const uint8_t hex_md5[32], uint8_t raw_md5_out[16])
+{
+    for (int i = 0; i < 32; i++) {
+        uint8_t nibble;
+        if (hex_md5[i] >= '0' && hex_md5[i] <= '9') {
+            nibble = hex_md5[i] - '0';
+        } else if (hex_md5[i] >= 'a' && hex_md5[i] <= 'f') {
+            nibble = hex_md5[i] - 'a' + 10;
+        } else if (hex_md5[i] >= 'A' && hex_md5[i] <= 'F') {
+            nibble = hex_md5[i] - 'A' + 10;
+        } else {
+            return ESP_LOADER_ERROR_INVALID_RESPONSE;
+        }
+        raw_md5_out[i / 2] = (i % 2 == 0) ? (uint8_t)(nibble << 4) : (uint8_t)(raw_md5_out[i / 2] | nibble);
+    }
 
-    RETURN_ON_ERROR(loader_md5_cmd(loader, address, size, received_md5));
+    return ESP_LOADER_SUCCESS;
+}
 
+/* The target replies in hex from the ROM loader and in raw bytes from the stub */
+static esp_loader_error_t md5_reply_to_raw(const esp_loader_t *loader, const uint8_t *reply,
+        uint8_t raw_md5_out[ESP_LOADER_MD5_DIGEST_SIZE])
+{
     if (loader->_stub_running) {
-        uint8_t rec_md5_hex[MAX(MD5_SIZE_ROM, MD5_SIZE_STUB) + 1] = {0};
+        memcpy(raw_md5_out, reply, MD5_SIZE_STUB);
+        return ESP_LOADER_SUCCESS;
+    }
+
+    return unhexify(reply, raw_md5_out);
+}
+
+/* Collects and drops the responses to MD5 queries still in flight after a
+   failure, see reg_response_drop(). Each wait only covers hashing one region. */
+static void md5_responses_drain(esp_loader_t *loader, uint32_t count, uint32_t granularity)
+{
+    const uint32_t hash_time = (uint32_t)((uint64_t)MD5_TIMEOUT_PER_MB * granularity / 1000000UL);
+    uint8_t reply[MAX(MD5_SIZE_ROM, MD5_SIZE_STUB)];
+
+    for (uint32_t i = 0; i < count; i++) {
+        loader->_port->ops->start_timer(loader->_port, SHORT_TIMEOUT + hash_time);
+        (void)loader_md5_cmd_recv(loader, reply);
+    }
+}
+
+esp_loader_error_t esp_loader_flash_fingerprint(esp_loader_t *loader, uint32_t address, uint32_t size,
+        uint32_t granularity, uint8_t *out_hashes)
+{
+    if (granularity == 0) {
+        granularity = ESP_LOADER_FINGERPRINT_DEFAULT_GRANULARITY;
+    }
+
+    if (size == 0 || out_hashes == NULL) {
+        return ESP_LOADER_ERROR_INVALID_PARAM;
+    }
+
+    if (loader->_target == ESP8266_CHIP && !loader->_stub_running) {
+        return ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
+    }
+
+    RETURN_ON_ERROR(init_flash_params(loader));
+
+    if (address + size > loader->_target_flash_size) {
+        return ESP_LOADER_ERROR_IMAGE_SIZE;
+    }
+
+    const uint32_t regions = (size + granularity - 1) / granularity;
+    const bool pipelined = cmd_pipelined(loader);
+    uint32_t sent = 0;
+    uint32_t received = 0;
+
+    while (received < regions) {
+        while (pipelined && sent < regions && sent - received < MD5_PIPELINE_DEPTH) {
+            const uint32_t offset = sent * granularity;
+            loader->_port->ops->start_timer(loader->_port, DEFAULT_TIMEOUT);
+            esp_loader_error_t err = loader_md5_cmd_send(loader, address + offset, MIN(granularity, size - offset));
+            if (err != ESP_LOADER_SUCCESS) {
+                md5_responses_drain(loader, sent - received, granularity);
+                return err;
+            }
+            sent++;
+        }
+
+        const uint32_t offset = received * granularity;
+        const uint32_t region_size = MIN(granularity, size - offset);
+        uint8_t reply[MAX(MD5_SIZE_ROM, MD5_SIZE_STUB)];
+
+        loader->_port->ops->start_timer(loader->_port, timeout_per_mb(region_size, MD5_TIMEOUT_PER_MB));
+        esp_loader_error_t err = pipelined
+                                 ? loader_md5_cmd_recv(loader, reply)
+                                 : loader_md5_cmd(loader, address + offset, region_size, reply);
+        // A rejected query has had its response read, other failures have not
+        if (err == ESP_LOADER_SUCCESS || err == ESP_LOADER_ERROR_INVALID_RESPONSE) {
+            received++;
+        }
+        if (err == ESP_LOADER_SUCCESS) {
+            err = md5_reply_to_raw(loader, reply, &out_hashes[(received - 1) * ESP_LOADER_MD5_DIGEST_SIZE]);
+        }
+        if (err != ESP_LOADER_SUCCESS) {
+            if (pipelined) {
+                md5_responses_drain(loader, sent - received, granularity);
+            }
+            return err;
+        }
+    }
+
+    return ESP_LOADER_SUCCESS;
+}
+
+esp_loader_error_t esp_loader_flash_verify_known_md5(esp_loader_t *loader,
+        uint32_t address,
+        uint32_t size,
+        const uint8_t *expected_md5)
+{
+
+    if (loader->_target == ESP8266_CHIP && !loader->_stub_running) {
+        return ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
+    }
+
+    RETURN_ON_ERROR(init_flash_params(loader));
+
+    if (address + size > loader->_target_flash_size) {
+        return ESP_LOADER_ERROR_IMAGE_SIZE;
+    }
+
+    uint8_t received_md5[MAX(MD5_SIZE_ROM, MD5_SIZE_STUB) + 1] = {0};
+
+    loader->_port->ops->start_timer(loader->_port, timeout_per_mb(size, MD5_TIMEOUT_PER_MB));
+
+    RETURN_ON_ERROR(loader_md5_cmd(loader, address, size, received_md5));
+
+    if (loader->_stub_running) {
+        uint8_t rec_md5_hex[MAX(MD5_SIZE_ROM, MD5_SIZE_STUB) + 1] = {0};
         hexify(received_md5, rec_md5_hex);
         memcpy(received_md5, rec_md5_hex, MD5_SIZE_ROM);
     }
@@ -1074,6 +1503,997 @@ esp_loader_error_t esp_loader_flash_verify_known_md5(esp_loader_t *loader,
     return ESP_LOADER_SUCCESS;
 }
 
+/* Erases and writes one contiguous part of an image without verifying it,
+   callers check the whole image once it is complete */
+static esp_loader_error_t flash_write_run(esp_loader_t *loader, uint32_t offset, const uint8_t *data,
+        uint32_t size, uint32_t block_size)
+{
+    esp_loader_flash_cfg_t flash_cfg = {
+        .offset = offset,
+        .image_size = size,
+        .block_size = block_size,
+        .skip_verify = true,
+    };
+
+    RETURN_ON_ERROR(esp_loader_flash_start(loader, &flash_cfg));
+    for (uint32_t written = 0; written < size; written += block_size) {
+        RETURN_ON_ERROR(esp_loader_flash_write(loader, &flash_cfg, &data[written],
+                                               MIN(block_size, size - written)));
+    }
+    return esp_loader_flash_finish(loader, &flash_cfg);
+}
+
+esp_loader_error_t loader_flash_verify_image(esp_loader_t *loader, uint32_t offset, const uint8_t *image,
+        uint32_t size)
+{
+    uint8_t raw_md5[16];
+    uint8_t hex_md5[MAX(MD5_SIZE_ROM, MD5_SIZE_STUB) + 1] = {0};
+    struct MD5Context md5_context;
+
+    MD5Init(&md5_context);
+    MD5Update(&md5_context, image, size);
+    MD5Final(raw_md5, &md5_context);
+    hexify(raw_md5, hex_md5);
+
+    return esp_loader_flash_verify_known_md5(loader, offset, size, hex_md5);
+}
+
+static esp_loader_error_t diff_write_run(esp_loader_t *loader, esp_loader_flash_diff_cfg_t *cfg,
+        uint32_t start, uint32_t size)
+{
+    RETURN_ON_ERROR(flash_write_run(loader, cfg->offset + start, &cfg->image[start], size, cfg->block_size));
+
+    cfg->runs++;
+    cfg->bytes_written += size;
+    return ESP_LOADER_SUCCESS;
+}
+
+/* Compares granules [first, first + count) against the flash and sets a bit
+   in changed for each one that differs */
+static esp_loader_error_t diff_compare_window(esp_loader_t *loader, const esp_loader_flash_diff_cfg_t *cfg,
+        uint32_t first, uint32_t count, uint32_t *changed)
+{
+    uint8_t flash_md5[DIFF_WINDOW_UNITS][ESP_LOADER_MD5_DIGEST_SIZE];
+    const uint32_t window_start = first * cfg->granularity;
+    const uint32_t window_size = MIN(count * cfg->granularity, cfg->image_size - window_start);
+
+    RETURN_ON_ERROR(esp_loader_flash_fingerprint(loader, cfg->offset + window_start, window_size,
+                    cfg->granularity, &flash_md5[0][0]));
+
+    *changed = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        const uint32_t start = window_start + i * cfg->granularity;
+        uint8_t image_md5[ESP_LOADER_MD5_DIGEST_SIZE];
+        struct MD5Context md5_context;
+
+        MD5Init(&md5_context);
+        MD5Update(&md5_context, &cfg->image[start], MIN(cfg->granularity, cfg->image_size - start));
+        MD5Final(image_md5, &md5_context);
+
+        if (memcmp(image_md5, flash_md5[i], ESP_LOADER_MD5_DIGEST_SIZE) != 0) {
+            *changed |= 1UL << i;
+        }
+    }
+
+    return ESP_LOADER_SUCCESS;
+}
+
+esp_loader_error_t esp_loader_flash_diff_write(esp_loader_t *loader, esp_loader_flash_diff_cfg_t *cfg)
+{
+    if (cfg->granularity == 0) {
+        cfg->granularity = FLASH_SECTOR_SIZE;
+    }
+
+    cfg->units_changed = 0;
+    cfg->runs = 0;
+    cfg->bytes_written = 0;
+
+    if (cfg->offset % FLASH_SECTOR_SIZE != 0 || cfg->granularity % FLASH_SECTOR_SIZE != 0 ||
+            cfg->image_size % 4 != 0 || cfg->block_size == 0) {
+        return ESP_LOADER_ERROR_INVALID_PARAM;
+    }
+
+    if (loader->_target == ESP8266_CHIP && !loader->_stub_running) {
+        return ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
+    }
+
+    RETURN_ON_ERROR(init_flash_params(loader));
+    if (cfg->offset + cfg->image_size > loader->_target_flash_size) {
+        return ESP_LOADER_ERROR_IMAGE_SIZE;
+    }
+
+    const uint32_t units = (cfg->image_size + cfg->granularity - 1) / cfg->granularity;
+    uint32_t run_start = UINT32_MAX;  // First granule of the changed run being collected
+
+    /* MD5 queries cannot be in flight while a run is written, so the granules
+       are compared a window at a time. A run still open at the end of a window
+       carries over into the next one. */
+    for (uint32_t first = 0; first < units; first += DIFF_WINDOW_UNITS) {
+        const uint32_t count = MIN(DIFF_WINDOW_UNITS, units - first);
+        uint32_t changed;
+        RETURN_ON_ERROR(diff_compare_window(loader, cfg, first, count, &changed));
+
+        for (uint32_t i = 0; i < count; i++) {
+            const bool unit_changed = (changed >> i) & 1;
+            if (unit_changed) {
+                cfg->units_changed++;
+                if (run_start == UINT32_MAX) {
+                    run_start = first + i;
+                }
+            } else if (run_start != UINT32_MAX) {
+                RETURN_ON_ERROR(diff_write_run(loader, cfg, run_start * cfg->granularity,
+                                               (first + i - run_start) * cfg->granularity));
+                run_start = UINT32_MAX;
+            }
+        }
+    }
+
+    if (run_start != UINT32_MAX) {
+        const uint32_t start = run_start * cfg->granularity;
+        RETURN_ON_ERROR(diff_write_run(loader, cfg, start, cfg->image_size - start));
+    }
+
+    LOADER_LOGI(loader, "Diff write: %" PRIu32 " of %" PRIu32 " granules changed, %" PRIu32 " bytes written",
+                cfg->units_changed, units, cfg->bytes_written);
+
+    if (cfg->bytes_written == 0) {
+        return ESP_LOADER_SUCCESS;
+    }
+
+    return loader_flash_verify_image(loader, cfg->offset, cfg->image, cfg->image_size);
+}
+
+/* Damaged sectors found so far that are adjacent, written together */
+typedef struct {
+    esp_loader_flash_repair_cfg_t *cfg;
+    uint32_t run_start;
+    uint32_t run_size;
+} repair_state_t;
+
+static bool repair_image_matches(const esp_loader_flash_repair_cfg_t *cfg, uint32_t start, uint32_t size,
+                                 const uint8_t flash_md5[ESP_LOADER_MD5_DIGEST_SIZE])
+{
+    uint8_t image_md5[ESP_LOADER_MD5_DIGEST_SIZE];
+    struct MD5Context md5_context;
+
+    MD5Init(&md5_context);
+    MD5Update(&md5_context, &cfg->image[start], size);
+    MD5Final(image_md5, &md5_context);
+
+    return memcmp(image_md5, flash_md5, ESP_LOADER_MD5_DIGEST_SIZE) == 0;
+}
+
+static esp_loader_error_t repair_flush_run(esp_loader_t *loader, repair_state_t *state)
+{
+    esp_loader_flash_repair_cfg_t *cfg = state->cfg;
+
+    if (state->run_size == 0) {
+        return ESP_LOADER_SUCCESS;
+    }
+
+    RETURN_ON_ERROR(flash_write_run(loader, cfg->offset + state->run_start, &cfg->image[state->run_start],
+                                    state->run_size, cfg->block_size));
+    cfg->runs++;
+    state->run_size = 0;
+    return ESP_LOADER_SUCCESS;
+}
+
+/* [start, start + size) is known to differ from the image. It is split in
+   halves until single sectors remain, which are then rewritten. */
+static esp_loader_error_t repair_bisect(esp_loader_t *loader, repair_state_t *state, uint32_t start, uint32_t size)
+{
+    esp_loader_flash_repair_cfg_t *cfg = state->cfg;
+
+    if (size <= FLASH_SECTOR_SIZE) {
+        if (state->run_size > 0 && state->run_start + state->run_size != start) {
+            RETURN_ON_ERROR(repair_flush_run(loader, state));
+        }
+        if (state->run_size == 0) {
+            state->run_start = start;
+        }
+        state->run_size += size;
+        cfg->sectors_rewritten++;
+        return ESP_LOADER_SUCCESS;
+    }
+
+    // Both halves are hashed in one pipelined fingerprint
+    const uint32_t sectors = (size + FLASH_SECTOR_SIZE - 1) / FLASH_SECTOR_SIZE;
+    const uint32_t half = (sectors + 1) / 2 * FLASH_SECTOR_SIZE;
+    uint8_t flash_md5[2][ESP_LOADER_MD5_DIGEST_SIZE];
+
+    RETURN_ON_ERROR(esp_loader_flash_fingerprint(loader, cfg->offset + start, size, half, &flash_md5[0][0]));
+    cfg->md5_queries += 2;
+
+    if (!repair_image_matches(cfg, start, half, flash_md5[0])) {
+        RETURN_ON_ERROR(repair_bisect(loader, state, start, half));
+    }
+    if (!repair_image_matches(cfg, start + half, size - half, flash_md5[1])) {
+        RETURN_ON_ERROR(repair_bisect(loader, state, start + half, size - half));
+    }
+    return ESP_LOADER_SUCCESS;
+}
+
+esp_loader_error_t esp_loader_flash_repair(esp_loader_t *loader, esp_loader_flash_repair_cfg_t *cfg)
+{
+    const uint32_t max_rounds = cfg->max_rounds != 0 ? cfg->max_rounds : REPAIR_DEFAULT_ROUNDS;
+
+    cfg->sectors_rewritten = 0;
+    cfg->runs = 0;
+    cfg->md5_queries = 0;
+    cfg->rounds = 0;
+
+    if (cfg->offset % FLASH_SECTOR_SIZE != 0 || cfg->image_size % 4 != 0 || cfg->image_size == 0 ||
+            cfg->block_size == 0) {
+        return ESP_LOADER_ERROR_INVALID_PARAM;
+    }
+
+    if (loader->_target == ESP8266_CHIP && !loader->_stub_running) {
+        return ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
+    }
+
+    RETURN_ON_ERROR(init_flash_params(loader));
+    if (cfg->offset + cfg->image_size > loader->_target_flash_size) {
+        return ESP_LOADER_ERROR_IMAGE_SIZE;
+    }
+
+    for (;;) {
+        uint8_t flash_md5[ESP_LOADER_MD5_DIGEST_SIZE];
+        RETURN_ON_ERROR(esp_loader_flash_fingerprint(loader, cfg->offset, cfg->image_size, cfg->image_size, flash_md5));
+        cfg->md5_queries++;
+
+        if (repair_image_matches(cfg, 0, cfg->image_size, flash_md5)) {
+            LOADER_LOGI(loader, "Repair: %" PRIu32 " sectors rewritten in %" PRIu32 " rounds, %" PRIu32 " MD5 queries",
+                        cfg->sectors_rewritten, cfg->rounds, cfg->md5_queries);
+            return ESP_LOADER_SUCCESS;
+        }
+
+        if (cfg->rounds == max_rounds) {
+            LOADER_LOGE(loader, "Repair: flash still differs after %" PRIu32 " rounds", cfg->rounds);
+            return ESP_LOADER_ERROR_INVALID_MD5;
+        }
+
+        repair_state_t state = { .cfg = cfg };
+        cfg->rounds++;
+        RETURN_ON_ERROR(repair_bisect(loader, &state, 0, cfg->image_size));
+        RETURN_ON_ERROR(repair_flush_run(loader, &state));
+    }
+}
+
+/* Checks a word at a time, the image may start at any alignment */
+static bool is_erased(const uint8_t *data, uint32_t size)
+{
+    uint32_t i = 0;
+
+    for (; i < size && (uintptr_t)&data[i] % sizeof(uint32_t) != 0; i++) {
+        if (data[i] != 0xFF) {
+            return false;
+        }
+    }
+
+    for (; i + 4 * sizeof(uint32_t) <= size; i += 4 * sizeof(uint32_t)) {
+        uint32_t words[4];
+        memcpy(words, &data[i], sizeof(words));
+        if ((words[0] & words[1] & words[2] & words[3]) != UINT32_MAX) {
+            return false;
+        }
+    }
+
+    for (; i < size; i++) {
+        if (data[i] != 0xFF) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void erased_md5(uint32_t size, uint8_t md5_out[ESP_LOADER_MD5_DIGEST_SIZE])
+{
+    uint8_t erased[64];
+    struct MD5Context md5_context;
+
+    memset(erased, 0xFF, sizeof(erased));
+    MD5Init(&md5_context);
+    for (uint32_t done = 0; done < size; done += sizeof(erased)) {
+        MD5Update(&md5_context, erased, MIN(sizeof(erased), size - done));
+    }
+    MD5Final(md5_out, &md5_context);
+}
+
+/* Erases [start, end) of the image range, except for the erase blocks that
+   are blank in flash already when cfg->skip_blank_erase is set */
+static esp_loader_error_t sparse_erase(esp_loader_t *loader, esp_loader_flash_sparse_cfg_t *cfg,
+                                       uint32_t start, uint32_t end)
+{
+    if (!cfg->skip_blank_erase) {
+        return esp_loader_flash_erase_region(loader, cfg->offset + start, ROUNDUP(end - start, FLASH_SECTOR_SIZE));
+    }
+
+    uint8_t flash_md5[SPARSE_BLANK_CHECK_BLOCKS][ESP_LOADER_MD5_DIGEST_SIZE];
+    uint8_t block_md5[ESP_LOADER_MD5_DIGEST_SIZE];
+    uint8_t partial_md5[ESP_LOADER_MD5_DIGEST_SIZE];
+    uint32_t erase_start = UINT32_MAX;
+    uint32_t pos = start;
+
+    erased_md5(FLASH_BLOCK_ERASE_SIZE, block_md5);
+
+    while (pos < end) {
+        /* A partial block at the start is checked on its own, so that the
+           fingerprint regions fall on erase block boundaries */
+        const uint32_t block_end = MIN(end, ROUNDUP(cfg->offset + pos + 1, FLASH_BLOCK_ERASE_SIZE) - cfg->offset);
+        const uint32_t window_end = block_end - pos < FLASH_BLOCK_ERASE_SIZE
+                                    ? block_end : MIN(end, pos + SPARSE_BLANK_CHECK_BLOCKS * FLASH_BLOCK_ERASE_SIZE);
+
+        RETURN_ON_ERROR(esp_loader_flash_fingerprint(loader, cfg->offset + pos, window_end - pos,
+                        FLASH_BLOCK_ERASE_SIZE, &flash_md5[0][0]));
+
+        for (uint32_t i = 0; pos < window_end; i++) {
+            const uint32_t size = MIN(FLASH_BLOCK_ERASE_SIZE, window_end - pos);
+            if (size != FLASH_BLOCK_ERASE_SIZE) {
+                erased_md5(size, partial_md5);
+            }
+
+            if (memcmp(flash_md5[i], size == FLASH_BLOCK_ERASE_SIZE ? block_md5 : partial_md5,
+                       ESP_LOADER_MD5_DIGEST_SIZE) == 0) {
+                if (erase_start != UINT32_MAX) {
+                    RETURN_ON_ERROR(esp_loader_flash_erase_region(loader, cfg->offset + erase_start, pos - erase_start));
+                    erase_start = UINT32_MAX;
+                }
+                cfg->bytes_erase_skipped += size;
+            } else if (erase_start == UINT32_MAX) {
+                erase_start = pos;
+            }
+            pos += size;
+        }
+    }
+
+    if (erase_start != UINT32_MAX) {
+        RETURN_ON_ERROR(esp_loader_flash_erase_region(loader, cfg->offset + erase_start,
+                        ROUNDUP(end - erase_start, FLASH_SECTOR_SIZE)));
+    }
+
+    return ESP_LOADER_SUCCESS;
+}
+
+esp_loader_error_t esp_loader_flash_write_sparse(esp_loader_t *loader, esp_loader_flash_sparse_cfg_t *cfg)
+{
+    cfg->runs = 0;
+    cfg->bytes_skipped = 0;
+    cfg->bytes_erase_skipped = 0;
+
+    if (cfg->offset % FLASH_SECTOR_SIZE != 0 || cfg->image_size % 4 != 0 || cfg->block_size == 0) {
+        return ESP_LOADER_ERROR_INVALID_PARAM;
+    }
+
+    if ((!cfg->skip_verify || cfg->skip_blank_erase) && loader->_target == ESP8266_CHIP && !loader->_stub_running) {
+        return ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
+    }
+
+    RETURN_ON_ERROR(init_flash_params(loader));
+    if (cfg->offset + cfg->image_size > loader->_target_flash_size) {
+        return ESP_LOADER_ERROR_IMAGE_SIZE;
+    }
+
+    /* The image is split at 64 KB erase block boundaries. Skipping single
+       sectors would break up the block erases of FLASH_BEGIN into sector
+       erases, which cost more than sending the sectors. The blank blocks are
+       erased on their own, as the stub only erases the sectors it writes to. */
+    uint32_t pos = 0;
+    while (pos < cfg->image_size) {
+        uint32_t end = pos;
+        bool blank = false;
+
+        while (end < cfg->image_size) {
+            const uint32_t next = MIN(cfg->image_size,
+                                      ROUNDUP(cfg->offset + end + 1, FLASH_BLOCK_ERASE_SIZE) - cfg->offset);
+            const bool unit_blank = is_erased(&cfg->image[end], next - end);
+            if (end == pos) {
+                blank = unit_blank;
+            } else if (unit_blank != blank) {
+                break;
+            }
+            end = next;
+        }
+
+        if (blank) {
+            RETURN_ON_ERROR(sparse_erase(loader, cfg, pos, end));
+            cfg->bytes_skipped += end - pos;
+        } else {
+            RETURN_ON_ERROR(flash_write_run(loader, cfg->offset + pos, &cfg->image[pos], end - pos,
+                                            cfg->block_size));
+            cfg->runs++;
+        }
+        pos = end;
+    }
+
+    LOADER_LOGI(loader, "Sparse write: %" PRIu32 " runs, %" PRIu32 " blank bytes not sent, %" PRIu32 " not erased",
+                cfg->runs, cfg->bytes_skipped, cfg->bytes_erase_skipped);
+
+    if (cfg->skip_verify) {
+        return ESP_LOADER_SUCCESS;
+    }
+
+    return loader_flash_verify_image(loader, cfg->offset, cfg->image, cfg->image_size);
+}
+
+static bool plan_region_compressed(const esp_loader_t *loader, const esp_loader_flash_region_t *region)
+{
+    return region->deflated != NULL && region->deflated_size < region->size && loader->_stub_running;
+}
+
+/* Regions sharing a sector must go into one FLASH_BEGIN, as a second one
+   would erase the end of the first region again */
+static bool plan_regions_share_sector(const esp_loader_flash_region_t *a, const esp_loader_flash_region_t *b)
+{
+    return (a->offset + a->size - 1) / FLASH_SECTOR_SIZE == b->offset / FLASH_SECTOR_SIZE;
+}
+
+static uint32_t plan_command_bytes(uint32_t payload_size, uint32_t block_size, bool verify)
+{
+    const uint32_t blocks = (payload_size + block_size - 1) / block_size;
+    return sizeof(flash_begin_command_t) + blocks * sizeof(data_command_t) + payload_size +
+           (verify ? sizeof(spi_flash_md5_command_t) : 0);
+}
+
+/* Copies the bytes of [start, start + size) of the flash address space into
+   buf, 0xFF where no region covers them */
+static void plan_fill_block(const esp_loader_flash_region_t *regions, uint32_t first, uint32_t last,
+                            uint32_t start, uint32_t size, uint8_t *buf)
+{
+    memset(buf, 0xFF, size);
+    for (uint32_t i = first; i <= last; i++) {
+        const uint32_t from = MAX(start, regions[i].offset);
+        const uint32_t to = MIN(start + size, regions[i].offset + regions[i].size);
+        if (from < to) {
+            memcpy(&buf[from - start], &regions[i].data[from - regions[i].offset], to - from);
+        }
+    }
+}
+
+static esp_loader_error_t plan_write_raw(esp_loader_t *loader, const esp_loader_flash_region_t *regions,
+        uint32_t first, uint32_t last, const esp_loader_flash_plan_cfg_t *cfg)
+{
+    const uint32_t start = regions[first].offset;
+    const uint32_t end = regions[last].offset + regions[last].size;
+    esp_loader_flash_cfg_t flash_cfg = {
+        .offset = start,
+        .image_size = end - start,
+        .block_size = cfg->block_size,
+        .skip_verify = cfg->skip_verify,
+    };
+
+    RETURN_ON_ERROR(esp_loader_flash_start(loader, &flash_cfg));
+
+    uint32_t region = first;
+    for (uint32_t pos = start; pos < end; pos += cfg->block_size) {
+        const uint32_t size = MIN(cfg->block_size, end - pos);
+        while (regions[region].offset + regions[region].size <= pos && region < last) {
+            region++;
+        }
+
+        /* Blocks within one region are sent from the image, the others are
+           put together in the block buffer */
+        const uint8_t *block;
+        if (pos >= regions[region].offset && pos + size <= regions[region].offset + regions[region].size) {
+            block = &regions[region].data[pos - regions[region].offset];
+        } else {
+            plan_fill_block(regions, region, last, pos, size, cfg->block_buffer);
+            block = cfg->block_buffer;
+        }
+        RETURN_ON_ERROR(esp_loader_flash_write(loader, &flash_cfg, block, size));
+    }
+
+    return esp_loader_flash_finish(loader, &flash_cfg);
+}
+
+static esp_loader_error_t plan_write_compressed(esp_loader_t *loader, const esp_loader_flash_region_t *region,
+        const esp_loader_flash_plan_cfg_t *cfg)
+{
+    esp_loader_flash_deflate_cfg_t deflate_cfg = {
+        .offset = region->offset,
+        .image_size = region->size,
+        .compressed_size = region->deflated_size,
+        .block_size = cfg->block_size,
+    };
+
+    RETURN_ON_ERROR(esp_loader_flash_deflate_start(loader, &deflate_cfg));
+    for (uint32_t sent = 0; sent < region->deflated_size; sent += cfg->block_size) {
+        RETURN_ON_ERROR(esp_loader_flash_deflate_write(loader, &deflate_cfg, (void *)&region->deflated[sent],
+                        MIN(cfg->block_size, region->deflated_size - sent)));
+    }
+    RETURN_ON_ERROR(esp_loader_flash_deflate_finish(loader, &deflate_cfg));
+
+    if (cfg->skip_verify) {
+        return ESP_LOADER_SUCCESS;
+    }
+
+    return loader_flash_verify_image(loader, region->offset, region->data, region->size);
+}
+
+esp_loader_error_t esp_loader_flash_plan(esp_loader_t *loader, esp_loader_flash_region_t *regions, uint32_t count,
+        esp_loader_flash_plan_cfg_t *cfg)
+{
+    cfg->passes = 0;
+    cfg->wire_bytes = 0;
+    cfg->erase_bytes = 0;
+
+    if (count == 0 || cfg->block_size == 0 || (!cfg->dry_run && cfg->block_buffer == NULL)) {
+        return ESP_LOADER_ERROR_INVALID_PARAM;
+    }
+
+    /* Sorted by address, so that each pass erases the flash once and in order */
+    for (uint32_t i = 1; i < count; i++) {
+        const esp_loader_flash_region_t region = regions[i];
+        uint32_t j = i;
+        for (; j > 0 && regions[j - 1].offset > region.offset; j--) {
+            regions[j] = regions[j - 1];
+        }
+        regions[j] = region;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (regions[i].offset % 4 != 0 || regions[i].size % 4 != 0 || regions[i].size == 0) {
+            return ESP_LOADER_ERROR_INVALID_PARAM;
+        }
+        if (i > 0 && regions[i - 1].offset + regions[i - 1].size > regions[i].offset) {
+            LOADER_LOGE(loader, "Images at 0x%08" PRIx32 " and 0x%08" PRIx32 " overlap",
+                        regions[i - 1].offset, regions[i].offset);
+            return ESP_LOADER_ERROR_INVALID_PARAM;
+        }
+    }
+
+    uint32_t first = 0;
+    while (first < count) {
+        /* A pass extends over the following images while they are close
+           enough, or must join it because they share a sector with it */
+        uint32_t last = first;
+        while (last + 1 < count &&
+                (regions[last + 1].offset - (regions[last].offset + regions[last].size) <= cfg->max_gap ||
+                 plan_regions_share_sector(&regions[last], &regions[last + 1]))) {
+            last++;
+        }
+
+        const uint32_t start = regions[first].offset;
+        const uint32_t end = regions[last].offset + regions[last].size;
+        const bool compressed = first == last && plan_region_compressed(loader, &regions[first]);
+
+        cfg->erase_bytes += ROUNDUP(end, FLASH_SECTOR_SIZE) - start / FLASH_SECTOR_SIZE * FLASH_SECTOR_SIZE;
+        cfg->wire_bytes += plan_command_bytes(compressed ? regions[first].deflated_size : end - start,
+                                              cfg->block_size, !cfg->skip_verify);
+        cfg->passes++;
+
+        LOADER_LOGI(loader, "Flash plan: 0x%08" PRIx32 "-0x%08" PRIx32 ", %" PRIu32 " images, %s",
+                    start, end, last - first + 1, compressed ? "compressed" : "raw");
+
+        if (!cfg->dry_run) {
+            RETURN_ON_ERROR(compressed
+                            ? plan_write_compressed(loader, &regions[first], cfg)
+                            : plan_write_raw(loader, regions, first, last, cfg));
+        }
+        first = last + 1;
+    }
+
+    return ESP_LOADER_SUCCESS;
+}
+
+typedef struct {
+    esp_loader_t *loader;
+    esp_loader_flash_deflate_cfg_t *deflate_cfg;
+    uint32_t elapsed_ms;
+} compressed_write_t;
+
+/* Time the last command took, as the loader starts the timer before each one */
+static uint32_t command_elapsed_ms(esp_loader_t *loader, uint32_t timeout)
+{
+    return timeout - MIN(timeout, loader->_port->ops->remaining_time(loader->_port));
+}
+
+static esp_loader_error_t compressed_block_sink(void *ctx, const uint8_t *data, uint32_t size)
+{
+    compressed_write_t *write = ctx;
+    RETURN_ON_ERROR(esp_loader_flash_deflate_write(write->loader, write->deflate_cfg, (void *)data, size));
+    write->elapsed_ms += command_elapsed_ms(write->loader, DEFAULT_TIMEOUT);
+    return ESP_LOADER_SUCCESS;
+}
+
+/* Compresses data into one FLASH_DEFL session, compressed_size being known from a
+   counting pass. Returns the time the data blocks took. */
+static esp_loader_error_t flash_write_deflated(esp_loader_t *loader, uint32_t offset, const uint8_t *data,
+        uint32_t size, uint32_t compressed_size, uint32_t block_size, uint8_t *block_buffer, uint32_t *elapsed_ms)
+{
+    esp_loader_flash_deflate_cfg_t deflate_cfg = {
+        .offset = offset,
+        .image_size = size,
+        .compressed_size = compressed_size,
+        .block_size = block_size,
+    };
+    compressed_write_t write = { loader, &deflate_cfg, 0 };
+    uint32_t sent_size;
+
+    RETURN_ON_ERROR(esp_loader_flash_deflate_start(loader, &deflate_cfg));
+    RETURN_ON_ERROR(deflate_compress(data, size, block_buffer, block_size, compressed_block_sink, &write, &sent_size));
+    RETURN_ON_ERROR(esp_loader_flash_deflate_finish(loader, &deflate_cfg));
+
+    *elapsed_ms = write.elapsed_ms;
+    return ESP_LOADER_SUCCESS;
+}
+
+static esp_loader_error_t adaptive_write_raw(esp_loader_t *loader, esp_loader_flash_compress_cfg_t *cfg,
+        uint32_t start, uint32_t size, uint32_t *elapsed_ms)
+{
+    esp_loader_flash_cfg_t flash_cfg = {
+        .offset = cfg->offset + start,
+        .image_size = size,
+        .block_size = cfg->block_size,
+        .skip_verify = true,
+    };
+
+    *elapsed_ms = 0;
+    RETURN_ON_ERROR(esp_loader_flash_start(loader, &flash_cfg));
+    for (uint32_t written = 0; written < size; written += cfg->block_size) {
+        RETURN_ON_ERROR(esp_loader_flash_write(loader, &flash_cfg, &cfg->image[start + written],
+                                               MIN(cfg->block_size, size - written)));
+        *elapsed_ms += command_elapsed_ms(loader, DEFAULT_TIMEOUT);
+    }
+    return esp_loader_flash_finish(loader, &flash_cfg);
+}
+
+/*
+ * Cost model of the adaptive mode, in ns per image byte. A raw region costs
+ * a = link + program. A compressed region with ratio r costs
+ * b(r) = r * link + program + inflate, a line in r whose slope is the link
+ * time per byte. The line is fitted to the compressed regions written so far;
+ * with a single ratio seen, the slope is taken as a, i.e. link bound.
+ * A region is compressed when b(r) < a.
+ */
+typedef struct {
+    uint64_t raw_bytes;
+    uint64_t raw_ms;
+    int64_t n;
+    int64_t sum_r;
+    int64_t sum_b;
+    int64_t sum_rr;
+    int64_t sum_rb;
+} adaptive_model_t;
+
+static int64_t adaptive_ns_per_byte(uint64_t ms, uint64_t bytes)
+{
+    return (int64_t)(ms * 1000000 / MAX(bytes, 1));
+}
+
+static bool adaptive_compress(const adaptive_model_t *model, uint32_t ratio)
+{
+    if (model->raw_bytes == 0 || model->n == 0) {
+        return ratio < ADAPTIVE_PRIOR_RATIO;
+    }
+
+    const int64_t a = adaptive_ns_per_byte(model->raw_ms, model->raw_bytes);
+    const int64_t denominator = model->n * model->sum_rr - model->sum_r * model->sum_r;
+    int64_t slope = a;  // Per ADAPTIVE_RATIO_ONE of ratio
+
+    if (denominator != 0) {
+        const int64_t fitted = (model->n * model->sum_rb - model->sum_r * model->sum_b) * ADAPTIVE_RATIO_ONE / denominator;
+        if (fitted >= 0 && fitted <= a) {
+            slope = fitted;
+        }
+    }
+
+    const int64_t intercept = (model->sum_b - slope * model->sum_r / ADAPTIVE_RATIO_ONE) / model->n;
+    return slope * ratio / ADAPTIVE_RATIO_ONE + intercept < a;
+}
+
+static esp_loader_error_t flash_write_adaptive(esp_loader_t *loader, esp_loader_flash_compress_cfg_t *cfg)
+{
+    adaptive_model_t model = { 0 };
+    uint32_t total_ms = 0;
+
+    cfg->compressed_size = 0;
+    cfg->regions_compressed = 0;
+    cfg->regions_raw = 0;
+
+    if (cfg->offset % FLASH_SECTOR_SIZE != 0) {
+        return ESP_LOADER_ERROR_INVALID_PARAM;
+    }
+
+    for (uint32_t start = 0; start < cfg->image_size; start += ADAPTIVE_REGION_SIZE) {
+        const uint32_t size = MIN(ADAPTIVE_REGION_SIZE, cfg->image_size - start);
+        uint32_t compressed_size;
+        uint32_t elapsed_ms;
+
+        RETURN_ON_ERROR(deflate_compress(&cfg->image[start], size, NULL, 0, NULL, NULL, &compressed_size));
+        const uint32_t ratio = (uint32_t)((uint64_t)compressed_size * ADAPTIVE_RATIO_ONE / size);
+        const bool compress = adaptive_compress(&model, ratio);
+
+        if (compress) {
+            RETURN_ON_ERROR(flash_write_deflated(loader, cfg->offset + start, &cfg->image[start], size, compressed_size,
+                                                 cfg->block_size, cfg->block_buffer, &elapsed_ms));
+            const int64_t b = adaptive_ns_per_byte(elapsed_ms, size);
+            model.n++;
+            model.sum_r += ratio;
+            model.sum_b += b;
+            model.sum_rr += (int64_t)ratio * ratio;
+            model.sum_rb += (int64_t)ratio * b;
+            cfg->compressed_size += compressed_size;
+            cfg->regions_compressed++;
+        } else {
+            RETURN_ON_ERROR(adaptive_write_raw(loader, cfg, start, size, &elapsed_ms));
+            model.raw_bytes += size;
+            model.raw_ms += elapsed_ms;
+            cfg->compressed_size += size;
+            cfg->regions_raw++;
+        }
+        total_ms += elapsed_ms;
+
+        LOADER_LOGI(loader, "Region 0x%08" PRIx32 ": compresses to %" PRIu32 "%%, sent %s in %" PRIu32 " ms",
+                    cfg->offset + start, ratio * 100 / ADAPTIVE_RATIO_ONE, compress ? "compressed" : "raw", elapsed_ms);
+    }
+
+    cfg->elapsed_ms = total_ms;
+    LOADER_LOGI(loader, "Adaptive write: %" PRIu32 " regions compressed, %" PRIu32 " raw, %" PRIu32 " KB/s effective",
+                cfg->regions_compressed, cfg->regions_raw,
+                (uint32_t)((uint64_t)cfg->image_size * 1000 / 1024 / MAX(total_ms, 1)));
+    return ESP_LOADER_SUCCESS;
+}
+
+esp_loader_error_t esp_loader_flash_write_compressed(esp_loader_t *loader, esp_loader_flash_compress_cfg_t *cfg)
+{
+    if (cfg->image_size % 4 != 0 || cfg->block_size == 0 || cfg->block_buffer == NULL) {
+        return ESP_LOADER_ERROR_INVALID_PARAM;
+    }
+
+    if (!cfg->skip_verify && loader->_target == ESP8266_CHIP && !loader->_stub_running) {
+        return ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
+    }
+
+    if (cfg->adaptive) {
+        RETURN_ON_ERROR(flash_write_adaptive(loader, cfg));
+        return cfg->skip_verify ? ESP_LOADER_SUCCESS
+               : loader_flash_verify_image(loader, cfg->offset, cfg->image, cfg->image_size);
+    }
+
+    /* FLASH_DEFL_BEGIN needs the number of blocks, so the image is compressed
+       twice: once to learn the size, once to send it */
+    uint32_t elapsed_ms;
+    RETURN_ON_ERROR(deflate_compress(cfg->image, cfg->image_size, NULL, 0, NULL, NULL, &cfg->compressed_size));
+    RETURN_ON_ERROR(flash_write_deflated(loader, cfg->offset, cfg->image, cfg->image_size, cfg->compressed_size,
+                                         cfg->block_size, cfg->block_buffer, &elapsed_ms));
+
+    if (cfg->skip_verify) {
+        return ESP_LOADER_SUCCESS;
+    }
+
+    return loader_flash_verify_image(loader, cfg->offset, cfg->image, cfg->image_size);
+}
+
+static esp_loader_error_t journal_store(esp_loader_flash_resumable_cfg_t *cfg, uint32_t confirmed)
+{
+    cfg->journal->confirmed = confirmed;
+    return cfg->journal_update != NULL ? cfg->journal_update(cfg->journal_ctx, cfg->journal) : ESP_LOADER_SUCCESS;
+}
+
+/* Moves the journal's point back to the first of the sectors before it that
+   does not hold the image, or to the start if the journal is for another image */
+static esp_loader_error_t resume_point(esp_loader_t *loader, esp_loader_flash_resumable_cfg_t *cfg,
+                                       const uint8_t image_md5[ESP_LOADER_MD5_DIGEST_SIZE], uint32_t *resume)
+{
+    esp_loader_flash_journal_t *journal = cfg->journal;
+
+    if (journal->magic != ESP_LOADER_JOURNAL_MAGIC || journal->offset != cfg->offset ||
+            journal->image_size != cfg->image_size || journal->confirmed > cfg->image_size ||
+            memcmp(journal->image_md5, image_md5, ESP_LOADER_MD5_DIGEST_SIZE) != 0) {
+        memset(journal, 0, sizeof(*journal));
+        journal->magic = ESP_LOADER_JOURNAL_MAGIC;
+        journal->offset = cfg->offset;
+        journal->image_size = cfg->image_size;
+        memcpy(journal->image_md5, image_md5, ESP_LOADER_MD5_DIGEST_SIZE);
+        *resume = 0;
+        return journal_store(cfg, 0);
+    }
+
+    *resume = journal->confirmed;
+    if (journal->confirmed == 0) {
+        return ESP_LOADER_SUCCESS;
+    }
+
+    const uint32_t check_sectors = MIN(cfg->check_sectors != 0 ? cfg->check_sectors : RESUME_DEFAULT_CHECK_SECTORS,
+                                       RESUME_MAX_CHECK_SECTORS);
+    const uint32_t confirmed_sectors = (journal->confirmed + FLASH_SECTOR_SIZE - 1) / FLASH_SECTOR_SIZE;
+    const uint32_t count = MIN(check_sectors, confirmed_sectors);
+    const uint32_t check_start = (confirmed_sectors - count) * FLASH_SECTOR_SIZE;
+    uint8_t flash_md5[RESUME_MAX_CHECK_SECTORS][ESP_LOADER_MD5_DIGEST_SIZE];
+
+    RETURN_ON_ERROR(esp_loader_flash_fingerprint(loader, cfg->offset + check_start, journal->confirmed - check_start,
+                    FLASH_SECTOR_SIZE, &flash_md5[0][0]));
+
+    for (uint32_t i = 0; i < count; i++) {
+        const uint32_t start = check_start + i * FLASH_SECTOR_SIZE;
+        uint8_t sector_md5[ESP_LOADER_MD5_DIGEST_SIZE];
+        struct MD5Context md5_context;
+
+        MD5Init(&md5_context);
+        MD5Update(&md5_context, &cfg->image[start], MIN(FLASH_SECTOR_SIZE, journal->confirmed - start));
+        MD5Final(sector_md5, &md5_context);
+
+        if (memcmp(sector_md5, flash_md5[i], ESP_LOADER_MD5_DIGEST_SIZE) != 0) {
+            *resume = start;
+            break;
+        }
+    }
+
+    if (cfg->compress) {
+        *resume -= *resume % RESUME_SEGMENT_SIZE;
+    }
+    return *resume != journal->confirmed ? journal_store(cfg, *resume) : ESP_LOADER_SUCCESS;
+}
+
+static uint32_t flash_data_in_flight(const esp_loader_t *loader)
+{
+    return loader->_protocol->data_in_flight != NULL ? loader->_protocol->data_in_flight(loader) : 0;
+}
+
+static esp_loader_error_t resumable_write_raw(esp_loader_t *loader, esp_loader_flash_resumable_cfg_t *cfg,
+        uint32_t resume)
+{
+    esp_loader_flash_cfg_t flash_cfg = {
+        .offset = cfg->offset + resume,
+        .image_size = cfg->image_size - resume,
+        .block_size = cfg->block_size,
+        .skip_verify = true,
+    };
+
+    uint32_t blocks_sent = 0;
+
+    RETURN_ON_ERROR(esp_loader_flash_start(loader, &flash_cfg));
+    for (uint32_t pos = resume; pos < cfg->image_size; pos += cfg->block_size) {
+        RETURN_ON_ERROR(esp_loader_flash_write(loader, &flash_cfg, &cfg->image[pos],
+                                               MIN(cfg->block_size, cfg->image_size - pos)));
+        blocks_sent++;
+
+        // Blocks still waiting for their response, e.g. queued over SDIO, do not count yet.
+        // Only whole sectors do, the write continues from a sector boundary.
+        const uint32_t answered = blocks_sent - flash_data_in_flight(loader);
+        const uint32_t acknowledged = resume + MIN(answered * cfg->block_size, cfg->image_size - resume);
+        const uint32_t confirmed = acknowledged - acknowledged % FLASH_SECTOR_SIZE;
+        if (confirmed > cfg->journal->confirmed) {
+            RETURN_ON_ERROR(journal_store(cfg, confirmed));
+        }
+    }
+
+    // Finishing collects the responses still outstanding
+    RETURN_ON_ERROR(esp_loader_flash_finish(loader, &flash_cfg));
+    return journal_store(cfg, cfg->image_size);
+}
+
+static esp_loader_error_t resumable_write_compressed(esp_loader_t *loader, esp_loader_flash_resumable_cfg_t *cfg,
+        uint32_t resume)
+{
+    for (uint32_t start = resume; start < cfg->image_size; start += RESUME_SEGMENT_SIZE) {
+        const uint32_t size = MIN(RESUME_SEGMENT_SIZE, cfg->image_size - start);
+        uint32_t compressed_size;
+        uint32_t elapsed_ms;
+
+        RETURN_ON_ERROR(deflate_compress(&cfg->image[start], size, NULL, 0, NULL, NULL, &compressed_size));
+        RETURN_ON_ERROR(flash_write_deflated(loader, cfg->offset + start, &cfg->image[start], size, compressed_size,
+                                             cfg->block_size, cfg->block_buffer, &elapsed_ms));
+        RETURN_ON_ERROR(journal_store(cfg, start + size));
+    }
+    return ESP_LOADER_SUCCESS;
+}
+
+esp_loader_error_t esp_loader_flash_write_resumable(esp_loader_t *loader, esp_loader_flash_resumable_cfg_t *cfg)
+{
+    cfg->resumed_from = 0;
+
+    if (cfg->offset % FLASH_SECTOR_SIZE != 0 || cfg->image_size % 4 != 0 || cfg->block_size == 0 ||
+            cfg->journal == NULL || (cfg->compress && cfg->block_buffer == NULL)) {
+        return ESP_LOADER_ERROR_INVALID_PARAM;
+    }
+
+    if (loader->_target == ESP8266_CHIP && !loader->_stub_running) {
+        return ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
+    }
+
+    RETURN_ON_ERROR(init_flash_params(loader));
+    if (cfg->offset + cfg->image_size > loader->_target_flash_size) {
+        return ESP_LOADER_ERROR_IMAGE_SIZE;
+    }
+
+    uint8_t image_md5[ESP_LOADER_MD5_DIGEST_SIZE];
+    struct MD5Context md5_context;
+    MD5Init(&md5_context);
+    MD5Update(&md5_context, cfg->image, cfg->image_size);
+    MD5Final(image_md5, &md5_context);
+
+    uint32_t resume;
+    RETURN_ON_ERROR(resume_point(loader, cfg, image_md5, &resume));
+    cfg->resumed_from = resume;
+
+    if (resume > 0) {
+        LOADER_LOGI(loader, "Resuming flash write at 0x%08" PRIx32 ", %" PRIu32 " of %" PRIu32 " bytes left",
+                    cfg->offset + resume, cfg->image_size - resume, cfg->image_size);
+    }
+
+    if (resume < cfg->image_size) {
+        RETURN_ON_ERROR(cfg->compress ? resumable_write_compressed(loader, cfg, resume)
+                        : resumable_write_raw(loader, cfg, resume));
+    }
+
+    if (cfg->skip_verify) {
+        return ESP_LOADER_SUCCESS;
+    }
+
+    return loader_flash_verify_image(loader, cfg->offset, cfg->image, cfg->image_size);
+}
+
+esp_loader_error_t esp_loader_profile_capture(esp_loader_t *loader, esp_loader_profile_t *profile)
+{
+    if (loader->_target == ESP_UNKNOWN_CHIP) {
+        return ESP_LOADER_ERROR_INVALID_TARGET;
+    }
+    if (loader->_target == ESP8266_CHIP) {
+        return ESP_LOADER_ERROR_UNSUPPORTED_CHIP;
+    }
+
+    memset(profile, 0, sizeof(*profile));
+    profile->target_chip = loader->_target;
+    RETURN_ON_ERROR(loader_read_mac(loader, loader->_target, profile->mac));
+
+    if (loader->_protocol->spi_attach != NULL && !loader->_spi_config_valid) {
+        RETURN_ON_ERROR(loader_read_spi_config(loader, loader->_target, &loader->_spi_config));
+        loader->_spi_config_valid = true;
+    }
+    profile->spi_config = loader->_spi_config;
+
+    if (loader->_target_flash_size == 0 &&
+            esp_loader_flash_detect_size(loader, &loader->_target_flash_size) != ESP_LOADER_SUCCESS) {
+        loader->_target_flash_size = 0;
+    }
+    profile->flash_size = loader->_target_flash_size;
+
+    if (loader->_target == ESP32C2_CHIP && loader->_crystal_freq_mhz == 0 &&
+            loader->_protocol_type == ESP_LOADER_PROTOCOL_SERIAL && loader->_transmission_rate == 0) {
+        uint32_t frequency;
+        RETURN_ON_ERROR(get_crystal_frequency_esp32c2(loader, &frequency));
+        loader->_crystal_freq_mhz = (uint8_t)frequency;
+    }
+    profile->crystal_freq_mhz = loader->_crystal_freq_mhz;
+    profile->transmission_rate = loader->_transmission_rate;
+    profile->magic = ESP_LOADER_PROFILE_MAGIC;
+
+    return ESP_LOADER_SUCCESS;
+}
+
+esp_loader_error_t esp_loader_profile_apply(esp_loader_t *loader, const esp_loader_profile_t *profile)
+{
+    if (profile->magic != ESP_LOADER_PROFILE_MAGIC ||
+            (unsigned)profile->target_chip >= ESP_MAX_CHIP || profile->target_chip == ESP8266_CHIP) {
+        return ESP_LOADER_ERROR_INVALID_PARAM;
+    }
+
+    loader->_target = profile->target_chip;
+    loader->_spi_config = profile->spi_config;
+    loader->_spi_config_valid = true;
+    loader->_target_flash_size = profile->flash_size;
+    loader->_crystal_freq_mhz = profile->crystal_freq_mhz;
+
+    loader->_profile.pending = true;
+    loader->_profile.target = profile->target_chip;
+    loader->_profile.transmission_rate = profile->transmission_rate;
+    memcpy(loader->_profile.mac, profile->mac, sizeof(loader->_profile.mac));
+
+    return ESP_LOADER_SUCCESS;
+}
+
+void esp_loader_get_stats(const esp_loader_t *loader, esp_loader_stats_t *stats)
+{
+    *stats = loader->_stats;
+}
+
+void esp_loader_reset_stats(esp_loader_t *loader)
+{
+    memset(&loader->_stats, 0, sizeof(loader->_stats));
+}
+
 void esp_loader_reset_target(esp_loader_t *loader)
 {
     loader->_stub_running = false;
@@ -331,11 +331,11 @@ esp_loader_error_t loader_read_mac(esp_loader_t *loader, const target_chip_t tar
 {
     const esp_target_t *target = &esp_target[target_code];
 
-    uint32_t part1 = 0;
-    uint32_t part2 = 0;
+    uint32_t words[2];
+    RETURN_ON_ERROR(esp_loader_read_memory(loader, target->efuse_base + target->mac_efuse_offset, 2, words));
 
-    RETURN_ON_ERROR(esp_loader_read_register(loader, target->efuse_base + target->mac_efuse_offset, &part1));
-    RETURN_ON_ERROR(esp_loader_read_register(loader, target->efuse_base + target->mac_efuse_offset + sizeof(uint32_t), &part2));
+    const uint32_t part1 = words[0];
+    const uint32_t part2 = words[1];
 
     mac[0] = (part2 >> 8) & 0xff;
     mac[1] = (part2 >> 0) & 0xff;
@@ -363,9 +363,11 @@ static esp_loader_error_t spi_config_esp32(esp_loader_t *loader, uint32_t efuse_
 {
     *spi_config = 0;
 
-    uint32_t reg5, reg3;
-    RETURN_ON_ERROR( esp_loader_read_register(loader, efuse_word_addr(efuse_base, 5), &reg5) );
-    RETURN_ON_ERROR( esp_loader_read_register(loader, efuse_word_addr(efuse_base, 3), &reg3) );
+    uint32_t words[3];
+    RETURN_ON_ERROR( esp_loader_read_memory(loader, efuse_word_addr(efuse_base, 3), 3, words) );
+
+    const uint32_t reg3 = words[0];
+    const uint32_t reg5 = words[2];
 
     uint32_t pins = reg5 & 0xfffff;
 
@@ -393,9 +395,11 @@ static esp_loader_error_t spi_config_esp32xx(esp_loader_t *loader, uint32_t efus
 {
     *spi_config = 0;
 
-    uint32_t reg1, reg2;
-    RETURN_ON_ERROR( esp_loader_read_register(loader, efuse_word_addr(efuse_base, 18), &reg1) );
-    RETURN_ON_ERROR( esp_loader_read_register(loader, efuse_word_addr(efuse_base, 19), &reg2) );
+    uint32_t words[2];
+    RETURN_ON_ERROR( esp_loader_read_memory(loader, efuse_word_addr(efuse_base, 18), 2, words) );
+
+    const uint32_t reg1 = words[0];
+    const uint32_t reg2 = words[1];
 
     uint32_t pins = ((reg1 >> 16) | ((reg2 & 0xfffff) << 16)) & 0x3fffffff;
 
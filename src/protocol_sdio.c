@@ -48,13 +48,26 @@ static inline esp_loader_error_t sdio_write_bytes(esp_loader_t *loader, uint32_t
                                           port_remaining_time(loader));
 }
 
+static inline bool sdio_has_block_mode(const esp_loader_t *loader)
+{
+    return loader->_port->ops->sdio_write_blocks != NULL && loader->_port->ops->sdio_read_blocks != NULL;
+}
+
+/* Largest block-mode transfer: the CMD53 block count field is 9 bits wide */
+#define SD_MAX_BLOCKS_PER_TRANSFER 511
+
 /* SDIO CCR registers - common to all SDIO devices */
 #define SD_IO_CCCR_FN_ENABLE 0x02
 #define SD_IO_CCR_FN_ENABLE_FUNC1_EN (1 << 1)
 #define SD_IO_CCCR_FN_READY 0x03
+#define SD_IO_CCCR_INT_ENABLE 0x04
+#define SD_IO_CCCR_INT_ENABLE_MASTER (1 << 0)
+#define SD_IO_CCCR_INT_ENABLE_FUNC1 (1 << 1)
 #define SD_IO_CCCR_FN_ID 0x09
 #define SD_IO_CCCR_FN_ID1 0x0A
 #define SD_IO_CCCR_FN_ID2 0x0B
+// Function 1 block size, in the function basic register (FBR) area
+#define SD_IO_FBR1_BLOCK_SIZE 0x110
 
 #define SD_IO_TUPLE_CODE 0x20
 #define SD_IO_TUPLE_SIZE 4
@@ -64,16 +77,80 @@ static inline esp_loader_error_t sdio_write_bytes(esp_loader_t *loader, uint32_t
 
 #define SD_BLOCK_SIZE 512
 
+/* Writes data starting at addr, moving whole blocks in block mode when the
+   port supports it and the rest in byte-mode pieces of at most one block */
+static esp_loader_error_t sdio_write_data(esp_loader_t *loader, uint32_t addr, const void *data, uint32_t size)
+{
+    const uint8_t *src = (const uint8_t *)data;
+
+    while (size > 0) {
+        if (sdio_has_block_mode(loader) && size >= SD_BLOCK_SIZE) {
+            const uint32_t chunk_size = MIN(size / SD_BLOCK_SIZE, SD_MAX_BLOCKS_PER_TRANSFER) * SD_BLOCK_SIZE;
+            LOADER_LOGD(loader, "SDIO W fn=1 addr=0x%04" PRIx32 " blocks=%" PRIu32,
+                        addr, chunk_size / SD_BLOCK_SIZE);
+            LOADER_LOG_HEX(loader, "SDIO TX", src, chunk_size);
+            RETURN_ON_ERROR(loader->_port->ops->sdio_write_blocks(loader->_port, 1, addr, src, chunk_size,
+                            port_remaining_time(loader)));
+            addr += chunk_size;
+            src += chunk_size;
+            size -= chunk_size;
+        } else {
+            const uint16_t chunk_size = (uint16_t)MIN(SD_BLOCK_SIZE, size);
+            RETURN_ON_ERROR(sdio_write_bytes(loader, 1, addr, src, chunk_size));
+            addr += chunk_size;
+            src += chunk_size;
+            size -= chunk_size;
+        }
+    }
+
+    return ESP_LOADER_SUCCESS;
+}
+
+static esp_loader_error_t sdio_read_data(esp_loader_t *loader, uint32_t addr, void *data, uint32_t size)
+{
+    uint8_t *dest = (uint8_t *)data;
+
+    while (size > 0) {
+        if (sdio_has_block_mode(loader) && size >= SD_BLOCK_SIZE) {
+            const uint32_t chunk_size = MIN(size / SD_BLOCK_SIZE, SD_MAX_BLOCKS_PER_TRANSFER) * SD_BLOCK_SIZE;
+            RETURN_ON_ERROR(loader->_port->ops->sdio_read_blocks(loader->_port, 1, addr, dest, chunk_size,
+                            port_remaining_time(loader)));
+            LOADER_LOGD(loader, "SDIO R fn=1 addr=0x%04" PRIx32 " blocks=%" PRIu32,
+                        addr, chunk_size / SD_BLOCK_SIZE);
+            LOADER_LOG_HEX(loader, "SDIO RX", dest, chunk_size);
+            addr += chunk_size;
+            dest += chunk_size;
+            size -= chunk_size;
+        } else {
+            const uint16_t chunk_size = (uint16_t)MIN(SD_BLOCK_SIZE, size);
+            RETURN_ON_ERROR(sdio_read_bytes(loader, 1, addr, dest, chunk_size));
+            addr += chunk_size;
+            dest += chunk_size;
+            size -= chunk_size;
+        }
+    }
+
+    return ESP_LOADER_SUCCESS;
+}
+
 /* Stub defines */
 // CONF_W0: stub writes total packet length here before each DMA send (func 1, addr 0x6C)
 #define STUB_CONF_W0_REG 0x006C
 #define STUB_TOKEN_RDATA_REG 0x0044
 #define STUB_INT_ST_REG 0x0058
 #define STUB_INT_CLR_REG 0x00D4
+#define STUB_INT_ENA_REG 0x00DC
 #define STUB_INT_NEW_PKT (1 << 23)
 #define STUB_MAX_TRANSACTION_SIZE 16647
 #define STUB_BOOT_TIMEOUT 500
 #define STUB_DEFAULT_TIMEOUT 200
+// Commands that may be written before their responses are collected
+#define SDIO_MAX_INFLIGHT (sizeof(((esp_loader_t *)0)->_proto_ctx.sdio.inflight) / \
+                           sizeof(((esp_loader_t *)0)->_proto_ctx.sdio.inflight[0]))
+// Time allowed for the stub to write one queued flash data packet and answer it
+#define STUB_DATA_RESPONSE_TIMEOUT 3000
+// Upper bound for a single interrupt wait, so a missed interrupt only costs this much latency
+#define STUB_INT_WAIT_SLICE_MS 50
 
 #define SDIO_RESPONSE_MAX_SIZE (sizeof(common_response_t) + MAX_RESP_DATA_SIZE + sizeof(response_status_t))
 
@@ -259,6 +336,13 @@ static esp_loader_error_t slave_init_io(esp_loader_t *loader)
         return ESP_LOADER_ERROR_FAIL;
     }
 
+    // Block-mode transfers on function 1 use the block size from its FBR
+    if (sdio_has_block_mode(loader)) {
+        const uint8_t block_size[2] = { SD_BLOCK_SIZE & 0xFF, SD_BLOCK_SIZE >> 8 };
+        RETURN_ON_ERROR(sdio_write_bytes(loader, 0, SD_IO_FBR1_BLOCK_SIZE, &block_size[0], 1));
+        RETURN_ON_ERROR(sdio_write_bytes(loader, 0, SD_IO_FBR1_BLOCK_SIZE + 1, &block_size[1], 1));
+    }
+
     return ESP_LOADER_SUCCESS;
 }
 
@@ -336,6 +420,92 @@ static esp_loader_error_t slave_init_link(esp_loader_t *loader)
     expected_val = reg;
     RETURN_ON_ERROR(slave_write_register(loader, esp_sdio_target[loader->_target].slc_len_conf_addr, reg));
 
+    // Route the new packet interrupt to DAT1 so responses need not be polled for
+    loader->_proto_ctx.sdio.int_enabled = false;
+    if (loader->_port->ops->sdio_wait_interrupt != NULL) {
+        const uint32_t int_ena = STUB_INT_NEW_PKT;
+        RETURN_ON_ERROR(sdio_write_bytes(loader, 1, STUB_INT_ENA_REG, &int_ena, sizeof(int_ena)));
+
+        const uint8_t cccr_int_ena = SD_IO_CCCR_INT_ENABLE_MASTER | SD_IO_CCCR_INT_ENABLE_FUNC1;
+        RETURN_ON_ERROR(sdio_write_bytes(loader, 0, SD_IO_CCCR_INT_ENABLE, &cccr_int_ena, sizeof(cccr_int_ena)));
+
+        loader->_proto_ctx.sdio.int_enabled = true;
+    }
+
+    return ESP_LOADER_SUCCESS;
+}
+
+static void sdio_count_poll(esp_loader_t *loader)
+{
+    loader->_stats.status_polls++;
+    if (++loader->_proto_ctx.sdio.cmd_polls > loader->_stats.max_polls_per_command) {
+        loader->_stats.max_polls_per_command = loader->_proto_ctx.sdio.cmd_polls;
+    }
+}
+
+static void sdio_disable_int(esp_loader_t *loader)
+{
+    LOADER_LOGW(loader, "SDIO interrupts not delivered, polling for responses");
+    loader->_proto_ctx.sdio.int_enabled = false;
+}
+
+/* Buffers making up the largest packet, the SIP header, command and payload, plus padding */
+#define SDIO_PACKET_MAX_IOV 4
+
+/* Writes one packet gathered from several buffers. The slave takes a packet
+   to end where the write address reaches the end of its packet space, so the
+   buffers go out back-to-back at addresses ending there, straight from the
+   caller's memory. Ports without scatter-gather writes get packets that fit
+   a SIP packet copied into one write, and larger ones a write per buffer.
+   With pad_to_word set, zeros are appended up to a whole number of words,
+   as the ROM loader requires of SIP packets. */
+static esp_loader_error_t sdio_write_packet(esp_loader_t *loader, const esp_loader_iovec_t *segments,
+        uint32_t count, bool pad_to_word)
+{
+    static const uint8_t padding[3] = {0};
+    esp_loader_iovec_t iov[SDIO_PACKET_MAX_IOV];
+    uint32_t total_size = 0;
+
+    assert(count < SDIO_PACKET_MAX_IOV);
+
+    for (uint32_t i = 0; i < count; i++) {
+        iov[i] = segments[i];
+        total_size += segments[i].size;
+    }
+    if (pad_to_word && total_size % 4 != 0) {
+        iov[count].data = padding;
+        iov[count].size = 4 - total_size % 4;
+        total_size += iov[count].size;
+        count++;
+    }
+
+    uint32_t addr = esp_sdio_target[loader->_target].slchost_packet_space_end - total_size;
+
+    if (loader->_port->ops->sdio_writev != NULL) {
+        LOADER_LOGD(loader, "SDIO W fn=1 addr=0x%04" PRIx32 " size=%" PRIu32 " iovcnt=%" PRIu32,
+                    addr, total_size, count);
+        for (uint32_t i = 0; i < count; i++) {
+            LOADER_LOG_HEX(loader, "SDIO TX", iov[i].data, iov[i].size);
+        }
+        return loader->_port->ops->sdio_writev(loader->_port, 1, addr, iov, count, port_remaining_time(loader));
+    }
+
+    // Without scatter-gather, gather packets that fit a SIP packet here to write them in one go
+    if (total_size <= SIP_PACKET_SIZE) {
+        uint32_t frame[SIP_PACKET_SIZE / 4];
+        uint32_t offset = 0;
+        for (uint32_t i = 0; i < count; i++) {
+            memcpy((uint8_t *)frame + offset, iov[i].data, iov[i].size);
+            offset += iov[i].size;
+        }
+        return sdio_write_data(loader, addr, frame, total_size);
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        RETURN_ON_ERROR(sdio_write_data(loader, addr, iov[i].data, iov[i].size));
+        addr += iov[i].size;
+    }
+
     return ESP_LOADER_SUCCESS;
 }
 
@@ -343,13 +513,18 @@ static esp_loader_error_t sip_upload_ram_segment(esp_loader_t *loader, const uin
         const uint8_t *data, const uint32_t size)
 {
     loader->_port->ops->start_timer(loader->_port, STUB_DEFAULT_TIMEOUT);
-    RETURN_ON_ERROR(slave_wait_ready(loader));
 
-    uint8_t packet[SIP_PACKET_SIZE];
-    int32_t remaining = size;
-    while (remaining > 0) {
-        const uint32_t nondata_size = sizeof(sip_header_t) + sizeof(sip_cmd_write_memory);
-        const uint32_t data_size = ROUNDUP(MIN(remaining, SIP_PACKET_SIZE - nondata_size), 4);
+    const uint32_t nondata_size = sizeof(sip_header_t) + sizeof(sip_cmd_write_memory);
+    /* Keep the payload of large packets a whole number of SDIO blocks */
+    uint32_t max_data_size = SIP_PACKET_SIZE - nondata_size;
+    if (max_data_size >= SD_BLOCK_SIZE) {
+        max_data_size -= max_data_size % SD_BLOCK_SIZE;
+    }
+
+    uint32_t offset = 0;
+    while (offset < size) {
+        const uint32_t chunk_size = MIN(size - offset, max_data_size);
+        const uint32_t data_size = ROUNDUP(chunk_size, 4);
 
         const sip_header_t header = {
             .fc[0] = SIP_PACKET_TYPE_CTRL & SIP_TYPE_MASK,
@@ -360,23 +535,18 @@ static esp_loader_error_t sip_upload_ram_segment(esp_loader_t *loader, const uin
         };
 
         const sip_cmd_write_memory cmd = {
-            .addr = addr + size - remaining,
+            .addr = addr + offset,
             .len = data_size,
         };
 
-        memcpy(&packet[0], &header, sizeof(header));
-        memcpy(&packet[sizeof(header)], &cmd, sizeof(cmd));
-        memcpy(
-            &packet[sizeof(header) + sizeof(cmd)],
-            &data[size - remaining],
-            data_size
-        );
-
-        RETURN_ON_ERROR(sdio_write_bytes(loader, 1,
-                                         esp_sdio_target[loader->_target].slchost_packet_space_end - header.len,
-                                         packet, header.len));
+        const esp_loader_iovec_t segments[] = {
+            { &header, sizeof(header) },
+            { &cmd, sizeof(cmd) },
+            { &data[offset], chunk_size },
+        };
+        RETURN_ON_ERROR(sdio_write_packet(loader, segments, sizeof(segments) / sizeof(segments[0]), true));
 
-        remaining -= data_size;
+        offset += chunk_size;
         loader->_proto_ctx.sdio.sip_seq_tx++;
     }
 
@@ -391,20 +561,18 @@ static esp_loader_error_t sip_run_ram_code(esp_loader_t *loader, const uint32_t
     const sip_header_t header = {
         .fc[0] = SIP_PACKET_TYPE_CTRL & SIP_TYPE_MASK,
         .fc[1] = SIP_HDR_F_SYNC,
-        .len = sizeof(sip_header_t) + sizeof(sip_cmd_write_memory),
+        .len = sizeof(sip_header_t) + sizeof(sip_cmd_bootup),
         .sequence_num = 0,
         .u.tx_info.u.cmdid = SIP_CMD_ID_BOOTUP,
     };
 
     const sip_cmd_bootup cmd = { .boot_addr = entrypoint, .discard_link = 1};
-    uint8_t packet[sizeof(header) + sizeof(cmd)];
-
-    memcpy(&packet[0], &header, sizeof(header));
-    memcpy(&packet[sizeof(header)], &cmd, sizeof(cmd));
 
-    return sdio_write_bytes(loader, 1,
-                            esp_sdio_target[loader->_target].slchost_packet_space_end - header.len,
-                            packet, header.len);
+    const esp_loader_iovec_t segments[] = {
+        { &header, sizeof(header) },
+        { &cmd, sizeof(cmd) },
+    };
+    return sdio_write_packet(loader, segments, sizeof(segments) / sizeof(segments[0]), true);
 }
 
 static const esp_stub_t *sdio_get_stub(target_chip_t target)
@@ -427,19 +595,39 @@ static esp_loader_error_t sdio_read_stub_packet(esp_loader_t *loader, uint8_t *d
 {
     uint32_t interrupt_status = 0;
     uint32_t poll_count = 0;
+    bool int_wait_timed_out = false;
 
-    do {
+    for (;;) {
         if (port_remaining_time(loader) == 0) {
             return ESP_LOADER_ERROR_TIMEOUT;
         }
 
         RETURN_ON_ERROR(sdio_read_bytes(loader, 1, STUB_INT_ST_REG, &interrupt_status, sizeof(interrupt_status)));
+        sdio_count_poll(loader);
+
+        if ((interrupt_status & STUB_INT_NEW_PKT) != 0) {
+            // A packet that was pending while the wait timed out means the interrupt never made it to the host
+            if (int_wait_timed_out) {
+                sdio_disable_int(loader);
+            }
+            break;
+        }
 
-        // Long-running commands such as chip erase can take seconds; avoid a hot poll loop.
-        if ((interrupt_status & STUB_INT_NEW_PKT) == 0 && ++poll_count > 10000) {
+        if (loader->_proto_ctx.sdio.int_enabled) {
+            loader->_stats.interrupt_waits++;
+            esp_loader_error_t err = loader->_port->ops->sdio_wait_interrupt(loader->_port,
+                                     MIN(port_remaining_time(loader), STUB_INT_WAIT_SLICE_MS));
+            int_wait_timed_out = (err == ESP_LOADER_ERROR_TIMEOUT);
+            if (err == ESP_LOADER_ERROR_UNSUPPORTED_FUNC) {
+                sdio_disable_int(loader);
+            } else if (err != ESP_LOADER_SUCCESS && err != ESP_LOADER_ERROR_TIMEOUT) {
+                return err;
+            }
+        } else if (++poll_count > 10000) {
+            // Long-running commands such as chip erase can take seconds; avoid a hot poll loop.
             loader->_port->ops->delay_ms(loader->_port, 10);
         }
-    } while ((interrupt_status & STUB_INT_NEW_PKT) == 0);
+    }
 
     uint32_t packet_size = 0;
     RETURN_ON_ERROR(sdio_read_bytes(loader, 1, STUB_CONF_W0_REG, &packet_size, sizeof(packet_size)));
@@ -452,14 +640,7 @@ static esp_loader_error_t sdio_read_stub_packet(esp_loader_t *loader, uint8_t *d
 
     const uint32_t packet_addr = esp_sdio_target[loader->_target].slchost_packet_space_end - packet_size;
 
-    uint32_t bytes_read = 0;
-    while (bytes_read < packet_size) {
-        const uint16_t chunk_size = (uint16_t)MIN(SD_BLOCK_SIZE, packet_size - bytes_read);
-
-        RETURN_ON_ERROR(sdio_read_bytes(loader, 1, packet_addr + bytes_read, dest + bytes_read, chunk_size));
-
-        bytes_read += chunk_size;
-    }
+    RETURN_ON_ERROR(sdio_read_data(loader, packet_addr, dest, packet_size));
 
     RETURN_ON_ERROR(sdio_write_bytes(loader, 1, STUB_INT_CLR_REG, &clr, sizeof(clr)));
 
@@ -498,6 +679,8 @@ static esp_loader_error_t slave_upload_stub(esp_loader_t *loader)
     }
 
     loader->_stub_running = true;
+    loader->_stub_segments = stub->segments;
+    loader->_stub_segment_count = sizeof(stub->segments) / sizeof(stub->segments[0]);
     return ESP_LOADER_SUCCESS;
 }
 
@@ -514,6 +697,9 @@ static esp_loader_error_t sdio_initialize_conn(esp_loader_t *loader, esp_loader_
 {
 
     loader->_proto_ctx.sdio.sip_seq_tx = 0;
+    loader->_proto_ctx.sdio.inflight_head = 0;
+    loader->_proto_ctx.sdio.inflight_count = 0;
+    loader->_proto_ctx.sdio.deferred_err = ESP_LOADER_SUCCESS;
 
     RETURN_ON_ERROR(initialize_connection(loader, connect_args));
 
@@ -524,6 +710,18 @@ static esp_loader_error_t sdio_initialize_conn(esp_loader_t *loader, esp_loader_
     return ESP_LOADER_SUCCESS;
 }
 
+/* Checks once whether the slave has room for a packet of the given size */
+static esp_loader_error_t sdio_rx_space_available(esp_loader_t *loader, uint32_t transaction_size, bool *available)
+{
+    uint32_t token_rdata = 0;
+    RETURN_ON_ERROR(sdio_read_bytes(loader, 1, STUB_TOKEN_RDATA_REG, &token_rdata, sizeof(token_rdata)));
+    sdio_count_poll(loader);
+
+    const uint32_t token1 = (token_rdata >> 16) & 0x0FFFU;
+    *available = token1 * SD_BLOCK_SIZE >= transaction_size;
+    return ESP_LOADER_SUCCESS;
+}
+
 static esp_loader_error_t sdio_wait_rx_space(esp_loader_t *loader, uint32_t transaction_size)
 {
     for (;;) {
@@ -531,11 +729,9 @@ static esp_loader_error_t sdio_wait_rx_space(esp_loader_t *loader, uint32_t tran
             return ESP_LOADER_ERROR_TIMEOUT;
         }
 
-        uint32_t token_rdata = 0;
-        RETURN_ON_ERROR(sdio_read_bytes(loader, 1, STUB_TOKEN_RDATA_REG, &token_rdata, sizeof(token_rdata)));
-
-        uint32_t token1 = (token_rdata >> 16) & 0x0FFFU;
-        if (token1 * SD_BLOCK_SIZE >= transaction_size) {
+        bool available = false;
+        RETURN_ON_ERROR(sdio_rx_space_available(loader, transaction_size, &available));
+        if (available) {
             return ESP_LOADER_SUCCESS;
         }
 
@@ -558,16 +754,16 @@ static esp_loader_error_t sdio_check_response(esp_loader_t *loader, const send_c
     command_t command = ((const command_common_t *)config->cmd)->command;
     uint8_t response_buf[SDIO_RESPONSE_MAX_SIZE];
     size_t response_len = 0;
-    RETURN_ON_ERROR(sdio_read_stub_packet(loader, response_buf, sizeof(response_buf), &response_len));
+    common_response_t *response = (common_response_t *)response_buf;
 
-    if (response_len < sizeof(common_response_t) + sizeof(response_status_t)) {
-        return ESP_LOADER_ERROR_INVALID_RESPONSE;
-    }
+    // Responses to other commands are late replies left behind by a timeout
+    do {
+        RETURN_ON_ERROR(sdio_read_stub_packet(loader, response_buf, sizeof(response_buf), &response_len));
 
-    common_response_t *response = (common_response_t *)response_buf;
-    if (response->direction != READ_DIRECTION || response->command != command) {
-        return ESP_LOADER_ERROR_INVALID_RESPONSE;
-    }
+        if (response_len < sizeof(common_response_t) + sizeof(response_status_t)) {
+            return ESP_LOADER_ERROR_INVALID_RESPONSE;
+        }
+    } while (response->direction != READ_DIRECTION || response->command != command);
 
     response_status_t *status = (response_status_t *)(response_buf + response_len - sizeof(response_status_t));
 
@@ -596,48 +792,224 @@ static esp_loader_error_t sdio_check_response(esp_loader_t *loader, const send_c
     return ESP_LOADER_SUCCESS;
 }
 
-static esp_loader_error_t sdio_send_cmd(esp_loader_t *loader, const send_cmd_config *config)
+static esp_loader_error_t sdio_write_cmd_packet(esp_loader_t *loader, const send_cmd_config *config)
 {
-    const uint32_t total_len = config->cmd_size + config->data_size;
     LOADER_LOGD(loader, "CMD -> %s (0x%02x)",
                 loader_command_name(((const command_common_t *)config->cmd)->command),
                 (unsigned)((const command_common_t *)config->cmd)->command);
 
+    loader->_stats.commands++;
+    loader->_proto_ctx.sdio.cmd_polls = 0;
+
+    const esp_loader_iovec_t segments[] = {
+        { config->cmd, config->cmd_size },
+        { config->data, config->data != NULL ? config->data_size : 0 },
+    };
+    return sdio_write_packet(loader, segments, sizeof(segments) / sizeof(segments[0]), false);
+}
+
+static void sdio_inflight_push(esp_loader_t *loader, const send_cmd_config *config, bool internal)
+{
+    const command_common_t *common = (const command_common_t *)config->cmd;
+    const uint32_t index = (loader->_proto_ctx.sdio.inflight_head + loader->_proto_ctx.sdio.inflight_count)
+                           % SDIO_MAX_INFLIGHT;
+
+    loader->_proto_ctx.sdio.inflight[index].command = common->command;
+    loader->_proto_ctx.sdio.inflight[index].internal = internal;
+    loader->_proto_ctx.sdio.inflight[index].sequence_number =
+        internal ? ((const data_command_t *)config->cmd)->sequence_number : 0;
+    loader->_proto_ctx.sdio.inflight_count++;
+}
+
+/* Forgets every command in flight. A response that still arrives is skipped
+   as belonging to another command, or answers a data packet nobody waits for. */
+static void sdio_inflight_reset(esp_loader_t *loader)
+{
+    loader->_proto_ctx.sdio.inflight_head = 0;
+    loader->_proto_ctx.sdio.inflight_count = 0;
+}
+
+static void sdio_inflight_pop(esp_loader_t *loader)
+{
+    loader->_proto_ctx.sdio.inflight_head = (loader->_proto_ctx.sdio.inflight_head + 1) % SDIO_MAX_INFLIGHT;
+    loader->_proto_ctx.sdio.inflight_count--;
+}
+
+/* Collects the response to the oldest queued flash data packet. Data responses
+   carry no sequence number, but the stub answers packets in order and rejects
+   any out of sequence, so the response belongs to the oldest sequence number
+   queued, which must be the one after the last answered. A failed packet is
+   remembered and reported by the following commands, as the call that queued
+   it has already returned. */
+static esp_loader_error_t sdio_collect_data_response(esp_loader_t *loader)
+{
+    const uint32_t head = loader->_proto_ctx.sdio.inflight_head;
+    const uint32_t sequence_number = loader->_proto_ctx.sdio.inflight[head].sequence_number;
+    const command_common_t expected = {
+        .direction = WRITE_DIRECTION,
+        .command = loader->_proto_ctx.sdio.inflight[head].command,
+    };
+    const send_cmd_config config = {
+        .cmd = &expected,
+        .cmd_size = sizeof(expected),
+    };
+
+    esp_loader_error_t err = ESP_LOADER_ERROR_INVALID_RESPONSE;
+    if (sequence_number == loader->_proto_ctx.sdio.next_data_sequence) {
+        loader->_port->ops->start_timer(loader->_port, STUB_DATA_RESPONSE_TIMEOUT);
+        err = sdio_check_response(loader, &config);
+    }
+
+    if (err != ESP_LOADER_SUCCESS && loader->_proto_ctx.sdio.deferred_err == ESP_LOADER_SUCCESS) {
+        LOADER_LOGE(loader, "Queued data packet %" PRIu32 " %s", sequence_number,
+                    err == ESP_LOADER_ERROR_TIMEOUT ? "was not answered" : "was rejected");
+        loader->_proto_ctx.sdio.deferred_err = err;
+    }
+
+    // Nothing after a lost response can be paired any more
+    if (err == ESP_LOADER_ERROR_TIMEOUT) {
+        sdio_inflight_reset(loader);
+        return err;
+    }
+
+    loader->_proto_ctx.sdio.next_data_sequence = sequence_number + 1;
+    sdio_inflight_pop(loader);
+    return ESP_LOADER_SUCCESS;
+}
+
+/* Collects every queued flash data response, leaving the caller's timer as it was */
+static esp_loader_error_t sdio_drain_data_responses(esp_loader_t *loader)
+{
+    if (loader->_proto_ctx.sdio.inflight_count == 0 ||
+            !loader->_proto_ctx.sdio.inflight[loader->_proto_ctx.sdio.inflight_head].internal) {
+        return ESP_LOADER_SUCCESS;
+    }
+
+    const uint32_t remaining = port_remaining_time(loader);
+
+    while (loader->_proto_ctx.sdio.inflight_count > 0 &&
+            loader->_proto_ctx.sdio.inflight[loader->_proto_ctx.sdio.inflight_head].internal) {
+        RETURN_ON_ERROR(sdio_collect_data_response(loader));
+    }
+
+    loader->_port->ops->start_timer(loader->_port, remaining);
+    return ESP_LOADER_SUCCESS;
+}
+
+/* Queues a FLASH_DATA/FLASH_DEFL_DATA packet without waiting for its response,
+   as long as the slave has buffer credits and the queue has room */
+static esp_loader_error_t sdio_queue_data_cmd(esp_loader_t *loader, const send_cmd_config *config)
+{
+    const uint32_t total_len = config->cmd_size + config->data_size;
+    const uint32_t remaining = port_remaining_time(loader);
+
+    RETURN_ON_ERROR(loader->_proto_ctx.sdio.deferred_err);
+
+    for (;;) {
+        if (loader->_proto_ctx.sdio.inflight_count < SDIO_MAX_INFLIGHT) {
+            bool available = false;
+            RETURN_ON_ERROR(sdio_rx_space_available(loader, total_len, &available));
+            if (available) {
+                break;
+            }
+        }
+
+        if (loader->_proto_ctx.sdio.inflight_count == 0) {
+            RETURN_ON_ERROR(sdio_wait_rx_space(loader, total_len));
+            break;
+        }
+
+        // Out of credits or queue slots: retiring the oldest packet frees both
+        RETURN_ON_ERROR(sdio_collect_data_response(loader));
+        loader->_port->ops->start_timer(loader->_port, remaining);
+        RETURN_ON_ERROR(loader->_proto_ctx.sdio.deferred_err);
+    }
+
+    RETURN_ON_ERROR(sdio_write_cmd_packet(loader, config));
+    sdio_inflight_push(loader, config, true);
+    return ESP_LOADER_SUCCESS;
+}
+
+static esp_loader_error_t sdio_send_cmd(esp_loader_t *loader, const send_cmd_config *config)
+{
+    const uint32_t total_len = config->cmd_size + config->data_size;
+    const command_t command = ((const command_common_t *)config->cmd)->command;
+
     if (total_len > STUB_MAX_TRANSACTION_SIZE) {
         return ESP_LOADER_ERROR_INVALID_PARAM;
     }
+
+    if (loader->_stub_running && (command == FLASH_DATA || command == FLASH_DEFL_DATA)) {
+        return sdio_queue_data_cmd(loader, config);
+    }
+
+    RETURN_ON_ERROR(sdio_drain_data_responses(loader));
+
+    // A new flash operation starts with a clean slate; anything else reports a pending failure
+    if (command == FLASH_BEGIN || command == FLASH_DEFL_BEGIN) {
+        loader->_proto_ctx.sdio.deferred_err = ESP_LOADER_SUCCESS;
+        loader->_proto_ctx.sdio.next_data_sequence = 0;
+    } else if (loader->_proto_ctx.sdio.deferred_err != ESP_LOADER_SUCCESS) {
+        return loader->_proto_ctx.sdio.deferred_err;
+    }
+
     RETURN_ON_ERROR(sdio_wait_rx_space(loader, total_len));
+    RETURN_ON_ERROR(sdio_write_cmd_packet(loader, config));
 
-    const uint32_t packet_base = esp_sdio_target[loader->_target].slchost_packet_space_end - total_len;
+    return sdio_check_response(loader, config);
+}
 
-    uint32_t bytes_sent = 0;
-    while (bytes_sent < config->cmd_size) {
-        const uint16_t chunk_size = (uint16_t)MIN(SD_BLOCK_SIZE, config->cmd_size - bytes_sent);
+static esp_loader_error_t sdio_write_cmd(esp_loader_t *loader, const send_cmd_config *config)
+{
+    const uint32_t total_len = config->cmd_size + config->data_size;
 
-        RETURN_ON_ERROR(sdio_write_bytes(loader, 1, packet_base + bytes_sent,
-                                         (const uint8_t *)config->cmd + bytes_sent, chunk_size));
+    if (total_len > STUB_MAX_TRANSACTION_SIZE) {
+        return ESP_LOADER_ERROR_INVALID_PARAM;
+    }
 
-        bytes_sent += chunk_size;
+    RETURN_ON_ERROR(sdio_drain_data_responses(loader));
+    RETURN_ON_ERROR(loader->_proto_ctx.sdio.deferred_err);
+
+    if (loader->_proto_ctx.sdio.inflight_count == SDIO_MAX_INFLIGHT) {
+        return ESP_LOADER_ERROR_INVALID_PARAM;
     }
 
-    if (config->data != NULL && config->data_size > 0) {
-        bytes_sent = 0;
-        while (bytes_sent < config->data_size) {
-            const uint16_t chunk_size = (uint16_t)MIN(SD_BLOCK_SIZE, config->data_size - bytes_sent);
+    RETURN_ON_ERROR(sdio_wait_rx_space(loader, total_len));
+    RETURN_ON_ERROR(sdio_write_cmd_packet(loader, config));
+    sdio_inflight_push(loader, config, false);
+    return ESP_LOADER_SUCCESS;
+}
 
-            RETURN_ON_ERROR(sdio_write_bytes(loader, 1,
-                                             packet_base + config->cmd_size + bytes_sent,
-                                             (const uint8_t *)config->data + bytes_sent,
-                                             chunk_size));
+/* Queued flash data packets are always the oldest entries */
+static uint32_t sdio_data_in_flight(const esp_loader_t *loader)
+{
+    uint32_t count = 0;
+    while (count < loader->_proto_ctx.sdio.inflight_count &&
+            loader->_proto_ctx.sdio.inflight[(loader->_proto_ctx.sdio.inflight_head + count) % SDIO_MAX_INFLIGHT].internal) {
+        count++;
+    }
+    return count;
+}
 
-            bytes_sent += chunk_size;
-        }
+static esp_loader_error_t sdio_read_response(esp_loader_t *loader, const send_cmd_config *config)
+{
+    if (loader->_proto_ctx.sdio.inflight_count == 0) {
+        return ESP_LOADER_ERROR_INVALID_PARAM;
     }
 
-    return sdio_check_response(loader, config);
+    // The entry is retired even on failure, the response has been consumed.
+    // After a timeout the order is lost, so every entry goes.
+    esp_loader_error_t err = sdio_check_response(loader, config);
+    if (err == ESP_LOADER_ERROR_TIMEOUT) {
+        sdio_inflight_reset(loader);
+    } else {
+        sdio_inflight_pop(loader);
+    }
+    return err;
 }
 
-// Temporary functions until the new stub is ready and placed at the end of RAM (ESPTOOL-1058).
+// Only used while the ROM loader is active, or when the RAM image overlaps the stub;
+// otherwise esp_loader_mem_start() sends MEM_* commands to the running stub directly.
 static esp_loader_error_t sdio_mem_begin_cmd(esp_loader_t *loader, uint32_t offset, uint32_t size,
         uint32_t blocks_to_write, uint32_t block_size)
 {
@@ -646,16 +1018,19 @@ static esp_loader_error_t sdio_mem_begin_cmd(esp_loader_t *loader, uint32_t offs
     (void)block_size;
     (void)size;
 
-    // Necessary as the stub is always uploaded during initialization, but is placed at the beginning of RAM.
-    // Loaded RAM app would have to be created with the stub in mind, so we just enter bootloader and reinitialize.
-    // This will be fixed when the stub is placed at the end of RAM (ESPTOOL-1058).
+    // The image would overwrite the running stub, so go back to the ROM loader.
     if (loader->_stub_running) {
         esp_loader_connect_args_t connect_config = ESP_LOADER_CONNECT_DEFAULT();
         loader->_port->ops->enter_bootloader(loader->_port);
         RETURN_ON_ERROR(initialize_connection(loader, &connect_config));
         RETURN_ON_ERROR(slave_init_link(loader));
         loader->_stub_running = false;
+        sdio_inflight_reset(loader);
     }
+
+    loader->_port->ops->start_timer(loader->_port, STUB_DEFAULT_TIMEOUT);
+    RETURN_ON_ERROR(slave_wait_ready(loader));
+
     loader->_proto_ctx.sdio.mem_offset = offset;
     return ESP_LOADER_SUCCESS;
 }
@@ -678,11 +1053,15 @@ const esp_loader_protocol_ops_t sdio_protocol_ops = {
     .initialize_conn   = sdio_initialize_conn,
     .send_cmd          = sdio_send_cmd,
     .spi_attach        = NULL,
+    .set_line_mode     = NULL,
     .recv_stub_packet  = sdio_read_stub_packet,
     .send_stub_ack     = sdio_send_stub_ack,
     .mem_begin_cmd     = sdio_mem_begin_cmd,
     .mem_data_cmd      = sdio_mem_data_cmd,
     .mem_end_cmd       = sdio_mem_end_cmd,
+    .write_cmd         = sdio_write_cmd,
+    .read_response     = sdio_read_response,
+    .data_in_flight    = sdio_data_in_flight,
 };
 
 const esp_loader_protocol_ops_t *esp_loader_get_sdio_ops(void)
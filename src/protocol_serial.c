@@ -426,6 +426,49 @@ esp_loader_error_t loader_md5_cmd(esp_loader_t *loader, uint32_t address, uint32
 }
 
 
+esp_loader_error_t loader_md5_cmd_send(esp_loader_t *loader, uint32_t address, uint32_t size)
+{
+    spi_flash_md5_command_t md5_cmd = {
+        .common = {
+            .direction = WRITE_DIRECTION,
+            .command = SPI_FLASH_MD5,
+            .size = CMD_SIZE(md5_cmd),
+            .checksum = 0
+        },
+        .address = address,
+        .size = size,
+        .reserved_0 = 0,
+        .reserved_1 = 0
+    };
+
+    const send_cmd_config cmd_config = {
+        .cmd = &md5_cmd,
+        .cmd_size = sizeof(md5_cmd),
+    };
+
+    return loader->_protocol->write_cmd(loader, &cmd_config);
+}
+
+
+esp_loader_error_t loader_md5_cmd_recv(esp_loader_t *loader, uint8_t *md5_out)
+{
+    // Only the command field is used to match the response
+    const command_common_t expected = {
+        .direction = WRITE_DIRECTION,
+        .command = SPI_FLASH_MD5,
+    };
+
+    const send_cmd_config cmd_config = {
+        .cmd = &expected,
+        .cmd_size = sizeof(expected),
+        .resp_data = md5_out,
+        .resp_data_size = loader->_stub_running ? MD5_SIZE_STUB : MD5_SIZE_ROM,
+    };
+
+    return loader->_protocol->read_response(loader, &cmd_config);
+}
+
+
 esp_loader_error_t loader_spi_parameters(esp_loader_t *loader, uint32_t total_size)
 {
 
@@ -576,6 +619,70 @@ esp_loader_error_t loader_read_reg_cmd(esp_loader_t *loader, uint32_t address, u
 }
 
 
+esp_loader_error_t loader_write_reg_cmd_send(esp_loader_t *loader, uint32_t address, uint32_t value,
+        uint32_t mask, uint32_t delay_us)
+{
+    write_reg_command_t write_cmd = {
+        .common = {
+            .direction = WRITE_DIRECTION,
+            .command = WRITE_REG,
+            .size = CMD_SIZE(write_cmd),
+            .checksum = 0
+        },
+        .address = address,
+        .value = value,
+        .mask = mask,
+        .delay_us = delay_us
+    };
+
+    const send_cmd_config cmd_config = {
+        .cmd = &write_cmd,
+        .cmd_size = sizeof(write_cmd),
+    };
+
+    return loader->_protocol->write_cmd(loader, &cmd_config);
+}
+
+
+esp_loader_error_t loader_read_reg_cmd_send(esp_loader_t *loader, uint32_t address)
+{
+    read_reg_command_t read_cmd = {
+        .common = {
+            .direction = WRITE_DIRECTION,
+            .command = READ_REG,
+            .size = CMD_SIZE(read_cmd),
+            .checksum = 0
+        },
+        .address = address,
+    };
+
+    const send_cmd_config cmd_config = {
+        .cmd = &read_cmd,
+        .cmd_size = sizeof(read_cmd),
+    };
+
+    return loader->_protocol->write_cmd(loader, &cmd_config);
+}
+
+
+esp_loader_error_t loader_reg_cmd_recv(esp_loader_t *loader, command_t command, uint32_t *reg)
+{
+    // Only the command field is used to match the response
+    const command_common_t expected = {
+        .direction = WRITE_DIRECTION,
+        .command = command,
+    };
+
+    const send_cmd_config cmd_config = {
+        .cmd = &expected,
+        .cmd_size = sizeof(expected),
+        .reg_value = reg,
+    };
+
+    return loader->_protocol->read_response(loader, &cmd_config);
+}
+
+
 esp_loader_error_t loader_change_baudrate_cmd(esp_loader_t *loader, uint32_t new_baudrate, uint32_t old_baudrate)
 {
 
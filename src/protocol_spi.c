@@ -12,6 +12,8 @@
 #include "loader_log.h"
 #include <stddef.h>
 #include <assert.h>
+#include <string.h>
+#include <inttypes.h>
 
 static inline uint32_t port_remaining_time(const esp_loader_t *loader)
 {
@@ -67,6 +69,11 @@ typedef enum {
 #define SLAVE_STA_INIT_BIT (0x01U << 1)
 #define SLAVE_STA_BUF_LENGTH_POS 2U
 
+/* Status polls answered without delay, enough to cover short commands */
+#define SPI_FAST_POLLS 16
+/* Longest single wait on the handshake line before the status is read again */
+#define SPI_READY_WAIT_SLICE_MS 50
+
 typedef enum {
     SLAVE_STATE_INIT = SLAVE_STA_TOGGLE_BIT | SLAVE_STA_INIT_BIT,
     SLAVE_STATE_FIRST_PACKET = SLAVE_STA_INIT_BIT,
@@ -82,16 +89,64 @@ typedef enum {
     SLAVE_CMD_DONE = 0x55,
 } slave_cmd_t;
 
+/* Runs one chip select cycle: the tx buffers are written, then rx_size bytes are read.
+   Ports without spi_transfer get one write or read call per buffer. */
+static esp_loader_error_t spi_transaction(esp_loader_t *loader, const esp_loader_iovec_t *tx, uint32_t txcnt,
+        uint8_t *rx, uint16_t rx_size)
+{
+    const esp_loader_port_ops_t *ops = loader->_port->ops;
+    esp_loader_error_t err = ESP_LOADER_SUCCESS;
+
+    if (ops->spi_transfer != NULL) {
+        for (uint32_t i = 0; i < txcnt; i++) {
+            LOADER_LOG_HEX(loader, "SPI TX", tx[i].data, tx[i].size);
+        }
+        err = ops->spi_transfer(loader->_port, tx, txcnt, rx, rx_size, port_remaining_time(loader));
+        if (err == ESP_LOADER_SUCCESS && rx_size != 0) {
+            LOADER_LOG_HEX(loader, "SPI RX", rx, rx_size);
+        }
+        return err;
+    }
+
+    ops->spi_set_cs(loader->_port, 0);
+    for (uint32_t i = 0; i < txcnt && err == ESP_LOADER_SUCCESS; i++) {
+        if (tx[i].size != 0) {
+            err = spi_write(loader, tx[i].data, tx[i].size);
+        }
+    }
+    if (err == ESP_LOADER_SUCCESS && rx_size != 0) {
+        err = spi_read(loader, rx, rx_size);
+    }
+    ops->spi_set_cs(loader->_port, 1);
+
+    return err;
+}
+
+static esp_loader_error_t spi_transaction_cmd(esp_loader_t *loader, transaction_cmd_t cmd)
+{
+    const transaction_preamble_t preamble = {.cmd = cmd};
+    const esp_loader_iovec_t tx = {&preamble, sizeof(preamble)};
+    return spi_transaction(loader, &tx, 1, NULL, 0);
+}
+
 static esp_loader_error_t write_slave_reg(esp_loader_t *loader, const uint8_t *data, const uint32_t addr,
         const uint8_t size);
 static esp_loader_error_t read_slave_reg(esp_loader_t *loader, uint8_t *out_data, const uint32_t addr,
         const uint8_t size);
 static esp_loader_error_t handle_slave_state(esp_loader_t *loader, const uint32_t status_reg_addr,
         uint8_t *seq_state, bool *slave_ready, uint32_t *buf_size);
-static esp_loader_error_t spi_check_response(esp_loader_t *loader, command_t cmd, uint32_t *reg_value);
+static esp_loader_error_t wait_slave_ready(esp_loader_t *loader, const uint32_t status_reg_addr,
+        uint8_t *seq_state, uint32_t *buf_size);
+static esp_loader_error_t spi_check_response(esp_loader_t *loader, const send_cmd_config *config);
 
 static esp_loader_error_t spi_initialize_conn(esp_loader_t *loader, esp_loader_connect_args_t *connect_args)
 {
+    /* The target was reset and talks single-line SPI again */
+    if (loader->_proto_ctx.spi.qpi) {
+        loader->_port->ops->spi_set_mode(loader->_port, ESP_LOADER_SPI_MODE_SINGLE);
+        loader->_proto_ctx.spi.qpi = false;
+    }
+    loader->_proto_ctx.spi.ready_wait = loader->_port->ops->spi_wait_ready != NULL;
 
     for (uint8_t trial = 0; trial < connect_args->trials; trial++) {
         uint8_t slave_ready_flag __attribute__((aligned(4)));
@@ -127,76 +182,65 @@ static esp_loader_error_t spi_initialize_conn(esp_loader_t *loader, esp_loader_c
 
 static esp_loader_error_t spi_send_cmd(esp_loader_t *loader, const send_cmd_config *config)
 {
-    command_t command = ((const command_common_t *)config->cmd)->command;
-    LOADER_LOGD(loader, "CMD -> %s (0x%02x)", loader_command_name(command), (unsigned)command);
+    LOADER_LOGD(loader, "CMD -> %s (0x%02x)",
+                loader_command_name(((const command_common_t *)config->cmd)->command),
+                (unsigned)((const command_common_t *)config->cmd)->command);
 
-    if (config->resp_data != NULL) {
-        return ESP_LOADER_ERROR_INVALID_PARAM;
-    }
+    loader->_stats.commands++;
+    loader->_proto_ctx.spi.cmd_polls = 0;
 
     uint32_t target_buf_size;
-    bool slave_ready = false;
-    while (!slave_ready) {
-        RETURN_ON_ERROR(handle_slave_state(loader, SLAVE_REGISTER_RXSTA, &loader->_proto_ctx.spi.slave_seq_rx,
-                                           &slave_ready, &target_buf_size));
-    }
+    RETURN_ON_ERROR(wait_slave_ready(loader, SLAVE_REGISTER_RXSTA, &loader->_proto_ctx.spi.slave_seq_rx,
+                                     &target_buf_size));
+    loader->_proto_ctx.spi.slave_buf_size = target_buf_size;
 
     if (config->cmd_size + config->data_size > target_buf_size) {
+        LOADER_LOGE(loader, "Command of %u bytes does not fit the %" PRIu32 " byte SPI slave buffer",
+                    (unsigned)(config->cmd_size + config->data_size), target_buf_size);
         return ESP_LOADER_ERROR_INVALID_PARAM;
     }
 
-    transaction_preamble_t preamble = {.cmd = TRANS_CMD_WRDMA};
-
-    loader->_port->ops->spi_set_cs(loader->_port, 0);
-    RETURN_ON_ERROR(spi_write(loader, (const uint8_t *)&preamble, sizeof(preamble)));
-    RETURN_ON_ERROR(spi_write(loader, (const uint8_t *)config->cmd, config->cmd_size));
-    if (config->data != NULL && config->data_size != 0) {
-        RETURN_ON_ERROR(spi_write(loader, (const uint8_t *)config->data, config->data_size));
-    }
-
-    loader->_port->ops->spi_set_cs(loader->_port, 1);
+    const transaction_preamble_t preamble = {.cmd = TRANS_CMD_WRDMA};
+    const esp_loader_iovec_t tx[] = {
+        {&preamble, sizeof(preamble)},
+        {config->cmd, config->cmd_size},
+        {config->data, config->data != NULL ? config->data_size : 0},
+    };
+    RETURN_ON_ERROR(spi_transaction(loader, tx, sizeof(tx) / sizeof(tx[0]), NULL, 0));
 
     /* Terminate the write */
-    loader->_port->ops->spi_set_cs(loader->_port, 0);
-    preamble.cmd = TRANS_CMD_WR_DONE;
-    RETURN_ON_ERROR(spi_write(loader, (const uint8_t *)&preamble, sizeof(preamble)));
-    loader->_port->ops->spi_set_cs(loader->_port, 1);
+    RETURN_ON_ERROR(spi_transaction_cmd(loader, TRANS_CMD_WR_DONE));
 
-    return spi_check_response(loader, command, config->reg_value);
+    return spi_check_response(loader, config);
 }
 
 
 static esp_loader_error_t read_slave_reg(esp_loader_t *loader, uint8_t *out_data, const uint32_t addr,
         const uint8_t size)
 {
-    transaction_preamble_t preamble = {
+    const transaction_preamble_t preamble = {
         .cmd = TRANS_CMD_RDBUF,
         .addr = addr,
     };
+    const esp_loader_iovec_t tx = {&preamble, sizeof(preamble)};
 
-    loader->_port->ops->spi_set_cs(loader->_port, 0);
-    RETURN_ON_ERROR(spi_write(loader, (const uint8_t *)&preamble, sizeof(preamble)));
-    RETURN_ON_ERROR(spi_read(loader, out_data, size));
-    loader->_port->ops->spi_set_cs(loader->_port, 1);
-
-    return ESP_LOADER_SUCCESS;
+    return spi_transaction(loader, &tx, 1, out_data, size);
 }
 
 
 static esp_loader_error_t write_slave_reg(esp_loader_t *loader, const uint8_t *data, const uint32_t addr,
         const uint8_t size)
 {
-    transaction_preamble_t preamble = {
+    const transaction_preamble_t preamble = {
         .cmd = TRANS_CMD_WRBUF,
         .addr = addr,
     };
+    const esp_loader_iovec_t tx[] = {
+        {&preamble, sizeof(preamble)},
+        {data, size},
+    };
 
-    loader->_port->ops->spi_set_cs(loader->_port, 0);
-    RETURN_ON_ERROR(spi_write(loader, (const uint8_t *)&preamble, sizeof(preamble)));
-    RETURN_ON_ERROR(spi_write(loader, data, size));
-    loader->_port->ops->spi_set_cs(loader->_port, 1);
-
-    return ESP_LOADER_SUCCESS;
+    return spi_transaction(loader, tx, sizeof(tx) / sizeof(tx[0]), NULL, 0);
 }
 
 
@@ -237,65 +281,192 @@ static esp_loader_error_t handle_slave_state(esp_loader_t *loader, const uint32_
 }
 
 
-static esp_loader_error_t spi_check_response(esp_loader_t *loader, const command_t cmd, uint32_t *reg_value)
+static void spi_count_poll(esp_loader_t *loader)
 {
-    uint8_t buf[sizeof(common_response_t) + sizeof(response_status_t)] __attribute__((aligned(4)));
-
-    uint32_t target_buf_size;
-    bool slave_ready = false;
-    while (!slave_ready) {
-        RETURN_ON_ERROR(handle_slave_state(loader, SLAVE_REGISTER_TXSTA, &loader->_proto_ctx.spi.slave_seq_tx,
-                                           &slave_ready, &target_buf_size));
+    loader->_stats.status_polls++;
+    if (++loader->_proto_ctx.spi.cmd_polls > loader->_stats.max_polls_per_command) {
+        loader->_stats.max_polls_per_command = loader->_proto_ctx.spi.cmd_polls;
     }
+}
 
-    if (sizeof(buf) > target_buf_size) {
-        return ESP_LOADER_ERROR_INVALID_RESPONSE;
-    }
+static void spi_disable_ready_wait(esp_loader_t *loader)
+{
+    LOADER_LOGW(loader, "SPI handshake line not signalled, polling the slave");
+    loader->_proto_ctx.spi.ready_wait = false;
+}
 
-    transaction_preamble_t preamble = {
-        .cmd = TRANS_CMD_RDDMA,
-    };
+/* Polls a status register until the slave reports a new buffer. In between
+   the host blocks on the handshake line if the port has one, otherwise the
+   polls are spaced out once the slave has been busy for a while, as it is
+   during flash erase and write. */
+static esp_loader_error_t wait_slave_ready(esp_loader_t *loader, const uint32_t status_reg_addr,
+        uint8_t *seq_state, uint32_t *buf_size)
+{
+    uint32_t poll_count = 0;
+    bool wait_timed_out = false;
+
+    while (true) {
+        bool slave_ready = false;
+        RETURN_ON_ERROR(handle_slave_state(loader, status_reg_addr, seq_state, &slave_ready, buf_size));
+        spi_count_poll(loader);
+
+        if (slave_ready) {
+            // A buffer that was ready while the wait timed out means the line never made it to the host
+            if (wait_timed_out) {
+                spi_disable_ready_wait(loader);
+            }
+            return ESP_LOADER_SUCCESS;
+        }
+
+        const uint32_t remaining = port_remaining_time(loader);
+        if (remaining == 0) {
+            return ESP_LOADER_ERROR_TIMEOUT;
+        }
+
+        if (loader->_proto_ctx.spi.ready_wait) {
+            loader->_stats.interrupt_waits++;
+            esp_loader_error_t err = loader->_port->ops->spi_wait_ready(loader->_port,
+                                     MIN(remaining, SPI_READY_WAIT_SLICE_MS));
+            wait_timed_out = (err == ESP_LOADER_ERROR_TIMEOUT);
+            if (err == ESP_LOADER_ERROR_UNSUPPORTED_FUNC) {
+                spi_disable_ready_wait(loader);
+            } else if (err != ESP_LOADER_SUCCESS && err != ESP_LOADER_ERROR_TIMEOUT) {
+                return err;
+            }
+        } else if (++poll_count > SPI_FAST_POLLS) {
+            loader->_port->ops->delay_ms(loader->_port, 1);
+        }
+    }
+}
 
-    loader->_port->ops->spi_set_cs(loader->_port, 0);
-    RETURN_ON_ERROR(spi_write(loader, (const uint8_t *)&preamble, sizeof(preamble)));
-    RETURN_ON_ERROR(spi_read(loader, buf, sizeof(buf)));
+/* The header's size field tells how much data and status follows it */
+static esp_loader_error_t spi_check_response(esp_loader_t *loader, const send_cmd_config *config)
+{
+    uint8_t buf[sizeof(common_response_t) + sizeof(response_status_t) + MAX_RESP_DATA_SIZE] __attribute__((aligned(4)));
+    const command_t command = ((const command_common_t *)config->cmd)->command;
 
-    loader->_port->ops->spi_set_cs(loader->_port, 1);
+    uint32_t target_buf_size;
+    RETURN_ON_ERROR(wait_slave_ready(loader, SLAVE_REGISTER_TXSTA, &loader->_proto_ctx.spi.slave_seq_tx,
+                                     &target_buf_size));
+
+    /* The slave reports the length of the response packet along with the toggle bit,
+       so the whole packet is read in one transaction */
+    const uint16_t read_size = target_buf_size < sizeof(buf) ? target_buf_size : sizeof(buf);
+    const transaction_preamble_t preamble = {.cmd = TRANS_CMD_RDDMA};
+    const esp_loader_iovec_t tx = {&preamble, sizeof(preamble)};
+    if (read_size >= sizeof(common_response_t)) {
+        RETURN_ON_ERROR(spi_transaction(loader, &tx, 1, buf, read_size));
+    }
 
     /* Terminate the read */
-    loader->_port->ops->spi_set_cs(loader->_port, 0);
-    preamble.cmd = TRANS_CMD_CMD8;
-    RETURN_ON_ERROR(spi_write(loader, (const uint8_t *)&preamble, sizeof(preamble)));
-    loader->_port->ops->spi_set_cs(loader->_port, 1);
+    RETURN_ON_ERROR(spi_transaction_cmd(loader, TRANS_CMD_CMD8));
 
-    common_response_t *common = (common_response_t *)&buf[0];
-    if ((common->direction != READ_DIRECTION) || (common->command != cmd)) {
+    if (read_size < sizeof(common_response_t)) {
         return ESP_LOADER_ERROR_INVALID_RESPONSE;
     }
 
-    response_status_t *status = (response_status_t *)&buf[sizeof(buf) - sizeof(response_status_t)];
+    const common_response_t *common = (const common_response_t *)&buf[0];
+    const size_t packet_size = sizeof(common_response_t) + common->size;
+    const bool size_valid = common->size >= sizeof(response_status_t) && packet_size <= read_size;
+
+    if (!size_valid || (common->direction != READ_DIRECTION) || (common->command != command)) {
+        return ESP_LOADER_ERROR_INVALID_RESPONSE;
+    }
+
+    const response_status_t *status = (const response_status_t *)&buf[packet_size - sizeof(response_status_t)];
     if (status->failed) {
         log_loader_internal_error(loader, status->error);
         return ESP_LOADER_ERROR_INVALID_RESPONSE;
     }
-    LOADER_LOGD(loader, "CMD <- %s OK", loader_command_name(cmd));
+    LOADER_LOGD(loader, "CMD <- %s OK", loader_command_name(command));
 
-    if (reg_value != NULL) {
-        *reg_value = common->value;
+    if (config->reg_value != NULL) {
+        *config->reg_value = common->value;
+    }
+
+    if (config->resp_data != NULL) {
+        const size_t resp_data_size = common->size - sizeof(response_status_t);
+
+        // If the command has fixed response data size, require all of it to be received
+        if (resp_data_size > config->resp_data_size ||
+                (config->resp_data_recv_size == NULL && resp_data_size != config->resp_data_size)) {
+            return ESP_LOADER_ERROR_INVALID_RESPONSE;
+        }
+
+        memcpy(config->resp_data, &buf[sizeof(common_response_t)], resp_data_size);
+
+        if (config->resp_data_recv_size != NULL) {
+            *config->resp_data_recv_size = resp_data_size;
+        }
     }
 
     return ESP_LOADER_SUCCESS;
 }
 
+/* The CMD register holds SLAVE_CMD_READY from connect on, reading it back
+   tells whether host and slave agree on the line mode */
+static bool spi_link_ok(esp_loader_t *loader)
+{
+    uint8_t reg_val __attribute__((aligned(4)));
+    return read_slave_reg(loader, &reg_val, SLAVE_REGISTER_CMD, sizeof(reg_val)) == ESP_LOADER_SUCCESS &&
+           reg_val == SLAVE_CMD_READY;
+}
+
+static esp_loader_error_t spi_set_line_mode(esp_loader_t *loader, esp_loader_spi_mode_t mode)
+{
+    const esp_loader_port_ops_t *ops = loader->_port->ops;
+    const bool qpi = mode == ESP_LOADER_SPI_MODE_QPI;
+
+    if (qpi == loader->_proto_ctx.spi.qpi) {
+        return ESP_LOADER_SUCCESS;
+    }
+    if (ops->spi_set_mode == NULL) {
+        return ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
+    }
+
+    if (!qpi) {
+        RETURN_ON_ERROR(spi_transaction_cmd(loader, TRANS_CMD_EXQPI));
+        loader->_proto_ctx.spi.qpi = false;
+        return ops->spi_set_mode(loader->_port, ESP_LOADER_SPI_MODE_SINGLE);
+    }
+
+    /* Once the slave is in QPI it can only be told to leave over four lines,
+       so make sure the host can switch before sending ENQPI */
+    RETURN_ON_ERROR(ops->spi_set_mode(loader->_port, ESP_LOADER_SPI_MODE_QPI));
+    RETURN_ON_ERROR(ops->spi_set_mode(loader->_port, ESP_LOADER_SPI_MODE_SINGLE));
+
+    RETURN_ON_ERROR(spi_transaction_cmd(loader, TRANS_CMD_ENQPI));
+    RETURN_ON_ERROR(ops->spi_set_mode(loader->_port, ESP_LOADER_SPI_MODE_QPI));
+    if (spi_link_ok(loader)) {
+        loader->_proto_ctx.spi.qpi = true;
+        LOADER_LOGI(loader, "SPI link switched to QPI");
+        return ESP_LOADER_SUCCESS;
+    }
+
+    LOADER_LOGW(loader, "SPI slave does not respond in QPI, staying on single-line SPI");
+    (void)spi_transaction_cmd(loader, TRANS_CMD_EXQPI);
+    RETURN_ON_ERROR(ops->spi_set_mode(loader->_port, ESP_LOADER_SPI_MODE_SINGLE));
+    return spi_link_ok(loader) ? ESP_LOADER_ERROR_FAIL : ESP_LOADER_ERROR_INVALID_RESPONSE;
+}
+
+static esp_loader_error_t spi_spi_attach(esp_loader_t *loader, uint32_t config)
+{
+    return loader_spi_attach_cmd(loader, config);
+}
+
 const esp_loader_protocol_ops_t spi_protocol_ops = {
     .initialize_conn   = spi_initialize_conn,
     .send_cmd          = spi_send_cmd,
-    .spi_attach        = NULL,
+    .spi_attach        = spi_spi_attach,
+    .set_line_mode     = spi_set_line_mode,
     .recv_stub_packet  = NULL,
     .send_stub_ack     = NULL,
     .mem_begin_cmd     = NULL,
     .mem_data_cmd      = NULL,
     .mem_end_cmd       = NULL,
+    .write_cmd         = NULL,
+    .read_response     = NULL,
+    .data_in_flight    = NULL,
 };
 
 const esp_loader_protocol_ops_t *esp_loader_get_spi_ops(void)
@@ -42,11 +42,14 @@ static esp_loader_error_t uart_spi_attach(esp_loader_t *loader, uint32_t config)
     return loader_spi_attach_cmd(loader, config);
 }
 
-static esp_loader_error_t uart_send_cmd(esp_loader_t *loader, const send_cmd_config *config)
+static esp_loader_error_t uart_write_cmd(esp_loader_t *loader, const send_cmd_config *config)
 {
     command_t command = ((const command_common_t *)config->cmd)->command;
+    (void)command; // Only logged, and debug logs may be compiled out
     LOADER_LOGD(loader, "CMD -> %s (0x%02x)", loader_command_name(command), (unsigned)command);
 
+    loader->_stats.commands++;
+
     RETURN_ON_ERROR(SLIP_send_delimiter(loader));
 
     RETURN_ON_ERROR(SLIP_send(loader, (const uint8_t *)config->cmd, config->cmd_size));
@@ -55,7 +58,14 @@ static esp_loader_error_t uart_send_cmd(esp_loader_t *loader, const send_cmd_con
         RETURN_ON_ERROR(SLIP_send(loader, (const uint8_t *)config->data, config->data_size));
     }
 
-    RETURN_ON_ERROR(SLIP_send_delimiter(loader));
+    return SLIP_send_delimiter(loader);
+}
+
+static esp_loader_error_t uart_send_cmd(esp_loader_t *loader, const send_cmd_config *config)
+{
+    command_t command = ((const command_common_t *)config->cmd)->command;
+
+    RETURN_ON_ERROR(uart_write_cmd(loader, config));
 
     const uint8_t response_cnt = command == SYNC ? 8 : 1;
 
@@ -131,6 +141,7 @@ static esp_loader_error_t uart_mem_begin_cmd(esp_loader_t *loader, uint32_t offs
         uint32_t size, uint32_t blocks_to_write,
         uint32_t block_size)
 {
+    // Only reached with the stub running when the image overlaps it
     if (loader->_stub_running) {
         esp_loader_connect_args_t connect_args = ESP_LOADER_CONNECT_DEFAULT();
         loader->_port->ops->enter_bootloader(loader->_port);
@@ -146,11 +157,15 @@ const esp_loader_protocol_ops_t uart_protocol_ops = {
     .initialize_conn   = uart_initialize_conn,
     .send_cmd          = uart_send_cmd,
     .spi_attach        = uart_spi_attach,
+    .set_line_mode     = NULL,
     .recv_stub_packet  = uart_recv_stub_packet,
     .send_stub_ack     = uart_send_stub_ack,
     .mem_begin_cmd     = uart_mem_begin_cmd,
     .mem_data_cmd      = NULL,
     .mem_end_cmd       = NULL,
+    .write_cmd         = uart_write_cmd,
+    .read_response     = uart_check_response,
+    .data_in_flight    = NULL,
 };
 
 const esp_loader_protocol_ops_t *esp_loader_get_serial_ops(void)
@@ -116,3 +116,46 @@ TEST_CASE( "Can write and read register" )
     ESP_ERR_CHECK( esp_loader_read_register(&g_loader, SPI_MOSI_DLEN_REG, &reg_value) );
     REQUIRE ( reg_value == 55 );
 }
+
+TEST_CASE( "Can run register program" )
+{
+    uint32_t SPI_MOSI_DLEN_REG = 0x60002000 + 0x28;
+    uint32_t SPI_MISO_DLEN_REG = 0x60002000 + 0x2c;
+    uint32_t mosi_value = 0;
+    uint32_t miso_value = 0;
+
+    const esp_loader_reg_op_t ops[] = {
+        ESP_LOADER_REG_OP_WRITE(SPI_MOSI_DLEN_REG, 17),
+        ESP_LOADER_REG_OP_WRITE(SPI_MISO_DLEN_REG, 31),
+        ESP_LOADER_REG_OP_POLL(SPI_MOSI_DLEN_REG, 0xFF, 17),
+        ESP_LOADER_REG_OP_READ(SPI_MOSI_DLEN_REG, &mosi_value),
+        ESP_LOADER_REG_OP_READ(SPI_MISO_DLEN_REG, &miso_value),
+    };
+
+    ESP_ERR_CHECK( esp_loader_run_reg_program(&g_loader, ops, sizeof(ops) / sizeof(ops[0]), NULL) );
+    REQUIRE ( mosi_value == 17 );
+    REQUIRE ( miso_value == 31 );
+
+    const esp_loader_reg_op_t poll_ops[] = {
+        ESP_LOADER_REG_OP_POLL(SPI_MOSI_DLEN_REG, 0xFF, 18),
+        ESP_LOADER_REG_OP_WRITE(SPI_MOSI_DLEN_REG, 0),
+    };
+    size_t failed_op = SIZE_MAX;
+
+    REQUIRE ( esp_loader_run_reg_program(&g_loader, poll_ops, 2, &failed_op) == ESP_LOADER_ERROR_TIMEOUT );
+    REQUIRE ( failed_op == 0 );
+}
+
+TEST_CASE( "Can read memory block" )
+{
+    uint32_t SPI_MOSI_DLEN_REG = 0x60002000 + 0x28;
+    uint32_t words[2] = { 0 };
+
+    ESP_ERR_CHECK( esp_loader_write_register(&g_loader, SPI_MOSI_DLEN_REG, 7) );
+    ESP_ERR_CHECK( esp_loader_write_register(&g_loader, SPI_MOSI_DLEN_REG + 4, 9) );
+    ESP_ERR_CHECK( esp_loader_read_memory(&g_loader, SPI_MOSI_DLEN_REG, 2, words) );
+    REQUIRE ( words[0] == 7 );
+    REQUIRE ( words[1] == 9 );
+
+    REQUIRE ( esp_loader_read_memory(&g_loader, SPI_MOSI_DLEN_REG + 1, 2, words) == ESP_LOADER_ERROR_INVALID_PARAM );
+}
@@ -0,0 +1,144 @@
+/*
+ * SPDX-FileCopyrightText: 2026 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "catch.hpp"
+#include "deflate.h"
+#include <random>
+#include <vector>
+
+#ifdef SIM_HAVE_ZLIB
+#include <zlib.h>
+
+using namespace std;
+
+static esp_loader_error_t append(void *ctx, const uint8_t *data, uint32_t size)
+{
+    vector<uint8_t> *out = static_cast<vector<uint8_t> *>(ctx);
+    out->insert(out->end(), data, data + size);
+    return ESP_LOADER_SUCCESS;
+}
+
+static vector<uint8_t> compress(const vector<uint8_t> &data, uint32_t chunk_size)
+{
+    vector<uint8_t> chunk(chunk_size);
+    vector<uint8_t> out;
+    uint32_t size = 0;
+    uint32_t counted = 0;
+
+    REQUIRE( deflate_compress(data.data(), (uint32_t)data.size(), NULL, 0, NULL, NULL, &counted) == ESP_LOADER_SUCCESS );
+    REQUIRE( deflate_compress(data.data(), (uint32_t)data.size(), chunk.data(), chunk_size, append, &out, &size)
+             == ESP_LOADER_SUCCESS );
+    REQUIRE( size == counted );
+    REQUIRE( out.size() == size );
+    return out;
+}
+
+static vector<uint8_t> inflate_all(const vector<uint8_t> &compressed, size_t size)
+{
+    vector<uint8_t> out(size + 1);
+    uLongf out_size = out.size();
+    REQUIRE( uncompress(out.data(), &out_size, compressed.data(), compressed.size()) == Z_OK );
+    out.resize(out_size);
+    return out;
+}
+
+TEST_CASE( "Deflate encoder output inflates back to the input" )
+{
+    mt19937 gen(20);
+    vector<vector<uint8_t>> inputs;
+
+    inputs.push_back({});
+    inputs.push_back({ 0x42 });
+    inputs.push_back(vector<uint8_t>(300 * 1024, 0xFF));
+
+    vector<uint8_t> random(100 * 1024 + 3);
+    for (uint8_t &byte : random) {
+        byte = (uint8_t)gen();
+    }
+    inputs.push_back(random);
+
+    // Repeats at all distances up to beyond the window, past the 64 KB position wrap
+    vector<uint8_t> mixed(200 * 1024);
+    for (size_t i = 0; i < mixed.size(); i++) {
+        mixed[i] = (i / 4096) % 3 == 0 ? (uint8_t)gen() % 4 : mixed[i >= 40000 ? i - 40000 + (i % 7) : i / 2];
+    }
+    inputs.push_back(mixed);
+
+    for (const vector<uint8_t> &input : inputs) {
+        const vector<uint8_t> compressed = compress(input, 1000);
+        REQUIRE( inflate_all(compressed, input.size()) == input );
+    }
+
+    // Padding compresses to almost nothing, random data grows by at most an eighth
+    REQUIRE( compress(inputs[2], 4096).size() < 3000 );
+    REQUIRE( compress(random, 4096).size() < random.size() * 9 / 8 + 16 );
+}
+
+TEST_CASE( "Deflate chunks join into one stream" )
+{
+    // A repeating motif, so matches reach back across every chunk boundary
+    mt19937 gen(21);
+    vector<uint8_t> motif(1000);
+    for (uint8_t &byte : motif) {
+        byte = (uint8_t)gen();
+    }
+    vector<uint8_t> input(300 * 1024);
+    for (size_t i = 0; i < input.size(); i++) {
+        input[i] = motif[i % motif.size()];
+    }
+
+    const uint8_t header[] = DEFLATE_ZLIB_HEADER;
+    vector<uint8_t> stream(header, header + sizeof(header));
+    const uint32_t chunk_size = 64 * 1024 + 12;
+
+    for (uint32_t start = 0; start < input.size(); start += chunk_size) {
+        const uint32_t end = (uint32_t)min<size_t>(start + chunk_size, input.size());
+        vector<uint8_t> chunk;
+        uint8_t out[512];
+        uint32_t size = 0;
+        REQUIRE( deflate_compress_chunk(input.data(), start, end, end == input.size(), out, sizeof(out), append, &chunk, &size)
+                 == ESP_LOADER_SUCCESS );
+        REQUIRE( chunk.size() == size );
+        REQUIRE( size < (end - start) / 4 );
+        REQUIRE( size <= DEFLATE_CHUNK_BOUND(end - start) );
+        stream.insert(stream.end(), chunk.begin(), chunk.end());
+    }
+
+    const uint32_t adler = deflate_adler32(input.data(), (uint32_t)input.size());
+    REQUIRE( adler == adler32(1, input.data(), (uInt)input.size()) );
+    for (int shift = 24; shift >= 0; shift -= 8) {
+        stream.push_back((uint8_t)(adler >> shift));
+    }
+
+    REQUIRE( inflate_all(stream, input.size()) == input );
+
+    // Incompressible data stays within the bound
+    vector<uint8_t> random(10000);
+    for (uint8_t &byte : random) {
+        byte = (uint8_t)gen();
+    }
+    uint32_t size = 0;
+    REQUIRE( deflate_compress_chunk(random.data(), 0, (uint32_t)random.size(), false, NULL, 0, NULL, NULL, &size)
+             == ESP_LOADER_SUCCESS );
+    REQUIRE( size <= DEFLATE_CHUNK_BOUND(random.size()) );
+}
+
+TEST_CASE( "Deflate encoder stops at the first sink error" )
+{
+    const vector<uint8_t> input(64 * 1024, 0x11);
+    uint8_t chunk[16];
+    uint32_t calls = 0;
+    uint32_t size = 0;
+
+    auto failing = [](void *ctx, const uint8_t *, uint32_t) {
+        return ++*static_cast<uint32_t *>(ctx) == 2 ? ESP_LOADER_ERROR_TIMEOUT : ESP_LOADER_SUCCESS;
+    };
+
+    REQUIRE( deflate_compress(input.data(), (uint32_t)input.size(), chunk, sizeof(chunk), failing, &calls, &size)
+             == ESP_LOADER_ERROR_TIMEOUT );
+    REQUIRE( calls == 2 );
+}
+#endif
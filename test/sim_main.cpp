@@ -0,0 +1,10 @@
+/*
+ * SPDX-FileCopyrightText: 2026 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// The simulator tests need no external setup, so Catch provides main()
+#define CATCH_CONFIG_MAIN
+
+#include "catch.hpp"
@@ -0,0 +1,609 @@
+/*
+ * SPDX-FileCopyrightText: 2026 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "sim_sdio_port.h"
+#include "sip.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <thread>
+
+using namespace std;
+
+/* Function 0 */
+#define CCCR_FN_ENABLE 0x02
+#define CCCR_FN_READY 0x03
+#define CCCR_INT_ENABLE 0x04
+#define CCCR_CIS_PTR 0x09
+#define FN1_ENABLE (1 << 1)
+#define INT_ENABLE_MASTER (1 << 0)
+#define INT_ENABLE_FUNC1 (1 << 1)
+#define FBR1_BLOCK_SIZE 0x110
+#define CIS_ADDR 0x1000
+#define ESPRESSIF_VENDOR_ID 0x0092
+
+/* Function 1: SLC host registers and the registers the stub uses */
+#define TOKEN_RDATA 0x44
+#define INT_ST 0x58
+#define STATE_W0 0x64
+#define CONF_W0 0x6C
+#define CONF_W5 0x80
+#define WIN_CMD 0x84
+#define INT_CLR 0xD4
+#define INT_ENA 0xDC
+#define INT_NEW_PKT (1U << 23)
+#define WIN_CMD_READ 0x80
+#define WIN_CMD_WRITE 0xC0
+#define SLC_LEN_CONF 0xF4
+#define SLC_LEN_CONF_TX_PACKET_LOAD_EN (1U << 24)
+
+#define FN1_REG_SPACE_END 0x100
+#define PACKET_SPACE_START 0x400
+#define PACKET_SPACE_END 0x1f800
+#define SD_BLOCK 512U
+#define SD_MAX_BLOCKS 511U
+
+#define MS_TO_NS(ms) ((uint64_t)(ms) * 1000000ULL)
+
+/* The port contains C++ members, so container_of() would trip -Winvalid-offsetof.
+   esp_loader_port_t is the first member, making the cast equivalent. */
+static inline sim_sdio_port_t *port_instance(esp_loader_port_t *base)
+{
+    return static_cast<sim_sdio_port_t *>(static_cast<void *>(base));
+}
+
+static void sim_log(esp_loader_port_t *port, esp_loader_log_level_t level, const char *fmt, va_list args)
+{
+    (void)port;
+    if (level > ESP_LOADER_LOG_LEVEL_WARN) {
+        return;
+    }
+    printf("[%s] esf: ", level == ESP_LOADER_LOG_LEVEL_ERROR ? "E" : "W");
+    vprintf(fmt, args);
+    putchar('\n');
+}
+
+static void sim_enter_bootloader(esp_loader_port_t *port)
+{
+    port_instance(port)->enter_bootloader();
+}
+
+static void sim_reset_target(esp_loader_port_t *port)
+{
+    port_instance(port)->target.reset();
+}
+
+static void sim_start_timer(esp_loader_port_t *port, uint32_t ms)
+{
+    port_instance(port)->start_timer(ms);
+}
+
+static uint32_t sim_remaining_time(esp_loader_port_t *port)
+{
+    return port_instance(port)->remaining_time();
+}
+
+static void sim_delay_ms(esp_loader_port_t *port, uint32_t ms)
+{
+    port_instance(port)->delay_ms(ms);
+}
+
+static esp_loader_error_t sim_sdio_write(esp_loader_port_t *port, uint32_t function, uint32_t addr,
+        const uint8_t *data, uint16_t size, uint32_t timeout)
+{
+    (void)timeout;
+    return port_instance(port)->write(function, addr, data, size, false);
+}
+
+static esp_loader_error_t sim_sdio_read(esp_loader_port_t *port, uint32_t function, uint32_t addr,
+                                        uint8_t *data, uint16_t size, uint32_t timeout)
+{
+    (void)timeout;
+    return port_instance(port)->read(function, addr, data, size, false);
+}
+
+static esp_loader_error_t sim_sdio_card_init(esp_loader_port_t *port)
+{
+    return port_instance(port)->card_init();
+}
+
+static esp_loader_error_t sim_sdio_write_blocks(esp_loader_port_t *port, uint32_t function, uint32_t addr,
+        const uint8_t *data, uint32_t size, uint32_t timeout)
+{
+    (void)timeout;
+    return port_instance(port)->write(function, addr, data, size, true);
+}
+
+static esp_loader_error_t sim_sdio_read_blocks(esp_loader_port_t *port, uint32_t function, uint32_t addr,
+        uint8_t *data, uint32_t size, uint32_t timeout)
+{
+    (void)timeout;
+    return port_instance(port)->read(function, addr, data, size, true);
+}
+
+static esp_loader_error_t sim_sdio_wait_interrupt(esp_loader_port_t *port, uint32_t timeout)
+{
+    return port_instance(port)->wait_interrupt(timeout);
+}
+
+static esp_loader_error_t sim_sdio_writev(esp_loader_port_t *port, uint32_t function, uint32_t addr,
+        const esp_loader_iovec_t *iov, uint32_t iovcnt, uint32_t timeout)
+{
+    (void)timeout;
+    return port_instance(port)->writev(function, addr, iov, iovcnt);
+}
+
+/*
+ * Positional initialization, as C++14 has no designated initializers.
+ * The order must match esp_loader_port_ops_t in esp_loader_io.h exactly.
+ * Optional operations the configuration leaves out are cleared per instance.
+ */
+static const esp_loader_port_ops_t s_ops = {
+    /* init                     = */ nullptr,
+    /* deinit                   = */ nullptr,
+    /* enter_bootloader         = */ sim_enter_bootloader,
+    /* reset_target             = */ sim_reset_target,
+    /* start_timer              = */ sim_start_timer,
+    /* remaining_time           = */ sim_remaining_time,
+    /* delay_ms                 = */ sim_delay_ms,
+    /* log                      = */ sim_log,
+    /* log_hex                  = */ nullptr,
+    /* change_transmission_rate = */ nullptr,
+    /* write                    = */ nullptr,
+    /* read                     = */ nullptr,
+    /* spi_set_cs               = */ nullptr,
+    /* sdio_write               = */ sim_sdio_write,
+    /* sdio_read                = */ sim_sdio_read,
+    /* sdio_card_init           = */ sim_sdio_card_init,
+    /* sdio_write_blocks        = */ sim_sdio_write_blocks,
+    /* sdio_read_blocks         = */ sim_sdio_read_blocks,
+    /* sdio_wait_interrupt      = */ sim_sdio_wait_interrupt,
+    /* sdio_writev              = */ sim_sdio_writev,
+    /* spi_transfer             = */ nullptr,
+    /* spi_set_mode             = */ nullptr,
+    /* spi_wait_ready           = */ nullptr,
+};
+
+static uint16_t device_id(target_chip_t chip)
+{
+    switch (chip) {
+    case ESP32C5_CHIP:
+        return 0x1017;
+    case ESP32C6_CHIP:
+        return 0x100D;
+    case ESP32C61_CHIP:
+        return 0x1014;
+    default:
+        return 0x0000;
+    }
+}
+
+sim_sdio_port_t::sim_sdio_port_t(const sim_sdio_config_t &config)
+    : config(config), target(config.target), counters(), bootloader_entries(0),
+      m_now_ns(0), m_timer_end_ns(0), m_wall_start(chrono::steady_clock::now()), m_cccr(), m_fn1_regs(), m_state_w0(0), m_int_ena(0),
+      m_rx_expected(0), m_slave_regs(0x80, 0)
+{
+    m_ops = s_ops;
+    if (!config.block_mode) {
+        m_ops.sdio_write_blocks = nullptr;
+        m_ops.sdio_read_blocks = nullptr;
+    }
+    if (!config.interrupts) {
+        m_ops.sdio_wait_interrupt = nullptr;
+    }
+    if (!config.gather) {
+        m_ops.sdio_writev = nullptr;
+    }
+    port.ops = &m_ops;
+
+    const uint16_t id = device_id(config.target.chip);
+    m_cis = {
+        0x21, 0x02, 0x0C, 0x00,   // CISTPL_FUNCID
+        0x20, 0x04, ESPRESSIF_VENDOR_ID & 0xFF, ESPRESSIF_VENDOR_ID >> 8, (uint8_t)(id & 0xFF), (uint8_t)(id >> 8),
+        0xFF,                     // CISTPL_END
+    };
+}
+
+void sim_sdio_port_t::enter_bootloader()
+{
+    target.reset();
+    memset(m_cccr, 0, sizeof(m_cccr));
+    memset(m_fn1_regs, 0, sizeof(m_fn1_regs));
+    fill(m_slave_regs.begin(), m_slave_regs.end(), 0);
+    m_int_ena = 0;
+    m_rx_packet.clear();
+    m_rx_expected = 0;
+    m_rx_credits.clear();
+    m_tx_packets.clear();
+    bootloader_entries++;
+    delay_ms(50);
+}
+
+void sim_sdio_port_t::start_timer(uint32_t ms)
+{
+    m_timer_end_ns = m_now_ns + MS_TO_NS(ms);
+}
+
+uint32_t sim_sdio_port_t::remaining_time() const
+{
+    return m_timer_end_ns > m_now_ns ? (uint32_t)((m_timer_end_ns - m_now_ns) / 1000000ULL) : 0;
+}
+
+void sim_sdio_port_t::delay_ms(uint32_t ms)
+{
+    follow_wall_clock();
+    m_now_ns += MS_TO_NS(ms);
+    follow_wall_clock();
+}
+
+/* Host time spent between port calls leaves the bus idle, and the host
+   waits for the bus to catch up with it after each call */
+void sim_sdio_port_t::follow_wall_clock()
+{
+    if (!config.wall_clock) {
+        return;
+    }
+
+    const uint64_t wall_ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - m_wall_start).count();
+    if (wall_ns > m_now_ns) {
+        m_now_ns = wall_ns;
+    } else {
+        this_thread::sleep_for(chrono::nanoseconds(m_now_ns - wall_ns));
+    }
+}
+
+esp_loader_error_t sim_sdio_port_t::card_init()
+{
+    memset(m_cccr, 0, sizeof(m_cccr));
+    m_cccr[CCCR_CIS_PTR] = CIS_ADDR & 0xFF;
+    m_cccr[CCCR_CIS_PTR + 1] = (CIS_ADDR >> 8) & 0xFF;
+    m_cccr[CCCR_CIS_PTR + 2] = (CIS_ADDR >> 16) & 0xFF;
+    m_cccr[CCCR_FN_READY] = FN1_ENABLE;
+    delay_ms(1);
+    return ESP_LOADER_SUCCESS;
+}
+
+void sim_sdio_port_t::bus_transfer(uint32_t size, bool block)
+{
+    const uint64_t data_ns = (uint64_t)size * 8 / config.bus.bus_width * 1000000ULL / config.bus.clock_khz;
+
+    follow_wall_clock();
+
+    if (block) {
+        counters.cmd53++;
+        counters.blocks += size / SD_BLOCK;
+        m_now_ns += config.bus.cmd53_ns + (size / SD_BLOCK) * config.bus.block_ns + data_ns;
+    } else if (size == 1) {
+        counters.cmd52++;
+        m_now_ns += config.bus.cmd52_ns;
+    } else {
+        counters.cmd53++;
+        m_now_ns += config.bus.cmd53_ns + data_ns;
+    }
+
+    follow_wall_clock();
+}
+
+esp_loader_error_t sim_sdio_port_t::write(uint32_t function, uint32_t addr, const uint8_t *data, uint32_t size,
+        bool block)
+{
+    if (size == 0 || (!block && size > SD_BLOCK) ||
+            (block && (size % SD_BLOCK != 0 || size / SD_BLOCK > SD_MAX_BLOCKS ||
+                       function != 1 || (m_cccr[FBR1_BLOCK_SIZE] | (m_cccr[FBR1_BLOCK_SIZE + 1] << 8)) != SD_BLOCK))) {
+        counters.protocol_errors++;
+        return ESP_LOADER_ERROR_FAIL;
+    }
+
+    bus_transfer(size, block);
+    counters.bytes_written += size;
+
+    if (function == 0) {
+        write_fn0(addr, data, size);
+    } else if (addr + size <= FN1_REG_SPACE_END) {
+        for (uint32_t i = 0; i < size; i++) {
+            write_fn1_reg(addr + i, data[i]);
+        }
+    } else if (addr >= PACKET_SPACE_START && addr + size <= PACKET_SPACE_END) {
+        write_packet_space(addr, data, size);
+    } else {
+        counters.protocol_errors++;
+    }
+
+    return ESP_LOADER_SUCCESS;
+}
+
+esp_loader_error_t sim_sdio_port_t::read(uint32_t function, uint32_t addr, uint8_t *data, uint32_t size, bool block)
+{
+    if (size == 0 || (!block && size > SD_BLOCK) ||
+            (block && (size % SD_BLOCK != 0 || size / SD_BLOCK > SD_MAX_BLOCKS ||
+                       function != 1 || (m_cccr[FBR1_BLOCK_SIZE] | (m_cccr[FBR1_BLOCK_SIZE + 1] << 8)) != SD_BLOCK))) {
+        counters.protocol_errors++;
+        return ESP_LOADER_ERROR_FAIL;
+    }
+
+    bus_transfer(size, block);
+    counters.bytes_read += size;
+
+    if (function == 0) {
+        read_fn0(addr, data, size);
+    } else if (addr + size <= FN1_REG_SPACE_END) {
+        for (uint32_t i = 0; i < size; i++) {
+            data[i] = read_fn1_reg(addr + i);
+        }
+    } else if (addr >= PACKET_SPACE_START && addr + size <= PACKET_SPACE_END) {
+        read_packet_space(addr, data, size);
+    } else {
+        memset(data, 0, size);
+        counters.protocol_errors++;
+    }
+
+    return ESP_LOADER_SUCCESS;
+}
+
+/* Models a host controller that gathers the buffers with DMA: whole blocks go
+   out in one block-mode transfer and only the tail in byte mode */
+esp_loader_error_t sim_sdio_port_t::writev(uint32_t function, uint32_t addr, const esp_loader_iovec_t *iov,
+        uint32_t iovcnt)
+{
+    vector<uint8_t> packet;
+    for (uint32_t i = 0; i < iovcnt; i++) {
+        const uint8_t *data = static_cast<const uint8_t *>(iov[i].data);
+        packet.insert(packet.end(), data, data + iov[i].size);
+    }
+
+    size_t offset = 0;
+    while (offset < packet.size()) {
+        const uint32_t remaining = (uint32_t)(packet.size() - offset);
+        const bool block = config.block_mode && remaining >= SD_BLOCK;
+        const uint32_t size = block ? min(remaining / SD_BLOCK, SD_MAX_BLOCKS) * SD_BLOCK : min(remaining, SD_BLOCK);
+
+        const esp_loader_error_t err = write(function, addr + (uint32_t)offset, &packet[offset], size, block);
+        if (err != ESP_LOADER_SUCCESS) {
+            return err;
+        }
+        offset += size;
+    }
+
+    return ESP_LOADER_SUCCESS;
+}
+
+void sim_sdio_port_t::write_fn0(uint32_t addr, const uint8_t *data, uint32_t size)
+{
+    for (uint32_t i = 0; i < size; i++) {
+        if (addr + i >= sizeof(m_cccr)) {
+            counters.protocol_errors++;
+            return;
+        }
+        m_cccr[addr + i] = data[i];
+    }
+
+    // Read-only: the slave reports function 1 ready from card initialization on
+    m_cccr[CCCR_FN_READY] = FN1_ENABLE;
+}
+
+void sim_sdio_port_t::read_fn0(uint32_t addr, uint8_t *data, uint32_t size)
+{
+    for (uint32_t i = 0; i < size; i++) {
+        const uint32_t a = addr + i;
+        if (a < sizeof(m_cccr)) {
+            data[i] = m_cccr[a];
+        } else if (a >= CIS_ADDR && a - CIS_ADDR < m_cis.size()) {
+            data[i] = m_cis[a - CIS_ADDR];
+        } else {
+            data[i] = 0xFF;
+        }
+    }
+}
+
+void sim_sdio_port_t::write_fn1_reg(uint32_t addr, uint8_t value)
+{
+    m_fn1_regs[addr] = value;
+
+    if (addr == WIN_CMD + 1) {
+        // Indirect access to an SLC slave register, started by the command byte
+        const uint32_t index = m_fn1_regs[WIN_CMD] & 0x7F;
+        if (value == WIN_CMD_READ) {
+            m_state_w0 = m_slave_regs[index];
+        } else if (value == WIN_CMD_WRITE) {
+            uint32_t reg_value;
+            memcpy(&reg_value, &m_fn1_regs[CONF_W5], sizeof(reg_value));
+            if (index << 2 == SLC_LEN_CONF) {
+                reg_value &= ~SLC_LEN_CONF_TX_PACKET_LOAD_EN;
+            }
+            m_slave_regs[index] = reg_value;
+        }
+    } else if (addr == INT_CLR + 2 && (value & (INT_NEW_PKT >> 16)) != 0) {
+        // Clearing the new packet interrupt hands the packet back to the stub
+        if (packet_pending()) {
+            m_tx_packets.pop_front();
+            counters.packets_to_host++;
+        }
+    } else if (addr >= INT_ENA && addr < INT_ENA + 4) {
+        memcpy(&m_int_ena, &m_fn1_regs[INT_ENA], sizeof(m_int_ena));
+    }
+}
+
+uint8_t sim_sdio_port_t::read_fn1_reg(uint32_t addr)
+{
+    const uint32_t word_addr = addr & ~3U;
+    uint32_t word;
+
+    switch (word_addr) {
+    case TOKEN_RDATA:
+        word = target.stub_running() ? free_rx_buffers() << 16 : 0;
+        break;
+    case INT_ST:
+        word = packet_pending() ? INT_NEW_PKT : 0;
+        break;
+    case STATE_W0:
+        word = m_state_w0;
+        break;
+    case CONF_W0:
+        word = packet_pending() ? (uint32_t)m_tx_packets.front().data.size() : 0;
+        break;
+    default:
+        memcpy(&word, &m_fn1_regs[word_addr], sizeof(word));
+        break;
+    }
+
+    return (word >> ((addr - word_addr) * 8)) & 0xFF;
+}
+
+/* A packet is written so that it ends at the end of the packet space; its
+   first byte tells the slave how long it is */
+void sim_sdio_port_t::write_packet_space(uint32_t addr, const uint8_t *data, uint32_t size)
+{
+    if (m_rx_packet.empty()) {
+        m_rx_expected = PACKET_SPACE_END - addr;
+    } else if (addr != PACKET_SPACE_END - m_rx_expected + m_rx_packet.size()) {
+        // Not a continuation of the packet being written: the previous one is lost
+        counters.protocol_errors++;
+        m_rx_packet.clear();
+        m_rx_expected = PACKET_SPACE_END - addr;
+    }
+
+    m_rx_packet.insert(m_rx_packet.end(), data, data + size);
+
+    if (addr + size == PACKET_SPACE_END) {
+        packet_received();
+        m_rx_packet.clear();
+        m_rx_expected = 0;
+    }
+}
+
+void sim_sdio_port_t::read_packet_space(uint32_t addr, uint8_t *data, uint32_t size)
+{
+    if (!packet_pending()) {
+        counters.protocol_errors++;
+        memset(data, 0, size);
+        return;
+    }
+
+    const vector<uint8_t> &packet = m_tx_packets.front().data;
+    const uint32_t start = PACKET_SPACE_END - (uint32_t)packet.size();
+    if (addr < start) {
+        counters.protocol_errors++;
+        memset(data, 0, size);
+        return;
+    }
+
+    memcpy(data, &packet[addr - start], size);
+}
+
+uint32_t sim_sdio_port_t::free_rx_buffers() const
+{
+    uint32_t used = 0;
+    for (const rx_credit_t &credit : m_rx_credits) {
+        if (credit.release_ns > m_now_ns) {
+            used += credit.buffers;
+        }
+    }
+    return config.rx_buffers > used ? config.rx_buffers - used : 0;
+}
+
+bool sim_sdio_port_t::packet_pending() const
+{
+    return !m_tx_packets.empty() && m_tx_packets.front().ready_ns <= m_now_ns;
+}
+
+bool sim_sdio_port_t::interrupt_enabled() const
+{
+    const uint8_t cccr_mask = INT_ENABLE_MASTER | INT_ENABLE_FUNC1;
+    return (m_cccr[CCCR_INT_ENABLE] & cccr_mask) == cccr_mask && (m_int_ena & INT_NEW_PKT) != 0;
+}
+
+void sim_sdio_port_t::packet_received()
+{
+    counters.packets_to_slave++;
+
+    if (!target.stub_running()) {
+        rom_receive(m_rx_packet);
+        return;
+    }
+
+    while (!m_rx_credits.empty() && m_rx_credits.front().release_ns <= m_now_ns) {
+        m_rx_credits.pop_front();
+    }
+
+    const uint32_t buffers = ((uint32_t)m_rx_packet.size() + SD_BLOCK - 1) / SD_BLOCK;
+    if (buffers > free_rx_buffers()) {
+        // The host wrote more than the stub had announced room for
+        counters.protocol_errors++;
+        return;
+    }
+
+    const uint64_t done_ns = target.receive(m_rx_packet.data(), m_rx_packet.size(), m_now_ns, m_tx_packets);
+    m_rx_credits.push_back({ done_ns, buffers });
+}
+
+/* RAM download packets, as understood by the ROM loader */
+void sim_sdio_port_t::rom_receive(const vector<uint8_t> &packet)
+{
+    sip_header_t header;
+    if (packet.size() < sizeof(header)) {
+        counters.protocol_errors++;
+        return;
+    }
+    memcpy(&header, packet.data(), sizeof(header));
+
+    const uint8_t *payload = packet.data() + sizeof(header);
+    const size_t payload_size = packet.size() - sizeof(header);
+
+    if (header.len != packet.size() || header.len % 4 != 0 ||
+            (header.fc[0] & SIP_TYPE_MASK) != SIP_PACKET_TYPE_CTRL) {
+        counters.protocol_errors++;
+        return;
+    }
+
+    switch (header.u.tx_info.u.cmdid) {
+    case SIP_CMD_ID_WRITE_MEMORY: {
+        sip_cmd_write_memory cmd;
+        if (payload_size < sizeof(cmd)) {
+            counters.protocol_errors++;
+            return;
+        }
+        memcpy(&cmd, payload, sizeof(cmd));
+        if (cmd.len != payload_size - sizeof(cmd)) {
+            counters.protocol_errors++;
+            return;
+        }
+        target.ram_write(cmd.addr, payload + sizeof(cmd), cmd.len);
+        break;
+    }
+    case SIP_CMD_ID_BOOTUP: {
+        sip_cmd_bootup cmd;
+        if (payload_size < sizeof(cmd)) {
+            counters.protocol_errors++;
+            return;
+        }
+        memcpy(&cmd, payload, sizeof(cmd));
+        target.boot(cmd.boot_addr, m_now_ns, m_tx_packets);
+        break;
+    }
+    default:
+        counters.protocol_errors++;
+        break;
+    }
+}
+
+esp_loader_error_t sim_sdio_port_t::wait_interrupt(uint32_t timeout)
+{
+    follow_wall_clock();
+    const uint64_t deadline_ns = m_now_ns + MS_TO_NS(timeout);
+
+    if (!config.lose_interrupts && interrupt_enabled() && !m_tx_packets.empty() &&
+            m_tx_packets.front().ready_ns <= deadline_ns) {
+        m_now_ns = max(m_now_ns, m_tx_packets.front().ready_ns) + config.bus.irq_latency_ns;
+        counters.interrupts++;
+        follow_wall_clock();
+        return ESP_LOADER_SUCCESS;
+    }
+
+    m_now_ns = deadline_ns;
+    follow_wall_clock();
+    return ESP_LOADER_ERROR_TIMEOUT;
+}
@@ -0,0 +1,147 @@
+/*
+ * SPDX-FileCopyrightText: 2026 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_loader.h"
+#include "esp_loader_io.h"
+
+#ifdef __cplusplus
+#include <chrono>
+#include <deque>
+#include <vector>
+#include "sim_target.h"
+
+/**
+ * @brief Timing of the simulated SDIO bus, in nanoseconds unless stated otherwise.
+ *
+ * The per-command figures cover the host driver and the command/response
+ * exchange, which dominate short transfers on real hosts.
+ */
+struct sim_sdio_timing_t {
+    uint32_t clock_khz = 40000;   /*!< SD clock */
+    uint32_t bus_width = 4;       /*!< Data lines, 1 or 4 */
+    uint64_t cmd52_ns = 15000;    /*!< Single-byte register access */
+    uint64_t cmd53_ns = 25000;    /*!< Setting up one data transfer, byte or block mode */
+    uint64_t block_ns = 1000;     /*!< CRC status and gap after each block in block mode */
+    uint64_t irq_latency_ns = 20000; /*!< From DAT1 going low until the waiting task runs */
+};
+
+struct sim_sdio_config_t {
+    sim_target_config_t target;
+    sim_sdio_timing_t bus;
+    uint32_t rx_buffers = 40;       /*!< 512-byte receive buffers of the stub, at least 33 for a 16 KB data packet */
+    bool block_mode = true;         /*!< Provide sdio_write_blocks/sdio_read_blocks */
+    bool interrupts = true;         /*!< Provide sdio_wait_interrupt */
+    bool gather = true;             /*!< Provide sdio_writev */
+    bool lose_interrupts = false;   /*!< Claim interrupt support but never deliver one */
+    bool wall_clock = false;        /*!< Keep virtual time in step with the host clock, so that host
+                                     *   processing between transfers counts. For benchmarks. */
+};
+
+/**
+ * @brief Counters kept by the simulated SDIO port.
+ *
+ * @c protocol_errors counts accesses the slave hardware would have mishandled,
+ * such as a packet overrunning the receive buffers or a read outside the
+ * pending packet; a correct host never causes one.
+ */
+struct sim_sdio_counters_t {
+    uint32_t cmd52;
+    uint32_t cmd53;
+    uint32_t blocks;
+    uint64_t bytes_written;
+    uint64_t bytes_read;
+    uint32_t packets_to_slave;
+    uint32_t packets_to_host;
+    uint32_t interrupts;
+    uint32_t protocol_errors;
+};
+
+/**
+ * @brief In-process SDIO slave simulator usable as an esp_loader port.
+ *
+ * Models the CCCR and CIS of function 0, the SLC host registers and the
+ * indirect slave register window of function 1, the token and interrupt
+ * registers of the flasher stub and the packet space ending at 0x1f800. RAM
+ * download packets are handled like the ROM loader does; once the stub image
+ * has been started, packets go to a sim_target_t. All time is virtual and
+ * derived from the bus timing, so results do not depend on the host machine.
+ *
+ * @code
+ *   sim_sdio_port_t sim(config);
+ *   esp_loader_t loader;
+ *   esp_loader_init_sdio(&loader, &sim.port);
+ * @endcode
+ */
+struct sim_sdio_port_t {
+    esp_loader_port_t port;  /*!< Must be first member for container_of */
+
+    explicit sim_sdio_port_t(const sim_sdio_config_t &config = sim_sdio_config_t());
+    sim_sdio_port_t(const sim_sdio_port_t &) = delete;
+    sim_sdio_port_t &operator=(const sim_sdio_port_t &) = delete;
+
+    /** Virtual time elapsed since the port was created */
+    uint64_t now_ns() const
+    {
+        return m_now_ns;
+    }
+
+    sim_sdio_config_t config;
+    sim_target_t target;
+    sim_sdio_counters_t counters;
+    uint32_t bootloader_entries;
+
+    /* Port implementation, called through the ops table */
+    void enter_bootloader();
+    void start_timer(uint32_t ms);
+    uint32_t remaining_time() const;
+    void delay_ms(uint32_t ms);
+    esp_loader_error_t write(uint32_t function, uint32_t addr, const uint8_t *data, uint32_t size, bool block);
+    esp_loader_error_t read(uint32_t function, uint32_t addr, uint8_t *data, uint32_t size, bool block);
+    esp_loader_error_t writev(uint32_t function, uint32_t addr, const esp_loader_iovec_t *iov, uint32_t iovcnt);
+    esp_loader_error_t card_init();
+    esp_loader_error_t wait_interrupt(uint32_t timeout);
+
+private:
+    void bus_transfer(uint32_t size, bool block);
+    void follow_wall_clock();
+    void write_fn0(uint32_t addr, const uint8_t *data, uint32_t size);
+    void read_fn0(uint32_t addr, uint8_t *data, uint32_t size);
+    void write_fn1_reg(uint32_t addr, uint8_t value);
+    uint8_t read_fn1_reg(uint32_t addr);
+    void write_packet_space(uint32_t addr, const uint8_t *data, uint32_t size);
+    void read_packet_space(uint32_t addr, uint8_t *data, uint32_t size);
+    void packet_received();
+    void rom_receive(const std::vector<uint8_t> &packet);
+    uint32_t free_rx_buffers() const;
+    bool packet_pending() const;
+    bool interrupt_enabled() const;
+
+    struct rx_credit_t {
+        uint64_t release_ns;
+        uint32_t buffers;
+    };
+
+    esp_loader_port_ops_t m_ops;
+    uint64_t m_now_ns;
+    uint64_t m_timer_end_ns;
+    std::chrono::steady_clock::time_point m_wall_start;
+    uint8_t m_cccr[0x200];
+    uint8_t m_fn1_regs[0x100];
+    uint32_t m_state_w0;
+    uint32_t m_int_ena;
+    std::vector<uint8_t> m_rx_packet;
+    uint32_t m_rx_expected;
+    std::deque<rx_credit_t> m_rx_credits;
+    std::deque<sim_packet_t> m_tx_packets;
+    std::vector<uint8_t> m_cis;
+    std::vector<uint32_t> m_slave_regs;
+};
+
+#endif /* __cplusplus */
@@ -0,0 +1,838 @@
+/*
+ * SPDX-FileCopyrightText: 2026 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "sim_test_helpers.h"
+#include "esp_loader.h"
+#include "protocol.h"
+#include "md5_hash.h"
+#include "linux_deflate.h"
+#include <stdio.h>
+#include <vector>
+
+#ifdef SIM_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+using namespace std;
+
+const uint32_t APP_START_ADDRESS = 0x10000;
+const uint32_t FLASH_BLOCK_SIZE = 16 * 1024;
+
+/* Flash timing set to zero, so that only the SDIO link is measured */
+static sim_sdio_config_t link_only_config()
+{
+    sim_sdio_config_t config;
+    config.target.timing.program_ns_per_byte = 0;
+    config.target.timing.sector_erase_ns = 0;
+    config.target.timing.block_erase_ns = 0;
+    config.target.timing.read_ns_per_byte = 0;
+    config.target.timing.md5_ns_per_byte = 0;
+    return config;
+}
+
+static void report(const char *what, size_t bytes, uint64_t elapsed_ns)
+{
+    printf("[sim] %-40s %7zu bytes in %9.3f ms: %8.1f KB/s\n", what, bytes,
+           elapsed_ns / 1e6, bytes / 1024.0 / (elapsed_ns / 1e9));
+}
+
+static bool flash_matches(const sim_sdio_port_t &sim, uint32_t offset, const vector<uint8_t> &image)
+{
+    return equal(image.begin(), image.end(), sim.target.flash.begin() + offset);
+}
+
+TEST_CASE( "SDIO sim: connect uploads and starts the stub" )
+{
+    sim_sdio_port_t sim;
+    esp_loader_t loader;
+
+    connect(sim, &loader);
+
+    REQUIRE( esp_loader_get_target(&loader) == ESP32C6_CHIP );
+    REQUIRE( sim.target.stub_running() );
+    REQUIRE( sim.counters.protocol_errors == 0 );
+    printf("[sim] connect and stub upload: %.3f ms, %u packets\n",
+           sim.now_ns() / 1e6, sim.counters.packets_to_slave);
+
+    uint8_t mac[6];
+    ESP_ERR_CHECK( esp_loader_read_mac(&loader, mac) );
+    REQUIRE( equal(begin(mac), end(mac), sim.config.target.mac.begin()) );
+
+    uint32_t flash_size = 0;
+    ESP_ERR_CHECK( esp_loader_flash_detect_size(&loader, &flash_size) );
+    REQUIRE( flash_size == sim.config.target.flash_size );
+}
+
+TEST_CASE( "SDIO sim: flash write, read back and erase" )
+{
+    sim_sdio_port_t sim;
+    esp_loader_t loader;
+    connect(sim, &loader);
+
+    const vector<uint8_t> image = random_image(256 * 1024 + 100 * 4, 1);
+
+    uint64_t start = sim.now_ns();
+    ESP_ERR_CHECK( flash_image(&loader, APP_START_ADDRESS, image, FLASH_BLOCK_SIZE) );
+    report("flash write (default flash timing)", image.size(), sim.now_ns() - start);
+    REQUIRE( flash_matches(sim, APP_START_ADDRESS, image) );
+
+    vector<uint8_t> readback(64 * 1024 + 3);
+    start = sim.now_ns();
+    ESP_ERR_CHECK( esp_loader_flash_read(&loader, readback.data(), APP_START_ADDRESS + 1, (uint32_t)readback.size()) );
+    report("flash read", readback.size(), sim.now_ns() - start);
+    REQUIRE( equal(readback.begin(), readback.end(), image.begin() + 1) );
+
+    ESP_ERR_CHECK( esp_loader_flash_erase_region(&loader, APP_START_ADDRESS, 8192) );
+    REQUIRE( all_of(sim.target.flash.begin() + APP_START_ADDRESS,
+                    sim.target.flash.begin() + APP_START_ADDRESS + 8192,
+                    [](uint8_t byte) { return byte == 0xFF; }) );
+    REQUIRE( sim.target.flash[APP_START_ADDRESS + 8192] == image[8192] );
+    REQUIRE( sim.counters.protocol_errors == 0 );
+}
+
+#ifdef SIM_HAVE_ZLIB
+TEST_CASE( "SDIO sim: compressed flash write" )
+{
+    sim_sdio_port_t sim;
+    esp_loader_t loader;
+    connect(sim, &loader);
+
+    vector<uint8_t> image(128 * 1024);
+    for (size_t i = 0; i < image.size(); i++) {
+        image[i] = (uint8_t)(i / 64);
+    }
+
+    uLongf compressed_size = compressBound(image.size());
+    vector<uint8_t> compressed(compressed_size);
+    REQUIRE( compress2(compressed.data(), &compressed_size, image.data(), image.size(), 9) == Z_OK );
+    compressed.resize(compressed_size);
+
+    esp_loader_flash_deflate_cfg_t cfg = {};
+    cfg.offset = APP_START_ADDRESS;
+    cfg.image_size = (uint32_t)image.size();
+    cfg.compressed_size = (uint32_t)compressed.size();
+    cfg.block_size = FLASH_BLOCK_SIZE;
+
+    ESP_ERR_CHECK( esp_loader_flash_deflate_start(&loader, &cfg) );
+    for (size_t sent = 0; sent < compressed.size(); sent += FLASH_BLOCK_SIZE) {
+        const uint32_t size = (uint32_t)min<size_t>(FLASH_BLOCK_SIZE, compressed.size() - sent);
+        ESP_ERR_CHECK( esp_loader_flash_deflate_write(&loader, &cfg, &compressed[sent], size) );
+    }
+    ESP_ERR_CHECK( esp_loader_flash_deflate_finish(&loader, &cfg) );
+
+    REQUIRE( flash_matches(sim, APP_START_ADDRESS, image) );
+    REQUIRE( sim.counters.protocol_errors == 0 );
+}
+#endif
+
+TEST_CASE( "SDIO sim: block mode moves data faster than byte mode" )
+{
+    const vector<uint8_t> image = random_image(512 * 1024, 2);
+    uint64_t elapsed[2];
+
+    for (int block_mode = 0; block_mode < 2; block_mode++) {
+        sim_sdio_config_t config = link_only_config();
+        config.block_mode = block_mode != 0;
+        sim_sdio_port_t sim(config);
+        esp_loader_t loader;
+        connect(sim, &loader);
+
+        const uint64_t start = sim.now_ns();
+        ESP_ERR_CHECK( flash_image(&loader, APP_START_ADDRESS, image, FLASH_BLOCK_SIZE) );
+        elapsed[block_mode] = sim.now_ns() - start;
+        report(block_mode ? "link only, block mode" : "link only, byte mode", image.size(), elapsed[block_mode]);
+
+        REQUIRE( flash_matches(sim, APP_START_ADDRESS, image) );
+        REQUIRE( sim.counters.protocol_errors == 0 );
+    }
+
+    REQUIRE( elapsed[1] < elapsed[0] );
+}
+
+TEST_CASE( "SDIO sim: gathered packet writes need fewer transfers" )
+{
+    const vector<uint8_t> image = random_image(64 * 1024 + 100, 7);
+    uint32_t transfers[2];
+
+    for (int gather = 0; gather < 2; gather++) {
+        sim_sdio_config_t config = link_only_config();
+        config.gather = gather != 0;
+        sim_sdio_port_t sim(config);
+        esp_loader_t loader;
+        connect(sim, &loader);
+        const uint32_t connect_transfers = sim.counters.cmd53;
+
+        // Blocks ending mid SDIO block: written a buffer at a time, the
+        // command, the whole SDIO blocks and the tail each take a transfer
+        const uint32_t block_size = 1000;
+        esp_loader_flash_cfg_t flash_cfg = {
+            .offset     = APP_START_ADDRESS,
+            .image_size = (uint32_t)image.size(),
+            .block_size = block_size,
+            .skip_verify = false,
+        };
+        ESP_ERR_CHECK( esp_loader_flash_start(&loader, &flash_cfg) );
+        for (size_t written = 0; written < image.size(); written += block_size) {
+            const uint32_t size = (uint32_t)min<size_t>(block_size, image.size() - written);
+            ESP_ERR_CHECK( esp_loader_flash_write(&loader, &flash_cfg, &image[written], size) );
+        }
+        ESP_ERR_CHECK( esp_loader_flash_finish(&loader, &flash_cfg) );
+        transfers[gather] = sim.counters.cmd53 - connect_transfers;
+        printf("[sim] %-16s %5u CMD53 transfers\n", gather ? "gathered" : "per buffer", transfers[gather]);
+
+        REQUIRE( flash_matches(sim, APP_START_ADDRESS, image) );
+        REQUIRE( sim.counters.protocol_errors == 0 );
+    }
+
+    REQUIRE( transfers[1] < transfers[0] );
+}
+
+TEST_CASE( "SDIO sim: packets that fit a SIP packet need one transfer without gathering" )
+{
+    uint32_t transfers[2];
+
+    for (int gather = 0; gather < 2; gather++) {
+        sim_sdio_config_t config = link_only_config();
+        config.gather = gather != 0;
+        sim_sdio_port_t sim(config);
+        esp_loader_t loader;
+        connect(sim, &loader);
+
+        // The stub upload is made of SIP packets no larger than SIP_PACKET_SIZE
+        transfers[gather] = sim.counters.cmd53;
+        REQUIRE( sim.counters.protocol_errors == 0 );
+    }
+
+    REQUIRE( transfers[0] == transfers[1] );
+}
+
+TEST_CASE( "SDIO sim: interrupts replace status polling" )
+{
+    const vector<uint8_t> image = random_image(128 * 1024, 3);
+    esp_loader_stats_t stats[3];
+    const char *const names[3] = { "polling", "interrupts", "interrupts lost" };
+
+    for (int mode = 0; mode < 3; mode++) {
+        sim_sdio_config_t config;
+        config.interrupts = mode != 0;
+        config.lose_interrupts = mode == 2;
+        sim_sdio_port_t sim(config);
+        esp_loader_t loader;
+        connect(sim, &loader);
+
+        esp_loader_reset_stats(&loader);
+        const uint64_t start = sim.now_ns();
+        ESP_ERR_CHECK( flash_image(&loader, APP_START_ADDRESS, image, FLASH_BLOCK_SIZE) );
+        esp_loader_get_stats(&loader, &stats[mode]);
+
+        printf("[sim] %-16s commands %4u  status polls %6u  interrupt waits %4u  %9.3f ms\n", names[mode],
+               stats[mode].commands, stats[mode].status_polls, stats[mode].interrupt_waits,
+               (sim.now_ns() - start) / 1e6);
+
+        REQUIRE( flash_matches(sim, APP_START_ADDRESS, image) );
+        REQUIRE( sim.counters.protocol_errors == 0 );
+    }
+
+    REQUIRE( stats[0].interrupt_waits == 0 );
+    REQUIRE( stats[1].interrupt_waits > 0 );
+    REQUIRE( stats[1].status_polls < stats[0].status_polls );
+}
+
+TEST_CASE( "SDIO sim: a rejected queued data packet fails the write" )
+{
+    sim_sdio_port_t sim(link_only_config());
+    esp_loader_t loader;
+    connect(sim, &loader);
+
+    const vector<uint8_t> image = random_image(128 * 1024, 4);
+
+    sim.target.inject_error(FLASH_DATA, STUB_FAILED_SPI_OP, 2);
+    REQUIRE( flash_image(&loader, APP_START_ADDRESS, image, FLASH_BLOCK_SIZE) == ESP_LOADER_ERROR_INVALID_RESPONSE );
+
+    // A new write starts from a clean slate
+    ESP_ERR_CHECK( flash_image(&loader, APP_START_ADDRESS, image, FLASH_BLOCK_SIZE) );
+    REQUIRE( flash_matches(sim, APP_START_ADDRESS, image) );
+    REQUIRE( sim.counters.protocol_errors == 0 );
+}
+
+TEST_CASE( "SDIO sim: an unanswered queued data packet does not leave the queue behind" )
+{
+    // Each full block takes longer to program than the host waits for its response
+    sim_sdio_config_t config = link_only_config();
+    config.target.timing.program_ns_per_byte = 200000;
+    sim_sdio_port_t sim(config);
+    esp_loader_t loader;
+    connect(sim, &loader);
+
+    const vector<uint8_t> image = random_image(256 * 1024, 5);
+    REQUIRE( flash_image(&loader, APP_START_ADDRESS, image, FLASH_BLOCK_SIZE) == ESP_LOADER_ERROR_TIMEOUT );
+    const uint32_t data_packets = sim.target.command_count(FLASH_DATA);
+    REQUIRE( data_packets < image.size() / FLASH_BLOCK_SIZE );
+
+    // The late responses are skipped, and the next write starts from an empty queue
+    sim.delay_ms(60000);
+    const vector<uint8_t> small_image = random_image(4096, 6);
+    ESP_ERR_CHECK( flash_image(&loader, APP_START_ADDRESS, small_image, FLASH_BLOCK_SIZE) );
+    REQUIRE( sim.target.command_count(FLASH_DATA) == data_packets + 1 );
+    REQUIRE( flash_matches(sim, APP_START_ADDRESS, small_image) );
+    REQUIRE( sim.counters.protocol_errors == 0 );
+}
+
+TEST_CASE( "SDIO sim: RAM images load through the stub unless they overlap it" )
+{
+    sim_sdio_port_t sim;
+    esp_loader_t loader;
+    connect(sim, &loader);
+
+    auto load_ram = [&](uint32_t addr, const vector<uint8_t> &image, uint32_t entrypoint) {
+        esp_loader_mem_cfg_t cfg = {};
+        cfg.offset = addr;
+        cfg.size = (uint32_t)image.size();
+        cfg.block_size = ESP_RAM_BLOCK;
+
+        ESP_ERR_CHECK( esp_loader_mem_start(&loader, &cfg) );
+        for (size_t sent = 0; sent < image.size(); sent += ESP_RAM_BLOCK) {
+            const uint32_t size = (uint32_t)min<size_t>(ESP_RAM_BLOCK, image.size() - sent);
+            ESP_ERR_CHECK( esp_loader_mem_write(&loader, &cfg, &image[sent], size) );
+        }
+        ESP_ERR_CHECK( esp_loader_mem_finish(&loader, &cfg, entrypoint) );
+    };
+
+    const vector<uint8_t> data = random_image(10000, 5);
+    load_ram(0x40820000, data, 0);
+
+    REQUIRE( sim.bootloader_entries == 1 );
+    REQUIRE( sim.target.command_count(MEM_BEGIN) == 1 );
+    REQUIRE( sim.target.stub_running() );
+    REQUIRE( sim.target.ram_read(0x40820000, data.size()) == data );
+
+    const vector<uint8_t> app = random_image(20002, 6);
+    load_ram(0x40800100, app, 0x40800100);
+
+    REQUIRE( sim.bootloader_entries == 2 );
+    REQUIRE( !sim.target.stub_running() );
+    REQUIRE( sim.target.app_entrypoint() == 0x40800100 );
+    REQUIRE( sim.target.ram_read(0x40800100, app.size()) == app );
+    REQUIRE( sim.counters.protocol_errors == 0 );
+}
+
+TEST_CASE( "SDIO sim: differential write sends only the changed sectors" )
+{
+    sim_sdio_port_t sim;
+    esp_loader_t loader;
+    connect(sim, &loader);
+
+    // 65 sectors, the last one partial, so that a run crosses a compare window
+    vector<uint8_t> image = random_image(64 * 4096 + 400, 7);
+    ESP_ERR_CHECK( flash_image(&loader, APP_START_ADDRESS, image, FLASH_BLOCK_SIZE) );
+
+    image[4096 + 17] ^= 0x01;
+    fill(image.begin() + 10 * 4096 + 1, image.begin() + 13 * 4096 + 5, 0x5A);
+    image[63 * 4096] ^= 0x80;
+    image[image.size() - 1] ^= 0x80;
+
+    esp_loader_flash_diff_cfg_t cfg = {};
+    cfg.offset = APP_START_ADDRESS;
+    cfg.image = image.data();
+    cfg.image_size = (uint32_t)image.size();
+    cfg.block_size = FLASH_BLOCK_SIZE;
+
+    const uint32_t md5_before = sim.target.command_count(SPI_FLASH_MD5);
+    const uint32_t begin_before = sim.target.command_count(FLASH_BEGIN);
+    const uint64_t start = sim.now_ns();
+    ESP_ERR_CHECK( esp_loader_flash_diff_write(&loader, &cfg) );
+    report("differential write (7 of 65 sectors)", image.size(), sim.now_ns() - start);
+
+    REQUIRE( flash_matches(sim, APP_START_ADDRESS, image) );
+    REQUIRE( cfg.units_changed == 7 );
+    REQUIRE( cfg.runs == 3 );
+    REQUIRE( cfg.bytes_written == 7 * 4096 - 4096 + 400 );
+    REQUIRE( sim.target.command_count(FLASH_BEGIN) - begin_before == 3 );
+    // One query per sector and the final verification of the whole image
+    REQUIRE( sim.target.command_count(SPI_FLASH_MD5) - md5_before == 65 + 1 );
+
+    // Writing the same image again only compares
+    ESP_ERR_CHECK( esp_loader_flash_diff_write(&loader, &cfg) );
+    REQUIRE( cfg.units_changed == 0 );
+    REQUIRE( cfg.bytes_written == 0 );
+    REQUIRE( sim.target.command_count(FLASH_BEGIN) - begin_before == 3 );
+
+    cfg.offset = APP_START_ADDRESS + 1;
+    REQUIRE( esp_loader_flash_diff_write(&loader, &cfg) == ESP_LOADER_ERROR_INVALID_PARAM );
+    REQUIRE( sim.counters.protocol_errors == 0 );
+}
+
+static vector<uint8_t> md5_of(const uint8_t *data, size_t size)
+{
+    vector<uint8_t> digest(ESP_LOADER_MD5_DIGEST_SIZE);
+    struct MD5Context md5;
+    MD5Init(&md5);
+    MD5Update(&md5, data, (unsigned)size);
+    MD5Final(digest.data(), &md5);
+    return digest;
+}
+
+TEST_CASE( "SDIO sim: flash fingerprint overlaps the MD5 requests" )
+{
+    sim_sdio_port_t sim;
+    esp_loader_t loader;
+    connect(sim, &loader);
+
+    const vector<uint8_t> image = random_image(1024 * 1024, 9);
+    ESP_ERR_CHECK( flash_image(&loader, APP_START_ADDRESS, image, FLASH_BLOCK_SIZE) );
+
+    // 16 full regions of 64 KB and a short one
+    const uint32_t size = (uint32_t)image.size() + 4096;
+    const uint32_t regions = 17;
+    vector<uint8_t> hashes(regions * ESP_LOADER_MD5_DIGEST_SIZE);
+
+    uint64_t start = sim.now_ns();
+    ESP_ERR_CHECK( esp_loader_flash_fingerprint(&loader, APP_START_ADDRESS, size, 0, hashes.data()) );
+    const uint64_t fingerprint_ns = sim.now_ns() - start;
+
+    for (uint32_t i = 0; i < regions; i++) {
+        const uint32_t offset = i * 64 * 1024;
+        const vector<uint8_t> expected = md5_of(&sim.target.flash[APP_START_ADDRESS + offset],
+                                                min<uint32_t>(64 * 1024, size - offset));
+        REQUIRE( equal(expected.begin(), expected.end(), &hashes[i * ESP_LOADER_MD5_DIGEST_SIZE]) );
+    }
+
+    // The same regions checked one blocking command at a time
+    start = sim.now_ns();
+    for (uint32_t i = 0; i < regions; i++) {
+        const uint32_t offset = i * 64 * 1024;
+        char hex[2 * ESP_LOADER_MD5_DIGEST_SIZE + 1];
+        for (uint32_t j = 0; j < ESP_LOADER_MD5_DIGEST_SIZE; j++) {
+            snprintf(&hex[2 * j], 3, "%02x", hashes[i * ESP_LOADER_MD5_DIGEST_SIZE + j]);
+        }
+        ESP_ERR_CHECK( esp_loader_flash_verify_known_md5(&loader, APP_START_ADDRESS + offset,
+                       min<uint32_t>(64 * 1024, size - offset), (const uint8_t *)hex) );
+    }
+    const uint64_t sequential_ns = sim.now_ns() - start;
+
+    printf("[sim] fingerprint of %u regions: %.3f ms pipelined, %.3f ms one at a time\n",
+           regions, fingerprint_ns / 1e6, sequential_ns / 1e6);
+    // The link traffic of each request is hidden behind the target hashing the previous region
+    REQUIRE( fingerprint_ns < sequential_ns );
+    REQUIRE( sim.counters.protocol_errors == 0 );
+}
+
+TEST_CASE( "SDIO sim: a rejected MD5 query leaves no responses behind" )
+{
+    sim_sdio_port_t sim(link_only_config());
+    esp_loader_t loader;
+    connect(sim, &loader);
+
+    const vector<uint8_t> image = random_image(1024 * 1024, 10);
+    ESP_ERR_CHECK( flash_image(&loader, APP_START_ADDRESS, image, FLASH_BLOCK_SIZE) );
+
+    const uint32_t regions = (uint32_t)image.size() / (64 * 1024);
+    vector<uint8_t> expected(regions * ESP_LOADER_MD5_DIGEST_SIZE);
+    ESP_ERR_CHECK( esp_loader_flash_fingerprint(&loader, APP_START_ADDRESS, (uint32_t)image.size(), 0,
+                   expected.data()) );
+
+    // The third query fails with later ones already queued behind it
+    sim.target.inject_error(SPI_FLASH_MD5, STUB_FAILED_SPI_OP, 2);
+    vector<uint8_t> hashes(expected.size());
+    REQUIRE( esp_loader_flash_fingerprint(&loader, APP_START_ADDRESS, (uint32_t)image.size(), 0,
+                                          hashes.data()) == ESP_LOADER_ERROR_INVALID_RESPONSE );
+
+    // Replies to the failed call must not be taken for the digests of the next one
+    fill(hashes.begin(), hashes.end(), 0);
+    ESP_ERR_CHECK( esp_loader_flash_fingerprint(&loader, APP_START_ADDRESS, (uint32_t)image.size(), 0,
+                   hashes.data()) );
+    REQUIRE( hashes == expected );
+    REQUIRE( sim.counters.protocol_errors == 0 );
+}
+
+TEST_CASE( "SDIO sim: sparse write erases the blocks the stub does not write" )
+{
+    sim_sdio_port_t sim;
+    esp_loader_t loader;
+    connect(sim, &loader);
+
+    const vector<uint8_t> old_image = random_image(4 * 64 * 1024, 13);
+    ESP_ERR_CHECK( flash_image(&loader, APP_START_ADDRESS, old_image, FLASH_BLOCK_SIZE) );
+
+    vector<uint8_t> image(old_image.size(), 0xFF);
+    const vector<uint8_t> data = random_image(64 * 1024, 14);
+    copy(data.begin(), data.end(), image.begin() + 2 * 64 * 1024);
+
+    esp_loader_flash_sparse_cfg_t cfg = {};
+    cfg.offset = APP_START_ADDRESS;
+    cfg.image = image.data();
+    cfg.image_size = (uint32_t)image.size();
+    cfg.block_size = FLASH_BLOCK_SIZE;
+    ESP_ERR_CHECK( esp_loader_flash_write_sparse(&loader, &cfg) );
+
+    REQUIRE( flash_matches(sim, APP_START_ADDRESS, image) );
+    REQUIRE( cfg.runs == 1 );
+    REQUIRE( cfg.bytes_skipped == 3 * 64 * 1024 );
+    REQUIRE( sim.target.command_count(ERASE_REGION) == 2 );
+    REQUIRE( sim.counters.protocol_errors == 0 );
+}
+
+TEST_CASE( "SDIO sim: flash plan merges nearby images into one pass" )
+{
+    sim_sdio_port_t sim;
+    esp_loader_t loader;
+    connect(sim, &loader);
+
+    const vector<uint8_t> bootloader = random_image(0x5000, 17);
+    const vector<uint8_t> partition_table = random_image(0xC00, 18);
+    const vector<uint8_t> otadata = random_image(0x400, 19);
+    vector<uint8_t> app(128 * 1024);
+    for (size_t i = 0; i < app.size(); i++) {
+        app[i] = (uint8_t)(i / 64);
+    }
+
+    // Written one at a time, an image sharing a sector with another erases its end
+    ESP_ERR_CHECK( flash_image(&loader, 0x8000, partition_table, FLASH_BLOCK_SIZE) );
+    ESP_ERR_CHECK( flash_image(&loader, 0x8C00, otadata, FLASH_BLOCK_SIZE) );
+    REQUIRE( !flash_matches(sim, 0x8000, partition_table) );
+
+    esp_loader_flash_region_t regions[4] = {};
+    regions[0] = { 0x10000, app.data(), (uint32_t)app.size(), NULL, 0 };
+    regions[1] = { 0x8C00, otadata.data(), (uint32_t)otadata.size(), NULL, 0 };
+    regions[2] = { 0x0, bootloader.data(), (uint32_t)bootloader.size(), NULL, 0 };
+    regions[3] = { 0x8000, partition_table.data(), (uint32_t)partition_table.size(), NULL, 0 };
+
+#ifdef SIM_HAVE_ZLIB
+    uLongf compressed_size = compressBound(app.size());
+    vector<uint8_t> compressed(compressed_size);
+    REQUIRE( compress2(compressed.data(), &compressed_size, app.data(), app.size(), 9) == Z_OK );
+    regions[0].deflated = compressed.data();
+    regions[0].deflated_size = (uint32_t)compressed_size;
+#endif
+
+    vector<uint8_t> block_buffer(FLASH_BLOCK_SIZE);
+    esp_loader_flash_plan_cfg_t cfg = {};
+    cfg.block_size = FLASH_BLOCK_SIZE;
+    cfg.max_gap = 0x3000;
+    cfg.block_buffer = block_buffer.data();
+    cfg.dry_run = true;
+
+    const uint32_t packets_before = sim.counters.packets_to_slave;
+    ESP_ERR_CHECK( esp_loader_flash_plan(&loader, regions, 4, &cfg) );
+    REQUIRE( sim.counters.packets_to_slave == packets_before );
+    REQUIRE( regions[0].offset == 0x0 );
+    REQUIRE( regions[3].offset == 0x10000 );
+
+    const esp_loader_flash_plan_cfg_t dry_run = cfg;
+    printf("[sim] flash plan: %u passes, %u wire bytes, %u bytes erased\n",
+           dry_run.passes, dry_run.wire_bytes, dry_run.erase_bytes);
+
+    cfg.dry_run = false;
+    const uint32_t begin_before = sim.target.command_count(FLASH_BEGIN) + sim.target.command_count(FLASH_DEFL_BEGIN);
+    ESP_ERR_CHECK( esp_loader_flash_plan(&loader, regions, 4, &cfg) );
+
+    REQUIRE( cfg.passes == 2 );
+    REQUIRE( cfg.wire_bytes == dry_run.wire_bytes );
+    REQUIRE( cfg.erase_bytes == 0x9000 + app.size() );
+    REQUIRE( sim.target.command_count(FLASH_BEGIN) + sim.target.command_count(FLASH_DEFL_BEGIN) - begin_before == 2 );
+    REQUIRE( flash_matches(sim, 0x0, bootloader) );
+    REQUIRE( flash_matches(sim, 0x8000, partition_table) );
+    REQUIRE( flash_matches(sim, 0x8C00, otadata) );
+    REQUIRE( flash_matches(sim, 0x10000, app) );
+    REQUIRE( all_of(sim.target.flash.begin() + 0x5000, sim.target.flash.begin() + 0x8000,
+                    [](uint8_t byte) { return byte == 0xFF; }) );
+#ifdef SIM_HAVE_ZLIB
+    REQUIRE( cfg.wire_bytes < app.size() );
+#endif
+
+    regions[1].size += 4;
+    REQUIRE( esp_loader_flash_plan(&loader, regions, 4, &cfg) == ESP_LOADER_ERROR_INVALID_PARAM );
+    REQUIRE( sim.counters.protocol_errors == 0 );
+}
+
+#ifdef SIM_HAVE_ZLIB
+TEST_CASE( "SDIO sim: image compressed on the fly and verified" )
+{
+    sim_sdio_port_t sim;
+    esp_loader_t loader;
+    connect(sim, &loader);
+
+    // A padded application: 96 KB of code followed by 0xFF up to the partition size
+    vector<uint8_t> image(512 * 1024, 0xFF);
+    const vector<uint8_t> code = random_image(96 * 1024, 21);
+    copy(code.begin(), code.end(), image.begin());
+
+    uint64_t start = sim.now_ns();
+    ESP_ERR_CHECK( flash_image(&loader, APP_START_ADDRESS, image, FLASH_BLOCK_SIZE) );
+    const uint64_t raw_ns = sim.now_ns() - start;
+
+    vector<uint8_t> block_buffer(FLASH_BLOCK_SIZE);
+    esp_loader_flash_compress_cfg_t cfg = {};
+    cfg.offset = APP_START_ADDRESS + image.size();
+    cfg.image = image.data();
+    cfg.image_size = (uint32_t)image.size();
+    cfg.block_size = FLASH_BLOCK_SIZE;
+    cfg.block_buffer = block_buffer.data();
+
+    const uint32_t md5_before = sim.target.command_count(SPI_FLASH_MD5);
+    start = sim.now_ns();
+    ESP_ERR_CHECK( esp_loader_flash_write_compressed(&loader, &cfg) );
+    const uint64_t compressed_ns = sim.now_ns() - start;
+
+    printf("[sim] on-the-fly compression: %u of %zu bytes sent, %.3f ms (raw %.3f ms)\n",
+           cfg.compressed_size, image.size(), compressed_ns / 1e6, raw_ns / 1e6);
+
+    REQUIRE( flash_matches(sim, cfg.offset, image) );
+    REQUIRE( sim.target.command_count(FLASH_DEFL_DATA) == (cfg.compressed_size + FLASH_BLOCK_SIZE - 1) / FLASH_BLOCK_SIZE );
+    REQUIRE( sim.target.command_count(SPI_FLASH_MD5) - md5_before == 1 );
+    REQUIRE( cfg.compressed_size < image.size() / 4 );
+    REQUIRE( compressed_ns < raw_ns );
+    REQUIRE( sim.counters.protocol_errors == 0 );
+}
+
+TEST_CASE( "SDIO sim: image compressed on worker threads" )
+{
+    sim_sdio_port_t sim;
+    esp_loader_t loader;
+    connect(sim, &loader);
+
+    vector<uint8_t> image(1024 * 1024 + 4, 0xFF);
+    const vector<uint8_t> code = random_image(300 * 1024, 22);
+    copy(code.begin(), code.end(), image.begin());
+
+    vector<uint8_t> block_buffer(FLASH_BLOCK_SIZE);
+    esp_loader_flash_compress_cfg_t cfg = {};
+    cfg.offset = APP_START_ADDRESS;
+    cfg.image = image.data();
+    cfg.image_size = (uint32_t)image.size();
+    cfg.block_size = FLASH_BLOCK_SIZE;
+    cfg.block_buffer = block_buffer.data();
+
+    for (uint32_t threads : { 1, 3, 8 }) {
+        fill(sim.target.flash.begin(), sim.target.flash.end(), 0xFF);
+        const uint32_t blocks_before = sim.target.command_count(FLASH_DEFL_DATA);
+        ESP_ERR_CHECK( linux_flash_write_compressed(&loader, &cfg, threads) );
+
+        REQUIRE( flash_matches(sim, cfg.offset, image) );
+        REQUIRE( sim.target.command_count(FLASH_DEFL_DATA) - blocks_before ==
+                 (cfg.compressed_size + FLASH_BLOCK_SIZE - 1) / FLASH_BLOCK_SIZE );
+        REQUIRE( cfg.compressed_size < image.size() / 2 );
+    }
+
+    cfg.adaptive = true;
+    REQUIRE( linux_flash_write_compressed(&loader, &cfg, 2) == ESP_LOADER_ERROR_INVALID_PARAM );
+    REQUIRE( sim.counters.protocol_errors == 0 );
+}
+
+/* Run with: serial_flasher_sim_test "[benchmark]" */
+TEST_CASE( "SDIO sim: wall-clock time of threaded compression", "[.][benchmark]" )
+{
+    // A merged image of 8 MB: code, then sparse data, then padding
+    vector<uint8_t> image(8 * 1024 * 1024, 0xFF);
+    const vector<uint8_t> code = random_image(2 * 1024 * 1024, 23);
+    copy(code.begin(), code.end(), image.begin());
+    for (size_t i = code.size(); i < 6 * 1024 * 1024; i++) {
+        image[i] = i % 64 < 8 ? code[i % code.size()] : (uint8_t)(i / 4096);
+    }
+
+    vector<uint8_t> block_buffer(FLASH_BLOCK_SIZE);
+    // Links of about 3 MB/s and 20 MB/s
+    for (uint32_t clock_khz : { 6000, 40000 }) {
+        for (uint32_t threads : { 0, 1, 2, 4 }) {
+            sim_sdio_config_t config = link_only_config();
+            config.bus.clock_khz = clock_khz;
+            config.target.flash_size = 16 * 1024 * 1024;
+            config.target.flash_id = 0x1840EF;
+            config.wall_clock = true;
+            sim_sdio_port_t sim(config);
+            esp_loader_t loader;
+            connect(sim, &loader);
+
+            esp_loader_flash_compress_cfg_t cfg = {};
+            cfg.offset = 0;
+            cfg.image = image.data();
+            cfg.image_size = (uint32_t)image.size();
+            cfg.block_size = FLASH_BLOCK_SIZE;
+            cfg.block_buffer = block_buffer.data();
+            cfg.skip_verify = true;
+
+            const auto start = chrono::steady_clock::now();
+            if (threads == 0) {
+                ESP_ERR_CHECK( esp_loader_flash_write_compressed(&loader, &cfg) );
+            } else {
+                ESP_ERR_CHECK( linux_flash_write_compressed(&loader, &cfg, threads) );
+            }
+            const uint64_t elapsed_ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+
+            const string what = to_string(clock_khz / 1000) + " MHz SDIO, " +
+                                (threads == 0 ? string("single-threaded") : to_string(threads) + " worker thread(s)");
+            report(what.c_str(), image.size(), elapsed_ns);
+            REQUIRE( flash_matches(sim, 0, image) );
+        }
+    }
+}
+
+TEST_CASE( "SDIO sim: interrupted compressed write resumes at a segment boundary" )
+{
+    sim_sdio_port_t sim;
+    esp_loader_t loader;
+    connect(sim, &loader);
+
+    vector<uint8_t> image(512 * 1024, 0xFF);
+    const vector<uint8_t> code = random_image(200 * 1024, 24);
+    copy(code.begin(), code.end(), image.begin());
+
+    vector<uint8_t> block_buffer(FLASH_BLOCK_SIZE);
+    esp_loader_flash_journal_t journal = {};
+    journal_saver_t saver = {};
+    saver.cut_at = 3 * 64 * 1024;
+    esp_loader_flash_resumable_cfg_t cfg = {};
+    cfg.offset = APP_START_ADDRESS;
+    cfg.image = image.data();
+    cfg.image_size = (uint32_t)image.size();
+    cfg.block_size = FLASH_BLOCK_SIZE;
+    cfg.compress = true;
+    cfg.block_buffer = block_buffer.data();
+    cfg.journal = &journal;
+    cfg.journal_update = save_journal;
+    cfg.journal_ctx = &saver;
+
+    REQUIRE( esp_loader_flash_write_resumable(&loader, &cfg) == ESP_LOADER_ERROR_TIMEOUT );
+    REQUIRE( saver.saved.confirmed == 2 * 64 * 1024 );
+    REQUIRE( sim.target.command_count(FLASH_DEFL_BEGIN) == 3 );
+
+    // After a reset the second segment checks out, so the third is sent again
+    connect(sim, &loader);
+    journal = saver.saved;
+    ESP_ERR_CHECK( esp_loader_flash_write_resumable(&loader, &cfg) );
+    REQUIRE( cfg.resumed_from == 2 * 64 * 1024 );
+    REQUIRE( sim.target.command_count(FLASH_DEFL_BEGIN) == 3 + 6 );
+    REQUIRE( flash_matches(sim, cfg.offset, image) );
+
+    // A damaged sector takes the write back to the start of its segment
+    sim.target.flash[APP_START_ADDRESS + 190 * 1024] ^= 0x01;
+    connect(sim, &loader);
+    journal.confirmed = 3 * 64 * 1024;
+    ESP_ERR_CHECK( esp_loader_flash_write_resumable(&loader, &cfg) );
+    REQUIRE( cfg.resumed_from == 2 * 64 * 1024 );
+    REQUIRE( flash_matches(sim, cfg.offset, image) );
+    REQUIRE( sim.counters.protocol_errors == 0 );
+}
+
+/* Checks that the journal never claims a data block whose response the host has not read */
+struct answered_checker_t {
+    sim_sdio_port_t *sim;
+    uint32_t packets_before;
+    uint32_t data_before;
+    uint32_t most_in_flight;
+    bool overclaimed;
+    esp_loader_flash_journal_t saved;
+    bool cut;
+};
+
+static esp_loader_error_t answered_checker(void *ctx, const esp_loader_flash_journal_t *journal)
+{
+    answered_checker_t *checker = static_cast<answered_checker_t *>(ctx);
+
+    if (journal->confirmed == 0) {
+        checker->packets_before = checker->sim->counters.packets_to_host;
+        checker->data_before = checker->sim->target.command_count(FLASH_DATA);
+    } else if (journal->confirmed < journal->image_size) {
+        // One response read after the first store is the one to FLASH_BEGIN
+        const uint32_t answered = checker->sim->counters.packets_to_host - checker->packets_before - 1;
+        const uint32_t sent = checker->sim->target.command_count(FLASH_DATA) - checker->data_before;
+        checker->most_in_flight = max(checker->most_in_flight, sent - answered);
+        checker->overclaimed |= journal->confirmed > answered * FLASH_BLOCK_SIZE;
+    }
+
+    if (journal->confirmed >= 128 * 1024 && !checker->cut) {
+        checker->cut = true;
+        return ESP_LOADER_ERROR_TIMEOUT;
+    }
+    checker->saved = *journal;
+    return ESP_LOADER_SUCCESS;
+}
+
+TEST_CASE( "SDIO sim: interrupted raw write journals only answered blocks" )
+{
+    sim_sdio_port_t sim;
+    esp_loader_t loader;
+    connect(sim, &loader);
+
+    const vector<uint8_t> image = random_image(512 * 1024, 25);
+    esp_loader_flash_journal_t journal = {};
+    answered_checker_t checker = {};
+    checker.sim = &sim;
+    esp_loader_flash_resumable_cfg_t cfg = {};
+    cfg.offset = APP_START_ADDRESS;
+    cfg.image = image.data();
+    cfg.image_size = (uint32_t)image.size();
+    cfg.block_size = FLASH_BLOCK_SIZE;
+    cfg.journal = &journal;
+    cfg.journal_update = answered_checker;
+    cfg.journal_ctx = &checker;
+
+    REQUIRE( esp_loader_flash_write_resumable(&loader, &cfg) == ESP_LOADER_ERROR_TIMEOUT );
+    REQUIRE( checker.most_in_flight > 0 );
+    REQUIRE_FALSE( checker.overclaimed );
+    REQUIRE( checker.saved.confirmed > 0 );
+    REQUIRE( checker.saved.confirmed < 128 * 1024 );
+
+    const uint32_t interrupted_at = checker.saved.confirmed;
+    connect(sim, &loader);
+    journal = checker.saved;
+    ESP_ERR_CHECK( esp_loader_flash_write_resumable(&loader, &cfg) );
+    REQUIRE( cfg.resumed_from == interrupted_at );
+    REQUIRE( checker.saved.confirmed == image.size() );
+    REQUIRE( flash_matches(sim, cfg.offset, image) );
+    REQUIRE( sim.counters.protocol_errors == 0 );
+}
+
+TEST_CASE( "SDIO sim: adaptive compression sends incompressible regions raw" )
+{
+    sim_sdio_port_t sim;
+    esp_loader_t loader;
+    connect(sim, &loader);
+
+    // Encrypted-looking 64 KB regions alternating with padding
+    vector<uint8_t> image(512 * 1024, 0xFF);
+    for (size_t region = 0; region < image.size(); region += 128 * 1024) {
+        const vector<uint8_t> data = random_image(64 * 1024, (uint32_t)region);
+        copy(data.begin(), data.end(), image.begin() + region);
+    }
+
+    uint64_t start = sim.now_ns();
+    ESP_ERR_CHECK( flash_image(&loader, APP_START_ADDRESS, image, FLASH_BLOCK_SIZE) );
+    const uint64_t raw_ns = sim.now_ns() - start;
+
+    vector<uint8_t> block_buffer(FLASH_BLOCK_SIZE);
+    esp_loader_flash_compress_cfg_t cfg = {};
+    cfg.offset = APP_START_ADDRESS + image.size();
+    cfg.image = image.data();
+    cfg.image_size = (uint32_t)image.size();
+    cfg.block_size = FLASH_BLOCK_SIZE;
+    cfg.block_buffer = block_buffer.data();
+
+    start = sim.now_ns();
+    ESP_ERR_CHECK( esp_loader_flash_write_compressed(&loader, &cfg) );
+    const uint64_t compressed_ns = sim.now_ns() - start;
+
+    cfg.offset += image.size();
+    cfg.adaptive = true;
+    start = sim.now_ns();
+    ESP_ERR_CHECK( esp_loader_flash_write_compressed(&loader, &cfg) );
+    const uint64_t adaptive_ns = sim.now_ns() - start;
+
+    printf("[sim] adaptive compression: %u regions compressed, %u raw, %.3f ms (raw %.3f ms, compressed %.3f ms)\n",
+           cfg.regions_compressed, cfg.regions_raw, adaptive_ns / 1e6, raw_ns / 1e6, compressed_ns / 1e6);
+
+    REQUIRE( flash_matches(sim, cfg.offset, image) );
+    REQUIRE( cfg.regions_compressed == 4 );
+    REQUIRE( cfg.regions_raw == 4 );
+    REQUIRE( cfg.elapsed_ms > 0 );
+    REQUIRE( adaptive_ns < raw_ns );
+    REQUIRE( adaptive_ns < compressed_ns );
+
+    cfg.offset += 0x100;
+    REQUIRE( esp_loader_flash_write_compressed(&loader, &cfg) == ESP_LOADER_ERROR_INVALID_PARAM );
+    REQUIRE( sim.counters.protocol_errors == 0 );
+}
+#endif
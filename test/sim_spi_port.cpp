@@ -0,0 +1,503 @@
+/*
+ * SPDX-FileCopyrightText: 2026 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "sim_spi_port.h"
+
+#include <stdio.h>
+#include <string.h>
+
+using namespace std;
+
+/* Transaction commands, the first byte of the 3-byte preamble */
+#define TRANS_CMD_WRBUF 0x01
+#define TRANS_CMD_RDBUF 0x02
+#define TRANS_CMD_WRDMA 0x03
+#define TRANS_CMD_RDDMA 0x04
+#define TRANS_CMD_SEG_DONE 0x05
+#define TRANS_CMD_ENQPI 0x06
+#define TRANS_CMD_WR_DONE 0x07
+#define TRANS_CMD_CMD8 0x08
+#define TRANS_CMD_EXQPI 0xDD
+#define PREAMBLE_SIZE 3
+
+/* Slave register file */
+#define REG_VER 0
+#define REG_RXSTA 4
+#define REG_TXSTA 8
+#define REG_CMD 12
+#define REG_FILE_SIZE 16
+#define SLAVE_VERSION 0x00000001
+
+#define STA_TOGGLE_BIT (1U << 0)
+#define STA_INIT_BIT (1U << 1)
+#define STA_BUF_LENGTH_POS 2
+
+#define SLAVE_CMD_IDLE 0xAA
+
+#define MS_TO_NS(ms) ((uint64_t)(ms) * 1000000ULL)
+
+/* The port contains C++ members, so container_of() would trip -Winvalid-offsetof.
+   esp_loader_port_t is the first member, making the cast equivalent. */
+static inline sim_spi_port_t *port_instance(esp_loader_port_t *base)
+{
+    return static_cast<sim_spi_port_t *>(static_cast<void *>(base));
+}
+
+static void sim_log(esp_loader_port_t *port, esp_loader_log_level_t level, const char *fmt, va_list args)
+{
+    (void)port;
+    if (level > ESP_LOADER_LOG_LEVEL_WARN) {
+        return;
+    }
+    printf("[%s] esf: ", level == ESP_LOADER_LOG_LEVEL_ERROR ? "E" : "W");
+    vprintf(fmt, args);
+    putchar('\n');
+}
+
+static void sim_enter_bootloader(esp_loader_port_t *port)
+{
+    port_instance(port)->enter_bootloader();
+}
+
+static void sim_reset_target(esp_loader_port_t *port)
+{
+    port_instance(port)->target.reset();
+}
+
+static void sim_start_timer(esp_loader_port_t *port, uint32_t ms)
+{
+    port_instance(port)->start_timer(ms);
+}
+
+static uint32_t sim_remaining_time(esp_loader_port_t *port)
+{
+    return port_instance(port)->remaining_time();
+}
+
+static void sim_delay_ms(esp_loader_port_t *port, uint32_t ms)
+{
+    port_instance(port)->delay_ms(ms);
+}
+
+static esp_loader_error_t sim_spi_write(esp_loader_port_t *port, const uint8_t *data, uint16_t size,
+                                        uint32_t timeout)
+{
+    (void)timeout;
+    return port_instance(port)->write(data, size);
+}
+
+static esp_loader_error_t sim_spi_read(esp_loader_port_t *port, uint8_t *data, uint16_t size, uint32_t timeout)
+{
+    (void)timeout;
+    return port_instance(port)->read(data, size);
+}
+
+static void sim_spi_set_cs(esp_loader_port_t *port, uint32_t level)
+{
+    port_instance(port)->set_cs(level);
+}
+
+static esp_loader_error_t sim_spi_transfer(esp_loader_port_t *port, const esp_loader_iovec_t *tx, uint32_t txcnt,
+        uint8_t *rx, uint32_t rx_size, uint32_t timeout)
+{
+    (void)timeout;
+    return port_instance(port)->transfer(tx, txcnt, rx, rx_size);
+}
+
+static esp_loader_error_t sim_spi_set_mode(esp_loader_port_t *port, esp_loader_spi_mode_t mode)
+{
+    return port_instance(port)->set_mode(mode);
+}
+
+static esp_loader_error_t sim_spi_wait_ready(esp_loader_port_t *port, uint32_t timeout)
+{
+    return port_instance(port)->wait_ready(timeout);
+}
+
+/*
+ * Positional initialization, as C++14 has no designated initializers.
+ * The order must match esp_loader_port_ops_t in esp_loader_io.h exactly.
+ */
+static const esp_loader_port_ops_t s_ops = {
+    /* init                     = */ nullptr,
+    /* deinit                   = */ nullptr,
+    /* enter_bootloader         = */ sim_enter_bootloader,
+    /* reset_target             = */ sim_reset_target,
+    /* start_timer              = */ sim_start_timer,
+    /* remaining_time           = */ sim_remaining_time,
+    /* delay_ms                 = */ sim_delay_ms,
+    /* log                      = */ sim_log,
+    /* log_hex                  = */ nullptr,
+    /* change_transmission_rate = */ nullptr,
+    /* write                    = */ sim_spi_write,
+    /* read                     = */ sim_spi_read,
+    /* spi_set_cs               = */ sim_spi_set_cs,
+    /* sdio_write               = */ nullptr,
+    /* sdio_read                = */ nullptr,
+    /* sdio_card_init           = */ nullptr,
+    /* sdio_write_blocks        = */ nullptr,
+    /* sdio_read_blocks         = */ nullptr,
+    /* sdio_wait_interrupt      = */ nullptr,
+    /* sdio_writev              = */ nullptr,
+    /* spi_transfer             = */ sim_spi_transfer,
+    /* spi_set_mode             = */ sim_spi_set_mode,
+    /* spi_wait_ready           = */ sim_spi_wait_ready,
+};
+
+sim_spi_port_t::sim_spi_port_t(const sim_spi_config_t &config)
+    : config(config), target(config.target), counters(), m_now_ns(0), m_timer_end_ns(0), m_cs_active(false),
+      m_host_qpi(false), m_slave_qpi(false), m_garbled(false), m_payload_offset(0), m_cmd_reg(0), m_rx(), m_tx()
+{
+    m_ops = s_ops;
+    if (!config.transfer) {
+        m_ops.spi_transfer = nullptr;
+    }
+    if (!config.qpi) {
+        m_ops.spi_set_mode = nullptr;
+    }
+    if (!config.handshake) {
+        m_ops.spi_wait_ready = nullptr;
+    }
+    port.ops = &m_ops;
+    channel_reset(m_rx);
+    channel_reset(m_tx);
+}
+
+void sim_spi_port_t::enter_bootloader()
+{
+    target.reset();
+    m_cs_active = false;
+    m_slave_qpi = false;
+    m_rx_packet.clear();
+    m_tx_packets.clear();
+    channel_reset(m_rx);
+    channel_reset(m_tx);
+    delay_ms(50);
+    m_cmd_reg = SLAVE_CMD_IDLE;
+    channel_arm(m_rx, m_now_ns, config.rx_buffer_size);
+}
+
+void sim_spi_port_t::start_timer(uint32_t ms)
+{
+    m_timer_end_ns = m_now_ns + MS_TO_NS(ms);
+}
+
+uint32_t sim_spi_port_t::remaining_time() const
+{
+    return m_timer_end_ns > m_now_ns ? (uint32_t)((m_timer_end_ns - m_now_ns) / 1000000ULL) : 0;
+}
+
+void sim_spi_port_t::delay_ms(uint32_t ms)
+{
+    m_now_ns += MS_TO_NS(ms);
+}
+
+void sim_spi_port_t::bus_transfer(uint32_t size)
+{
+    const uint32_t bits_per_clock = m_host_qpi ? 4 : 1;
+    counters.transfers++;
+    m_now_ns += config.bus.transfer_ns + (uint64_t)size * (8 / bits_per_clock) * 1000000ULL / config.bus.clock_khz;
+}
+
+/* Status registers start in the init state, which the host acknowledges by
+   writing zero. The slave then reports its first buffer with the init bit set
+   and every later one by flipping the toggle bit, the buffer length above. */
+void sim_spi_port_t::channel_reset(channel_t &channel)
+{
+    channel = channel_t();
+    channel.reg = STA_TOGGLE_BIT | STA_INIT_BIT;
+    channel.first_packet = true;
+}
+
+void sim_spi_port_t::channel_arm(channel_t &channel, uint64_t ready_ns, uint32_t length)
+{
+    channel.armed = true;
+    channel.ready_ns = ready_ns;
+    channel.length = length;
+}
+
+void sim_spi_port_t::channel_consume(channel_t &channel)
+{
+    channel.reg &= STA_TOGGLE_BIT;
+    channel.open = false;
+}
+
+void sim_spi_port_t::channel_update(channel_t &channel)
+{
+    if (!channel.armed || !channel.host_initialized || m_now_ns < channel.ready_ns) {
+        return;
+    }
+
+    if (channel.first_packet) {
+        channel.reg = STA_INIT_BIT;
+        channel.first_packet = false;
+    } else {
+        channel.reg = (channel.reg & STA_TOGGLE_BIT) ^ STA_TOGGLE_BIT;
+    }
+    channel.reg |= channel.length << STA_BUF_LENGTH_POS;
+    channel.armed = false;
+    channel.open = true;
+}
+
+void sim_spi_port_t::arm_tx()
+{
+    if (!m_tx_packets.empty() && !m_tx.armed && !m_tx.open) {
+        channel_arm(m_tx, m_tx_packets.front().ready_ns, (uint32_t)m_tx_packets.front().data.size());
+    }
+}
+
+void sim_spi_port_t::set_cs(uint32_t level)
+{
+    if (level == 0) {
+        if (m_cs_active) {
+            counters.protocol_errors++;
+        }
+        m_cs_active = true;
+        m_garbled = m_host_qpi != m_slave_qpi;
+        m_preamble.clear();
+        m_payload_offset = 0;
+        counters.transactions++;
+        if (m_garbled) {
+            counters.mode_mismatches++;
+        }
+    } else if (m_cs_active) {
+        transaction_end();
+        m_cs_active = false;
+    }
+}
+
+esp_loader_error_t sim_spi_port_t::write(const uint8_t *data, uint32_t size)
+{
+    if (!m_cs_active) {
+        counters.protocol_errors++;
+        return ESP_LOADER_ERROR_FAIL;
+    }
+
+    bus_transfer(size);
+    shift_out(data, size);
+
+    return ESP_LOADER_SUCCESS;
+}
+
+/* The handshake line is high while a buffer is ready that the host has not
+   yet seen in a status register read */
+esp_loader_error_t sim_spi_port_t::wait_ready(uint32_t timeout)
+{
+    const uint64_t deadline_ns = m_now_ns + MS_TO_NS(timeout);
+
+    uint64_t ready_ns = UINT64_MAX;
+    for (const channel_t *channel : {&m_rx, &m_tx}) {
+        if (channel->armed && channel->host_initialized) {
+            ready_ns = min(ready_ns, channel->ready_ns);
+        }
+    }
+
+    if (!config.lose_handshake && ready_ns <= deadline_ns) {
+        if (ready_ns > m_now_ns) {
+            m_now_ns = ready_ns + config.bus.handshake_latency_ns;
+        }
+        counters.handshakes++;
+        return ESP_LOADER_SUCCESS;
+    }
+
+    m_now_ns = deadline_ns;
+    return ESP_LOADER_ERROR_TIMEOUT;
+}
+
+void sim_spi_port_t::shift_out(const uint8_t *data, uint32_t size)
+{
+    counters.bytes_written += size;
+    if (m_garbled) {
+        return;
+    }
+
+    while (size > 0 && m_preamble.size() < PREAMBLE_SIZE) {
+        m_preamble.push_back(*data++);
+        size--;
+    }
+    if (size > 0) {
+        payload_write(data, size);
+    }
+}
+
+esp_loader_error_t sim_spi_port_t::read(uint8_t *data, uint32_t size)
+{
+    if (!m_cs_active || (!m_garbled && m_preamble.size() < PREAMBLE_SIZE)) {
+        counters.protocol_errors++;
+        return ESP_LOADER_ERROR_FAIL;
+    }
+
+    bus_transfer(size);
+    shift_in(data, size);
+
+    return ESP_LOADER_SUCCESS;
+}
+
+esp_loader_error_t sim_spi_port_t::set_mode(esp_loader_spi_mode_t mode)
+{
+    if (m_cs_active) {
+        counters.protocol_errors++;
+    }
+    m_host_qpi = mode == ESP_LOADER_SPI_MODE_QPI;
+    return ESP_LOADER_SUCCESS;
+}
+
+/* A whole transaction in one transfer, as a host driver with a scatter list would do it */
+esp_loader_error_t sim_spi_port_t::transfer(const esp_loader_iovec_t *tx, uint32_t txcnt, uint8_t *rx, uint32_t rx_size)
+{
+    if (txcnt == 0 || tx[0].size < PREAMBLE_SIZE) {
+        counters.protocol_errors++;
+        return ESP_LOADER_ERROR_INVALID_PARAM;
+    }
+
+    uint32_t size = rx_size;
+    for (uint32_t i = 0; i < txcnt; i++) {
+        size += tx[i].size;
+    }
+
+    set_cs(0);
+    bus_transfer(size);
+    for (uint32_t i = 0; i < txcnt; i++) {
+        shift_out(static_cast<const uint8_t *>(tx[i].data), tx[i].size);
+    }
+    if (rx_size > 0) {
+        shift_in(rx, rx_size);
+    }
+    set_cs(1);
+
+    return ESP_LOADER_SUCCESS;
+}
+
+/* A slave in the other line mode sees noise and leaves MISO floating high */
+void sim_spi_port_t::shift_in(uint8_t *data, uint32_t size)
+{
+    counters.bytes_read += size;
+    if (m_garbled) {
+        memset(data, 0xFF, size);
+        return;
+    }
+    payload_read(data, size);
+}
+
+void sim_spi_port_t::payload_write(const uint8_t *data, uint32_t size)
+{
+    const uint8_t cmd = m_preamble[0];
+    const uint32_t addr = m_preamble[1] + m_payload_offset;
+
+    if (cmd == TRANS_CMD_WRBUF) {
+        for (uint32_t i = 0; i < size; i++) {
+            if (addr + i == REG_CMD) {
+                m_cmd_reg = data[i];
+            } else if (addr + i >= REG_FILE_SIZE) {
+                counters.protocol_errors++;
+            }
+        }
+        /* Writing the status registers is only used to acknowledge their init state */
+        uint32_t value = 0;
+        if ((addr == REG_RXSTA || addr == REG_TXSTA) && size == sizeof(value)) {
+            memcpy(&value, data, sizeof(value));
+            channel_t &channel = addr == REG_RXSTA ? m_rx : m_tx;
+            channel.reg = value;
+            channel.host_initialized = channel.host_initialized || value == 0;
+        }
+    } else if (cmd == TRANS_CMD_WRDMA && m_rx.open && m_rx_packet.size() + size <= config.rx_buffer_size) {
+        m_rx_packet.insert(m_rx_packet.end(), data, data + size);
+    } else {
+        counters.protocol_errors++;
+    }
+
+    m_payload_offset += size;
+}
+
+void sim_spi_port_t::payload_read(uint8_t *data, uint32_t size)
+{
+    const uint8_t cmd = m_preamble[0];
+    const uint32_t addr = m_preamble[1] + m_payload_offset;
+
+    memset(data, 0, size);
+
+    if (cmd == TRANS_CMD_RDBUF && addr + size <= REG_FILE_SIZE) {
+        channel_update(m_rx);
+        channel_update(m_tx);
+
+        uint8_t regs[REG_FILE_SIZE] = {};
+        const uint32_t version = SLAVE_VERSION;
+        memcpy(&regs[REG_VER], &version, sizeof(version));
+        memcpy(&regs[REG_RXSTA], &m_rx.reg, sizeof(m_rx.reg));
+        memcpy(&regs[REG_TXSTA], &m_tx.reg, sizeof(m_tx.reg));
+        regs[REG_CMD] = m_cmd_reg;
+        memcpy(data, &regs[addr], size);
+
+        if (addr == REG_RXSTA || addr == REG_TXSTA) {
+            counters.status_reads++;
+        }
+    } else if (cmd == TRANS_CMD_RDDMA && m_tx.open && m_payload_offset + size <= m_tx_packets.front().data.size()) {
+        memcpy(data, &m_tx_packets.front().data[m_payload_offset], size);
+    } else {
+        counters.protocol_errors++;
+    }
+
+    m_payload_offset += size;
+}
+
+void sim_spi_port_t::transaction_end()
+{
+    if (m_garbled) {
+        return;
+    }
+    if (m_preamble.size() < PREAMBLE_SIZE) {
+        counters.protocol_errors++;
+        return;
+    }
+
+    m_transaction_counts[m_preamble[0]]++;
+
+    switch (m_preamble[0]) {
+    case TRANS_CMD_WR_DONE: {
+        if (!m_rx.open || m_rx_packet.empty()) {
+            counters.protocol_errors++;
+            break;
+        }
+        counters.packets_to_slave++;
+        channel_consume(m_rx);
+        const uint64_t done_ns = target.receive(m_rx_packet.data(), m_rx_packet.size(), m_now_ns, m_tx_packets);
+        m_rx_packet.clear();
+        channel_arm(m_rx, done_ns, config.rx_buffer_size);
+        arm_tx();
+        break;
+    }
+
+    case TRANS_CMD_CMD8:
+        if (!m_tx.open) {
+            counters.protocol_errors++;
+            break;
+        }
+        counters.packets_to_host++;
+        channel_consume(m_tx);
+        m_tx_packets.pop_front();
+        arm_tx();
+        break;
+
+    /* Ends a DMA segment without releasing the buffer; the ROM loader does not
+       use segments, so there is nothing to do beyond checking a buffer is open */
+    case TRANS_CMD_SEG_DONE:
+        if (!m_rx.open && !m_tx.open) {
+            counters.protocol_errors++;
+        }
+        break;
+
+    case TRANS_CMD_ENQPI:
+        m_slave_qpi = config.slave_qpi;
+        break;
+
+    case TRANS_CMD_EXQPI:
+        m_slave_qpi = false;
+        break;
+
+    default:
+        break;
+    }
+}
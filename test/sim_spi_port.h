@@ -0,0 +1,164 @@
+/*
+ * SPDX-FileCopyrightText: 2026 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_loader.h"
+#include "esp_loader_io.h"
+
+#ifdef __cplusplus
+#include <deque>
+#include <map>
+#include <vector>
+#include "sim_target.h"
+
+/**
+ * @brief Timing of the simulated SPI bus, in nanoseconds unless stated otherwise.
+ *
+ * @c transfer_ns covers the host driver setting up one transfer, which
+ * dominates short transfers such as status register reads on real hosts.
+ */
+struct sim_spi_timing_t {
+    uint32_t clock_khz = 10000;   /*!< SPI clock */
+    uint64_t transfer_ns = 15000; /*!< Fixed cost of each write or read call of the port */
+    uint64_t handshake_latency_ns = 5000; /*!< From the handshake line rising to the host waking up */
+};
+
+struct sim_spi_config_t {
+    sim_spi_config_t()
+    {
+        target.chip = ESP32C3_CHIP;
+    }
+
+    sim_target_config_t target;
+    sim_spi_timing_t bus;
+    uint32_t rx_buffer_size = 8192; /*!< Receive DMA buffer of the slave, reported in RXSTA */
+    bool transfer = true;           /*!< Provide spi_transfer */
+    bool qpi = true;                /*!< Provide spi_set_mode */
+    bool slave_qpi = true;          /*!< The slave honours ENQPI */
+    bool handshake = true;          /*!< Provide spi_wait_ready */
+    bool lose_handshake = false;    /*!< Claim a handshake line but never signal on it */
+};
+
+/**
+ * @brief Counters kept by the simulated SPI port.
+ *
+ * A transaction spans one chip select assertion, a transfer is one call of
+ * the port's write, read or spi_transfer operation. @c protocol_errors counts accesses the
+ * slave would have mishandled, such as writing a command while its receive
+ * buffer is not armed; a correct host never causes one. @c mode_mismatches
+ * counts transactions the slave could not decode because host and slave
+ * disagreed on single-line or QPI mode.
+ */
+struct sim_spi_counters_t {
+    uint32_t transactions;
+    uint32_t transfers;
+    uint32_t status_reads;
+    uint64_t bytes_written;
+    uint64_t bytes_read;
+    uint32_t packets_to_slave;
+    uint32_t packets_to_host;
+    uint32_t protocol_errors;
+    uint32_t mode_mismatches;
+    uint32_t handshakes;
+};
+
+/**
+ * @brief In-process SPI slave simulator usable as an esp_loader port.
+ *
+ * Models the slave register file (VER, RXSTA, TXSTA, CMD) with the
+ * init/toggle handshake of the status registers and the WRBUF, RDBUF, WRDMA,
+ * WR_DONE, SEG_DONE, RDDMA, CMD8, ENQPI and EXQPI transactions of the ROM
+ * loader in SPI download mode.
+ * Command packets go to a sim_target_t. All time is virtual and derived from
+ * the bus timing, so results do not depend on the host machine.
+ *
+ * @code
+ *   sim_spi_port_t sim(config);
+ *   esp_loader_t loader;
+ *   esp_loader_init_spi(&loader, &sim.port);
+ * @endcode
+ */
+struct sim_spi_port_t {
+    esp_loader_port_t port;  /*!< Must be first member for container_of */
+
+    explicit sim_spi_port_t(const sim_spi_config_t &config = sim_spi_config_t());
+    sim_spi_port_t(const sim_spi_port_t &) = delete;
+    sim_spi_port_t &operator=(const sim_spi_port_t &) = delete;
+
+    /** Virtual time elapsed since the port was created */
+    uint64_t now_ns() const
+    {
+        return m_now_ns;
+    }
+
+    /** Number of transactions started with the given transaction command, e.g. 0x03 for WRDMA */
+    uint32_t transaction_count(uint8_t cmd) const
+    {
+        auto it = m_transaction_counts.find(cmd);
+        return it == m_transaction_counts.end() ? 0 : it->second;
+    }
+
+    sim_spi_config_t config;
+    sim_target_t target;
+    sim_spi_counters_t counters;
+
+    /* Port implementation, called through the ops table */
+    void enter_bootloader();
+    void start_timer(uint32_t ms);
+    uint32_t remaining_time() const;
+    void delay_ms(uint32_t ms);
+    esp_loader_error_t write(const uint8_t *data, uint32_t size);
+    esp_loader_error_t read(uint8_t *data, uint32_t size);
+    void set_cs(uint32_t level);
+    esp_loader_error_t transfer(const esp_loader_iovec_t *tx, uint32_t txcnt, uint8_t *rx, uint32_t rx_size);
+    esp_loader_error_t set_mode(esp_loader_spi_mode_t mode);
+    esp_loader_error_t wait_ready(uint32_t timeout);
+
+private:
+    /* One direction of the status register handshake */
+    struct channel_t {
+        uint32_t reg;
+        bool host_initialized;
+        bool first_packet;
+        bool armed;     /*!< A buffer becomes available at ready_ns */
+        bool open;      /*!< Reported to the host and not yet consumed */
+        uint64_t ready_ns;
+        uint32_t length;
+    };
+
+    void bus_transfer(uint32_t size);
+    void shift_out(const uint8_t *data, uint32_t size);
+    void shift_in(uint8_t *data, uint32_t size);
+    void channel_reset(channel_t &channel);
+    void channel_arm(channel_t &channel, uint64_t ready_ns, uint32_t length);
+    void channel_consume(channel_t &channel);
+    void channel_update(channel_t &channel);
+    void payload_write(const uint8_t *data, uint32_t size);
+    void payload_read(uint8_t *data, uint32_t size);
+    void transaction_end();
+    void arm_tx();
+
+    uint64_t m_now_ns;
+    uint64_t m_timer_end_ns;
+    bool m_cs_active;
+    bool m_host_qpi;
+    bool m_slave_qpi;
+    bool m_garbled;     /*!< Current transaction uses a line mode the slave is not in */
+    std::vector<uint8_t> m_preamble;
+    uint32_t m_payload_offset;
+    uint8_t m_cmd_reg;
+    channel_t m_rx;
+    channel_t m_tx;
+    std::vector<uint8_t> m_rx_packet;
+    std::deque<sim_packet_t> m_tx_packets;
+    std::map<uint8_t, uint32_t> m_transaction_counts;
+    esp_loader_port_ops_t m_ops;
+};
+
+#endif /* __cplusplus */
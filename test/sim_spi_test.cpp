@@ -0,0 +1,671 @@
+/*
+ * SPDX-FileCopyrightText: 2026 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "sim_test_helpers.h"
+#include "esp_loader.h"
+#include "protocol.h"
+#include "md5_hash.h"
+#include "linux_deflate.h"
+#include <stdio.h>
+#include <vector>
+
+#ifdef SIM_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+using namespace std;
+
+static const uint32_t APP_START_ADDRESS = 0x10000;
+static const uint32_t SPI_BLOCK_SIZE = 4096;
+/* Status polls per command the library makes before it starts backing off, plus some slack */
+static const uint32_t SPI_FAST_POLLS_BOUND = 20;
+
+TEST_CASE( "SPI sim: flash write, verify and read back through the ROM loader" )
+{
+    sim_spi_port_t sim;
+    esp_loader_t loader;
+    connect(sim, &loader);
+
+    REQUIRE( esp_loader_get_target(&loader) == ESP32C3_CHIP );
+
+    uint8_t mac[6];
+    ESP_ERR_CHECK( esp_loader_read_mac(&loader, mac) );
+    REQUIRE( equal(begin(mac), end(mac), sim.config.target.mac.begin()) );
+
+    const vector<uint8_t> image = random_image(64 * 1024 + 100, 1);
+    const uint64_t start = sim.now_ns();
+    ESP_ERR_CHECK( flash_image(&loader, APP_START_ADDRESS, image, SPI_BLOCK_SIZE) );
+    printf("[sim] SPI flash write: %zu bytes in %.3f ms, %u transactions\n", image.size(),
+           (sim.now_ns() - start) / 1e6, sim.counters.transactions);
+
+    REQUIRE( equal(image.begin(), image.end(), sim.target.flash.begin() + APP_START_ADDRESS) );
+    REQUIRE( sim.target.command_count(SPI_ATTACH) == 1 );
+    REQUIRE( sim.target.command_count(SPI_FLASH_MD5) == 1 );
+
+    vector<uint8_t> readback(1000);
+    ESP_ERR_CHECK( esp_loader_flash_read(&loader, readback.data(), APP_START_ADDRESS + 3, (uint32_t)readback.size()) );
+    REQUIRE( equal(readback.begin(), readback.end(), image.begin() + 3) );
+
+    ESP_ERR_CHECK( esp_loader_flash_erase_region(&loader, APP_START_ADDRESS, 4096) );
+    REQUIRE( all_of(sim.target.flash.begin() + APP_START_ADDRESS,
+                    sim.target.flash.begin() + APP_START_ADDRESS + 4096,
+                    [](uint8_t byte) { return byte == 0xFF; }) );
+
+    REQUIRE( sim.counters.protocol_errors == 0 );
+}
+
+TEST_CASE( "SPI sim: each transaction is a single transfer with spi_transfer" )
+{
+    const vector<uint8_t> image = random_image(64 * 1024 + 100, 2);
+    double transfers_per_command[2];
+
+    for (int transfer = 0; transfer < 2; transfer++) {
+        sim_spi_config_t config;
+        config.transfer = transfer != 0;
+        sim_spi_port_t sim(config);
+        esp_loader_t loader;
+        connect(sim, &loader);
+
+        const sim_spi_counters_t before = sim.counters;
+        const uint64_t start = sim.now_ns();
+        ESP_ERR_CHECK( flash_image(&loader, APP_START_ADDRESS, image, SPI_BLOCK_SIZE) );
+        REQUIRE( equal(image.begin(), image.end(), sim.target.flash.begin() + APP_START_ADDRESS) );
+        REQUIRE( sim.counters.protocol_errors == 0 );
+
+        /* Status register polls depend on how long the target is busy, leave them out */
+        const uint32_t commands = sim.counters.packets_to_slave - before.packets_to_slave;
+        const uint32_t polls = sim.counters.status_reads - before.status_reads;
+        const uint32_t transactions = sim.counters.transactions - before.transactions - polls;
+        const uint32_t transfers = sim.counters.transfers - before.transfers - polls * (transfer ? 1 : 2);
+        transfers_per_command[transfer] = (double)transfers / commands;
+        printf("[sim] SPI flash write %s spi_transfer: %.3f ms, %.1f transfers in %.1f transactions per command\n",
+               transfer ? "with" : "without", (sim.now_ns() - start) / 1e6, transfers_per_command[transfer],
+               (double)transactions / commands);
+
+        if (transfer) {
+            REQUIRE( transfers == transactions );
+        }
+    }
+
+    REQUIRE( transfers_per_command[1] < transfers_per_command[0] * 0.65 );
+}
+
+TEST_CASE( "SPI sim: handshake line replaces status polling" )
+{
+    const vector<uint8_t> image = random_image(64 * 1024 + 100, 3);
+    esp_loader_stats_t stats[3];
+    double duration_ms[3];
+    const char *const names[3] = { "polling", "handshake", "handshake lost" };
+
+    for (int mode = 0; mode < 3; mode++) {
+        sim_spi_config_t config;
+        config.handshake = mode != 0;
+        config.lose_handshake = mode == 2;
+        sim_spi_port_t sim(config);
+        esp_loader_t loader;
+        connect(sim, &loader);
+
+        esp_loader_reset_stats(&loader);
+        const uint64_t start = sim.now_ns();
+        ESP_ERR_CHECK( flash_image(&loader, APP_START_ADDRESS, image, SPI_BLOCK_SIZE) );
+        esp_loader_get_stats(&loader, &stats[mode]);
+        duration_ms[mode] = (sim.now_ns() - start) / 1e6;
+
+        printf("[sim] SPI %-14s commands %4u  status polls %5u (max %3u per command)  handshake waits %4u  %8.3f ms\n",
+               names[mode], stats[mode].commands, stats[mode].status_polls, stats[mode].max_polls_per_command,
+               stats[mode].interrupt_waits, duration_ms[mode]);
+
+        REQUIRE( equal(image.begin(), image.end(), sim.target.flash.begin() + APP_START_ADDRESS) );
+        REQUIRE( sim.counters.protocol_errors == 0 );
+    }
+
+    REQUIRE( stats[0].interrupt_waits == 0 );
+    REQUIRE( stats[1].interrupt_waits > 0 );
+    REQUIRE( stats[1].status_polls < stats[0].status_polls / 4 );
+    REQUIRE( duration_ms[1] <= duration_ms[0] );
+    /* Backing off limits polling to about one read per millisecond while the flash is busy */
+    REQUIRE( stats[0].status_polls < SPI_FAST_POLLS_BOUND * stats[0].commands + (uint32_t)duration_ms[0] );
+}
+
+TEST_CASE( "SPI sim: a block rejected by the ROM is sent again" )
+{
+    sim_spi_port_t sim;
+    esp_loader_t loader;
+    connect(sim, &loader);
+
+    const vector<uint8_t> image = random_image(8 * SPI_BLOCK_SIZE, 2);
+    sim.target.inject_error(FLASH_DATA, FLASH_WRITE_ERR, 3);
+    ESP_ERR_CHECK( flash_image(&loader, APP_START_ADDRESS, image, SPI_BLOCK_SIZE) );
+
+    REQUIRE( equal(image.begin(), image.end(), sim.target.flash.begin() + APP_START_ADDRESS) );
+    REQUIRE( sim.target.command_count(FLASH_DATA) == 8 + 1 );
+    REQUIRE( sim.counters.protocol_errors == 0 );
+}
+
+TEST_CASE( "SPI sim: blocks that do not fit the slave buffer are rejected up front" )
+{
+    sim_spi_port_t sim;
+    esp_loader_t loader;
+    connect(sim, &loader);
+
+    const vector<uint8_t> image = random_image(32 * 1024, 3);
+    REQUIRE( flash_image(&loader, APP_START_ADDRESS, image, 16 * 1024) == ESP_LOADER_ERROR_INVALID_PARAM );
+    REQUIRE( sim.target.command_count(FLASH_BEGIN) == 0 );
+    REQUIRE( sim.counters.protocol_errors == 0 );
+}
+
+#ifdef SIM_HAVE_ZLIB
+TEST_CASE( "SPI sim: compressed flash write through the ROM loader" )
+{
+    sim_spi_port_t sim;
+    esp_loader_t loader;
+    connect(sim, &loader);
+
+    vector<uint8_t> image(64 * 1024);
+    for (size_t i = 0; i < image.size(); i++) {
+        image[i] = (uint8_t)(i / 64);
+    }
+
+    uLongf compressed_size = compressBound(image.size());
+    vector<uint8_t> compressed(compressed_size);
+    REQUIRE( compress2(compressed.data(), &compressed_size, image.data(), image.size(), 9) == Z_OK );
+    compressed.resize(compressed_size);
+
+    esp_loader_flash_deflate_cfg_t cfg = {};
+    cfg.offset = APP_START_ADDRESS;
+    cfg.image_size = (uint32_t)image.size();
+    cfg.compressed_size = (uint32_t)compressed.size();
+    cfg.block_size = SPI_BLOCK_SIZE;
+
+    ESP_ERR_CHECK( esp_loader_flash_deflate_start(&loader, &cfg) );
+    for (size_t sent = 0; sent < compressed.size(); sent += SPI_BLOCK_SIZE) {
+        const uint32_t size = (uint32_t)min<size_t>(SPI_BLOCK_SIZE, compressed.size() - sent);
+        ESP_ERR_CHECK( esp_loader_flash_deflate_write(&loader, &cfg, &compressed[sent], size) );
+    }
+    ESP_ERR_CHECK( esp_loader_flash_deflate_finish(&loader, &cfg) );
+
+    REQUIRE( sim.target.command_count(FLASH_DEFL_DATA) == (compressed.size() + SPI_BLOCK_SIZE - 1) / SPI_BLOCK_SIZE );
+    REQUIRE( equal(image.begin(), image.end(), sim.target.flash.begin() + APP_START_ADDRESS) );
+    REQUIRE( sim.counters.protocol_errors == 0 );
+}
+#endif
+
+TEST_CASE( "SPI sim: compressing on worker threads needs the stub" )
+{
+    sim_spi_port_t sim;
+    esp_loader_t loader;
+    connect(sim, &loader);
+
+    const vector<uint8_t> image = random_image(16 * 1024, 4);
+    vector<uint8_t> block_buffer(SPI_BLOCK_SIZE);
+    esp_loader_flash_compress_cfg_t cfg = {};
+    cfg.offset = APP_START_ADDRESS;
+    cfg.image = image.data();
+    cfg.image_size = (uint32_t)image.size();
+    cfg.block_size = SPI_BLOCK_SIZE;
+    cfg.block_buffer = block_buffer.data();
+
+    // The ROM loader would wait for every block of the upper bound FLASH_DEFL_BEGIN announces
+    REQUIRE( linux_flash_write_compressed(&loader, &cfg, 2) == ESP_LOADER_ERROR_UNSUPPORTED_FUNC );
+    REQUIRE( sim.target.command_count(FLASH_DEFL_BEGIN) == 0 );
+    REQUIRE( sim.counters.protocol_errors == 0 );
+}
+
+static esp_loader_error_t ram_download(esp_loader_t *loader, uint32_t offset, const vector<uint8_t> &app,
+                                       uint32_t entrypoint)
+{
+    esp_loader_mem_cfg_t cfg = {};
+    cfg.offset = offset;
+    cfg.size = (uint32_t)app.size();
+    cfg.block_size = ESP_RAM_BLOCK;
+
+    RETURN_ON_ERROR( esp_loader_mem_start(loader, &cfg) );
+    for (size_t sent = 0; sent < app.size(); sent += ESP_RAM_BLOCK) {
+        const uint32_t size = (uint32_t)min<size_t>(ESP_RAM_BLOCK, app.size() - sent);
+        RETURN_ON_ERROR( esp_loader_mem_write(loader, &cfg, &app[sent], size) );
+    }
+    return esp_loader_mem_finish(loader, &cfg, entrypoint);
+}
+
+TEST_CASE( "SPI sim: RAM download and run" )
+{
+    sim_spi_port_t sim;
+    esp_loader_t loader;
+    connect(sim, &loader);
+
+    const vector<uint8_t> app = random_image(20000, 4);
+    ESP_ERR_CHECK( ram_download(&loader, 0x3FC90000, app, 0x40380000) );
+
+    REQUIRE( sim.target.ram_read(0x3FC90000, app.size()) == app );
+    REQUIRE( sim.target.app_entrypoint() == 0x40380000 );
+    REQUIRE( sim.counters.protocol_errors == 0 );
+}
+
+TEST_CASE( "SPI sim: QPI mode speeds up RAM download" )
+{
+    const vector<uint8_t> app = random_image(256 * 1024, 5);
+    double duration_ms[2];
+
+    for (int qpi = 0; qpi < 2; qpi++) {
+        sim_spi_port_t sim;
+        esp_loader_t loader;
+        connect(sim, &loader);
+
+        if (qpi) {
+            ESP_ERR_CHECK( esp_loader_spi_set_mode(&loader, ESP_LOADER_SPI_MODE_QPI) );
+        }
+
+        const uint64_t start = sim.now_ns();
+        ESP_ERR_CHECK( ram_download(&loader, 0x3FC90000, app, 0x40380000) );
+        duration_ms[qpi] = (sim.now_ns() - start) / 1e6;
+        printf("[sim] SPI RAM download %s: %zu bytes in %.3f ms\n", qpi ? "QPI" : "single-line", app.size(),
+               duration_ms[qpi]);
+
+        REQUIRE( sim.target.ram_read(0x3FC90000, app.size()) == app );
+        REQUIRE( sim.counters.protocol_errors == 0 );
+        REQUIRE( sim.counters.mode_mismatches == 0 );
+
+        /* Leaving QPI and reconnecting both bring the link back to single-line */
+        ESP_ERR_CHECK( esp_loader_spi_set_mode(&loader, ESP_LOADER_SPI_MODE_SINGLE) );
+        uint8_t mac[6];
+        ESP_ERR_CHECK( esp_loader_read_mac(&loader, mac) );
+        ESP_ERR_CHECK( esp_loader_spi_set_mode(&loader, ESP_LOADER_SPI_MODE_QPI) );
+        esp_loader_connect_args_t connect_config = ESP_LOADER_CONNECT_DEFAULT();
+        ESP_ERR_CHECK( esp_loader_connect(&loader, &connect_config) );
+        REQUIRE( sim.counters.mode_mismatches == 0 );
+    }
+
+    REQUIRE( duration_ms[1] < duration_ms[0] * 0.5 );
+}
+
+TEST_CASE( "SPI sim: QPI falls back to single-line SPI" )
+{
+    sim_spi_config_t config;
+    config.slave_qpi = false;
+    sim_spi_port_t sim(config);
+    esp_loader_t loader;
+    connect(sim, &loader);
+
+    REQUIRE( esp_loader_spi_set_mode(&loader, ESP_LOADER_SPI_MODE_QPI) == ESP_LOADER_ERROR_FAIL );
+
+    const vector<uint8_t> app = random_image(20000, 6);
+    ESP_ERR_CHECK( ram_download(&loader, 0x3FC90000, app, 0x40380000) );
+    REQUIRE( sim.target.ram_read(0x3FC90000, app.size()) == app );
+    REQUIRE( sim.counters.protocol_errors == 0 );
+
+    sim_spi_config_t single_only;
+    single_only.qpi = false;
+    sim_spi_port_t single_sim(single_only);
+    connect(single_sim, &loader);
+    REQUIRE( esp_loader_spi_set_mode(&loader, ESP_LOADER_SPI_MODE_QPI) == ESP_LOADER_ERROR_UNSUPPORTED_FUNC );
+    REQUIRE( single_sim.counters.mode_mismatches == 0 );
+}
+
+TEST_CASE( "SPI sim: throughput report" )
+{
+    /* Transaction commands of the slave protocol */
+    const uint8_t WRDMA = 0x03, RDDMA = 0x04, WR_DONE = 0x07, CMD8 = 0x08;
+    const uint32_t clocks_khz[] = { 10000, 20000, 40000 };
+    const vector<uint8_t> app = random_image(128 * 1024, 7);
+    const vector<uint8_t> image = random_image(64 * 1024, 8);
+    double last_ram_kbps[2] = { 0, 0 };
+
+    printf("[sim] SPI clock  mode    RAM download      flash write       transactions per command\n");
+
+    for (const uint32_t clock_khz : clocks_khz) {
+        for (int qpi = 0; qpi < 2; qpi++) {
+            sim_spi_config_t config;
+            config.bus.clock_khz = clock_khz;
+            sim_spi_port_t sim(config);
+            esp_loader_t loader;
+            connect(sim, &loader);
+            if (qpi) {
+                ESP_ERR_CHECK( esp_loader_spi_set_mode(&loader, ESP_LOADER_SPI_MODE_QPI) );
+            }
+
+            uint64_t start = sim.now_ns();
+            ESP_ERR_CHECK( ram_download(&loader, 0x3FC90000, app, 0x40380000) );
+            const double ram_kbps = app.size() / 1024.0 / ((sim.now_ns() - start) / 1e9);
+
+            const uint32_t commands_before = sim.counters.packets_to_slave;
+            const uint32_t transactions_before = sim.counters.transactions - sim.counters.status_reads;
+            start = sim.now_ns();
+            ESP_ERR_CHECK( flash_image(&loader, APP_START_ADDRESS, image, SPI_BLOCK_SIZE) );
+            const double flash_kbps = image.size() / 1024.0 / ((sim.now_ns() - start) / 1e9);
+            const uint32_t commands = sim.counters.packets_to_slave - commands_before;
+            const uint32_t transactions = sim.counters.transactions - sim.counters.status_reads - transactions_before;
+
+            printf("[sim] %5u kHz  %-6s  %8.1f KiB/s    %8.1f KiB/s    %.1f\n", clock_khz, qpi ? "QPI" : "single",
+                   ram_kbps, flash_kbps, (double)transactions / commands);
+
+            /* Every command is one write, its terminator, one read and its terminator */
+            REQUIRE( sim.transaction_count(WRDMA) == sim.counters.packets_to_slave );
+            REQUIRE( sim.transaction_count(WR_DONE) == sim.counters.packets_to_slave );
+            REQUIRE( sim.transaction_count(RDDMA) == sim.counters.packets_to_host );
+            REQUIRE( sim.transaction_count(CMD8) == sim.counters.packets_to_host );
+            REQUIRE( sim.counters.protocol_errors == 0 );
+
+            REQUIRE( ram_kbps > last_ram_kbps[qpi] );
+            last_ram_kbps[qpi] = ram_kbps;
+        }
+    }
+}
+
+TEST_CASE( "SPI sim: differential write through the ROM loader" )
+{
+    sim_spi_port_t sim;
+    esp_loader_t loader;
+    connect(sim, &loader);
+
+    vector<uint8_t> image = random_image(16 * 4096, 8);
+    ESP_ERR_CHECK( flash_image(&loader, APP_START_ADDRESS, image, SPI_BLOCK_SIZE) );
+
+    fill(image.begin() + 5 * 4096, image.begin() + 6 * 4096, 0x00);
+
+    esp_loader_flash_diff_cfg_t cfg = {};
+    cfg.offset = APP_START_ADDRESS;
+    cfg.image = image.data();
+    cfg.image_size = (uint32_t)image.size();
+    cfg.granularity = 8192;
+    cfg.block_size = SPI_BLOCK_SIZE;
+
+    const uint32_t md5_before = sim.target.command_count(SPI_FLASH_MD5);
+    ESP_ERR_CHECK( esp_loader_flash_diff_write(&loader, &cfg) );
+
+    REQUIRE( equal(image.begin(), image.end(), sim.target.flash.begin() + APP_START_ADDRESS) );
+    REQUIRE( cfg.units_changed == 1 );
+    REQUIRE( cfg.bytes_written == 8192 );
+    REQUIRE( sim.target.command_count(SPI_FLASH_MD5) - md5_before == 8 + 1 );
+    REQUIRE( sim.counters.protocol_errors == 0 );
+}
+
+TEST_CASE( "SPI sim: flash fingerprint decodes the hex digests of the ROM loader" )
+{
+    sim_spi_port_t sim;
+    esp_loader_t loader;
+    connect(sim, &loader);
+
+    const vector<uint8_t> image = random_image(5 * 4096, 10);
+    ESP_ERR_CHECK( flash_image(&loader, APP_START_ADDRESS, image, SPI_BLOCK_SIZE) );
+
+    vector<uint8_t> hashes(5 * ESP_LOADER_MD5_DIGEST_SIZE);
+    ESP_ERR_CHECK( esp_loader_flash_fingerprint(&loader, APP_START_ADDRESS, (uint32_t)image.size(), 4096,
+                   hashes.data()) );
+
+    for (uint32_t i = 0; i < 5; i++) {
+        uint8_t expected[ESP_LOADER_MD5_DIGEST_SIZE];
+        struct MD5Context md5;
+        MD5Init(&md5);
+        MD5Update(&md5, &image[i * 4096], 4096);
+        MD5Final(expected, &md5);
+        REQUIRE( equal(begin(expected), end(expected), &hashes[i * ESP_LOADER_MD5_DIGEST_SIZE]) );
+    }
+
+    REQUIRE( esp_loader_flash_fingerprint(&loader, APP_START_ADDRESS, 0, 4096, hashes.data())
+             == ESP_LOADER_ERROR_INVALID_PARAM );
+    REQUIRE( sim.counters.protocol_errors == 0 );
+}
+
+TEST_CASE( "SPI sim: sparse write skips the blank blocks of an image" )
+{
+    sim_spi_port_t sim;
+    esp_loader_t loader;
+    connect(sim, &loader);
+
+    const uint32_t BLOCK = 64 * 1024;
+
+    // Old contents everywhere, so that a block left unerased shows up
+    const vector<uint8_t> old_image = random_image(6 * BLOCK, 11);
+    ESP_ERR_CHECK( flash_image(&loader, APP_START_ADDRESS, old_image, SPI_BLOCK_SIZE) );
+
+    // Data at the start and in block 4, blank blocks 1 to 3 and 5, a short blank tail
+    vector<uint8_t> image(6 * BLOCK + 2048, 0xFF);
+    const vector<uint8_t> data = random_image(3 * 4096, 12);
+    copy(data.begin(), data.begin() + 2 * 4096, image.begin() + 4096);
+    copy(data.begin() + 2 * 4096, data.end(), image.begin() + 4 * BLOCK + 8192);
+
+    uint64_t start = sim.now_ns();
+    ESP_ERR_CHECK( flash_image(&loader, APP_START_ADDRESS, image, SPI_BLOCK_SIZE) );
+    const uint64_t full_ns = sim.now_ns() - start;
+
+    ESP_ERR_CHECK( flash_image(&loader, APP_START_ADDRESS, old_image, SPI_BLOCK_SIZE) );
+
+    esp_loader_flash_sparse_cfg_t cfg = {};
+    cfg.offset = APP_START_ADDRESS;
+    cfg.image = image.data();
+    cfg.image_size = (uint32_t)image.size();
+    cfg.block_size = SPI_BLOCK_SIZE;
+
+    const uint32_t data_before = sim.target.command_count(FLASH_DATA);
+    start = sim.now_ns();
+    ESP_ERR_CHECK( esp_loader_flash_write_sparse(&loader, &cfg) );
+    const uint64_t sparse_ns = sim.now_ns() - start;
+
+    printf("[sim] SPI sparse write: %.3f ms, %u data blocks (full write %.3f ms, %zu data blocks)\n",
+           sparse_ns / 1e6, sim.target.command_count(FLASH_DATA) - data_before,
+           full_ns / 1e6, (image.size() + SPI_BLOCK_SIZE - 1) / SPI_BLOCK_SIZE);
+
+    REQUIRE( equal(image.begin(), image.end(), sim.target.flash.begin() + APP_START_ADDRESS) );
+    REQUIRE( cfg.runs == 2 );
+    REQUIRE( cfg.bytes_skipped == 4 * BLOCK + 2048 );
+    REQUIRE( sim.target.command_count(FLASH_DATA) - data_before == 2 * BLOCK / SPI_BLOCK_SIZE );
+    REQUIRE( sparse_ns < full_ns );
+    REQUIRE( sim.counters.protocol_errors == 0 );
+}
+
+TEST_CASE( "SPI sim: sparse write leaves blocks that are blank already unerased" )
+{
+    sim_spi_port_t sim;
+    esp_loader_t loader;
+    connect(sim, &loader);
+
+    const uint32_t BLOCK = 64 * 1024;
+
+    // Data in blocks 0 and 5, blank blocks 1 to 4 of which only block 3 holds old data in flash
+    vector<uint8_t> image(6 * BLOCK, 0xFF);
+    const vector<uint8_t> data = random_image(3 * 4096, 15);
+    copy(data.begin(), data.begin() + 2 * 4096, image.begin());
+    copy(data.begin() + 2 * 4096, data.end(), image.begin() + 5 * BLOCK);
+    const vector<uint8_t> old_block = random_image(BLOCK, 16);
+
+    uint64_t elapsed_ns[2];
+    for (int skip_blank_erase = 0; skip_blank_erase < 2; skip_blank_erase++) {
+        ESP_ERR_CHECK( flash_image(&loader, APP_START_ADDRESS + 3 * BLOCK, old_block, SPI_BLOCK_SIZE) );
+
+        esp_loader_flash_sparse_cfg_t cfg = {};
+        cfg.offset = APP_START_ADDRESS;
+        cfg.image = image.data();
+        cfg.image_size = (uint32_t)image.size();
+        cfg.block_size = SPI_BLOCK_SIZE;
+        cfg.skip_blank_erase = skip_blank_erase;
+
+        const uint64_t start = sim.now_ns();
+        ESP_ERR_CHECK( esp_loader_flash_write_sparse(&loader, &cfg) );
+        elapsed_ns[skip_blank_erase] = sim.now_ns() - start;
+
+        REQUIRE( equal(image.begin(), image.end(), sim.target.flash.begin() + APP_START_ADDRESS) );
+        REQUIRE( cfg.bytes_skipped == 4 * BLOCK );
+        REQUIRE( cfg.bytes_erase_skipped == (skip_blank_erase ? 3 * BLOCK : 0) );
+    }
+
+    printf("[sim] SPI sparse write: %.3f ms erasing all blank blocks, %.3f ms only those not blank already\n",
+           elapsed_ns[0] / 1e6, elapsed_ns[1] / 1e6);
+    REQUIRE( elapsed_ns[1] < elapsed_ns[0] );
+    REQUIRE( sim.counters.protocol_errors == 0 );
+}
+
+TEST_CASE( "SPI sim: repair rewrites only the damaged sectors" )
+{
+    sim_spi_port_t sim;
+    esp_loader_t loader;
+    connect(sim, &loader);
+
+    const vector<uint8_t> image = random_image(64 * 4096 + 1000, 17);
+    uint64_t start = sim.now_ns();
+    ESP_ERR_CHECK( flash_image(&loader, APP_START_ADDRESS, image, SPI_BLOCK_SIZE) );
+    const uint64_t reflash_ns = sim.now_ns() - start;
+
+    // Two adjacent damaged sectors, one on its own and the partial last sector
+    for (uint32_t sector : { 5, 6, 40, 64 }) {
+        sim.target.flash[APP_START_ADDRESS + sector * 4096 + 100] ^= 0x10;
+    }
+
+    esp_loader_flash_repair_cfg_t cfg = {};
+    cfg.offset = APP_START_ADDRESS;
+    cfg.image = image.data();
+    cfg.image_size = (uint32_t)image.size();
+    cfg.block_size = SPI_BLOCK_SIZE;
+
+    const uint32_t md5_before = sim.target.command_count(SPI_FLASH_MD5);
+    start = sim.now_ns();
+    ESP_ERR_CHECK( esp_loader_flash_repair(&loader, &cfg) );
+    const uint64_t repair_ns = sim.now_ns() - start;
+
+    printf("[sim] SPI repair: %u sectors rewritten with %u MD5 queries in %.3f ms, full reflash %.3f ms\n",
+           cfg.sectors_rewritten, cfg.md5_queries, repair_ns / 1e6, reflash_ns / 1e6);
+
+    REQUIRE( equal(image.begin(), image.end(), sim.target.flash.begin() + APP_START_ADDRESS) );
+    REQUIRE( cfg.sectors_rewritten == 4 );
+    REQUIRE( cfg.runs == 3 );
+    REQUIRE( cfg.rounds == 1 );
+    REQUIRE( sim.target.command_count(SPI_FLASH_MD5) - md5_before == cfg.md5_queries );
+    REQUIRE( cfg.md5_queries < 40 );
+    REQUIRE( repair_ns < reflash_ns / 2 );
+
+    // An intact image costs a single query
+    ESP_ERR_CHECK( esp_loader_flash_repair(&loader, &cfg) );
+    REQUIRE( cfg.md5_queries == 1 );
+    REQUIRE( cfg.sectors_rewritten == 0 );
+
+    cfg.offset += 4;
+    REQUIRE( esp_loader_flash_repair(&loader, &cfg) == ESP_LOADER_ERROR_INVALID_PARAM );
+    REQUIRE( sim.counters.protocol_errors == 0 );
+}
+
+TEST_CASE( "SPI sim: interrupted write resumes from the journal" )
+{
+    sim_spi_port_t sim;
+    esp_loader_t loader;
+    connect(sim, &loader);
+
+    const vector<uint8_t> image = random_image(32 * 4096, 18);
+    esp_loader_flash_journal_t journal = {};
+    journal_saver_t saver = {};
+    saver.cut_at = 10 * 4096;
+
+    esp_loader_flash_resumable_cfg_t cfg = {};
+    cfg.offset = APP_START_ADDRESS;
+    cfg.image = image.data();
+    cfg.image_size = (uint32_t)image.size();
+    cfg.block_size = SPI_BLOCK_SIZE;
+    cfg.journal = &journal;
+    cfg.journal_update = save_journal;
+    cfg.journal_ctx = &saver;
+
+    REQUIRE( esp_loader_flash_write_resumable(&loader, &cfg) == ESP_LOADER_ERROR_TIMEOUT );
+    REQUIRE( saver.saved.confirmed == 9 * 4096 );
+
+    // The target resets and loses the last sector it acknowledged
+    fill(sim.target.flash.begin() + APP_START_ADDRESS + 8 * 4096, sim.target.flash.begin() + APP_START_ADDRESS + 9 * 4096, 0xFF);
+    connect(sim, &loader);
+
+    journal = saver.saved;
+    const uint32_t blocks_before = sim.target.command_count(FLASH_DATA);
+    ESP_ERR_CHECK( esp_loader_flash_write_resumable(&loader, &cfg) );
+
+    REQUIRE( cfg.resumed_from == 8 * 4096 );
+    REQUIRE( sim.target.command_count(FLASH_DATA) - blocks_before == 32 - 8 );
+    REQUIRE( equal(image.begin(), image.end(), sim.target.flash.begin() + APP_START_ADDRESS) );
+    REQUIRE( journal.confirmed == image.size() );
+
+    // A finished journal only verifies, one for another image starts over
+    ESP_ERR_CHECK( esp_loader_flash_write_resumable(&loader, &cfg) );
+    REQUIRE( cfg.resumed_from == image.size() );
+    REQUIRE( sim.target.command_count(FLASH_DATA) - blocks_before == 32 - 8 );
+
+    journal.image_md5[0] ^= 1;
+    ESP_ERR_CHECK( esp_loader_flash_write_resumable(&loader, &cfg) );
+    REQUIRE( cfg.resumed_from == 0 );
+    REQUIRE( sim.counters.protocol_errors == 0 );
+}
+
+static esp_loader_profile_t capture_profile()
+{
+    sim_spi_port_t sim;
+    esp_loader_t loader;
+    connect(sim, &loader);
+
+    esp_loader_profile_t profile;
+    ESP_ERR_CHECK( esp_loader_profile_capture(&loader, &profile) );
+    REQUIRE( profile.magic == ESP_LOADER_PROFILE_MAGIC );
+    REQUIRE( profile.target_chip == ESP32C3_CHIP );
+    REQUIRE( equal(begin(profile.mac), end(profile.mac), sim.config.target.mac.begin()) );
+    REQUIRE( profile.flash_size == sim.config.target.flash_size );
+    return profile;
+}
+
+static void connect_with_profile(sim_spi_port_t &sim, esp_loader_t *loader, const esp_loader_profile_t &profile)
+{
+    ESP_ERR_CHECK( esp_loader_init_spi(loader, &sim.port) );
+    ESP_ERR_CHECK( esp_loader_profile_apply(loader, &profile) );
+    esp_loader_connect_args_t connect_config = ESP_LOADER_CONNECT_DEFAULT();
+    ESP_ERR_CHECK( esp_loader_connect(loader, &connect_config) );
+}
+
+/* Whether a flash range beyond 2 MB is accepted, which tells the flash size the loader works with */
+static bool flash_above_2mb_usable(esp_loader_t *loader)
+{
+    uint8_t hash[ESP_LOADER_MD5_DIGEST_SIZE];
+    return esp_loader_flash_fingerprint(loader, 3 * 1024 * 1024, 4096, 0, hash) == ESP_LOADER_SUCCESS;
+}
+
+TEST_CASE( "SPI sim: a matching profile replaces the probes" )
+{
+    esp_loader_profile_t profile = capture_profile();
+    // A size the chip would never report, so that its use shows the probe was skipped
+    profile.flash_size = 2 * 1024 * 1024;
+
+    sim_spi_port_t sim;
+    esp_loader_t loader;
+    connect_with_profile(sim, &loader, profile);
+
+    REQUIRE( esp_loader_get_target(&loader) == ESP32C3_CHIP );
+    REQUIRE_FALSE( flash_above_2mb_usable(&loader) );
+    REQUIRE( sim.counters.protocol_errors == 0 );
+}
+
+TEST_CASE( "SPI sim: a profile of another board is dropped" )
+{
+    esp_loader_profile_t profile = capture_profile();
+    profile.flash_size = 2 * 1024 * 1024;
+
+    sim_spi_config_t config;
+    config.target.mac[5] ^= 0x01;
+    sim_spi_port_t sim(config);
+    esp_loader_t loader;
+    connect_with_profile(sim, &loader, profile);
+
+    REQUIRE( esp_loader_get_target(&loader) == ESP32C3_CHIP );
+    REQUIRE( flash_above_2mb_usable(&loader) );
+    REQUIRE( sim.counters.protocol_errors == 0 );
+}
+
+TEST_CASE( "SPI sim: a profile without its magic is rejected" )
+{
+    esp_loader_profile_t profile = capture_profile();
+    profile.flash_size = 2 * 1024 * 1024;
+    profile.magic ^= 0x01;
+
+    sim_spi_port_t sim;
+    esp_loader_t loader;
+    ESP_ERR_CHECK( esp_loader_init_spi(&loader, &sim.port) );
+    REQUIRE( esp_loader_profile_apply(&loader, &profile) == ESP_LOADER_ERROR_INVALID_PARAM );
+
+    esp_loader_connect_args_t connect_config = ESP_LOADER_CONNECT_DEFAULT();
+    ESP_ERR_CHECK( esp_loader_connect(&loader, &connect_config) );
+    REQUIRE( flash_above_2mb_usable(&loader) );
+    REQUIRE( sim.counters.protocol_errors == 0 );
+}
@@ -0,0 +1,610 @@
+/*
+ * SPDX-FileCopyrightText: 2026 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "sim_target.h"
+#include "protocol.h"
+#include "esp_stubs.h"
+#include "md5_hash.h"
+
+#include <string.h>
+#include <algorithm>
+
+#ifdef SIM_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+using namespace std;
+
+#define SECTOR_SIZE 4096U
+#define BLOCK_SIZE (64U * 1024U)
+#define SPI_CMD_USR (1U << 18)
+#define SPI_FLASH_READ_ID 0x9F
+
+typedef struct {
+    target_chip_t chip;
+    uint32_t efuse_base;
+    uint32_t chip_id;
+    uint32_t spi_cmd;
+    uint32_t spi_usr2;
+    uint32_t spi_w0;
+} sim_chip_info_t;
+
+static const sim_chip_info_t s_chip_info[] = {
+    { ESP32_CHIP,    0x3ff5A000, 0,  0x3ff42000, 0x3ff42024, 0x3ff42080 },
+    { ESP32C3_CHIP,  0x60008800, 5,  0x60002000, 0x60002020, 0x60002058 },
+    { ESP32S3_CHIP,  0x60007000, 9,  0x60002000, 0x60002020, 0x60002058 },
+    { ESP32C5_CHIP,  0x600B4800, 23, 0x60003000, 0x60003020, 0x60003058 },
+    { ESP32C6_CHIP,  0x600B0800, 13, 0x60003000, 0x60003020, 0x60003058 },
+    { ESP32C61_CHIP, 0x600B4800, 20, 0x60003000, 0x60003020, 0x60003058 },
+};
+
+static const sim_chip_info_t *chip_info(target_chip_t chip)
+{
+    for (const sim_chip_info_t &info : s_chip_info) {
+        if (info.chip == chip) {
+            return &info;
+        }
+    }
+    return &s_chip_info[0];
+}
+
+static uint32_t read_u32(const uint8_t *data)
+{
+    uint32_t value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+static uint8_t checksum(const uint8_t *data, size_t size)
+{
+    uint8_t sum = 0xEF;
+    while (size--) {
+        sum ^= *data++;
+    }
+    return sum;
+}
+
+static void send_response(deque<sim_packet_t> &out, uint64_t ready_ns, uint8_t command, uint32_t value,
+                          const void *data, size_t size, uint8_t error)
+{
+    common_response_t header = {};
+    header.direction = READ_DIRECTION;
+    header.command = command;
+    header.size = (uint16_t)(size + sizeof(response_status_t));
+    header.value = value;
+
+    response_status_t status = {};
+    status.failed = error != 0 ? STATUS_FAILURE : STATUS_SUCCESS;
+    status.error = error;
+
+    sim_packet_t packet = { ready_ns, {} };
+    const uint8_t *header_bytes = reinterpret_cast<const uint8_t *>(&header);
+    const uint8_t *status_bytes = reinterpret_cast<const uint8_t *>(&status);
+    packet.data.insert(packet.data.end(), header_bytes, header_bytes + sizeof(header));
+    if (size > 0) {
+        const uint8_t *bytes = static_cast<const uint8_t *>(data);
+        packet.data.insert(packet.data.end(), bytes, bytes + size);
+    }
+    packet.data.insert(packet.data.end(), status_bytes, status_bytes + sizeof(status));
+    out.push_back(move(packet));
+}
+
+struct sim_target_t::flash_op_t {
+    bool compressed;
+    uint32_t offset;
+    uint32_t erase_end;
+    uint32_t erased_to;
+    uint32_t written;
+    uint32_t next_sequence;
+#ifdef SIM_HAVE_ZLIB
+    z_stream stream;
+#endif
+};
+
+struct sim_target_t::read_op_t {
+    uint32_t address;
+    uint32_t total_size;
+    uint32_t packet_size;
+    uint32_t max_inflight;
+    uint32_t sent;
+    uint32_t acked;
+    struct MD5Context md5;
+};
+
+sim_target_t::sim_target_t(const sim_target_config_t &config)
+    : config(config), flash(config.flash_size, 0xFF)
+{
+    reset();
+}
+
+sim_target_t::~sim_target_t()
+{
+    reset();
+}
+
+void sim_target_t::end_flash_op()
+{
+#ifdef SIM_HAVE_ZLIB
+    if (m_flash_op && m_flash_op->compressed) {
+        inflateEnd(&m_flash_op->stream);
+    }
+#endif
+    m_flash_op.reset();
+}
+
+void sim_target_t::reset()
+{
+    end_flash_op();
+    m_read_op.reset();
+    m_stub_running = false;
+    m_app_entrypoint = 0;
+    m_busy_until_ns = 0;
+    m_ram.clear();
+    registers.clear();
+
+    const sim_chip_info_t *info = chip_info(config.chip);
+    const uint32_t mac_lo = ((uint32_t)config.mac[2] << 24) | ((uint32_t)config.mac[3] << 16) |
+                            ((uint32_t)config.mac[4] << 8) | config.mac[5];
+    const uint32_t mac_hi = ((uint32_t)config.mac[0] << 8) | config.mac[1];
+    registers[info->efuse_base + 0x44] = mac_lo;
+    registers[info->efuse_base + 0x48] = mac_hi;
+}
+
+void sim_target_t::ram_write(uint32_t addr, const uint8_t *data, size_t size)
+{
+    for (size_t i = 0; i < size; i++) {
+        m_ram[(addr + i) / 4096][(addr + i) % 4096] = data[i];
+    }
+}
+
+vector<uint8_t> sim_target_t::ram_read(uint32_t addr, size_t size) const
+{
+    vector<uint8_t> data(size, 0);
+    for (size_t i = 0; i < size; i++) {
+        auto page = m_ram.find((addr + i) / 4096);
+        if (page != m_ram.end()) {
+            data[i] = page->second[(addr + i) % 4096];
+        }
+    }
+    return data;
+}
+
+void sim_target_t::boot(uint32_t entrypoint, uint64_t now_ns, deque<sim_packet_t> &out)
+{
+    const esp_stub_t *stub = esp_stub[config.chip];
+    bool is_stub = stub != NULL && entrypoint == stub->header.entrypoint;
+
+    for (size_t i = 0; is_stub && i < sizeof(stub->segments) / sizeof(stub->segments[0]); i++) {
+        const esp_loader_bin_segment_t &seg = stub->segments[i];
+        is_stub = ram_read(seg.addr, seg.size) == vector<uint8_t>(seg.data, seg.data + seg.size);
+    }
+
+    if (!is_stub) {
+        m_stub_running = false;
+        m_app_entrypoint = entrypoint;
+        return;
+    }
+
+    m_stub_running = true;
+    m_busy_until_ns = now_ns + config.timing.boot_ns;
+    out.push_back({ m_busy_until_ns, { 'O', 'H', 'A', 'I' } });
+}
+
+void sim_target_t::inject_error(uint8_t command, uint8_t error, uint32_t nth)
+{
+    m_injected.push_back({ command, error, nth });
+}
+
+bool sim_target_t::take_injected_error(uint8_t command, uint8_t *error)
+{
+    for (auto it = m_injected.begin(); it != m_injected.end(); ++it) {
+        if (it->command != command) {
+            continue;
+        }
+        if (it->nth > 0) {
+            it->nth--;
+            continue;
+        }
+        *error = it->error;
+        m_injected.erase(it);
+        return true;
+    }
+    return false;
+}
+
+uint32_t sim_target_t::command_count(uint8_t command) const
+{
+    auto it = m_command_counts.find(command);
+    return it != m_command_counts.end() ? it->second : 0;
+}
+
+uint64_t sim_target_t::receive(const uint8_t *data, size_t size, uint64_t now_ns, deque<sim_packet_t> &out)
+{
+    const uint64_t start_ns = max(now_ns, m_busy_until_ns);
+
+    if (m_read_op && size == sizeof(uint32_t)) {
+        m_busy_until_ns = handle_read_ack(data, size, start_ns, out);
+    } else {
+        m_busy_until_ns = handle_command(data, size, start_ns, out);
+    }
+
+    return m_busy_until_ns;
+}
+
+uint64_t sim_target_t::flash_erase(uint32_t addr, uint32_t size)
+{
+    uint64_t time_ns = 0;
+    uint32_t end = addr + size;
+
+    while (addr < end) {
+        const uint32_t erase_size = (addr % BLOCK_SIZE == 0 && end - addr >= BLOCK_SIZE) ? BLOCK_SIZE : SECTOR_SIZE;
+        fill(flash.begin() + addr, flash.begin() + addr + erase_size, 0xFF);
+        time_ns += erase_size == BLOCK_SIZE ? config.timing.block_erase_ns : config.timing.sector_erase_ns;
+        addr += erase_size;
+    }
+
+    return time_ns;
+}
+
+/* Programs flash with NOR semantics: bits can only be cleared, erasing the
+   region ahead of the write the way the stub does while data arrives */
+uint64_t sim_target_t::flash_write(uint32_t addr, const uint8_t *data, size_t size)
+{
+    uint64_t time_ns = 0;
+    flash_op_t &op = *m_flash_op;
+
+    if (op.erased_to < op.erase_end && op.erased_to < addr + size) {
+        const uint32_t erase_to = min(op.erase_end, (uint32_t)ROUNDUP(addr + size, SECTOR_SIZE));
+        uint32_t erase_from = op.erased_to;
+        while (erase_from < erase_to) {
+            /* Whole 64 KB blocks are erased at once, even if the data only reaches into them */
+            const bool block = erase_from % BLOCK_SIZE == 0 && op.erase_end - erase_from >= BLOCK_SIZE;
+            const uint32_t erase_size = block ? BLOCK_SIZE : SECTOR_SIZE;
+            time_ns += flash_erase(erase_from, erase_size);
+            erase_from += erase_size;
+        }
+        op.erased_to = erase_from;
+    }
+
+    for (size_t i = 0; i < size; i++) {
+        flash[addr + i] &= data[i];
+    }
+
+    return time_ns + config.timing.program_ns_per_byte * size;
+}
+
+void sim_target_t::reg_write(uint32_t addr, uint32_t value, uint32_t mask)
+{
+    const sim_chip_info_t *info = chip_info(config.chip);
+    registers[addr] = (registers[addr] & ~mask) | (value & mask);
+
+    if (addr == info->spi_cmd && (registers[addr] & SPI_CMD_USR) != 0) {
+        if ((registers[info->spi_usr2] & 0xFF) == SPI_FLASH_READ_ID) {
+            registers[info->spi_w0] = config.flash_id;
+        }
+        registers[addr] &= ~SPI_CMD_USR;
+    }
+}
+
+void sim_target_t::send_read_packet(uint64_t start_ns, deque<sim_packet_t> &out)
+{
+    read_op_t &op = *m_read_op;
+    uint64_t ready_ns = start_ns;
+
+    while (op.sent < op.total_size && (op.sent - op.acked) / op.packet_size < op.max_inflight) {
+        const uint32_t size = min(op.packet_size, op.total_size - op.sent);
+        const uint8_t *data = &flash[op.address + op.sent];
+        MD5Update(&op.md5, data, size);
+        ready_ns += config.timing.read_ns_per_byte * size;
+        out.push_back({ ready_ns, vector<uint8_t>(data, data + size) });
+        op.sent += size;
+    }
+    m_busy_until_ns = ready_ns;
+}
+
+uint64_t sim_target_t::handle_read_ack(const uint8_t *data, size_t size, uint64_t start_ns, deque<sim_packet_t> &out)
+{
+    (void)size;
+    read_op_t &op = *m_read_op;
+    op.acked = min(read_u32(data), op.sent);
+
+    if (op.acked < op.total_size) {
+        send_read_packet(start_ns, out);
+        return m_busy_until_ns;
+    }
+
+    sim_packet_t digest = { start_ns, vector<uint8_t>(16) };
+    MD5Final(digest.data.data(), &op.md5);
+    out.push_back(move(digest));
+    m_read_op.reset();
+    return start_ns;
+}
+
+uint64_t sim_target_t::handle_command(const uint8_t *data, size_t size, uint64_t start_ns, deque<sim_packet_t> &out)
+{
+    command_common_t common = {};
+    if (size < sizeof(common)) {
+        return start_ns;
+    }
+    memcpy(&common, data, sizeof(common));
+    m_command_counts[common.command]++;
+
+    const uint8_t *payload = data + sizeof(common);
+    const size_t payload_size = size - sizeof(common);
+    uint64_t end_ns = start_ns + config.timing.command_ns;
+    uint32_t value = 0;
+    vector<uint8_t> resp_data;
+    uint8_t error = 0;
+
+    if (common.direction != WRITE_DIRECTION || common.size != payload_size) {
+        send_response(out, end_ns, common.command, 0, NULL, 0, STUB_BAD_DATA_LEN);
+        return end_ns;
+    }
+
+    if (take_injected_error(common.command, &error)) {
+        send_response(out, end_ns, common.command, 0, NULL, 0, error);
+        return end_ns;
+    }
+
+    const bool stub_only = common.command == ERASE_FLASH || common.command == ERASE_REGION ||
+                           common.command == READ_FLASH_STUB;
+    if (stub_only && !m_stub_running) {
+        send_response(out, end_ns, common.command, 0, NULL, 0, INVALID_COMMAND);
+        return end_ns;
+    }
+
+    switch (common.command) {
+    case FLASH_BEGIN:
+    case FLASH_DEFL_BEGIN: {
+        if (payload_size < 16) {
+            error = STUB_BAD_DATA_LEN;
+            break;
+        }
+        const uint32_t erase_size = read_u32(payload);
+        const uint32_t offset = read_u32(payload + 12);
+        if ((uint64_t)offset + erase_size > flash.size()) {
+            error = STUB_FAILED_SPI_OP;
+            break;
+        }
+#ifndef SIM_HAVE_ZLIB
+        if (common.command == FLASH_DEFL_BEGIN) {
+            error = STUB_CMD_NOT_IMPLEMENTED;
+            break;
+        }
+#endif
+        end_flash_op();
+        m_flash_op.reset(new flash_op_t());
+        m_flash_op->compressed = common.command == FLASH_DEFL_BEGIN;
+        m_flash_op->offset = offset;
+        m_flash_op->erased_to = offset - offset % SECTOR_SIZE;
+        m_flash_op->erase_end = min((uint32_t)flash.size(), (uint32_t)ROUNDUP(offset + erase_size, SECTOR_SIZE));
+        if (!m_stub_running) {
+            end_ns += flash_erase(m_flash_op->erased_to, m_flash_op->erase_end - m_flash_op->erased_to);
+            m_flash_op->erased_to = m_flash_op->erase_end;
+        }
+#ifdef SIM_HAVE_ZLIB
+        if (m_flash_op->compressed && inflateInit(&m_flash_op->stream) != Z_OK) {
+            error = STUB_INFLATE_ERROR;
+        }
+#endif
+        break;
+    }
+
+    case FLASH_DATA:
+    case FLASH_DEFL_DATA: {
+        const bool compressed = common.command == FLASH_DEFL_DATA;
+        if (!m_flash_op || m_flash_op->compressed != compressed) {
+            error = STUB_NOT_IN_FLASH_MODE;
+            break;
+        }
+        if (payload_size < 16 || read_u32(payload) != payload_size - 16) {
+            error = STUB_BAD_DATA_LEN;
+            break;
+        }
+        const uint8_t *block = payload + 16;
+        const uint32_t block_size = payload_size - 16;
+        if (checksum(block, block_size) != common.checksum) {
+            error = STUB_BAD_DATA_CHECKSUM;
+            break;
+        }
+        if (read_u32(payload + 4) != m_flash_op->next_sequence) {
+            error = STUB_BAD_DATA_LEN;
+            break;
+        }
+        m_flash_op->next_sequence++;
+
+        if (!compressed) {
+            if (m_flash_op->offset + m_flash_op->written + block_size > m_flash_op->erase_end) {
+                error = STUB_TOO_MUCH_DATA;
+                break;
+            }
+            end_ns += flash_write(m_flash_op->offset + m_flash_op->written, block, block_size);
+            m_flash_op->written += block_size;
+            break;
+        }
+#ifdef SIM_HAVE_ZLIB
+        z_stream &stream = m_flash_op->stream;
+        stream.next_in = const_cast<uint8_t *>(block);
+        stream.avail_in = block_size;
+        while (stream.avail_in > 0) {
+            uint8_t buf[4096];
+            stream.next_out = buf;
+            stream.avail_out = sizeof(buf);
+            const int ret = inflate(&stream, Z_NO_FLUSH);
+            if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+                error = STUB_INFLATE_ERROR;
+                break;
+            }
+            const uint32_t produced = sizeof(buf) - stream.avail_out;
+            if (m_flash_op->offset + m_flash_op->written + produced > m_flash_op->erase_end) {
+                error = STUB_TOO_MUCH_DATA;
+                break;
+            }
+            end_ns += flash_write(m_flash_op->offset + m_flash_op->written, buf, produced);
+            end_ns += config.timing.inflate_ns_per_byte * produced;
+            m_flash_op->written += produced;
+            if (ret == Z_STREAM_END || (produced == 0 && ret == Z_BUF_ERROR)) {
+                break;
+            }
+        }
+#endif
+        break;
+    }
+
+    case FLASH_END:
+    case FLASH_DEFL_END:
+        if (!m_flash_op) {
+            error = STUB_NOT_IN_FLASH_MODE;
+            break;
+        }
+        end_flash_op();
+        break;
+
+    case MEM_BEGIN:
+        if (payload_size < 16) {
+            error = STUB_BAD_DATA_LEN;
+            break;
+        }
+        m_mem_addr = read_u32(payload + 12);
+        break;
+
+    case MEM_DATA:
+        if (payload_size < 16 || read_u32(payload) != payload_size - 16) {
+            error = STUB_BAD_DATA_LEN;
+            break;
+        }
+        ram_write(m_mem_addr, payload + 16, payload_size - 16);
+        m_mem_addr += payload_size - 16;
+        break;
+
+    case MEM_END:
+        if (payload_size < 8) {
+            error = STUB_BAD_DATA_LEN;
+            break;
+        }
+        send_response(out, end_ns, common.command, 0, NULL, 0, 0);
+        if (read_u32(payload) == 0) {
+            m_stub_running = false;
+            m_app_entrypoint = read_u32(payload + 4);
+        }
+        return end_ns;
+
+    case WRITE_REG:
+        if (payload_size < 16) {
+            error = STUB_BAD_DATA_LEN;
+            break;
+        }
+        reg_write(read_u32(payload), read_u32(payload + 4), read_u32(payload + 8));
+        end_ns += (uint64_t)read_u32(payload + 12) * 1000;
+        break;
+
+    case READ_REG:
+        if (payload_size < 4) {
+            error = STUB_BAD_DATA_LEN;
+            break;
+        }
+        value = registers[read_u32(payload)];
+        break;
+
+    case SPI_ATTACH:
+    case SPI_SET_PARAMS:
+    case CHANGE_BAUDRATE:
+        break;
+
+    case SPI_FLASH_MD5: {
+        const uint32_t address = payload_size >= 8 ? read_u32(payload) : 0;
+        const uint32_t length = payload_size >= 8 ? read_u32(payload + 4) : 0;
+        if (payload_size < 8 || (uint64_t)address + length > flash.size()) {
+            error = STUB_BAD_DATA_LEN;
+            break;
+        }
+        struct MD5Context md5;
+        MD5Init(&md5);
+        MD5Update(&md5, &flash[address], length);
+        uint8_t digest[16];
+        MD5Final(digest, &md5);
+        if (m_stub_running) {
+            resp_data.assign(digest, digest + sizeof(digest));
+        } else {
+            static const char hex[] = "0123456789abcdef";
+            for (uint8_t byte : digest) {
+                resp_data.push_back(hex[byte >> 4]);
+                resp_data.push_back(hex[byte & 0xF]);
+            }
+        }
+        end_ns += (config.timing.read_ns_per_byte + config.timing.md5_ns_per_byte) * length;
+        break;
+    }
+
+    case READ_FLASH_ROM: {
+        const uint32_t address = payload_size >= 8 ? read_u32(payload) : 0;
+        const uint32_t length = payload_size >= 8 ? read_u32(payload + 4) : 0;
+        if (m_stub_running) {
+            error = STUB_INVALID_COMMAND;
+            break;
+        }
+        if (payload_size < 8 || length > 64 || (uint64_t)address + length > flash.size()) {
+            error = STUB_BAD_DATA_LEN;
+            break;
+        }
+        resp_data.assign(flash.begin() + address, flash.begin() + address + length);
+        end_ns += config.timing.read_ns_per_byte * length;
+        break;
+    }
+
+    case GET_SECURITY_INFO: {
+        get_security_info_response_data_t info = {};
+        info.chip_id = chip_info(config.chip)->chip_id;
+        const uint8_t *bytes = reinterpret_cast<const uint8_t *>(&info);
+        resp_data.assign(bytes, bytes + sizeof(info));
+        break;
+    }
+
+    case ERASE_FLASH:
+        end_ns += flash_erase(0, (uint32_t)flash.size());
+        break;
+
+    case ERASE_REGION: {
+        const uint32_t offset = payload_size >= 8 ? read_u32(payload) : 0;
+        const uint32_t length = payload_size >= 8 ? read_u32(payload + 4) : 0;
+        if (payload_size < 8 || offset % SECTOR_SIZE != 0 || length % SECTOR_SIZE != 0 ||
+                (uint64_t)offset + length > flash.size()) {
+            error = STUB_BAD_DATA_LEN;
+            break;
+        }
+        end_ns += flash_erase(offset, length);
+        break;
+    }
+
+    case READ_FLASH_STUB: {
+        if (payload_size < 16) {
+            error = STUB_BAD_DATA_LEN;
+            break;
+        }
+        m_read_op.reset(new read_op_t());
+        m_read_op->address = read_u32(payload);
+        m_read_op->total_size = read_u32(payload + 4);
+        m_read_op->packet_size = read_u32(payload + 8);
+        m_read_op->max_inflight = max(read_u32(payload + 12), 1U);
+        if ((uint64_t)m_read_op->address + m_read_op->total_size > flash.size() || m_read_op->packet_size == 0) {
+            m_read_op.reset();
+            error = STUB_BAD_DATA_LEN;
+            break;
+        }
+        MD5Init(&m_read_op->md5);
+        send_response(out, end_ns, common.command, 0, NULL, 0, 0);
+        send_read_packet(end_ns, out);
+        return m_busy_until_ns;
+    }
+
+    default:
+        error = m_stub_running ? STUB_INVALID_COMMAND : INVALID_COMMAND;
+        break;
+    }
+
+    send_response(out, end_ns, common.command, value, resp_data.data(), resp_data.size(), error);
+    return end_ns;
+}
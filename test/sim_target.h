@@ -0,0 +1,142 @@
+/*
+ * SPDX-FileCopyrightText: 2026 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_loader.h"
+
+#ifdef __cplusplus
+#include <array>
+#include <deque>
+#include <map>
+#include <memory>
+#include <vector>
+
+/**
+ * @brief Timing of the simulated flasher stub and its SPI flash chip, in nanoseconds.
+ *
+ * The defaults follow the datasheet figures of a common 4 MB NOR flash, so a
+ * simulated flash write is dominated by programming and erasing the way it is
+ * on real hardware. Set the flash figures to zero to measure the host link alone.
+ */
+struct sim_target_timing_t {
+    uint64_t command_ns = 5000;           /*!< Decoding and dispatching one command */
+    uint64_t program_ns_per_byte = 1500;  /*!< Page program, ~0.4 ms per 256-byte page */
+    uint64_t sector_erase_ns = 45000000;  /*!< 4 KB sector erase */
+    uint64_t block_erase_ns = 150000000;  /*!< 64 KB block erase */
+    uint64_t read_ns_per_byte = 50;       /*!< Flash read */
+    uint64_t md5_ns_per_byte = 100;       /*!< MD5 over data already read */
+    uint64_t inflate_ns_per_byte = 30;    /*!< Decompression, per output byte */
+    uint64_t boot_ns = 2000000;           /*!< From the jump to the stub until it says OHAI */
+};
+
+struct sim_target_config_t {
+    target_chip_t chip = ESP32C6_CHIP;
+    uint32_t flash_size = 4 * 1024 * 1024;
+    uint32_t flash_id = 0x1640EF;  /*!< JEDEC ID as returned in SPI W0, size ID in bits 16..23 */
+    std::array<uint8_t, 6> mac = {{ 0x60, 0x55, 0xf9, 0x01, 0x02, 0x03 }};
+    sim_target_timing_t timing;
+};
+
+/**
+ * @brief A packet sent by the target, readable by the host from @c ready_ns on.
+ */
+struct sim_packet_t {
+    uint64_t ready_ns;
+    std::vector<uint8_t> data;
+};
+
+/**
+ * @brief Protocol-agnostic model of a chip in the ROM loader or running the flasher stub.
+ *
+ * Transport models (SDIO, SPI) feed it whole command packets and deliver the
+ * response packets it produces. It keeps an in-memory NOR flash image, a sparse
+ * RAM and register space, and accounts for the time spent on each command so
+ * the transport can tell when responses become available. Until the stub is
+ * booted, commands get ROM loader semantics: FLASH_BEGIN erases the whole
+ * region up front, SPI_FLASH_MD5 answers in hex, flash is read with
+ * READ_FLASH_ROM and the stub-only erase and read commands are rejected.
+ */
+class sim_target_t {
+public:
+    explicit sim_target_t(const sim_target_config_t &config);
+    ~sim_target_t();
+
+    /** Resets the chip into the ROM loader. Flash contents survive, RAM does not. */
+    void reset();
+
+    /** Writes to RAM, as done by the ROM loader for RAM download packets. */
+    void ram_write(uint32_t addr, const uint8_t *data, size_t size);
+    std::vector<uint8_t> ram_read(uint32_t addr, size_t size) const;
+
+    /**
+     * Jumps to RAM code at the given address. The stub starts and announces
+     * itself with OHAI if the RAM holds its image, anything else counts as an
+     * application being started.
+     */
+    void boot(uint32_t entrypoint, uint64_t now_ns, std::deque<sim_packet_t> &out);
+
+    /**
+     * Processes a packet received at now_ns by the ROM loader or the running
+     * stub and appends the packets it sends in return to out.
+     *
+     * @return Time at which the target has finished with the packet.
+     */
+    uint64_t receive(const uint8_t *data, size_t size, uint64_t now_ns, std::deque<sim_packet_t> &out);
+
+    /**
+     * Makes the nth following command with the given ID (0 = the next one) fail
+     * with the given error code.
+     */
+    void inject_error(uint8_t command, uint8_t error, uint32_t nth = 0);
+
+    bool stub_running() const
+    {
+        return m_stub_running;
+    }
+    uint32_t app_entrypoint() const
+    {
+        return m_app_entrypoint;
+    }
+    uint32_t command_count(uint8_t command) const;
+
+    const sim_target_config_t config;
+    std::vector<uint8_t> flash;
+    std::map<uint32_t, uint32_t> registers;
+
+private:
+    struct injected_error_t {
+        uint8_t command;
+        uint8_t error;
+        uint32_t nth;
+    };
+
+    struct flash_op_t;
+    struct read_op_t;
+
+    uint64_t handle_command(const uint8_t *data, size_t size, uint64_t start_ns, std::deque<sim_packet_t> &out);
+    uint64_t handle_read_ack(const uint8_t *data, size_t size, uint64_t start_ns, std::deque<sim_packet_t> &out);
+    void end_flash_op();
+    uint64_t flash_write(uint32_t addr, const uint8_t *data, size_t size);
+    uint64_t flash_erase(uint32_t addr, uint32_t size);
+    void reg_write(uint32_t addr, uint32_t value, uint32_t mask);
+    bool take_injected_error(uint8_t command, uint8_t *error);
+    void send_read_packet(uint64_t start_ns, std::deque<sim_packet_t> &out);
+
+    bool m_stub_running = false;
+    uint32_t m_app_entrypoint = 0;
+    uint64_t m_busy_until_ns = 0;
+    std::map<uint32_t, std::array<uint8_t, 4096>> m_ram;
+    std::map<uint8_t, uint32_t> m_command_counts;
+    std::vector<injected_error_t> m_injected;
+    std::unique_ptr<flash_op_t> m_flash_op;
+    std::unique_ptr<read_op_t> m_read_op;
+    uint32_t m_mem_addr = 0;
+};
+
+#endif /* __cplusplus */
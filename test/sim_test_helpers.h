@@ -0,0 +1,89 @@
+/*
+ * SPDX-FileCopyrightText: 2026 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#pragma once
+
+#include "catch.hpp"
+#include "sim_sdio_port.h"
+#include "sim_spi_port.h"
+#include "esp_loader.h"
+#include <algorithm>
+#include <random>
+#include <vector>
+
+/*
+ * Helpers shared by the simulator tests of the SDIO and SPI transports.
+ */
+
+#define ESP_ERR_CHECK(exp) REQUIRE( (exp) == ESP_LOADER_SUCCESS )
+
+static inline std::vector<uint8_t> random_image(size_t size, uint32_t seed)
+{
+    std::mt19937 gen(seed);
+    std::vector<uint8_t> image(size);
+    for (uint8_t &byte : image) {
+        byte = (uint8_t)gen();
+    }
+    return image;
+}
+
+static inline void sim_connect(esp_loader_t *loader, esp_loader_port_t *port,
+                               esp_loader_error_t (*init)(esp_loader_t *, esp_loader_port_t *))
+{
+    ESP_ERR_CHECK( init(loader, port) );
+    esp_loader_connect_args_t connect_config = ESP_LOADER_CONNECT_DEFAULT();
+    ESP_ERR_CHECK( esp_loader_connect(loader, &connect_config) );
+}
+
+/* Initializes the loader on a simulated port and connects to the target's loader */
+static inline void connect(sim_sdio_port_t &sim, esp_loader_t *loader)
+{
+    sim_connect(loader, &sim.port, esp_loader_init_sdio);
+}
+
+static inline void connect(sim_spi_port_t &sim, esp_loader_t *loader)
+{
+    sim_connect(loader, &sim.port, esp_loader_init_spi);
+}
+
+/* Writes an image with esp_loader_flash_write(), in blocks of block_size */
+static inline esp_loader_error_t flash_image(esp_loader_t *loader, uint32_t offset, const std::vector<uint8_t> &image,
+        uint32_t block_size)
+{
+    esp_loader_flash_cfg_t flash_cfg = {
+        .offset     = offset,
+        .image_size = (uint32_t)image.size(),
+        .block_size = block_size,
+        .skip_verify = false,
+    };
+
+    RETURN_ON_ERROR( esp_loader_flash_start(loader, &flash_cfg) );
+
+    for (size_t written = 0; written < image.size(); written += block_size) {
+        const uint32_t size = (uint32_t)std::min<size_t>(block_size, image.size() - written);
+        RETURN_ON_ERROR( esp_loader_flash_write(loader, &flash_cfg, &image[written], size) );
+    }
+
+    return esp_loader_flash_finish(loader, &flash_cfg);
+}
+
+/* Saves the journal, failing the first store that confirms cut_at bytes, as if the host lost the target */
+struct journal_saver_t {
+    esp_loader_flash_journal_t saved;
+    uint32_t cut_at;
+    bool cut;
+};
+
+static inline esp_loader_error_t save_journal(void *ctx, const esp_loader_flash_journal_t *journal)
+{
+    journal_saver_t *saver = static_cast<journal_saver_t *>(ctx);
+    if (journal->confirmed == saver->cut_at && !saver->cut) {
+        saver->cut = true;
+        return ESP_LOADER_ERROR_TIMEOUT;
+    }
+    saver->saved = *journal;
+    return ESP_LOADER_SUCCESS;
+}
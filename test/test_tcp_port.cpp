@@ -172,6 +172,13 @@ static const esp_loader_port_ops_t test_port_ops = {
     /* sdio_write               = */ nullptr,
     /* sdio_read                = */ nullptr,
     /* sdio_card_init           = */ nullptr,
+    /* sdio_write_blocks        = */ nullptr,
+    /* sdio_read_blocks         = */ nullptr,
+    /* sdio_wait_interrupt      = */ nullptr,
+    /* sdio_writev              = */ nullptr,
+    /* spi_transfer             = */ nullptr,
+    /* spi_set_mode             = */ nullptr,
+    /* spi_wait_ready           = */ nullptr,
 };
 
 esp_loader_error_t esp_loader_port_test_init(test_tcp_port_t *p)